@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Archive.hxx"
+#include "ArchiveFormat.hxx"
+#include "ArchiveReader.hxx"
+#include "CgroupAccounting.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "io/Open.hxx"
+#include "system/Error.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::max()
+#include <atomic>
+#include <cassert>
+#include <cstring> // for std::memcpy()
+
+#include <fcntl.h> // for fallocate()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h> // for ftruncate()
+
+static std::string
+MakeSegmentName(std::chrono::sys_days day)
+{
+	const std::chrono::year_month_day ymd{day};
+	return fmt::format("{:04}-{:02}-{:02}.acct",
+			   static_cast<int>(ymd.year()),
+			   static_cast<unsigned>(ymd.month()),
+			   static_cast<unsigned>(ymd.day()));
+}
+
+/**
+ * Write a string with its length.
+ */
+static std::byte *
+WriteString(std::byte *p, std::string_view s) noexcept
+{
+	p = WriteVarint(p, s.size());
+	std::memcpy(p, s.data(), s.size());
+	return p + s.size();
+}
+
+AccountingArchive::AccountingArchive(const char *directory)
+	:directory_fd(OpenDirectory(directory)) {}
+
+AccountingArchive::~AccountingArchive() noexcept
+{
+	Close();
+}
+
+inline std::byte *
+AccountingArchive::GetTail() noexcept
+{
+	assert(mapping != nullptr);
+
+	return mapping + sizeof(ArchiveHeader) + size;
+}
+
+void
+AccountingArchive::Reserve(std::size_t n)
+{
+	const std::size_t needed = sizeof(ArchiveHeader) + size + n;
+	if (needed <= mapping_size)
+		return;
+
+	const std::size_t new_size = (needed + GROW_STEP - 1) / GROW_STEP * GROW_STEP;
+
+	/* allocate the blocks now, or else writing to the mapping
+	   would raise SIGBUS when the filesystem is full */
+	if (fallocate(fd.Get(), 0, mapping_size, new_size - mapping_size) < 0)
+		throw MakeErrno("Failed to grow archive segment");
+
+	void *p = mapping != nullptr
+		? mremap(mapping, mapping_size, new_size, MREMAP_MAYMOVE)
+		: mmap(nullptr, new_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		       fd.Get(), 0);
+	if (p == MAP_FAILED)
+		throw MakeErrno("Failed to map archive segment");
+
+	mapping = static_cast<std::byte *>(p);
+	mapping_size = new_size;
+}
+
+void
+AccountingArchive::Commit(std::byte *tail) noexcept
+{
+	assert(tail >= GetTail());
+	assert(tail <= mapping + mapping_size);
+
+	size = tail - mapping - sizeof(ArchiveHeader);
+
+	/* pairs with the acquire load in ArchiveReader */
+	std::atomic_ref<uint64_t>{GetHeader().size}.store(size, std::memory_order_release);
+}
+
+void
+AccountingArchive::Open(std::chrono::sys_days _day)
+{
+	assert(!fd.IsDefined());
+
+	const auto name = MakeSegmentName(_day);
+	if (!fd.Open({directory_fd, name.c_str()},
+		     O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0644))
+		throw FmtErrno("Failed to open {}", name);
+
+	try {
+		day = _day;
+		size = 0;
+		last_release = day;
+		last_id = 0;
+		dictionary.clear();
+
+		struct stat st;
+		if (fstat(fd.Get(), &st) < 0)
+			throw FmtErrno("Failed to stat {}", name);
+
+		if (static_cast<std::size_t>(st.st_size) < sizeof(ArchiveHeader)) {
+			/* a new file (or one which was abandoned
+			   before the header was written) */
+			try {
+				Reserve(0);
+			} catch (...) {
+				/* discard the blocks which may have
+				   been allocated already, or else the
+				   next attempt would mistake them for
+				   a header */
+				(void)ftruncate(fd.Get(), 0);
+				throw;
+			}
+
+			auto &header = GetHeader();
+			header.magic = ARCHIVE_MAGIC;
+			header.day = std::chrono::duration_cast<std::chrono::microseconds>(day.time_since_epoch()).count();
+			header.size = 0;
+			return;
+		}
+
+		/* continue an existing segment (after a restart) */
+
+		{
+			ArchiveReader reader{fd};
+			ArchiveRecord record;
+			while (reader.Read(record)) {}
+
+			const auto d = reader.GetDictionary();
+			for (std::size_t i = 0; i < d.size(); ++i)
+				dictionary.emplace(d[i], i);
+
+			size = reader.GetPosition();
+			last_release = reader.GetLastRelease();
+			last_id = reader.GetLastId();
+		}
+
+		void *p = mmap(nullptr, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			       fd.Get(), 0);
+		if (p == MAP_FAILED)
+			throw FmtErrno("Failed to map {}", name);
+
+		mapping = static_cast<std::byte *>(p);
+		mapping_size = st.st_size;
+	} catch (...) {
+		/* don't leave a half-opened segment behind; the next
+		   Append() will try again */
+		Close();
+		day = {};
+		throw;
+	}
+}
+
+void
+AccountingArchive::Close() noexcept
+{
+	if (!fd.IsDefined())
+		return;
+
+	if (mapping != nullptr) {
+		munmap(mapping, mapping_size);
+		mapping = nullptr;
+		mapping_size = 0;
+
+		/* discard the space preallocated by Reserve() */
+		(void)ftruncate(fd.Get(), sizeof(ArchiveHeader) + size);
+	}
+
+	fd.Close();
+}
+
+uint_least32_t
+AccountingArchive::LookupParent(std::string_view parent)
+{
+	if (auto i = dictionary.find(parent); i != dictionary.end())
+		return i->second;
+
+	Reserve(1 + MAX_VARINT_SIZE + parent.size());
+
+	std::byte *p = GetTail();
+	*p++ = static_cast<std::byte>(ArchiveRecordType::PARENT);
+	p = WriteString(p, parent);
+	Commit(p);
+
+	const uint_least32_t index = dictionary.size();
+	dictionary.emplace(parent, index);
+	return index;
+}
+
+void
+AccountingArchive::Append(std::string_view relative_path, uint_least64_t id,
+			  const std::chrono::system_clock::time_point btime,
+			  const std::chrono::system_clock::time_point release_time,
+			  const CgroupResourceUsage &usage)
+{
+	const auto release_day = std::chrono::floor<std::chrono::days>(release_time);
+	if (!fd.IsDefined() || release_day != day) {
+		Close();
+		Open(release_day);
+	}
+
+	const auto slash = relative_path.rfind('/');
+	assert(slash != relative_path.npos);
+	const auto parent = relative_path.substr(0, slash);
+	const auto name = relative_path.substr(slash + 1);
+
+	const auto parent_index = LookupParent(parent);
+
+	Reserve(1 + 2 * MAX_VARINT_SIZE + name.size() +
+		3 * MAX_VARINT_SIZE + MAX_ARCHIVE_USAGE_SIZE);
+
+	std::byte *p = GetTail();
+	*p++ = static_cast<std::byte>(ArchiveRecordType::RELEASE);
+	p = WriteVarint(p, parent_index);
+	p = WriteString(p, name);
+
+	/* the clock may go backwards; the archive can't */
+	const auto delta = std::max(std::chrono::duration_cast<std::chrono::microseconds>(release_time - last_release),
+				    std::chrono::microseconds{});
+	p = WriteVarint(p, delta.count());
+	last_release += delta;
+
+	uint_least64_t age = 0;
+	if (btime != std::chrono::system_clock::time_point{})
+		age = std::max(std::chrono::duration_cast<std::chrono::microseconds>(last_release - btime),
+			       std::chrono::microseconds{}).count() + 1;
+	p = WriteVarint(p, age);
+
+	p = WriteVarint(p, ZigZagEncode(static_cast<int_least64_t>(id - last_id)));
+	last_id = id;
+
+	p = WriteArchiveUsage(p, usage);
+	Commit(p);
+}
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+
+struct ArchiveHeader;
+struct CgroupResourceUsage;
+
+/**
+ * Appends the resource usage of released cgroups to memory-mapped
+ * segment files, one per day (see ArchiveFormat.hxx).  They can be
+ * queried with "cm4all-spawn-stats".
+ */
+class AccountingArchive final {
+	/**
+	 * Segment files are grown in steps of this size.
+	 */
+	static constexpr std::size_t GROW_STEP = 4 * 1024 * 1024;
+
+	const UniqueFileDescriptor directory_fd;
+
+	/**
+	 * The current segment file; undefined if none is open.
+	 */
+	UniqueFileDescriptor fd;
+
+	/**
+	 * The day of the current segment.
+	 */
+	std::chrono::sys_days day;
+
+	/**
+	 * The writable mapping of the whole file #fd.
+	 */
+	std::byte *mapping = nullptr;
+	std::size_t mapping_size = 0;
+
+	/**
+	 * The number of bytes after the header which contain
+	 * complete records.
+	 */
+	std::size_t size;
+
+	/**
+	 * Maps the parent paths of the current segment to their
+	 * dictionary index.
+	 */
+	std::map<std::string, uint_least32_t, std::less<>> dictionary;
+
+	std::chrono::system_clock::time_point last_release;
+
+	uint_least64_t last_id;
+
+public:
+	/**
+	 * Throws if the directory cannot be opened.
+	 */
+	explicit AccountingArchive(const char *directory);
+
+	~AccountingArchive() noexcept;
+
+	AccountingArchive(const AccountingArchive &) = delete;
+	AccountingArchive &operator=(const AccountingArchive &) = delete;
+
+	/**
+	 * Append one release to the segment of the day of
+	 * #release_time.
+	 *
+	 * Throws on error.
+	 *
+	 * @param relative_path the cgroup path with a leading slash
+	 */
+	void Append(std::string_view relative_path, uint_least64_t id,
+		    std::chrono::system_clock::time_point btime,
+		    std::chrono::system_clock::time_point release_time,
+		    const CgroupResourceUsage &usage);
+
+private:
+	/**
+	 * Open (or create) the segment file for the given day.  If
+	 * it exists already, its records are read to restore the
+	 * dictionary and the delta encoding state.
+	 *
+	 * Throws on error.
+	 */
+	void Open(std::chrono::sys_days _day);
+
+	/**
+	 * Close the current segment file and trim the space
+	 * preallocated by Reserve().
+	 */
+	void Close() noexcept;
+
+	ArchiveHeader &GetHeader() noexcept {
+		return *reinterpret_cast<ArchiveHeader *>(mapping);
+	}
+
+	/**
+	 * Returns the address where the next record shall be
+	 * written.
+	 */
+	std::byte *GetTail() noexcept;
+
+	/**
+	 * Make sure that at least this number of bytes can be
+	 * written at GetTail().
+	 *
+	 * Throws on error.
+	 */
+	void Reserve(std::size_t n);
+
+	/**
+	 * Mark all bytes up to the given tail pointer as complete
+	 * records.
+	 */
+	void Commit(std::byte *tail) noexcept;
+
+	/**
+	 * Look up a parent path in the dictionary; add it (by
+	 * writing a PARENT record) if it is not there.
+	 *
+	 * Throws on error.
+	 */
+	uint_least32_t LookupParent(std::string_view parent);
+};
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "ArchiveFormat.hxx"
+#include "CgroupAccounting.hxx"
+
+#include <cmath> // for std::llround()
+
+static constexpr unsigned
+Bit(ArchiveField field) noexcept
+{
+	return 1U << static_cast<unsigned>(field);
+}
+
+static uint_least64_t
+ToMicroseconds(CgroupCpuStat::Duration d) noexcept
+{
+	return static_cast<uint_least64_t>(std::llround(d.count() * 1e6));
+}
+
+static constexpr CgroupCpuStat::Duration
+FromMicroseconds(uint_least64_t us) noexcept
+{
+	return CgroupCpuStat::Duration{static_cast<double>(us) / 1e6};
+}
+
+std::byte *
+WriteArchiveUsage(std::byte *p, const CgroupResourceUsage &usage) noexcept
+{
+	unsigned mask = 0;
+	if (usage.cpu.total.count() >= 0)
+		mask |= Bit(ArchiveField::CPU_TOTAL);
+	if (usage.cpu.user.count() >= 0)
+		mask |= Bit(ArchiveField::CPU_USER);
+	if (usage.cpu.system.count() >= 0)
+		mask |= Bit(ArchiveField::CPU_SYSTEM);
+	if (usage.have_memory_peak)
+		mask |= Bit(ArchiveField::MEMORY_PEAK);
+	if (usage.have_memory_events_high)
+		mask |= Bit(ArchiveField::MEMORY_EVENTS_HIGH);
+	if (usage.have_memory_events_max)
+		mask |= Bit(ArchiveField::MEMORY_EVENTS_MAX);
+	if (usage.have_memory_events_oom)
+		mask |= Bit(ArchiveField::MEMORY_EVENTS_OOM);
+	if (usage.have_pids_peak)
+		mask |= Bit(ArchiveField::PIDS_PEAK);
+	if (usage.have_pids_forks)
+		mask |= Bit(ArchiveField::PIDS_FORKS);
+	if (usage.have_pids_events_max)
+		mask |= Bit(ArchiveField::PIDS_EVENTS_MAX);
+
+	p = WriteVarint(p, mask);
+
+	if (mask & Bit(ArchiveField::CPU_TOTAL))
+		p = WriteVarint(p, ToMicroseconds(usage.cpu.total));
+	if (mask & Bit(ArchiveField::CPU_USER))
+		p = WriteVarint(p, ToMicroseconds(usage.cpu.user));
+	if (mask & Bit(ArchiveField::CPU_SYSTEM))
+		p = WriteVarint(p, ToMicroseconds(usage.cpu.system));
+	if (mask & Bit(ArchiveField::MEMORY_PEAK))
+		p = WriteVarint(p, usage.memory_peak);
+	if (mask & Bit(ArchiveField::MEMORY_EVENTS_HIGH))
+		p = WriteVarint(p, usage.memory_events_high);
+	if (mask & Bit(ArchiveField::MEMORY_EVENTS_MAX))
+		p = WriteVarint(p, usage.memory_events_max);
+	if (mask & Bit(ArchiveField::MEMORY_EVENTS_OOM))
+		p = WriteVarint(p, usage.memory_events_oom);
+	if (mask & Bit(ArchiveField::PIDS_PEAK))
+		p = WriteVarint(p, usage.pids_peak);
+	if (mask & Bit(ArchiveField::PIDS_FORKS))
+		p = WriteVarint(p, usage.pids_forks);
+	if (mask & Bit(ArchiveField::PIDS_EVENTS_MAX))
+		p = WriteVarint(p, usage.pids_events_max);
+
+	return p;
+}
+
+/**
+ * Read one field value if its bit is set in the mask.
+ *
+ * @return false if the data is malformed
+ */
+static bool
+ReadField(std::span<const std::byte> &src, uint_least64_t mask,
+	  ArchiveField field, bool &have, auto &value) noexcept
+{
+	have = mask & Bit(field);
+	if (!have)
+		return true;
+
+	uint_least64_t v;
+	if (!ReadVarint(src, v))
+		return false;
+
+	value = v;
+	return true;
+}
+
+static bool
+ReadCpuField(std::span<const std::byte> &src, uint_least64_t mask,
+	     ArchiveField field, CgroupCpuStat::Duration &value) noexcept
+{
+	if (!(mask & Bit(field))) {
+		value = CgroupCpuStat::Duration{-1};
+		return true;
+	}
+
+	uint_least64_t us;
+	if (!ReadVarint(src, us))
+		return false;
+
+	value = FromMicroseconds(us);
+	return true;
+}
+
+bool
+ReadArchiveUsage(std::span<const std::byte> &src,
+		 CgroupResourceUsage &usage) noexcept
+{
+	uint_least64_t mask;
+	if (!ReadVarint(src, mask) ||
+	    mask >= (1U << static_cast<unsigned>(ArchiveField::N)))
+		return false;
+
+	return ReadCpuField(src, mask, ArchiveField::CPU_TOTAL, usage.cpu.total) &&
+		ReadCpuField(src, mask, ArchiveField::CPU_USER, usage.cpu.user) &&
+		ReadCpuField(src, mask, ArchiveField::CPU_SYSTEM, usage.cpu.system) &&
+		ReadField(src, mask, ArchiveField::MEMORY_PEAK,
+			  usage.have_memory_peak, usage.memory_peak) &&
+		ReadField(src, mask, ArchiveField::MEMORY_EVENTS_HIGH,
+			  usage.have_memory_events_high, usage.memory_events_high) &&
+		ReadField(src, mask, ArchiveField::MEMORY_EVENTS_MAX,
+			  usage.have_memory_events_max, usage.memory_events_max) &&
+		ReadField(src, mask, ArchiveField::MEMORY_EVENTS_OOM,
+			  usage.have_memory_events_oom, usage.memory_events_oom) &&
+		ReadField(src, mask, ArchiveField::PIDS_PEAK,
+			  usage.have_pids_peak, usage.pids_peak) &&
+		ReadField(src, mask, ArchiveField::PIDS_FORKS,
+			  usage.have_pids_forks, usage.pids_forks) &&
+		ReadField(src, mask, ArchiveField::PIDS_EVENTS_MAX,
+			  usage.have_pids_events_max, usage.pids_events_max);
+}
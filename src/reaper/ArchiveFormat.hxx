@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * The file format of the accounting archive written by the reaper
+ * (#AccountingArchive) and read by "cm4all-spawn-stats"
+ * (#ArchiveReader).
+ *
+ * Each segment file contains the releases of one day (UTC) and is
+ * called "YYYY-MM-DD.acct".  It begins with an #ArchiveHeader which
+ * is followed by records.  Each record starts with one
+ * #ArchiveRecordType byte; all integers are unsigned LEB128
+ * varints:
+ *
+ * - PARENT: the length of a parent cgroup path and the path; this
+ *   adds the path to the dictionary of this segment.  Its index is
+ *   the number of PARENT records preceding it.
+ *
+ * - RELEASE: the dictionary index of the parent, the length of the
+ *   cgroup name and the name, the release time (microseconds since
+ *   the previous RELEASE record or, for the first one, since
+ *   ArchiveHeader::day), the age at the time of the release in
+ *   microseconds plus one (zero if unknown), the zigzag-encoded
+ *   difference between the cgroup id and the previous one, a bit
+ *   mask of #ArchiveField and the values of these fields (CPU times
+ *   in microseconds).
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+struct CgroupResourceUsage;
+
+static constexpr std::array<char, 8> ARCHIVE_MAGIC{
+	'C', 'M', '4', 'A', 'C', 'C', 'T', '1',
+};
+
+struct ArchiveHeader {
+	std::array<char, 8> magic;
+
+	/**
+	 * The start of the day (UTC) in microseconds since the
+	 * epoch.
+	 */
+	uint64_t day;
+
+	/**
+	 * The number of bytes after this header which contain
+	 * complete records.  The writer updates it (atomically)
+	 * after each record, so readers may run concurrently.
+	 */
+	uint64_t size;
+};
+
+enum class ArchiveRecordType : uint8_t {
+	PARENT = 1,
+	RELEASE = 2,
+};
+
+enum class ArchiveField : unsigned {
+	CPU_TOTAL,
+	CPU_USER,
+	CPU_SYSTEM,
+	MEMORY_PEAK,
+	MEMORY_EVENTS_HIGH,
+	MEMORY_EVENTS_MAX,
+	MEMORY_EVENTS_OOM,
+	PIDS_PEAK,
+	PIDS_FORKS,
+	PIDS_EVENTS_MAX,
+
+	N
+};
+
+/**
+ * The maximum size of one varint.
+ */
+static constexpr std::size_t MAX_VARINT_SIZE = 10;
+
+/**
+ * The maximum size of the fields written by WriteArchiveUsage().
+ */
+static constexpr std::size_t MAX_ARCHIVE_USAGE_SIZE =
+	(1 + static_cast<std::size_t>(ArchiveField::N)) * MAX_VARINT_SIZE;
+
+constexpr std::byte *
+WriteVarint(std::byte *p, uint_least64_t value) noexcept
+{
+	while (value >= 0x80) {
+		*p++ = static_cast<std::byte>(value | 0x80);
+		value >>= 7;
+	}
+
+	*p++ = static_cast<std::byte>(value);
+	return p;
+}
+
+/**
+ * Decode a varint and remove it from the source buffer.
+ *
+ * @return false if the buffer ends prematurely or if the value is
+ * too large
+ */
+constexpr bool
+ReadVarint(std::span<const std::byte> &src, uint_least64_t &value) noexcept
+{
+	value = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (src.empty())
+			return false;
+
+		const auto b = static_cast<uint_least64_t>(src.front());
+		src = src.subspan(1);
+
+		value |= (b & 0x7f) << shift;
+		if (b < 0x80)
+			return true;
+	}
+
+	return false;
+}
+
+constexpr uint_least64_t
+ZigZagEncode(int_least64_t value) noexcept
+{
+	return (static_cast<uint_least64_t>(value) << 1) ^
+		static_cast<uint_least64_t>(value >> 63);
+}
+
+constexpr int_least64_t
+ZigZagDecode(uint_least64_t value) noexcept
+{
+	return static_cast<int_least64_t>(value >> 1) ^
+		-static_cast<int_least64_t>(value & 1);
+}
+
+/**
+ * Write the bit mask and the values of all fields which are present
+ * in the #CgroupResourceUsage.  The buffer must have at least
+ * #MAX_ARCHIVE_USAGE_SIZE bytes.
+ */
+std::byte *
+WriteArchiveUsage(std::byte *p, const CgroupResourceUsage &usage) noexcept;
+
+/**
+ * The counterpart of WriteArchiveUsage().
+ *
+ * @return false if the data is malformed
+ */
+bool
+ReadArchiveUsage(std::span<const std::byte> &src,
+		 CgroupResourceUsage &usage) noexcept;
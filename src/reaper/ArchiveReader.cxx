@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "ArchiveReader.hxx"
+#include "ArchiveFormat.hxx"
+#include "io/FileDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm> // for std::min()
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+[[noreturn]]
+static void
+ThrowMalformed()
+{
+	throw std::runtime_error{"Malformed archive segment"};
+}
+
+static uint_least64_t
+ReadVarintOrThrow(std::span<const std::byte> &src)
+{
+	uint_least64_t value;
+	if (!ReadVarint(src, value))
+		ThrowMalformed();
+	return value;
+}
+
+static std::string_view
+ReadString(std::span<const std::byte> &src)
+{
+	const auto length = ReadVarintOrThrow(src);
+	if (length > src.size())
+		ThrowMalformed();
+
+	const std::string_view value{reinterpret_cast<const char *>(src.data()), length};
+	src = src.subspan(length);
+	return value;
+}
+
+ArchiveReader::ArchiveReader(FileDescriptor fd)
+{
+	struct stat st;
+	if (fstat(fd.Get(), &st) < 0)
+		throw MakeErrno("Failed to stat archive segment");
+
+	if (static_cast<std::size_t>(st.st_size) < sizeof(ArchiveHeader))
+		throw std::runtime_error{"Truncated archive segment"};
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.Get(), 0);
+	if (p == MAP_FAILED)
+		throw MakeErrno("Failed to map archive segment");
+
+	mapping = {static_cast<const std::byte *>(p), static_cast<std::size_t>(st.st_size)};
+
+	const auto &header = *static_cast<const ArchiveHeader *>(p);
+	if (header.magic != ARCHIVE_MAGIC) {
+		munmap(p, mapping.size());
+		throw std::runtime_error{"Not an archive segment"};
+	}
+
+	/* the writer may be appending right now; the acquire
+	   barrier pairs with its release store */
+	const uint_least64_t size = __atomic_load_n(&header.size, __ATOMIC_ACQUIRE);
+
+	records = mapping.subspan(sizeof(header));
+	records = records.first(std::min<uint_least64_t>(size, records.size()));
+	remaining = records;
+
+	last_release = std::chrono::system_clock::time_point{std::chrono::microseconds{header.day}};
+}
+
+ArchiveReader::~ArchiveReader() noexcept
+{
+	munmap(const_cast<std::byte *>(mapping.data()), mapping.size());
+}
+
+bool
+ArchiveReader::Read(ArchiveRecord &record)
+{
+	while (!remaining.empty()) {
+		const auto type = static_cast<ArchiveRecordType>(remaining.front());
+		remaining = remaining.subspan(1);
+
+		switch (type) {
+		case ArchiveRecordType::PARENT:
+			dictionary.emplace_back(ReadString(remaining));
+			continue;
+
+		case ArchiveRecordType::RELEASE:
+			break;
+
+		default:
+			ThrowMalformed();
+		}
+
+		const auto parent = ReadVarintOrThrow(remaining);
+		if (parent >= dictionary.size())
+			ThrowMalformed();
+
+		record.parent = dictionary[parent];
+		record.name = ReadString(remaining);
+
+		last_release += std::chrono::microseconds{ReadVarintOrThrow(remaining)};
+		record.release_time = last_release;
+
+		const auto age = ReadVarintOrThrow(remaining);
+		record.btime = age > 0
+			? last_release - std::chrono::microseconds{age - 1}
+			: std::chrono::system_clock::time_point{};
+
+		last_id += static_cast<uint_least64_t>(ZigZagDecode(ReadVarintOrThrow(remaining)));
+		record.id = last_id;
+
+		if (!ReadArchiveUsage(remaining, record.usage))
+			ThrowMalformed();
+
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+class FileDescriptor;
+
+/**
+ * A release decoded from an archive segment.  The strings point
+ * into the #ArchiveReader's mapping.
+ */
+struct ArchiveRecord {
+	/**
+	 * The path of the parent cgroup (with a leading slash, empty
+	 * for top-level cgroups).
+	 */
+	std::string_view parent;
+
+	/**
+	 * The name of the cgroup (without the parent path).
+	 */
+	std::string_view name;
+
+	std::chrono::system_clock::time_point release_time;
+
+	/**
+	 * The time the cgroup was created or the epoch if that is
+	 * unknown.
+	 */
+	std::chrono::system_clock::time_point btime;
+
+	uint_least64_t id;
+
+	CgroupResourceUsage usage;
+};
+
+/**
+ * Reads the records of one accounting archive segment (see
+ * ArchiveFormat.hxx) from a read-only mapping.
+ */
+class ArchiveReader {
+	std::span<const std::byte> mapping;
+
+	/**
+	 * All complete records (after the header).
+	 */
+	std::span<const std::byte> records;
+
+	/**
+	 * The records which have not yet been read.
+	 */
+	std::span<const std::byte> remaining;
+
+	/**
+	 * The parent paths defined by PARENT records so far.
+	 */
+	std::vector<std::string_view> dictionary;
+
+	std::chrono::system_clock::time_point last_release;
+
+	uint_least64_t last_id = 0;
+
+public:
+	/**
+	 * Map the file.  Records which the writer appends later are
+	 * not seen.
+	 *
+	 * Throws on error.
+	 */
+	explicit ArchiveReader(FileDescriptor fd);
+
+	~ArchiveReader() noexcept;
+
+	ArchiveReader(const ArchiveReader &) = delete;
+	ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+	/**
+	 * Decode the next RELEASE record (handling all PARENT
+	 * records before it).
+	 *
+	 * Throws if the segment is malformed.
+	 *
+	 * @return false if there are no more records
+	 */
+	bool Read(ArchiveRecord &record);
+
+	/**
+	 * The number of bytes (after the header) which have been
+	 * consumed by Read().
+	 */
+	std::size_t GetPosition() const noexcept {
+		return records.size() - remaining.size();
+	}
+
+	std::span<const std::string_view> GetDictionary() const noexcept {
+		return dictionary;
+	}
+
+	std::chrono::system_clock::time_point GetLastRelease() const noexcept {
+		return last_release;
+	}
+
+	uint_least64_t GetLastId() const noexcept {
+		return last_id;
+	}
+};
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "BlockDevices.hxx"
+#include "lib/fmt/ToBuffer.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/IterableSplitString.hxx"
+#include "util/NumberParser.hxx"
+#include "util/SpanCast.hxx"
+#include "util/StringStrip.hxx"
+
+#include <algorithm> // for std::sort(), std::lower_bound()
+#include <mutex> // for std::call_once()
+
+#include <sys/sysmacros.h> // for makedev()
+
+/**
+ * Parse one line of /proc/partitions, e.g. "   8        0  500107608 sda".
+ */
+static bool
+ParsePartitionLine(std::string_view line,
+		   dev_t &dev_r, std::string_view &name_r) noexcept
+{
+	unsigned major = 0, minor = 0;
+	unsigned column = 0;
+
+	for (const std::string_view i : IterableSplitString(line, ' ')) {
+		if (i.empty())
+			/* multiple spaces */
+			continue;
+
+		switch (column++) {
+		case 0:
+			if (auto value = ParseInteger<unsigned>(i))
+				major = *value;
+			else
+				/* the header line */
+				return false;
+			break;
+
+		case 1:
+			if (auto value = ParseInteger<unsigned>(i))
+				minor = *value;
+			else
+				return false;
+			break;
+
+		case 2:
+			/* the number of blocks */
+			break;
+
+		case 3:
+			dev_r = makedev(major, minor);
+			name_r = StripRight(i);
+			return !name_r.empty();
+		}
+	}
+
+	return false;
+}
+
+BlockDeviceNames::BlockDeviceNames() noexcept
+{
+	UniqueFileDescriptor fd;
+	if (!fd.OpenReadOnly("/proc/partitions"))
+		return;
+
+	std::byte buffer[65536];
+	const ssize_t nbytes = fd.Read(buffer);
+	if (nbytes <= 0)
+		return;
+
+	const auto contents = ToStringView(std::span{buffer}.first(nbytes));
+
+	try {
+		for (const std::string_view line : IterableSplitString(contents, '\n')) {
+			dev_t dev;
+			std::string_view name;
+			if (ParsePartitionLine(line, dev, name))
+				devices.emplace_back(dev, name);
+		}
+
+		std::sort(devices.begin(), devices.end());
+	} catch (...) {
+		/* out of memory: all devices will be formatted as
+		   "MAJOR:MINOR" */
+		devices.clear();
+	}
+}
+
+/**
+ * The process-wide instance, created by BlockDeviceNames::Get().  It
+ * is never freed.
+ */
+static const BlockDeviceNames *instance;
+static std::once_flag instance_flag;
+
+const BlockDeviceNames &
+BlockDeviceNames::Get() noexcept
+{
+	/* this is called from the main thread and from the Lua
+	   worker threads; a function-local static would not be
+	   guarded, because we build with -fno-threadsafe-statics */
+	std::call_once(instance_flag, []{
+		instance = new BlockDeviceNames();
+	});
+
+	return *instance;
+}
+
+const char *
+BlockDeviceNames::Find(dev_t dev) const noexcept
+{
+	const auto i = std::lower_bound(devices.begin(), devices.end(), dev,
+					[](const auto &a, dev_t b){
+						return a.first < b;
+					});
+	if (i == devices.end() || i->first != dev)
+		return nullptr;
+
+	return i->second.c_str();
+}
+
+StringBuffer<32>
+FormatBlockDevice(dev_t dev) noexcept
+{
+	if (const char *name = BlockDeviceNames::Get().Find(dev))
+		return FmtBuffer<32>("{}", name);
+
+	return FmtBuffer<32>("{}:{}", major(dev), minor(dev));
+}
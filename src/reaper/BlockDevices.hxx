@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "util/StringBuffer.hxx"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h> // for dev_t
+
+/**
+ * Maps block device numbers to kernel device names (e.g. "sda" or
+ * "nvme0n1").  The map is built once from /proc/partitions; devices
+ * which appear later are formatted as "MAJOR:MINOR".
+ */
+class BlockDeviceNames {
+	/**
+	 * Sorted by device number.
+	 */
+	std::vector<std::pair<dev_t, std::string>> devices;
+
+	BlockDeviceNames() noexcept;
+
+public:
+	/**
+	 * Return the process-wide instance, building it on the
+	 * first call.  This may be called from any thread.
+	 */
+	[[gnu::const]]
+	static const BlockDeviceNames &Get() noexcept;
+
+	/**
+	 * @return the name or nullptr if the device is unknown
+	 */
+	[[gnu::pure]]
+	const char *Find(dev_t dev) const noexcept;
+};
+
+/**
+ * Format the name of a block device or "MAJOR:MINOR" if it is
+ * unknown.
+ */
+[[gnu::pure]]
+StringBuffer<32>
+FormatBlockDevice(dev_t dev) noexcept;
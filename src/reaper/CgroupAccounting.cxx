@@ -3,120 +3,733 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "CgroupAccounting.hxx"
-#include "lib/fmt/ToBuffer.hxx"
-#include "system/Error.hxx"
-#include "io/SmallTextFile.hxx"
-#include "io/Open.hxx"
+#include "StatParser.hxx"
+#include "config.h"
+#include "io/FileAt.hxx"
 #include "io/UniqueFileDescriptor.hxx"
+#include "time/StatxCast.hxx"
+#include "util/IterableSplitString.hxx"
 #include "util/NumberParser.hxx"
-#include "util/PrintException.hxx"
+#include "util/SpanCast.hxx"
+#include "util/StringSplit.hxx"
 #include "util/StringStrip.hxx"
 
+#include <algorithm> // for std::max()
+#include <atomic>
+#include <bit> // for std::popcount()
+#include <cassert>
+#include <cerrno>
+#include <span>
+
+#include <fcntl.h> // for AT_EMPTY_PATH
+#include <sys/sysmacros.h> // for makedev()
+#include <sys/resource.h> // for getrlimit()
+#include <sys/stat.h> // for statx()
+
 using std::string_view_literals::operator""sv;
 
+static constexpr const char *stat_file_names[] = {
+	"cpu.stat",
+	"memory.peak",
+	"memory.events",
+	"pids.peak",
+	"pids.forks",
+	"pids.events",
+	"io.stat",
+	"cpu.pressure",
+	"memory.pressure",
+	"io.pressure",
+	"memory.stat",
+};
+
+static_assert(std::size(stat_file_names) == std::size_t(CgroupStatFile::N));
+
+/**
+ * Were extended statistics enabled by
+ * EnableExtendedCgroupStats()?
+ */
+static bool extended_stats;
+
+void
+EnableExtendedCgroupStats() noexcept
+{
+	extended_stats = true;
+}
+
+/**
+ * Shall this file be read?  Files with extended statistics are
+ * only read if they were selected at build time and enabled at
+ * runtime.
+ */
+[[gnu::pure]]
+static bool
+IsStatFileEnabled(CgroupStatFile file) noexcept
+{
+	switch (file) {
+	case CgroupStatFile::CPU_STAT:
+	case CgroupStatFile::MEMORY_PEAK:
+	case CgroupStatFile::MEMORY_EVENTS:
+	case CgroupStatFile::PIDS_PEAK:
+	case CgroupStatFile::PIDS_FORKS:
+	case CgroupStatFile::PIDS_EVENTS:
+	case CgroupStatFile::IO_STAT:
+		return true;
+
+	case CgroupStatFile::CPU_PRESSURE:
+	case CgroupStatFile::MEMORY_PRESSURE:
+	case CgroupStatFile::IO_PRESSURE:
+#ifdef ENABLE_PRESSURE_STATS
+		return extended_stats;
+#else
+		return false;
+#endif
+
+	case CgroupStatFile::MEMORY_STAT:
+#ifdef ENABLE_MEMORY_STATS
+		return extended_stats;
+#else
+		return false;
+#endif
+
+	case CgroupStatFile::N:
+		break;
+	}
+
+	return false;
+}
+
+/**
+ * The number of file descriptors currently owned by
+ * #CgroupStatFiles instances.  This is modified by all shard
+ * threads and by the main thread (which destroys the
+ * #PendingRelease objects reported by the shards).
+ */
+static std::atomic_size_t n_stat_fds;
+
+/**
+ * The maximum number of file descriptors all #CgroupStatFiles
+ * instances may own.  This is initialized by InitCgroupStatFdLimit()
+ * before any thread is started, so it is read without
+ * synchronization.
+ */
+static std::size_t stat_fd_limit = 32768;
+
+void
+InitCgroupStatFdLimit() noexcept
+{
+	struct rlimit r;
+	if (getrlimit(RLIMIT_NOFILE, &r) == 0 &&
+	    r.rlim_cur != RLIM_INFINITY)
+		stat_fd_limit = r.rlim_cur / 2;
+}
+
+static std::chrono::system_clock::time_point
+ReadBirthTime(FileDescriptor cgroup_fd) noexcept
+{
+	struct statx stx;
+	if (statx(cgroup_fd.Get(), "", AT_EMPTY_PATH|AT_STATX_FORCE_SYNC,
+		  STATX_BTIME, &stx) == 0 &&
+	    (stx.stx_mask & STATX_BTIME))
+		return ToSystemTimePoint(stx.stx_btime);
+
+	return {};
+}
+
+CgroupStatFiles::~CgroupStatFiles() noexcept
+{
+	for (const auto &fd : fds)
+		if (fd.IsDefined())
+			n_stat_fds.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void
+CgroupStatFiles::Open(FileDescriptor cgroup_fd) noexcept
+{
+	assert(cgroup_fd.IsDefined());
+
+	if (!have_btime) {
+		btime = ReadBirthTime(cgroup_fd);
+		have_btime = true;
+	}
+
+	for (std::size_t i = 0; i < fds.size(); ++i) {
+		if (fds[i].IsDefined() || (missing & (1U << i)) ||
+		    !IsStatFileEnabled(static_cast<CgroupStatFile>(i)))
+			continue;
+
+		if (n_stat_fds.load(std::memory_order_relaxed) >= stat_fd_limit)
+			/* don't exhaust RLIMIT_NOFILE; the remaining
+			   files will be opened on release */
+			break;
+
+		if (fds[i].OpenReadOnly({cgroup_fd, stat_file_names[i]}))
+			n_stat_fds.fetch_add(1, std::memory_order_relaxed);
+		else if (errno == ENOENT)
+			missing |= 1U << i;
+	}
+}
+
+std::chrono::system_clock::time_point
+CgroupStatFiles::GetBirthTime(FileDescriptor cgroup_fd) noexcept
+{
+	if (!have_btime && cgroup_fd.IsDefined()) {
+		btime = ReadBirthTime(cgroup_fd);
+		have_btime = true;
+	}
+
+	return btime;
+}
+
+unsigned
+CgroupStatFiles::GetSavedSyscalls() const noexcept
+{
+	/* each pre-opened (or known to be missing) file saves one
+	   openat() and the statx() was done in advance */
+	unsigned n = std::popcount(missing) + (have_btime ? 1 : 0);
+
+	for (const auto &fd : fds)
+		if (fd.IsDefined())
+			++n;
+
+	return n;
+}
+
+/**
+ * Read the contents of a statistics file, either with pread() on
+ * the pre-opened file descriptor or by opening it inside the
+ * cgroup directory.  Returns an empty string if the file is not
+ * available.
+ */
+static std::string_view
+ReadStatFile(FileDescriptor cgroup_fd, const CgroupStatFiles &files,
+	     CgroupStatFile file, std::span<std::byte> buffer) noexcept
+{
+	ssize_t nbytes;
+
+	if (const FileDescriptor fd = files.Get(file); fd.IsDefined()) {
+		nbytes = fd.ReadAt(0, buffer);
+	} else if (cgroup_fd.IsDefined() && !files.IsMissing(file)) {
+		UniqueFileDescriptor tmp;
+		if (!tmp.OpenReadOnly({cgroup_fd, GetCgroupStatFileName(file)}))
+			return {};
+
+		nbytes = tmp.Read(buffer);
+	} else
+		return {};
+
+	if (nbytes <= 0)
+		return {};
+
+	return ToStringView(buffer.first(nbytes));
+}
+
+enum CpuStatKey : unsigned {
+	USAGE_USEC,
+	USER_USEC,
+	SYSTEM_USEC,
+	NR_THROTTLED,
+	THROTTLED_USEC,
+
+	N_CPU_STAT_KEYS
+};
+
+/**
+ * The keys of "cpu.stat" which are always parsed; the throttling
+ * keys which follow are only parsed with extended statistics.
+ */
+static constexpr unsigned BASIC_CPU_STAT_KEYS =
+	(1U << USAGE_USEC) | (1U << USER_USEC) | (1U << SYSTEM_USEC);
+
+static constexpr StatKeys cpu_stat_keys{std::array{
+	"usage_usec"sv,
+	"user_usec"sv,
+	"system_usec"sv,
+#ifdef ENABLE_CPU_THROTTLE_STATS
+	"nr_throttled"sv,
+	"throttled_usec"sv,
+#endif
+}};
+
 static CgroupCpuStat
-ReadCgroupCpuStat(FileDescriptor cgroup_fd)
+ParseCgroupCpuStat(std::string_view contents) noexcept
 {
+	std::array<uint_least64_t, N_CPU_STAT_KEYS> values;
+	unsigned found = extended_stats
+		? ParseFlatKeyed(contents, cpu_stat_keys, values)
+		: ParseFlatKeyed(contents, cpu_stat_keys, values,
+				 BASIC_CPU_STAT_KEYS);
+	if (!extended_stats)
+		found &= BASIC_CPU_STAT_KEYS;
+
+	const auto have = [found](CpuStatKey key){
+		return (found & (1U << key)) != 0;
+	};
+
 	CgroupCpuStat result;
 
-	for (const std::string_view line : IterableSmallTextFile<4096>{FileAt{cgroup_fd, "cpu.stat"}}) {
-		const auto [name, value_s] = Split(line, ' ');
+	if (have(USAGE_USEC))
+		result.total = std::chrono::microseconds(values[USAGE_USEC]);
+	if (have(USER_USEC))
+		result.user = std::chrono::microseconds(values[USER_USEC]);
+	if (have(SYSTEM_USEC))
+		result.system = std::chrono::microseconds(values[SYSTEM_USEC]);
 
-		if (name == "usage_usec"sv) {
-			if (auto value = ParseInteger<uint_least64_t>(value_s))
-				result.total = std::chrono::microseconds(*value);
-		} else if (name == "user_usec"sv) {
-			if (auto value = ParseInteger<uint_least64_t>(value_s))
-				result.user = std::chrono::microseconds(*value);
-		} else if (name == "system_usec"sv) {
-			if (auto value = ParseInteger<uint_least64_t>(value_s))
-				result.system = std::chrono::microseconds(*value);
-		}
+	if (have(NR_THROTTLED) && have(THROTTLED_USEC)) {
+		result.throttled = std::chrono::microseconds(values[THROTTLED_USEC]);
+		result.nr_throttled = values[NR_THROTTLED];
 	}
 
 	return result;
 }
 
-CgroupResourceUsage
-ReadCgroupResourceUsage(FileDescriptor cgroup_fd) noexcept
+/**
+ * The keys of "memory.stat" which are collected (in the order of
+ * #CgroupMemoryStat::Key).
+ */
+static constexpr StatKeys memory_stat_keys{std::array{
+	"anon"sv,
+	"file"sv,
+	"kernel"sv,
+	"sock"sv,
+	"pgmajfault"sv,
+}};
+
+static_assert(memory_stat_keys.ALL == (1U << CgroupMemoryStat::N_KEYS) - 1);
+
+static CgroupMemoryStat
+ParseMemoryStat(std::string_view contents) noexcept
+{
+	CgroupMemoryStat result;
+	result.found = ParseFlatKeyed(contents, memory_stat_keys, result.values);
+	return result;
+}
+
+/**
+ * Parse a pressure stall information file, e.g.:
+ *
+ *   some avg10=0.00 avg60=0.00 avg300=0.00 total=123456
+ *   full avg10=0.00 avg60=0.00 avg300=0.00 total=65432
+ *
+ * Only the last field is needed, therefore this does not use
+ * ParseNestedKeyed().
+ */
+static CgroupPressureStat
+ParsePressure(std::string_view contents) noexcept
 {
-	// TODO: blkio
+	CgroupPressureStat result;
 
-	CgroupResourceUsage result;
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [kind, rest] = Split(line, ' ');
 
-	try {
-		result.cpu = ReadCgroupCpuStat(cgroup_fd);
-	} catch (...) {
-		PrintException(std::current_exception());
+		static constexpr auto total_prefix = "total="sv;
+		const auto i = rest.rfind(total_prefix);
+		if (i == rest.npos)
+			continue;
+
+		const auto value = ParseInteger<uint_least64_t>(rest.substr(i + total_prefix.size()));
+		if (!value)
+			continue;
+
+		const CgroupPressureStat::Duration total = std::chrono::microseconds(*value);
+		if (kind == "some"sv)
+			result.some = total;
+		else if (kind == "full"sv)
+			result.full = total;
 	}
 
-	try {
-		WithSmallTextFile<64>(FileAt{cgroup_fd, "memory.peak"}, [&result](std::string_view contents){
-			if (auto value = ParseInteger<uint_least64_t>(StripRight(contents))) {
-				result.memory_peak = *value;
-				result.have_memory_peak = true;
-			}
-		});
-	} catch (...) {
-	}
-
-	try {
-		for (const std::string_view line : IterableSmallTextFile<4096>{FileAt{cgroup_fd, "memory.events"}}) {
-			const auto [name, value_s] = Split(line, ' ');
-
-			if (name == "high"sv) {
-				if (auto value = ParseInteger<uint_least32_t>(value_s)) {
-					result.memory_events_high = *value;
-					result.have_memory_events_high = true;
-				}
-			} else if (name == "max"sv) {
-				if (auto value = ParseInteger<uint_least32_t>(value_s)) {
-					result.memory_events_max = *value;
-					result.have_memory_events_max = true;
-				}
-			} else if (name == "oom"sv) {
-				if (auto value = ParseInteger<uint_least32_t>(value_s)) {
-					result.memory_events_oom = *value;
-					result.have_memory_events_oom = true;
-				}
-			}
-		}
-	} catch (...) {
-	}
-
-	try {
-		WithSmallTextFile<64>(FileAt{cgroup_fd, "pids.peak"}, [&result](std::string_view contents){
-			if (auto value = ParseInteger<uint_least32_t>(StripRight(contents))) {
-				result.pids_peak = *value;
-				result.have_pids_peak = true;
-			}
-		});
-	} catch (...) {
+	return result;
+}
+
+template<typename T>
+static bool
+ParseSingleValue(std::string_view contents, T &value_r) noexcept
+{
+	if (auto value = ParseInteger<T>(StripRight(contents))) {
+		value_r = *value;
+		return true;
 	}
 
-	try {
-		WithSmallTextFile<64>(FileAt{cgroup_fd, "pids.forks"}, [&result](std::string_view contents){
-			if (auto value = ParseInteger<uint_least32_t>(StripRight(contents))) {
-				result.pids_forks = *value;
-				result.have_pids_forks = true;
-			}
-		});
-	} catch (...) {
+	return false;
+}
+
+enum MemoryEventsKey : unsigned {
+	MEMORY_EVENTS_HIGH,
+	MEMORY_EVENTS_MAX,
+	MEMORY_EVENTS_OOM,
+};
+
+static constexpr StatKeys memory_events_keys{std::array{
+	"high"sv,
+	"max"sv,
+	"oom"sv,
+}};
+
+static void
+ParseMemoryEvents(std::string_view contents, CgroupResourceUsage &result) noexcept
+{
+	std::array<uint_least64_t, 3> values;
+	const unsigned found = ParseFlatKeyed(contents, memory_events_keys, values);
+
+	if (found & (1U << MEMORY_EVENTS_HIGH)) {
+		result.memory_events_high = values[MEMORY_EVENTS_HIGH];
+		result.have_memory_events_high = true;
 	}
 
-	try {
-		for (const std::string_view line : IterableSmallTextFile<4096>{FileAt{cgroup_fd, "pids.events"}}) {
-			const auto [name, value_s] = Split(line, ' ');
+	if (found & (1U << MEMORY_EVENTS_MAX)) {
+		result.memory_events_max = values[MEMORY_EVENTS_MAX];
+		result.have_memory_events_max = true;
+	}
+
+	if (found & (1U << MEMORY_EVENTS_OOM)) {
+		result.memory_events_oom = values[MEMORY_EVENTS_OOM];
+		result.have_memory_events_oom = true;
+	}
+}
+
+static constexpr StatKeys pids_events_keys{std::array{"max"sv}};
 
-			if (name == "max"sv) {
-				if (auto value = ParseInteger<uint_least32_t>(value_s)) {
-					result.pids_events_max = *value;
-					result.have_pids_events_max = true;
-				}
-			}
-		}
-	} catch (...) {
+static void
+ParsePidsEvents(std::string_view contents, CgroupResourceUsage &result) noexcept
+{
+	std::array<uint_least64_t, 1> values;
+	if (ParseFlatKeyed(contents, pids_events_keys, values)) {
+		result.pids_events_max = values[0];
+		result.have_pids_events_max = true;
 	}
+}
+
+void
+CgroupIoStat::AddDevice(dev_t dev, const Counters &counters) noexcept
+{
+	total += counters;
+
+	const auto bytes = counters.GetBytes();
+	if (bytes == 0)
+		return;
+
+	/* insertion sort into the (tiny) array of the busiest
+	   devices */
+	std::size_t i = std::min(n_devices, MAX_DEVICES - 1);
+	if (n_devices == MAX_DEVICES &&
+	    devices[i].counters.GetBytes() >= bytes)
+		return;
+
+	for (; i > 0 && devices[i - 1].counters.GetBytes() < bytes; --i)
+		devices[i] = devices[i - 1];
+
+	devices[i] = {dev, counters};
+	n_devices = std::min(n_devices + 1, MAX_DEVICES);
+}
+
+enum IoStatKey : unsigned {
+	IO_RBYTES,
+	IO_WBYTES,
+	IO_RIOS,
+	IO_WIOS,
+	IO_DBYTES,
+
+	N_IO_STAT_KEYS
+};
+
+static constexpr StatKeys io_stat_keys{std::array{
+	"rbytes"sv,
+	"wbytes"sv,
+	"rios"sv,
+	"wios"sv,
+	"dbytes"sv,
+}};
+
+static_assert(io_stat_keys.ALL == (1U << N_IO_STAT_KEYS) - 1);
+
+/**
+ * Parse the device number at the beginning of an "io.stat" line,
+ * e.g. "8:0".
+ */
+static bool
+ParseIoStatDevice(std::string_view s, dev_t &dev_r) noexcept
+{
+	const auto [major_s, minor_s] = Split(s, ':');
+	const auto major = ParseInteger<unsigned>(major_s);
+	const auto minor = ParseInteger<unsigned>(minor_s);
+	if (!major || !minor)
+		return false;
+
+	dev_r = makedev(*major, *minor);
+	return true;
+}
+
+/**
+ * Parse "io.stat", e.g.:
+ *
+ *   8:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 dbytes=0 dios=0
+ */
+static void
+ParseIoStat(std::string_view contents, CgroupResourceUsage &result) noexcept
+{
+	/* ignore the last line if the buffer was too small for the
+	   whole file */
+	if (const auto newline = contents.rfind('\n');
+	    newline != contents.npos)
+		contents = contents.substr(0, newline);
+	else
+		return;
+
+	CgroupIoStat io;
+
+	ParseNestedKeyed(contents, io_stat_keys, [&io](std::string_view dev_s,
+						       std::span<const uint_least64_t, N_IO_STAT_KEYS> values,
+						       unsigned found){
+		dev_t dev;
+		if (!ParseIoStatDevice(dev_s, dev))
+			return;
+
+		const auto get = [&values, found](IoStatKey key) -> uint_least64_t {
+			return found & (1U << key) ? values[key] : 0;
+		};
+
+		io.AddDevice(dev, {
+			.rbytes = get(IO_RBYTES),
+			.wbytes = get(IO_WBYTES),
+			.rios = get(IO_RIOS),
+			.wios = get(IO_WIOS),
+			.dbytes = get(IO_DBYTES),
+		});
+	});
+
+	result.io = io;
+	result.have_io = true;
+}
+
+const char *
+GetCgroupStatFileName(CgroupStatFile file) noexcept
+{
+	return stat_file_names[static_cast<std::size_t>(file)];
+}
+
+void
+ParseCgroupStatFile(CgroupResourceUsage &result, CgroupStatFile file,
+		    std::string_view contents) noexcept
+{
+	if (contents.empty())
+		return;
+
+	switch (file) {
+	case CgroupStatFile::CPU_STAT:
+		result.cpu = ParseCgroupCpuStat(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_PEAK:
+		result.have_memory_peak = ParseSingleValue(contents, result.memory_peak);
+		break;
+
+	case CgroupStatFile::MEMORY_EVENTS:
+		ParseMemoryEvents(contents, result);
+		break;
+
+	case CgroupStatFile::PIDS_PEAK:
+		result.have_pids_peak = ParseSingleValue(contents, result.pids_peak);
+		break;
+
+	case CgroupStatFile::PIDS_FORKS:
+		result.have_pids_forks = ParseSingleValue(contents, result.pids_forks);
+		break;
+
+	case CgroupStatFile::PIDS_EVENTS:
+		ParsePidsEvents(contents, result);
+		break;
+
+	case CgroupStatFile::IO_STAT:
+		ParseIoStat(contents, result);
+		break;
+
+	case CgroupStatFile::CPU_PRESSURE:
+		result.cpu_pressure = ParsePressure(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_PRESSURE:
+		result.memory_pressure = ParsePressure(contents);
+		break;
+
+	case CgroupStatFile::IO_PRESSURE:
+		result.io_pressure = ParsePressure(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_STAT:
+		result.memory_stat = ParseMemoryStat(contents);
+		break;
+
+	case CgroupStatFile::N:
+		break;
+	}
+}
+
+void
+ReadCgroupStatFile(CgroupResourceUsage &result, FileDescriptor cgroup_fd,
+		   const CgroupStatFiles &files, CgroupStatFile file) noexcept
+{
+	if (!IsStatFileEnabled(file))
+		return;
+
+	/* large enough for "io.stat" with many devices and for
+	   "memory.stat" */
+	std::byte buffer[16384];
+	ParseCgroupStatFile(result, file,
+			    ReadStatFile(cgroup_fd, files, file, buffer));
+}
+
+CgroupResourceUsage
+ReadCgroupResourceUsage(FileDescriptor cgroup_fd,
+			const CgroupStatFiles &files) noexcept
+{
+	CgroupResourceUsage result;
+
+	for (unsigned i = 0; i < unsigned(CgroupStatFile::N); ++i)
+		ReadCgroupStatFile(result, cgroup_fd, files,
+				   static_cast<CgroupStatFile>(i));
 
 	return result;
 }
+
+void
+CgroupResourceUsage::Complete(const CgroupResourceUsage &other) noexcept
+{
+	if (cpu.total.count() < 0)
+		cpu.total = other.cpu.total;
+	if (cpu.user.count() < 0)
+		cpu.user = other.cpu.user;
+	if (cpu.system.count() < 0)
+		cpu.system = other.cpu.system;
+	if (cpu.throttled.count() < 0) {
+		cpu.throttled = other.cpu.throttled;
+		cpu.nr_throttled = other.cpu.nr_throttled;
+	}
+
+	cpu_pressure.Complete(other.cpu_pressure);
+	memory_pressure.Complete(other.memory_pressure);
+	io_pressure.Complete(other.io_pressure);
+
+	if (memory_stat.found == 0)
+		memory_stat = other.memory_stat;
+
+	if (!have_memory_peak && other.have_memory_peak) {
+		memory_peak = other.memory_peak;
+		have_memory_peak = true;
+	}
+
+	if (!have_memory_events_high && other.have_memory_events_high) {
+		memory_events_high = other.memory_events_high;
+		have_memory_events_high = true;
+	}
+
+	if (!have_memory_events_max && other.have_memory_events_max) {
+		memory_events_max = other.memory_events_max;
+		have_memory_events_max = true;
+	}
+
+	if (!have_memory_events_oom && other.have_memory_events_oom) {
+		memory_events_oom = other.memory_events_oom;
+		have_memory_events_oom = true;
+	}
+
+	if (!have_pids_peak && other.have_pids_peak) {
+		pids_peak = other.pids_peak;
+		have_pids_peak = true;
+	}
+
+	if (!have_pids_forks && other.have_pids_forks) {
+		pids_forks = other.pids_forks;
+		have_pids_forks = true;
+	}
+
+	if (!have_pids_events_max && other.have_pids_events_max) {
+		pids_events_max = other.pids_events_max;
+		have_pids_events_max = true;
+	}
+
+	if (!have_io && other.have_io) {
+		io = other.io;
+		have_io = true;
+	}
+}
+
+static constexpr CgroupCpuStat::Duration
+CalcDurationDelta(CgroupCpuStat::Duration before,
+		  CgroupCpuStat::Duration after) noexcept
+{
+	if (before.count() < 0 || after.count() < 0)
+		return CgroupCpuStat::Duration{-1};
+
+	return std::max(after - before, CgroupCpuStat::Duration{});
+}
+
+template<typename T>
+static constexpr bool
+CalcCounterDelta(bool have_before, T before, bool have_after, T after,
+		 T &delta_r) noexcept
+{
+	if (!have_before || !have_after)
+		return false;
+
+	delta_r = after > before ? after - before : 0;
+	return true;
+}
+
+CgroupResourceUsage
+CalcCgroupResourceDelta(const CgroupResourceUsage &before,
+			const CgroupResourceUsage &after) noexcept
+{
+	CgroupResourceUsage delta;
+
+	delta.cpu.total = CalcDurationDelta(before.cpu.total, after.cpu.total);
+	delta.cpu.user = CalcDurationDelta(before.cpu.user, after.cpu.user);
+	delta.cpu.system = CalcDurationDelta(before.cpu.system, after.cpu.system);
+
+	delta.have_memory_peak =
+		CalcCounterDelta(before.have_memory_peak, before.memory_peak,
+				 after.have_memory_peak, after.memory_peak,
+				 delta.memory_peak);
+
+	delta.have_memory_events_high =
+		CalcCounterDelta(before.have_memory_events_high, before.memory_events_high,
+				 after.have_memory_events_high, after.memory_events_high,
+				 delta.memory_events_high);
+
+	delta.have_memory_events_max =
+		CalcCounterDelta(before.have_memory_events_max, before.memory_events_max,
+				 after.have_memory_events_max, after.memory_events_max,
+				 delta.memory_events_max);
+
+	delta.have_memory_events_oom =
+		CalcCounterDelta(before.have_memory_events_oom, before.memory_events_oom,
+				 after.have_memory_events_oom, after.memory_events_oom,
+				 delta.memory_events_oom);
+
+	delta.have_pids_peak =
+		CalcCounterDelta(before.have_pids_peak, before.pids_peak,
+				 after.have_pids_peak, after.pids_peak,
+				 delta.pids_peak);
+
+	delta.have_pids_forks =
+		CalcCounterDelta(before.have_pids_forks, before.pids_forks,
+				 after.have_pids_forks, after.pids_forks,
+				 delta.pids_forks);
+
+	delta.have_pids_events_max =
+		CalcCounterDelta(before.have_pids_events_max, before.pids_events_max,
+				 after.have_pids_events_max, after.pids_events_max,
+				 delta.pids_events_max);
+
+	if (before.have_io && after.have_io) {
+		/* only the sum; there is no per-device delta */
+		const auto &b = before.io.total, &a = after.io.total;
+		auto &d = delta.io.total;
+		CalcCounterDelta(true, b.rbytes, true, a.rbytes, d.rbytes);
+		CalcCounterDelta(true, b.wbytes, true, a.wbytes, d.wbytes);
+		CalcCounterDelta(true, b.rios, true, a.rios, d.rios);
+		CalcCounterDelta(true, b.wios, true, a.wios, d.wios);
+		CalcCounterDelta(true, b.dbytes, true, a.dbytes, d.dbytes);
+		delta.have_io = true;
+	}
+
+	return delta;
+}
@@ -4,20 +4,155 @@
 
 #pragma once
 
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <array>
 #include <chrono>
 #include <cstdint>
+#include <string_view>
 
-class FileDescriptor;
+#include <sys/types.h> // for dev_t
 
 struct CgroupCpuStat {
 	using Duration = std::chrono::duration<double>;
 
 	Duration total{-1}, user{-1}, system{-1};
+
+	/**
+	 * The time the cgroup was throttled by its bandwidth limit
+	 * ("cpu.max").  Only available with the "cpu" controller and
+	 * with extended statistics (see
+	 * EnableExtendedCgroupStats()); #nr_throttled is only valid
+	 * if this is non-negative.
+	 */
+	Duration throttled{-1};
+
+	/**
+	 * The number of periods in which the cgroup was throttled.
+	 */
+	uint_least64_t nr_throttled;
+};
+
+/**
+ * The total stall times from one pressure stall information file
+ * (e.g. "memory.pressure").  Negative if unknown.
+ */
+struct CgroupPressureStat {
+	using Duration = CgroupCpuStat::Duration;
+
+	/**
+	 * Some tasks were stalled.
+	 */
+	Duration some{-1};
+
+	/**
+	 * All non-idle tasks were stalled.
+	 */
+	Duration full{-1};
+
+	/**
+	 * Copy all values which are missing in this object from
+	 * another (older) snapshot.
+	 */
+	constexpr void Complete(const CgroupPressureStat &other) noexcept {
+		if (some.count() < 0)
+			some = other.some;
+		if (full.count() < 0)
+			full = other.full;
+	}
+};
+
+/**
+ * Selected counters from "memory.stat".
+ */
+struct CgroupMemoryStat {
+	enum Key : unsigned {
+		ANON,
+		FILE,
+		KERNEL,
+		SOCK,
+		PGMAJFAULT,
+
+		N_KEYS
+	};
+
+	std::array<uint_least64_t, N_KEYS> values;
+
+	/**
+	 * A bit mask of the #Key values which were found.
+	 */
+	unsigned found = 0;
+
+	constexpr bool Has(Key key) const noexcept {
+		return found & (1U << key);
+	}
+
+	constexpr uint_least64_t Get(Key key) const noexcept {
+		return values[key];
+	}
+};
+
+/**
+ * Counters from "io.stat".
+ */
+struct CgroupIoStat {
+	struct Counters {
+		uint_least64_t rbytes = 0, wbytes = 0, rios = 0, wios = 0, dbytes = 0;
+
+		constexpr Counters &operator+=(const Counters &other) noexcept {
+			rbytes += other.rbytes;
+			wbytes += other.wbytes;
+			rios += other.rios;
+			wios += other.wios;
+			dbytes += other.dbytes;
+			return *this;
+		}
+
+		constexpr uint_least64_t GetBytes() const noexcept {
+			return rbytes + wbytes + dbytes;
+		}
+	};
+
+	/**
+	 * The sum of all devices.
+	 */
+	Counters total;
+
+	struct Device {
+		dev_t dev;
+		Counters counters;
+	};
+
+	/**
+	 * The maximum number of devices in the per-device
+	 * breakdown.
+	 */
+	static constexpr std::size_t MAX_DEVICES = 4;
+
+	/**
+	 * The devices with the most bytes transferred (sorted in
+	 * descending order); all others are only included in
+	 * #total.
+	 */
+	std::array<Device, MAX_DEVICES> devices;
+
+	std::size_t n_devices = 0;
+
+	/**
+	 * Add one device to #total and (maybe) to #devices.
+	 */
+	void AddDevice(dev_t dev, const Counters &counters) noexcept;
 };
 
 struct CgroupResourceUsage {
 	CgroupCpuStat cpu;
 
+	CgroupIoStat io;
+
+	CgroupPressureStat cpu_pressure, memory_pressure, io_pressure;
+
+	CgroupMemoryStat memory_stat;
+
 	uint_least64_t memory_peak;
 
 	uint_least32_t memory_events_high, memory_events_max, memory_events_oom;
@@ -30,8 +165,155 @@ struct CgroupResourceUsage {
 	bool have_memory_events_oom = false;
 
 	bool have_pids_peak = false, have_pids_forks = false, have_pids_events_max = false;
+
+	bool have_io = false;
+
+	/**
+	 * Copy all values which are missing in this object from
+	 * another (older) snapshot.
+	 */
+	void Complete(const CgroupResourceUsage &other) noexcept;
 };
 
+/**
+ * Calculate how much the usage has grown between two snapshots.
+ * Only values which are present in both snapshots are set in the
+ * returned object.
+ */
 [[gnu::pure]]
 CgroupResourceUsage
-ReadCgroupResourceUsage(FileDescriptor cgroup_fd) noexcept;
+CalcCgroupResourceDelta(const CgroupResourceUsage &before,
+			const CgroupResourceUsage &after) noexcept;
+
+/**
+ * The statistics files read by ReadCgroupResourceUsage().
+ */
+enum class CgroupStatFile : unsigned {
+	CPU_STAT,
+	MEMORY_PEAK,
+	MEMORY_EVENTS,
+	PIDS_PEAK,
+	PIDS_FORKS,
+	PIDS_EVENTS,
+	IO_STAT,
+
+	/* the following files are only read with extended
+	   statistics */
+	CPU_PRESSURE,
+	MEMORY_PRESSURE,
+	IO_PRESSURE,
+	MEMORY_STAT,
+
+	N
+};
+
+/**
+ * Enable reading the extended statistics (pressure stall
+ * information, CPU throttling and "memory.stat"), as far as they
+ * were selected at build time (option "reaper_stats").  Must be
+ * called before the first cgroup is opened.
+ */
+void
+EnableExtendedCgroupStats() noexcept;
+
+/**
+ * Limit the number of pre-opened statistics files (see
+ * #CgroupStatFiles) to half of RLIMIT_NOFILE; the rest is needed for
+ * watching directories and "cgroup.events" files.  Must be called
+ * before any thread which opens cgroups is started.
+ */
+void
+InitCgroupStatFdLimit() noexcept;
+
+[[gnu::const]]
+const char *
+GetCgroupStatFileName(CgroupStatFile file) noexcept;
+
+/**
+ * File descriptors of a cgroup's statistics files, opened when the
+ * cgroup is discovered, so releasing it needs only pread() calls
+ * and no path lookups on cgroupfs.
+ */
+class CgroupStatFiles {
+	std::array<UniqueFileDescriptor, std::size_t(CgroupStatFile::N)> fds;
+
+	/**
+	 * The time the cgroup was created or the epoch if that is
+	 * unknown.
+	 */
+	std::chrono::system_clock::time_point btime;
+
+	/**
+	 * A bit mask of #CgroupStatFile values which did not exist
+	 * when Open() was called (e.g. because the kernel is too old
+	 * or because the controller is not enabled).
+	 */
+	unsigned missing = 0;
+
+	/**
+	 * Was statx() already called to obtain #btime?
+	 */
+	bool have_btime = false;
+
+public:
+	CgroupStatFiles() noexcept = default;
+	~CgroupStatFiles() noexcept;
+
+	CgroupStatFiles(CgroupStatFiles &&) noexcept = default;
+	CgroupStatFiles &operator=(CgroupStatFiles &&) = delete;
+
+	/**
+	 * Open all statistics files inside the specified cgroup
+	 * directory and obtain its birth time.  Errors are ignored;
+	 * files which do not exist are remembered in #missing, and
+	 * files which could not be opened for other reasons will be
+	 * opened by ReadCgroupResourceUsage().
+	 */
+	void Open(FileDescriptor cgroup_fd) noexcept;
+
+	FileDescriptor Get(CgroupStatFile file) const noexcept {
+		return fds[static_cast<std::size_t>(file)];
+	}
+
+	bool IsMissing(CgroupStatFile file) const noexcept {
+		return missing & (1U << static_cast<unsigned>(file));
+	}
+
+	/**
+	 * Return the birth time of the cgroup, calling statx() if
+	 * that has not been done by Open() already.
+	 */
+	std::chrono::system_clock::time_point GetBirthTime(FileDescriptor cgroup_fd) noexcept;
+
+	/**
+	 * How many system calls does the release path save because
+	 * of the work already done by Open()?
+	 */
+	[[gnu::pure]]
+	unsigned GetSavedSyscalls() const noexcept;
+};
+
+/**
+ * Parse the contents of one statistics file into the
+ * #CgroupResourceUsage object.  An empty string is ignored.
+ */
+void
+ParseCgroupStatFile(CgroupResourceUsage &result, CgroupStatFile file,
+		    std::string_view contents) noexcept;
+
+/**
+ * Read and parse one statistics file (see
+ * ReadCgroupResourceUsage()).
+ */
+void
+ReadCgroupStatFile(CgroupResourceUsage &result, FileDescriptor cgroup_fd,
+		   const CgroupStatFiles &files, CgroupStatFile file) noexcept;
+
+/**
+ * Read the resource usage of a cgroup.  Pre-opened file descriptors
+ * from #CgroupStatFiles are used with pread(); all other files are
+ * opened inside #cgroup_fd (which may be undefined).
+ */
+CgroupResourceUsage
+ReadCgroupResourceUsage(FileDescriptor cgroup_fd,
+			const CgroupStatFiles &files) noexcept;
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "CgroupId.hxx"
+#include "io/FileDescriptor.hxx"
+
+#include <cstddef> // for std::byte
+#include <cstring> // for std::memcpy()
+
+#include <fcntl.h> // for name_to_handle_at()
+#include <sys/stat.h> // for fstat()
+
+uint_least64_t
+ReadCgroupId(FileDescriptor cgroup_fd) noexcept
+{
+	/* the file handle of a kernfs directory is the 64-bit cgroup
+	   ID */
+	alignas(struct file_handle) std::byte buffer[sizeof(struct file_handle) + sizeof(uint64_t)];
+	auto &fh = *reinterpret_cast<struct file_handle *>(buffer);
+	fh.handle_bytes = sizeof(uint64_t);
+
+	int mount_id;
+	if (name_to_handle_at(cgroup_fd.Get(), "", &fh, &mount_id,
+			      AT_EMPTY_PATH) == 0 &&
+	    fh.handle_bytes == sizeof(uint64_t)) {
+		uint64_t id;
+		std::memcpy(&id, fh.f_handle, sizeof(id));
+		return id;
+	}
+
+	/* fallback for kernels without file handle support on
+	   kernfs: on 64-bit kernels, the inode number is the cgroup
+	   ID */
+	struct stat st;
+	if (fstat(cgroup_fd.Get(), &st) == 0)
+		return st.st_ino;
+
+	return 0;
+}
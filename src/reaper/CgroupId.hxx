@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstdint>
+
+class FileDescriptor;
+
+/**
+ * Determine the kernel's 64-bit ID of the specified cgroup
+ * directory.  This is the same number which BPF programs see (see
+ * bpf_get_current_cgroup_id()).
+ *
+ * @param cgroup_fd a cgroup directory (may be an O_PATH descriptor)
+ * @return the cgroup ID or 0 on error
+ */
+[[gnu::pure]]
+uint_least64_t
+ReadCgroupId(FileDescriptor cgroup_fd) noexcept;
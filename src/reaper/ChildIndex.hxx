@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <functional> // for std::hash
+#include <memory>
+#include <string_view>
+#include <utility>
+
+/**
+ * A hash table with open addressing (linear probing) which indexes
+ * objects owned by somebody else by a string key.  Each slot is just
+ * a pointer plus the hash value; there is no allocation per element,
+ * and an empty index owns no memory at all.
+ *
+ * @param GetKey a function object which returns the key
+ * (std::string_view) of an object
+ */
+template<typename T, typename GetKey>
+class ChildIndex {
+	struct Slot {
+		T *value;
+		std::size_t hash;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+
+	/**
+	 * The capacity minus one (the capacity is always a power of
+	 * two); only valid if #slots is set.
+	 */
+	std::size_t mask = 0;
+
+	std::size_t count = 0;
+
+	static constexpr std::size_t MIN_CAPACITY = 4;
+
+public:
+	ChildIndex() noexcept = default;
+	ChildIndex(ChildIndex &&) noexcept = default;
+	ChildIndex &operator=(ChildIndex &&) noexcept = default;
+
+	[[gnu::pure]]
+	static std::size_t Hash(std::string_view key) noexcept {
+		return std::hash<std::string_view>{}(key);
+	}
+
+	bool empty() const noexcept {
+		return count == 0;
+	}
+
+	std::size_t size() const noexcept {
+		return count;
+	}
+
+	std::size_t GetCapacity() const noexcept {
+		return slots ? mask + 1 : 0;
+	}
+
+	/**
+	 * How much heap memory does this index occupy?
+	 */
+	std::size_t GetMemoryUsage() const noexcept {
+		return GetCapacity() * sizeof(Slot);
+	}
+
+	[[gnu::pure]]
+	T *Find(std::string_view key, std::size_t hash) const noexcept {
+		if (!slots)
+			return nullptr;
+
+		for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+			const Slot &slot = slots[i];
+			if (slot.value == nullptr)
+				return nullptr;
+
+			if (slot.hash == hash && GetKey{}(*slot.value) == key)
+				return slot.value;
+		}
+	}
+
+	[[gnu::pure]]
+	T *Find(std::string_view key) const noexcept {
+		return Find(key, Hash(key));
+	}
+
+	/**
+	 * Add an object.  The caller must ensure that there is no
+	 * object with the same key yet.
+	 *
+	 * @param hash the return value of Hash() for the object's
+	 * key
+	 */
+	void Insert(T &value, std::size_t hash) noexcept {
+		if ((count + 1) * 4 > GetCapacity() * 3)
+			Resize(CapacityFor(count + 1));
+
+		InsertUnchecked({&value, hash});
+		++count;
+	}
+
+	/**
+	 * Remove the specified object (which must be in this index).
+	 * Uses backward-shift deletion, i.e. there are no
+	 * tombstones.
+	 */
+	void Erase(const T &value) noexcept {
+		assert(slots);
+
+		std::size_t i = Hash(GetKey{}(value)) & mask;
+		while (slots[i].value != &value) {
+			assert(slots[i].value != nullptr);
+			i = (i + 1) & mask;
+		}
+
+		for (std::size_t j = (i + 1) & mask;; j = (j + 1) & mask) {
+			if (slots[j].value == nullptr)
+				break;
+
+			/* move slot "j" into the hole if its ideal
+			   position is not inside the cyclic range
+			   (i, j] */
+			const std::size_t ideal = slots[j].hash & mask;
+			if (((j - ideal) & mask) >= ((j - i) & mask)) {
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+
+		slots[i].value = nullptr;
+
+		if (--count == 0)
+			/* free the table of directories which have
+			   lost all their children */
+			slots.reset();
+	}
+
+	template<typename F>
+	void ForEach(F &&f) const {
+		if (!slots)
+			return;
+
+		for (std::size_t i = 0; i <= mask; ++i)
+			if (slots[i].value != nullptr)
+				f(*slots[i].value);
+	}
+
+	/**
+	 * Remove all objects for which the predicate returns true.
+	 * The predicate may dispose the object (after returning
+	 * true), but it must not modify this index.
+	 */
+	template<typename P>
+	void RemoveIf(P &&p) {
+		if (!slots)
+			return;
+
+		const std::size_t old_capacity = mask + 1;
+		auto old = std::move(slots);
+		count = 0;
+
+		/* compact the survivors at the beginning of the old
+		   table */
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < old_capacity; ++i)
+			if (old[i].value != nullptr && !p(*old[i].value))
+				old[n++] = old[i];
+
+		if (n == 0)
+			return;
+
+		Resize(CapacityFor(n));
+		for (std::size_t i = 0; i < n; ++i)
+			InsertUnchecked(old[i]);
+		count = n;
+	}
+
+private:
+	static constexpr std::size_t CapacityFor(std::size_t n) noexcept {
+		std::size_t capacity = MIN_CAPACITY;
+		while (n * 4 > capacity * 3)
+			capacity *= 2;
+		return capacity;
+	}
+
+	void InsertUnchecked(Slot slot) noexcept {
+		std::size_t i = slot.hash & mask;
+		while (slots[i].value != nullptr)
+			i = (i + 1) & mask;
+
+		slots[i] = slot;
+	}
+
+	void Resize(std::size_t new_capacity) noexcept {
+		const std::size_t old_capacity = GetCapacity();
+		auto old = std::move(slots);
+
+		slots = std::make_unique<Slot[]>(new_capacity);
+		mask = new_capacity - 1;
+
+		for (std::size_t i = 0; i < old_capacity; ++i)
+			if (old[i].value != nullptr)
+				InsertUnchecked(old[i]);
+	}
+};
@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Config.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "util/ScopeExit.hxx"
+
+extern "C" {
+#include <lua.h>
+}
+
+#include <string_view>
+
+using std::string_view_literals::operator""sv;
+
+static std::string_view
+CheckString(lua_State *L, int idx, std::string_view name)
+{
+	if (!lua_isstring(L, idx))
+		throw FmtRuntimeError("'{}' must be a string", name);
+
+	std::size_t length;
+	const char *value = lua_tolstring(L, idx, &length);
+	return {value, length};
+}
+
+static bool
+CheckBoolean(lua_State *L, int idx, std::string_view name)
+{
+	if (!lua_isboolean(L, idx))
+		throw FmtRuntimeError("'{}' must be a boolean", name);
+
+	return lua_toboolean(L, idx);
+}
+
+static lua_Number
+CheckNumber(lua_State *L, int idx, std::string_view name)
+{
+	if (!lua_isnumber(L, idx))
+		throw FmtRuntimeError("'{}' must be a number", name);
+
+	return lua_tonumber(L, idx);
+}
+
+static std::size_t
+CheckPositiveInteger(lua_State *L, int idx, std::string_view name)
+{
+	const auto value = CheckNumber(L, idx, name);
+	if (value < 1 || value > 65536)
+		throw FmtRuntimeError("Bad value for '{}'", name);
+
+	return static_cast<std::size_t>(value);
+}
+
+static std::size_t
+CheckThreads(lua_State *L, int idx, std::string_view name)
+{
+	const auto value = CheckNumber(L, idx, name);
+	if (value < 0 || value > 64)
+		throw FmtRuntimeError("Bad value for '{}'", name);
+
+	return static_cast<std::size_t>(value);
+}
+
+static Event::Duration
+CheckDuration(lua_State *L, int idx, std::string_view name)
+{
+	const std::chrono::duration<lua_Number> value{CheckNumber(L, idx, name)};
+	if (value.count() < 0 || value > std::chrono::hours{1})
+		throw FmtRuntimeError("Bad value for '{}'", name);
+
+	return std::chrono::duration_cast<Event::Duration>(value);
+}
+
+static void
+HandleScopeSetting(lua_State *L, ManagedScope &scope, std::string_view name)
+{
+	if (name == "path"sv)
+		/* already evaluated by ParseScope() */
+		return;
+	else if (name == "delete_delay"sv)
+		scope.delete_delay = CheckDuration(L, -1, name);
+	else if (name == "accounting"sv)
+		scope.accounting = CheckBoolean(L, -1, name);
+	else
+		throw FmtRuntimeError("Unknown scope setting '{}'", name);
+}
+
+static std::string_view
+CheckScopePath(lua_State *L, int idx)
+{
+	auto path = CheckString(L, idx, "path"sv);
+
+	/* tolerate trailing slashes */
+	while (path.size() > 1 && path.ends_with('/'))
+		path.remove_suffix(1);
+
+	return path;
+}
+
+/**
+ * Parse one item of the "scopes" setting: either a path string or a
+ * table with "path" and options.
+ */
+static ManagedScope
+ParseScope(lua_State *L, int idx)
+{
+	if (lua_type(L, idx) == LUA_TSTRING)
+		return ManagedScope{CheckScopePath(L, idx)};
+
+	if (!lua_istable(L, idx))
+		throw std::runtime_error{"Scopes must be strings or tables"};
+
+	lua_getfield(L, idx, "path");
+	AtScopeExit(L) { lua_pop(L, 1); };
+
+	if (lua_isnil(L, -1))
+		throw std::runtime_error{"Scope without 'path'"};
+
+	ManagedScope scope{CheckScopePath(L, -1)};
+
+	/* the "path" field is at the top of the stack now */
+	lua_pushnil(L);
+	while (lua_next(L, idx < 0 ? idx - 2 : idx)) {
+		AtScopeExit(L) { lua_pop(L, 1); };
+
+		if (lua_type(L, -2) != LUA_TSTRING)
+			throw std::runtime_error{"Scope setting names must be strings"};
+
+		std::size_t length;
+		const char *name = lua_tolstring(L, -2, &length);
+		HandleScopeSetting(L, scope, {name, length});
+	}
+
+	return scope;
+}
+
+static ManagedScopes
+ParseScopes(lua_State *L, int idx)
+{
+	if (!lua_istable(L, idx))
+		throw std::runtime_error{"'scopes' must be a table"};
+
+	ManagedScopes scopes;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx < 0 ? idx - 1 : idx)) {
+		AtScopeExit(L) { lua_pop(L, 1); };
+
+		scopes.Add(ParseScope(L, -1));
+	}
+
+	if (scopes.empty())
+		throw std::runtime_error{"'scopes' must not be empty"};
+
+	return scopes;
+}
+
+static ReaperConfig::EmptyDetection
+ParseEmptyDetection(std::string_view value)
+{
+	if (value == "epoll"sv)
+		return ReaperConfig::EmptyDetection::EPOLL;
+	else if (value == "inotify"sv)
+		return ReaperConfig::EmptyDetection::INOTIFY;
+	else
+		throw FmtRuntimeError("Unknown empty_detection value '{}'", value);
+}
+
+static ReaperConfig::ReleaseLog
+ParseReleaseLog(std::string_view value)
+{
+	if (value == "text"sv)
+		return ReaperConfig::ReleaseLog::TEXT;
+	else if (value == "journal"sv)
+		return ReaperConfig::ReleaseLog::JOURNAL;
+	else
+		throw FmtRuntimeError("Unknown release_log value '{}'", value);
+}
+
+static void
+HandleSetting(lua_State *L, ReaperConfig &config, std::string_view name)
+{
+	if (name == "scopes"sv)
+		config.scopes = ParseScopes(L, -1);
+	else if (name == "empty_detection"sv)
+		config.empty_detection = ParseEmptyDetection(CheckString(L, -1, name));
+	else if (name == "release_log"sv)
+		config.release_log = ParseReleaseLog(CheckString(L, -1, name));
+	else if (name == "archive_directory"sv)
+		config.archive_directory = CheckString(L, -1, name);
+	else if (name == "metrics_socket"sv)
+		config.metrics_socket = CheckString(L, -1, name);
+	else if (name == "watch_trace"sv)
+		config.watch_trace = CheckString(L, -1, name);
+	else if (name == "fd_budget"sv)
+		config.fd_budget = CheckBoolean(L, -1, name);
+	else if (name == "io_devices"sv)
+		config.io_devices = CheckBoolean(L, -1, name);
+	else if (name == "extended_stats"sv)
+		config.extended_stats = CheckBoolean(L, -1, name);
+	else if (name == "sample_interval"sv)
+		config.sample_interval = CheckDuration(L, -1, name);
+	else if (name == "sample_reset_memory_peak"sv)
+		config.sample_reset_memory_peak = CheckBoolean(L, -1, name);
+	else if (name == "release_batch_size"sv)
+		config.release_batch_size = CheckPositiveInteger(L, -1, name);
+	else if (name == "release_batch_window"sv)
+		config.release_batch_window = CheckDuration(L, -1, name);
+	else if (name == "shards"sv)
+		config.shards = CheckThreads(L, -1, name);
+	else if (name == "lua_threads"sv)
+		config.lua_threads = CheckThreads(L, -1, name);
+	else if (name == "lua_max_concurrent"sv)
+		config.lua_max_concurrent = CheckPositiveInteger(L, -1, name);
+	else if (name == "lua_queue_size"sv)
+		config.lua_queue_size = CheckPositiveInteger(L, -1, name);
+	else if (name == "lua_timeout"sv)
+		config.lua_timeout = CheckDuration(L, -1, name);
+	else
+		throw FmtRuntimeError("Unknown setting '{}'", name);
+}
+
+void
+LoadReaperConfig(lua_State *L, ReaperConfig &config)
+{
+	lua_getglobal(L, "reaper_settings");
+	AtScopeExit(L) { lua_pop(L, 1); };
+
+	if (lua_isnil(L, -1))
+		return;
+
+	if (!lua_istable(L, -1))
+		throw std::runtime_error{"'reaper_settings' is not a table"};
+
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		AtScopeExit(L) { lua_pop(L, 1); };
+
+		if (lua_type(L, -2) != LUA_TSTRING)
+			throw std::runtime_error{"Setting names must be strings"};
+
+		std::size_t length;
+		const char *name = lua_tolstring(L, -2, &length);
+		HandleSetting(L, config, {name, length});
+	}
+
+	if (config.fd_budget &&
+	    config.empty_detection != ReaperConfig::EmptyDetection::INOTIFY)
+		throw std::runtime_error{"'fd_budget' requires empty_detection=\"inotify\""};
+}
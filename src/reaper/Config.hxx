@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Scopes.hxx"
+#include "event/Chrono.hxx"
+
+#include <cstddef>
+#include <string>
+
+struct lua_State;
+
+/**
+ * Settings loaded from the global "reaper_settings" table in
+ * reaper.lua.  They are evaluated only once at startup, except for
+ * #scopes, which is reloaded on SIGHUP.
+ */
+struct ReaperConfig {
+	/**
+	 * The scopes whose cgroups are managed by this daemon.
+	 */
+	ManagedScopes scopes = ManagedScopes::Default();
+
+	/**
+	 * How to find out that a cgroup has run empty.
+	 */
+	enum class EmptyDetection {
+		/**
+		 * Register the "cgroup.events" file of each cgroup
+		 * in epoll.
+		 */
+		EPOLL,
+
+		/**
+		 * Watch IN_MODIFY on the "cgroup.events" file of
+		 * each cgroup with the inotify instance which is
+		 * already used for watching the tree.
+		 */
+		INOTIFY,
+	} empty_detection = EmptyDetection::EPOLL;
+
+	/**
+	 * Where to log the resource usage of released cgroups.
+	 */
+	enum class ReleaseLog {
+		/**
+		 * One line of text on stderr.
+		 */
+		TEXT,
+
+		/**
+		 * Structured fields sent directly to
+		 * systemd-journald (without blocking).
+		 */
+		JOURNAL,
+	} release_log = ReleaseLog::TEXT;
+
+	/**
+	 * If not empty, then the resource usage of released cgroups
+	 * is appended to segment files in this directory (see
+	 * AccountingArchive).
+	 */
+	std::string archive_directory;
+
+	/**
+	 * If not empty, then a local stream socket is bound to this
+	 * path (or abstract name if it begins with '@'), which
+	 * serves the #ReleaseMetrics in the OpenMetrics text format.
+	 */
+	std::string metrics_socket;
+
+	/**
+	 * If not empty, then all events seen by the cgroup watch are
+	 * recorded in this file (see #WatchTraceWriter).  With
+	 * #shards, each shard writes its own file, with the shard
+	 * index appended to this path.
+	 */
+	std::string watch_trace;
+
+	/**
+	 * Don't keep file descriptors for each cgroup (see
+	 * UnifiedCgroupWatch::EnableFdBudget())?  This requires
+	 * #EmptyDetection::INOTIFY.
+	 */
+	bool fd_budget = false;
+
+	/**
+	 * Log the I/O of released cgroups per block device (in
+	 * addition to the sum)?
+	 */
+	bool io_devices = false;
+
+	/**
+	 * Collect extended statistics (pressure stall information,
+	 * CPU throttling, "memory.stat"), log them and pass them to
+	 * Lua?  Only those which were selected at build time are
+	 * available.
+	 */
+	bool extended_stats = false;
+
+	/**
+	 * If non-zero, running cgroups are sampled at this interval
+	 * (see #CgroupSampler).
+	 */
+	Event::Duration sample_interval{};
+
+	/**
+	 * Reset "memory.peak" after each sample, so each sample
+	 * reports the peak of its own window?
+	 */
+	bool sample_reset_memory_peak = false;
+
+	/**
+	 * If reaper.lua defines "cgroup_released_batch", then it
+	 * gets a list of at most this many cgroups ...
+	 */
+	std::size_t release_batch_size = 256;
+
+	/**
+	 * ... which were released within this duration (measured
+	 * from the first one).
+	 */
+	Event::Duration release_batch_window = std::chrono::seconds{1};
+
+	/**
+	 * If non-zero, then the children of the managed scopes are
+	 * distributed among this many threads, each with its own
+	 * #EventLoop and #UnifiedCgroupWatch (see ShardPool).
+	 */
+	std::size_t shards = 0;
+
+	/**
+	 * If non-zero, then reaper.lua is loaded into this many
+	 * independent Lua states, each running in its own thread.
+	 */
+	std::size_t lua_threads = 0;
+
+	/**
+	 * The maximum number of Lua handler coroutines which may be
+	 * running at the same time (per thread).  Each one holds file descriptors
+	 * of the cgroups passed to it.
+	 */
+	std::size_t lua_max_concurrent = 1024;
+
+	/**
+	 * The maximum number of releases waiting for a free
+	 * coroutine slot.  Further releases are not passed to the
+	 * Lua handler.
+	 */
+	std::size_t lua_queue_size = 16384;
+
+	/**
+	 * Cancel a Lua handler coroutine which has not finished
+	 * after this duration.  Zero means no limit.
+	 */
+	Event::Duration lua_timeout = std::chrono::minutes{1};
+};
+
+/**
+ * Load settings from the global "reaper_settings" table (if one was
+ * defined).
+ *
+ * Throws on error.
+ */
+void
+LoadReaperConfig(lua_State *L, ReaperConfig &config);
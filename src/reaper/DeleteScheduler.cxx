@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "DeleteScheduler.hxx"
+#include "Stats.hxx"
+#include "event/Loop.hxx"
+#include "util/PrintException.hxx"
+
+#ifdef HAVE_URING
+#include "io/uring/Operation.hxx"
+#include "io/uring/Queue.hxx"
+
+#include <liburing.h>
+#endif
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cassert>
+#include <span>
+
+#include <errno.h>
+#include <fcntl.h> // for AT_REMOVEDIR
+#include <string.h> // for strerror()
+#include <unistd.h>
+
+/**
+ * Read the final snapshot right before the rmdir(); this catches
+ * charges which arrived after the cgroup ran empty (e.g. page cache
+ * and kernel work).
+ *
+ * @param queued the time the cgroup was added to the queue
+ */
+static CgroupResourceUsage
+ReadFinalUsage(PendingRelease &release, Event::TimePoint queued) noexcept
+{
+	const auto start = release.timeline.Finish(ReleaseStage::DELETE_QUEUE,
+						   queued);
+
+	if (!release.accounting)
+		/* this cgroup will not be reported (see
+		   ManagedScope::accounting); don't waste any system
+		   calls on it */
+		return {};
+
+	auto usage = ReadCgroupResourceUsage(release.cgroup_fd,
+					     release.stat_files);
+	usage.Complete(release.usage);
+
+	release.timeline.Finish(ReleaseStage::FINAL_USAGE, start);
+	return usage;
+}
+
+/**
+ * @return the errno value or 0 on success
+ */
+static int
+DeleteCgroup(FileDescriptor root_cgroup, const char *relative_path) noexcept
+{
+	assert(*relative_path == '/');
+	assert(relative_path[1] != 0);
+
+	if (unlinkat(root_cgroup.Get(), relative_path + 1, AT_REMOVEDIR) < 0)
+		return errno;
+
+	return 0;
+}
+
+#ifdef HAVE_URING
+
+/**
+ * Delete many cgroups (of the same depth) with one io_uring
+ * submission of IORING_OP_UNLINKAT operations.  The queue nodes
+ * are owned by this object until the callback has been invoked.
+ */
+class CgroupDeleteScheduler::Batch final {
+public:
+	struct Entry final : Uring::Operation {
+		Batch *batch;
+
+		Queue::node_type node;
+
+		CgroupResourceUsage usage;
+
+		/**
+		 * When was the IORING_OP_UNLINKAT operation
+		 * prepared?
+		 */
+		Event::TimePoint start;
+
+		/**
+		 * The errno value or 0 on success.
+		 */
+		int error;
+
+	private:
+		void OnUringCompletion(int res) noexcept override {
+			auto &timeline = node.mapped().release.timeline;
+			timeline.deleted = timeline.Finish(ReleaseStage::DELETE,
+							   start);
+
+			error = res < 0 ? -res : 0;
+			batch->OnEntryDone();
+		}
+	};
+
+private:
+	Uring::Queue &uring;
+
+	const FileDescriptor root_cgroup;
+
+	using Callback = BoundMethod<void() noexcept>;
+	const Callback callback;
+
+	const std::unique_ptr<Entry[]> entries;
+	const std::size_t capacity;
+	std::size_t n_entries = 0;
+
+	/**
+	 * The number of operations which have not yet completed
+	 * plus one until Submit() has been called.
+	 */
+	std::size_t n_pending = 1;
+
+public:
+	Batch(Uring::Queue &_uring, FileDescriptor _root_cgroup,
+	      std::size_t _capacity, Callback _callback)
+		:uring(_uring), root_cgroup(_root_cgroup), callback(_callback),
+		 entries(std::make_unique<Entry[]>(_capacity)),
+		 capacity(_capacity) {}
+
+	~Batch() noexcept {
+		/* the kernel would still read the paths of pending
+		   operations */
+		assert(n_pending == 0 || n_entries == 0);
+	}
+
+	Batch(const Batch &) = delete;
+	Batch &operator=(const Batch &) = delete;
+
+	std::span<Entry> GetEntries() noexcept {
+		return {entries.get(), n_entries};
+	}
+
+	/**
+	 * Read the final snapshot and prepare the IORING_OP_UNLINKAT
+	 * operation.  If the submission queue fails, the cgroup is
+	 * deleted synchronously.
+	 */
+	void Add(Queue::node_type &&node) noexcept;
+
+	/**
+	 * @return true if operations are pending (the callback will
+	 * be invoked later), false if all cgroups have been deleted
+	 * already
+	 */
+	bool Submit() noexcept;
+
+private:
+	void OnEntryDone() noexcept {
+		assert(n_pending > 0);
+
+		if (--n_pending == 0)
+			callback();
+	}
+};
+
+void
+CgroupDeleteScheduler::Batch::Add(Queue::node_type &&node) noexcept
+{
+	assert(n_entries < capacity);
+	assert(n_pending > 0);
+
+	auto &entry = entries[n_entries++];
+	entry.batch = this;
+	entry.node = std::move(node);
+	auto &item = entry.node.mapped();
+	entry.usage = ReadFinalUsage(item.release, item.queued);
+	entry.start = Event::Clock::now();
+	entry.error = 0;
+
+	const char *path = entry.node.key().second.c_str();
+
+	try {
+		auto &sqe = uring.RequireSubmitEntry();
+		/* the +1 strips the leading slash; the string is
+		   owned by the node which remains valid until the
+		   operation has completed */
+		io_uring_prep_unlinkat(&sqe, root_cgroup.Get(), path + 1,
+				       AT_REMOVEDIR);
+		uring.Push(sqe, entry);
+		++n_pending;
+	} catch (...) {
+		PrintException(std::current_exception());
+		entry.error = DeleteCgroup(root_cgroup, path);
+
+		auto &timeline = item.release.timeline;
+		timeline.deleted = timeline.Finish(ReleaseStage::DELETE,
+						   entry.start);
+	}
+}
+
+bool
+CgroupDeleteScheduler::Batch::Submit() noexcept
+{
+	assert(n_pending > 0);
+
+	try {
+		uring.Submit();
+	} catch (...) {
+		/* the prepared entries remain in the submission
+		   queue and will be submitted by the next
+		   io_uring_submit() call */
+		PrintException(std::current_exception());
+	}
+
+	/* release the reference held by the constructor */
+	return --n_pending > 0;
+}
+
+#endif // HAVE_URING
+
+CgroupDeleteScheduler::CgroupDeleteScheduler(EventLoop &event_loop,
+					     FileDescriptor _root_cgroup,
+					     CgroupDeleteHandler &_handler,
+					     ReaperStats &_stats) noexcept
+	:root_cgroup(_root_cgroup), handler(_handler), stats(_stats),
+	 timer(event_loop, BIND_THIS_METHOD(OnTimer))
+{
+}
+
+CgroupDeleteScheduler::~CgroupDeleteScheduler() noexcept = default;
+
+static constexpr bool
+IsDue(const auto &item, Event::TimePoint now) noexcept
+{
+	return item.not_before <= now;
+}
+
+inline Event::Duration
+CgroupDeleteScheduler::GetDelay() const noexcept
+{
+	const auto delay = DELAY_PER_CGROUP * static_cast<Event::Duration::rep>(last_batch_size);
+	return std::clamp(delay, MIN_DELAY, MAX_DELAY);
+}
+
+Event::Duration
+CgroupDeleteScheduler::GetBusyBackoff(std::string_view path) const noexcept
+{
+	const auto i = busy.find(path);
+	if (i == busy.end())
+		return {};
+
+	Event::Duration backoff = BUSY_BACKOFF;
+	for (unsigned n = 1; n < i->second.n_failures && backoff < MAX_BUSY_BACKOFF; ++n)
+		backoff *= 2;
+
+	return std::min(backoff, MAX_BUSY_BACKOFF);
+}
+
+void
+CgroupDeleteScheduler::Add(std::string &&path, PendingRelease &&release) noexcept
+{
+	assert(path.starts_with('/'));
+
+	const auto now = GetEventLoop().SteadyNow();
+
+	auto not_before = now + release.delete_delay;
+	if (const auto backoff = GetBusyBackoff(path);
+	    backoff > Event::Duration{}) {
+		not_before += backoff;
+		++stats.n_delete_backoff;
+	}
+
+	const unsigned depth = std::count(path.begin(), path.end(), '/');
+
+	if (!queue.try_emplace(Key{depth, std::move(path)},
+			       std::move(release), now, not_before).second)
+		return;
+
+	stats.delete_queue_size = queue.size();
+	stats.delete_queue_max = std::max(stats.delete_queue_max, queue.size());
+
+	timer.ScheduleEarlier(std::max(GetDelay(), not_before - now));
+}
+
+void
+CgroupDeleteScheduler::FlushAll() noexcept
+{
+	timer.Cancel();
+
+#ifdef HAVE_URING
+	if (batch)
+		/* the kernel may still read the paths of this batch,
+		   so it must not be freed; this process is about to
+		   exit, so just leak it */
+		(void)batch.release();
+#endif
+
+	DeleteSync(GetEventLoop().SteadyNow(), true);
+}
+
+void
+CgroupDeleteScheduler::PruneBusy(Event::TimePoint now) noexcept
+{
+	std::erase_if(busy, [now](const auto &i){
+		return now - i.second.last_failure > 2 * MAX_BUSY_BACKOFF;
+	});
+}
+
+void
+CgroupDeleteScheduler::Schedule(Event::TimePoint now) noexcept
+{
+	if (queue.empty())
+		return;
+
+	auto earliest = Event::TimePoint::max();
+	for (const auto &[key, item] : queue)
+		earliest = std::min(earliest, item.not_before);
+
+	timer.Schedule(std::max(GetDelay(), earliest - now));
+}
+
+void
+CgroupDeleteScheduler::OnTimer() noexcept
+{
+#ifdef HAVE_URING
+	if (batch)
+		/* wait for the batch to finish; OnBatchDone() will
+		   reschedule */
+		return;
+#endif
+
+	const auto now = GetEventLoop().SteadyNow();
+
+	PruneBusy(now);
+
+	if (std::none_of(queue.begin(), queue.end(), [now](const auto &i){
+		return IsDue(i.second, now);
+	})) {
+		/* all remaining cgroups are in EBUSY backoff */
+		last_batch_size = 0;
+		Schedule(now);
+		return;
+	}
+
+#ifdef HAVE_URING
+	if (auto *uring = GetEventLoop().GetUring()) {
+		if (StartBatch(*uring, now))
+			return;
+	}
+#endif
+
+	DeleteSync(now, false);
+	Schedule(now);
+}
+
+void
+CgroupDeleteScheduler::DeleteSync(Event::TimePoint now, bool all) noexcept
+{
+	std::size_t n = 0;
+
+	/* the queue is ordered deepest first, so children are
+	   deleted before their parents */
+	for (auto i = queue.begin(); i != queue.end();) {
+		if (!all && !IsDue(i->second, now)) {
+			++i;
+			continue;
+		}
+
+		/* remove the item from the queue before calling
+		   Finish(), because OnCgroupBusy() may add the same
+		   cgroup again */
+		auto next = std::next(i);
+		auto node = queue.extract(i);
+		i = next;
+
+		const auto &key = node.key();
+		auto &item = node.mapped();
+
+		const auto usage = ReadFinalUsage(item.release, item.queued);
+
+		const auto start = Event::Clock::now();
+		const int error = DeleteCgroup(root_cgroup, key.second.c_str());
+		auto &timeline = item.release.timeline;
+		timeline.deleted = timeline.Finish(ReleaseStage::DELETE, start);
+
+		Finish(now, key.second, item, usage, error);
+
+		++n;
+	}
+
+	last_batch_size = n;
+	stats.delete_queue_size = queue.size();
+}
+
+void
+CgroupDeleteScheduler::Finish(Event::TimePoint now, const std::string &path,
+			      Item &item, const CgroupResourceUsage &usage,
+			      int error) noexcept
+{
+	if (error == EBUSY) {
+		/* meanwhile, a new process has been spawned/moved
+		   into the cgroup (or it has a child cgroup which
+		   was not yet deleted); the next attempt will be
+		   delayed with an exponential backoff */
+		++stats.n_delete_busy;
+
+		auto &state = busy[path];
+		++state.n_failures;
+		state.last_failure = now;
+
+		handler.OnCgroupBusy(path);
+		return;
+	}
+
+	if (error != 0) {
+		/* the end-to-end latency only counts cgroups which
+		   were deleted by us */
+		item.release.timeline.deleted = {};
+
+		if (error != ENOENT)
+			fmt::print(stderr, "Failed to delete '{}': {}\n",
+				   path, strerror(error));
+	}
+
+	if (const auto i = busy.find(path); i != busy.end())
+		busy.erase(i);
+
+	const auto latency = now - item.queued;
+	++stats.n_deleted;
+	stats.delete_latency_total += latency;
+	stats.delete_latency_max = std::max(stats.delete_latency_max, latency);
+
+	handler.OnCgroupDeleted(path.c_str(), item.release, usage);
+}
+
+#ifdef HAVE_URING
+
+inline bool
+CgroupDeleteScheduler::StartBatch(Uring::Queue &uring,
+				  Event::TimePoint now) noexcept
+{
+	assert(!batch);
+
+	/* the deepest level which has due cgroups; its parents
+	   will be deleted by the next batch */
+	auto i = std::find_if(queue.begin(), queue.end(), [now](const auto &j){
+		return IsDue(j.second, now);
+	});
+	assert(i != queue.end());
+
+	const unsigned depth = i->first.first;
+
+	std::size_t n = 0;
+	for (auto j = i; j != queue.end() && j->first.first == depth &&
+		     n < MAX_BATCH; ++j)
+		if (IsDue(j->second, now))
+			++n;
+
+	try {
+		batch = std::make_unique<Batch>(uring, root_cgroup, n,
+						BIND_THIS_METHOD(OnBatchDone));
+	} catch (...) {
+		PrintException(std::current_exception());
+		return false;
+	}
+
+	for (std::size_t added = 0; added < n;) {
+		assert(i != queue.end());
+		assert(i->first.first == depth);
+
+		auto next = std::next(i);
+		if (IsDue(i->second, now)) {
+			batch->Add(queue.extract(i));
+			++added;
+		}
+
+		i = next;
+	}
+
+	last_batch_size = n;
+	stats.delete_queue_size = queue.size();
+
+	if (!batch->Submit())
+		/* everything was done synchronously */
+		OnBatchDone();
+
+	return true;
+}
+
+void
+CgroupDeleteScheduler::OnBatchDone() noexcept
+{
+	assert(batch);
+
+	const auto now = GetEventLoop().SteadyNow();
+
+	for (auto &entry : batch->GetEntries())
+		Finish(now, entry.node.key().second, entry.node.mapped(),
+		       entry.usage, entry.error);
+
+	batch.reset();
+
+	if (std::any_of(queue.begin(), queue.end(), [now](const auto &i){
+		return IsDue(i.second, now);
+	}))
+		/* continue with the parent level right away */
+		timer.Schedule({});
+	else
+		Schedule(now);
+}
+
+#endif // HAVE_URING
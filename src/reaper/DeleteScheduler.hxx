@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "PendingRelease.hxx"
+#include "event/Chrono.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "io/FileDescriptor.hxx"
+#include "config.h"
+
+#include <functional> // for std::greater
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+struct ReaperStats;
+namespace Uring { class Queue; }
+
+class CgroupDeleteHandler {
+public:
+	/**
+	 * The cgroup has been deleted (or it did not exist anymore).
+	 *
+	 * @param path the cgroup path with a leading slash
+	 * @param usage the final snapshot of the resource usage,
+	 * taken right before the cgroup was deleted
+	 */
+	virtual void OnCgroupDeleted(const char *path, PendingRelease &release,
+				     const CgroupResourceUsage &usage) noexcept = 0;
+
+	/**
+	 * The cgroup could not be deleted because it is populated
+	 * again (EBUSY).
+	 *
+	 * @param path the cgroup path with a leading slash
+	 */
+	virtual void OnCgroupBusy(std::string_view path) noexcept = 0;
+};
+
+/**
+ * Deletes cgroups which have run empty, right after reading their
+ * final resource usage snapshot.
+ *
+ * Children are deleted before their parents: the queue is ordered
+ * by depth (deepest first), and with io_uring, one depth level is
+ * removed with one batch of IORING_OP_UNLINKAT before the next
+ * level is submitted.
+ *
+ * The deletion is deferred a little to coalesce bursts; the delay
+ * is derived from the size of the previous batch, i.e. it is about
+ * a millisecond if only a single cgroup has run empty and grows (up
+ * to #MAX_DELAY) while many cgroups are released.
+ *
+ * A cgroup which fails with EBUSY again and again (because
+ * processes keep getting spawned into it) is retried with an
+ * exponential backoff.
+ */
+class CgroupDeleteScheduler final {
+	/**
+	 * The delay per cgroup in the previous batch.
+	 */
+	static constexpr Event::Duration DELAY_PER_CGROUP = std::chrono::microseconds{200};
+
+	/**
+	 * The lower limit for the adaptive delay; this gives the
+	 * children of a cgroup a chance to get enqueued before their
+	 * parent is deleted.
+	 */
+	static constexpr Event::Duration MIN_DELAY = std::chrono::milliseconds{1};
+
+	/**
+	 * The upper limit for the adaptive delay.
+	 */
+	static constexpr Event::Duration MAX_DELAY = std::chrono::milliseconds{50};
+
+	/**
+	 * The delay after the first EBUSY; it doubles with each
+	 * further EBUSY.
+	 */
+	static constexpr Event::Duration BUSY_BACKOFF = std::chrono::milliseconds{100};
+
+	static constexpr Event::Duration MAX_BUSY_BACKOFF = std::chrono::seconds{30};
+
+	/**
+	 * The maximum number of cgroups deleted in one batch.
+	 */
+	static constexpr std::size_t MAX_BATCH = 1024;
+
+	const FileDescriptor root_cgroup;
+
+	CgroupDeleteHandler &handler;
+
+	ReaperStats &stats;
+
+	FineTimerEvent timer;
+
+	struct Item {
+		PendingRelease release;
+
+		/**
+		 * When was this cgroup added to the queue?
+		 */
+		Event::TimePoint queued;
+
+		/**
+		 * Do not attempt to delete this cgroup before this
+		 * time (EBUSY backoff).
+		 */
+		Event::TimePoint not_before;
+
+		Item(PendingRelease &&_release,
+		     Event::TimePoint _queued, Event::TimePoint _not_before) noexcept
+			:release(std::move(_release)),
+			 queued(_queued), not_before(_not_before) {}
+	};
+
+	/**
+	 * The key is the depth (number of slashes) and the cgroup
+	 * path with a leading slash.  The reverse order puts deeper
+	 * cgroups first.
+	 */
+	using Key = std::pair<unsigned, std::string>;
+	using Queue = std::map<Key, Item, std::greater<>>;
+
+	Queue queue;
+
+	/**
+	 * Cgroups which have recently failed with EBUSY.  The value
+	 * is the number of consecutive failures and the time of the
+	 * most recent one.
+	 */
+	struct BusyState {
+		unsigned n_failures = 0;
+		Event::TimePoint last_failure;
+	};
+
+	std::map<std::string, BusyState, std::less<>> busy;
+
+	/**
+	 * The number of cgroups deleted by the previous batch; it
+	 * determines the next delay.
+	 */
+	std::size_t last_batch_size = 0;
+
+#ifdef HAVE_URING
+	class Batch;
+	std::unique_ptr<Batch> batch;
+#endif
+
+public:
+	CgroupDeleteScheduler(EventLoop &event_loop, FileDescriptor _root_cgroup,
+			      CgroupDeleteHandler &_handler,
+			      ReaperStats &_stats) noexcept;
+	~CgroupDeleteScheduler() noexcept;
+
+	CgroupDeleteScheduler(const CgroupDeleteScheduler &) = delete;
+	CgroupDeleteScheduler &operator=(const CgroupDeleteScheduler &) = delete;
+
+	/**
+	 * Schedule the deletion of a cgroup.  Duplicates are ignored.
+	 *
+	 * @param path the cgroup path with a leading slash
+	 */
+	void Add(std::string &&path, PendingRelease &&release) noexcept;
+
+	/**
+	 * Delete all queued cgroups synchronously, ignoring delays
+	 * and backoff.  This is called before the process exits.
+	 * An io_uring batch which is still in flight is leaked (and
+	 * its cgroups are not reported).
+	 */
+	void FlushAll() noexcept;
+
+private:
+	EventLoop &GetEventLoop() const noexcept {
+		return timer.GetEventLoop();
+	}
+
+	/**
+	 * Calculate the delay for newly queued cgroups from
+	 * #last_batch_size.
+	 */
+	[[gnu::pure]]
+	Event::Duration GetDelay() const noexcept;
+
+	[[gnu::pure]]
+	Event::Duration GetBusyBackoff(std::string_view path) const noexcept;
+
+	/**
+	 * Forget EBUSY failures which are older than the maximum
+	 * backoff.
+	 */
+	void PruneBusy(Event::TimePoint now) noexcept;
+
+	/**
+	 * Arm the timer for the earliest queued cgroup.
+	 */
+	void Schedule(Event::TimePoint now) noexcept;
+
+	void OnTimer() noexcept;
+
+	/**
+	 * Delete all due cgroups synchronously.
+	 *
+	 * @param all ignore the backoff and delete all cgroups
+	 */
+	void DeleteSync(Event::TimePoint now, bool all) noexcept;
+
+	/**
+	 * Evaluate the result of one unlinkat() call and invoke the
+	 * #CgroupDeleteHandler.
+	 *
+	 * @param error the errno value or 0 on success
+	 */
+	void Finish(Event::TimePoint now, const std::string &path, Item &item,
+		    const CgroupResourceUsage &usage, int error) noexcept;
+
+#ifdef HAVE_URING
+	/**
+	 * Start a #Batch for the due cgroups of the deepest level.
+	 *
+	 * @return false if io_uring could not be used
+	 */
+	bool StartBatch(Uring::Queue &uring, Event::TimePoint now) noexcept;
+
+	void OnBatchDone() noexcept;
+#endif
+};
@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "DirentReader.hxx"
+#include "system/Error.hxx"
+
+const struct dirent64 *
+DirentReader::Read()
+{
+	if (position >= fill) {
+		const auto nbytes = getdents64(fd.Get(), buffer.data(), buffer.size());
+		if (nbytes < 0)
+			throw MakeErrno("getdents64() failed");
+
+		if (nbytes == 0)
+			return nullptr;
+
+		position = 0;
+		fill = static_cast<std::size_t>(nbytes);
+	}
+
+	const auto *entry = reinterpret_cast<const struct dirent64 *>(buffer.data() + position);
+	position += entry->d_reclen;
+	return entry;
+}
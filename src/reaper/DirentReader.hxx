@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "io/FileDescriptor.hxx"
+
+#include <cstddef>
+#include <span>
+
+#include <dirent.h>
+
+/**
+ * Read directory entries with getdents64() into a caller-provided
+ * buffer.  Unlike readdir(), this allows sharing one large buffer
+ * for scanning many directories, which reduces the number of system
+ * calls for large directories.
+ */
+class DirentReader {
+	const FileDescriptor fd;
+
+	const std::span<std::byte> buffer;
+
+	std::size_t position = 0, fill = 0;
+
+public:
+	/**
+	 * @param _fd a directory opened for reading (not O_PATH); it
+	 * is owned by the caller
+	 * @param _buffer the buffer; it must be suitably aligned for
+	 * struct dirent64
+	 */
+	DirentReader(FileDescriptor _fd, std::span<std::byte> _buffer) noexcept
+		:fd(_fd), buffer(_buffer) {}
+
+	/**
+	 * Read the next entry (including "." and "..").  Returns
+	 * nullptr at the end of the directory.  The pointer is
+	 * invalidated by the next call.
+	 *
+	 * Throws on error.
+	 */
+	const struct dirent64 *Read();
+};
+
+/**
+ * Is this entry possibly a directory?  Returns true if the
+ * filesystem does not provide the file type.
+ */
+constexpr bool
+MaybeDirectory(const struct dirent64 &entry) noexcept
+{
+	return entry.d_type == DT_DIR || entry.d_type == DT_UNKNOWN;
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "FdUsage.hxx"
+#include "DirentReader.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/NumberParser.hxx"
+#include "util/SpanCast.hxx"
+#include "util/StringStrip.hxx"
+
+#include <fmt/core.h>
+
+#include <sys/resource.h> // for getrlimit()
+
+std::size_t
+CountOpenFds() noexcept
+try {
+	const auto fd = OpenDirectory("/proc/self/fd");
+
+	alignas(struct dirent64) std::byte buffer[16384];
+	DirentReader reader{fd, buffer};
+
+	std::size_t n = 0;
+	while (const auto *dirent = reader.Read())
+		if (dirent->d_name[0] != '.')
+			++n;
+
+	/* don't count the file descriptor used for reading the
+	   directory */
+	return n - 1;
+} catch (...) {
+	return 0;
+}
+
+std::size_t
+GetFdLimit() noexcept
+{
+	struct rlimit r;
+	if (getrlimit(RLIMIT_NOFILE, &r) < 0 || r.rlim_cur == RLIM_INFINITY)
+		return 0;
+
+	return r.rlim_cur;
+}
+
+std::size_t
+GetInotifyWatchLimit() noexcept
+{
+	UniqueFileDescriptor fd;
+	if (!fd.OpenReadOnly("/proc/sys/fs/inotify/max_user_watches"))
+		return 0;
+
+	std::byte buffer[64];
+	const ssize_t nbytes = fd.Read(buffer);
+	if (nbytes <= 0)
+		return 0;
+
+	return ParseInteger<std::size_t>(StripRight(ToStringView(std::span{buffer}.first(nbytes))))
+		.value_or(0);
+}
+
+/**
+ * Print one "NAME=VALUE/LIMIT[PERCENT%]" field.
+ */
+static void
+LogUsage(const char *name, std::size_t value, std::size_t limit) noexcept
+{
+	fmt::print(stderr, " {}={}", name, value);
+
+	if (limit > 0)
+		fmt::print(stderr, "/{}[{:.0f}%]",
+			   limit, 100. * value / limit);
+}
+
+void
+LogFdUsage(std::size_t n_watches) noexcept
+{
+	fmt::print(stderr, "usage:");
+	LogUsage("fds", CountOpenFds(), GetFdLimit());
+	LogUsage("inotify_watches", n_watches, GetInotifyWatchLimit());
+	fmt::print(stderr, "\n");
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Count the open file descriptors of this process (by reading
+ * /proc/self/fd).  Returns 0 on error.
+ */
+std::size_t
+CountOpenFds() noexcept;
+
+/**
+ * Returns the soft RLIMIT_NOFILE (0 if unlimited or unknown).
+ */
+std::size_t
+GetFdLimit() noexcept;
+
+/**
+ * Returns the maximum number of inotify watches of this user
+ * ("fs.inotify.max_user_watches"; 0 if unknown).  Note that this
+ * limit is shared with all other processes of the same user.
+ */
+std::size_t
+GetInotifyWatchLimit() noexcept;
+
+/**
+ * Print the number of file descriptors and inotify watches and
+ * their limits to stderr.
+ *
+ * @param n_watches the number of inotify watches registered by
+ * this process (see UnifiedCgroupWatch::GetWatchCount())
+ */
+void
+LogFdUsage(std::size_t n_watches) noexcept;
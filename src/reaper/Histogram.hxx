@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * A histogram of unsigned integers with log-linear buckets: each
+ * power of two is divided into 2^SUB_BITS buckets of equal width,
+ * which limits the relative error to 2^-SUB_BITS.  Values below
+ * 2^SUB_BITS get one bucket each; values of 2^MAX_BITS and more go
+ * to one overflow bucket.
+ *
+ * All buckets are allocated inline, so adding a value never
+ * allocates memory, and its size (and the cost of exporting it)
+ * does not depend on the number of values.
+ */
+template<unsigned SUB_BITS, unsigned MAX_BITS>
+class LogLinearHistogram {
+	static_assert(SUB_BITS < MAX_BITS);
+	static_assert(MAX_BITS < 64);
+
+	static constexpr std::size_t N_SUB = std::size_t{1} << SUB_BITS;
+
+public:
+	/**
+	 * The number of buckets with a finite upper bound.
+	 */
+	static constexpr std::size_t N_FINITE = (MAX_BITS - SUB_BITS + 1) * N_SUB;
+
+	/**
+	 * The number of buckets including the overflow bucket.
+	 */
+	static constexpr std::size_t N_BUCKETS = N_FINITE + 1;
+
+private:
+	std::array<uint_least64_t, N_BUCKETS> buckets{};
+
+	uint_least64_t count = 0, sum = 0;
+
+public:
+	[[gnu::const]]
+	static constexpr std::size_t IndexOf(uint_least64_t value) noexcept {
+		if (value < N_SUB)
+			return value;
+
+		const unsigned exponent = std::bit_width(value) - 1;
+		if (exponent >= MAX_BITS)
+			return N_FINITE;
+
+		const unsigned shift = exponent - SUB_BITS;
+		return (shift + 1) * N_SUB + ((value >> shift) - N_SUB);
+	}
+
+	/**
+	 * Returns the (exclusive) upper bound of the values in the
+	 * specified bucket.  Must not be called for the overflow
+	 * bucket.
+	 */
+	[[gnu::const]]
+	static constexpr uint_least64_t UpperBound(std::size_t i) noexcept {
+		if (i < N_SUB)
+			return i + 1;
+
+		const unsigned shift = i / N_SUB - 1;
+		const uint_least64_t mantissa = N_SUB + i % N_SUB;
+		return (mantissa + 1) << shift;
+	}
+
+	constexpr void Add(uint_least64_t value) noexcept {
+		++buckets[IndexOf(value)];
+		++count;
+		sum += value;
+	}
+
+	constexpr void Add(const LogLinearHistogram &other) noexcept {
+		for (std::size_t i = 0; i < N_BUCKETS; ++i)
+			buckets[i] += other.buckets[i];
+		count += other.count;
+		sum += other.sum;
+	}
+
+	constexpr uint_least64_t GetCount() const noexcept {
+		return count;
+	}
+
+	constexpr uint_least64_t GetSum() const noexcept {
+		return sum;
+	}
+
+	constexpr uint_least64_t GetBucket(std::size_t i) const noexcept {
+		return buckets[i];
+	}
+
+	/**
+	 * Estimate a quantile (0..1).  Returns the largest value of
+	 * the bucket containing it, i.e. the result is too large by
+	 * less than one bucket width.  Returns 0 if the histogram is
+	 * empty and UINT_LEAST64_MAX if the quantile lies in the
+	 * overflow bucket.
+	 */
+	[[gnu::pure]]
+	constexpr uint_least64_t Quantile(double q) const noexcept {
+		if (count == 0)
+			return 0;
+
+		uint_least64_t rank = static_cast<uint_least64_t>(q * count);
+		if (rank >= count)
+			rank = count - 1;
+
+		uint_least64_t n = 0;
+		for (std::size_t i = 0; i < N_FINITE; ++i) {
+			n += buckets[i];
+			if (n > rank)
+				return UpperBound(i) - 1;
+		}
+
+		return UINT_LEAST64_MAX;
+	}
+};
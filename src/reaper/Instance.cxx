@@ -3,79 +3,146 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Instance.hxx"
-#include "Scopes.hxx"
-#include "UnifiedWatch.hxx"
+#include "ShardPool.hxx"
 #include "LAccounting.hxx"
 #include "LInit.hxx"
+#include "LWorker.hxx"
+#include "JournalSink.hxx"
+#include "Archive.hxx"
+#include "FdUsage.hxx"
+#include "lua/ReloadRunner.hxx"
 #include "lua/RunFile.hxx"
-#include "lib/fmt/RuntimeError.hxx"
 #include "io/Open.hxx"
 #include "util/PrintException.hxx"
-#include "util/ScopeExit.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "config.h"
 
-#include <signal.h>
+#ifdef HAVE_URING
+#include <liburing.h> // for IORING_SETUP_*
+#endif
 
-static auto
-CreateUnifiedCgroupWatch(EventLoop &event_loop,
-			 const FileDescriptor root_cgroup,
-			 auto callback)
-{
-	assert(root_cgroup.IsDefined());
+#include <fmt/core.h>
 
-	auto watch = std::make_unique<UnifiedCgroupWatch>(event_loop,
-							  root_cgroup,
-							  callback);
-	for (auto i = managed_scopes; *i != nullptr; ++i) {
-		const char *relative_path = *i;
-		if (*relative_path == '/')
-			++relative_path;
+#include <chrono>
 
-		watch->AddCgroup(relative_path);
-	}
+#include <signal.h>
 
-	return watch;
-}
+static constexpr const char *lua_path = "/etc/cm4all/spawn/reaper.lua";
 
-static Lua::ValuePtr
-GetGlobalFunction(lua_State *L, const char *name)
-{
-	lua_getglobal(L, name);
-	AtScopeExit(L) { lua_pop(L, 1); };
+/**
+ * The Lua state in which the main thread has loaded reaper.lua if
+ * the handler runs in worker threads.  Like the handler states, it
+ * gets its "reload" function called on SIGHUP, and then the scopes
+ * are read from it (see Instance::ReloadScopes()).
+ */
+class LuaSettings final {
+	Lua::State state;
 
-	if (lua_isnil(L, -1))
-		throw FmtRuntimeError("Function '{}' not found", name);
+	Lua::ReloadRunner reload{state.get()};
 
-	if (!lua_isfunction(L, -1))
-		throw FmtRuntimeError("'{}' is not a function", name);
+public:
+	explicit LuaSettings(Lua::State &&_state) noexcept
+		:state(std::move(_state)) {}
 
-	return std::make_shared<Lua::Value>(L, Lua::RelativeStackIndex{-1});
-}
+	lua_State *GetState() const noexcept {
+		return state.get();
+	}
 
+	void Reload() noexcept {
+		reload.Start();
+	}
+};
+
+/**
+ * Load reaper.lua and its settings.  Returns nullptr if the handler
+ * runs in worker threads (which load the script again); the state
+ * is then moved to #settings_r.
+ */
 static std::unique_ptr<LuaAccounting>
-LoadLuaAccounting(EventLoop &event_loop, const char *path)
+LoadLuaAccounting(EventLoop &event_loop, const char *path,
+		  ReaperConfig &config, LuaAccountingStats &stats,
+		  std::unique_ptr<LuaSettings> &settings_r)
 {
 	auto state = LuaInit(event_loop);
 	Lua::RunFile(state.get(), path);
 
-	auto handler = GetGlobalFunction(state.get(), "cgroup_released");
+	LoadReaperConfig(state.get(), config);
+
+	if (config.lua_threads > 0) {
+		settings_r = std::make_unique<LuaSettings>(std::move(state));
+		return nullptr;
+	}
 
-	return std::make_unique<LuaAccounting>(std::move(state),
-					       std::move(handler));
+	return CreateLuaAccounting(event_loop, std::move(state),
+				   config, stats);
 }
 
 Instance::Instance()
 	:shutdown_listener(event_loop, BIND_THIS_METHOD(OnExit)),
 	 sighup_event(event_loop, SIGHUP, BIND_THIS_METHOD(OnReload)),
+	 sigusr1_event(event_loop, SIGUSR1, BIND_THIS_METHOD(OnDumpStats)),
 	 root_cgroup(OpenPath("/sys/fs/cgroup")),
-	 unified_cgroup_watch(CreateUnifiedCgroupWatch(event_loop, root_cgroup,
-						       BIND_THIS_METHOD(OnCgroupEmpty))),
 	 lua_accounting(LoadLuaAccounting(event_loop,
-					  "/etc/cm4all/spawn/reaper.lua")),
-	 defer_cgroup_delete(event_loop,
-			     BIND_THIS_METHOD(OnDeferredCgroupDelete))
+					  lua_path, config, lua_stats,
+					  lua_settings)),
+	 lua_workers(config.lua_threads > 0
+		     ? std::make_unique<LuaWorkerPool>(lua_path, config)
+		     : nullptr)
 {
+	for (auto &scope : config.scopes)
+		scope.metrics_index = metrics.AddScope(scope.GetName());
+
+	/* must be enabled before the initial scan opens the
+	   statistics files */
+	if (config.extended_stats)
+		EnableExtendedCgroupStats();
+
+	/* must be initialized before the shard threads are
+	   started */
+	InitCgroupStatFdLimit();
+
+	auto &shard_handler = static_cast<ReaperShardHandler &>(*this);
+	if (config.shards > 0)
+		shards = std::make_unique<ShardPool>(event_loop, root_cgroup,
+						     config, shard_handler);
+	else
+		shard = std::make_unique<ReaperShard>(event_loop, root_cgroup,
+						      config,
+						      ManagedScopes{config.scopes},
+						      0, 1,
+						      stats, shard_handler);
+
+#ifdef HAVE_URING
+	try {
+		event_loop.EnableUring(4096, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+	} catch (...) {
+		fmt::print(stderr, "Failed to initialize io_uring: {}\n",
+			   std::current_exception());
+	}
+#endif
+
+	if (config.release_log == ReaperConfig::ReleaseLog::JOURNAL) {
+		try {
+			journal_sink = std::make_unique<JournalSink>(event_loop, stats);
+		} catch (...) {
+			fmt::print(stderr, "Failed to connect to the journal, logging to stderr: {}\n",
+				   std::current_exception());
+		}
+	}
+
+	if (!config.archive_directory.empty())
+		archive = std::make_unique<AccountingArchive>(config.archive_directory.c_str());
+
+	if (!config.metrics_socket.empty()) {
+		metrics_listener = std::make_unique<MetricsListener>(event_loop,
+								     event_loop,
+								     metrics);
+		metrics_listener->Listen(CreateMetricsSocket(config.metrics_socket.c_str()));
+	}
+
 	shutdown_listener.Enable();
 	sighup_event.Enable();
+	sigusr1_event.Enable();
 }
 
 Instance::~Instance() noexcept = default;
@@ -90,11 +157,65 @@ Instance::OnExit() noexcept
 
 	shutdown_listener.Disable();
 	sighup_event.Disable();
+	sigusr1_event.Disable();
+
+	if (shard)
+		shard->Flush();
+
+	/* this waits for the shard threads, which collect and delete
+	   all empty cgroups first, and reports them */
+	shards.reset();
+
+	if (journal_sink)
+		journal_sink->FlushBlocking();
+
+	if (lua_accounting)
+		/* invoke the handler for the cgroups which were
+		   reported by the flushes above */
+		lua_accounting->FlushBatch();
 
 	lua_accounting.reset();
+	lua_settings.reset();
+
+	/* this waits for the worker threads, which pass all queued
+	   cgroups to the handler first */
+	lua_workers.reset();
+
+	LogReleaseLatency(metrics.GetLatency());
+
+	shard.reset();
 
-	unified_cgroup_watch.reset();
-	defer_cgroup_delete.Cancel();
+	metrics_listener.reset();
+}
+
+void
+Instance::ApplyScopes(ManagedScopes &&new_scopes) noexcept
+{
+	for (auto &scope : new_scopes)
+		scope.metrics_index = metrics.AddScope(scope.GetName());
+
+	if (shard)
+		shard->ApplyScopes(ManagedScopes{new_scopes});
+	else
+		shards->ApplyScopes(new_scopes);
+
+	config.scopes = std::move(new_scopes);
+}
+
+void
+Instance::ReloadScopes() noexcept
+try {
+	lua_State *const L = lua_accounting
+		? lua_accounting->GetState()
+		: lua_settings->GetState();
+
+	ReaperConfig new_config;
+	LoadReaperConfig(L, new_config);
+
+	ApplyScopes(std::move(new_config.scopes));
+} catch (...) {
+	fmt::print(stderr, "Failed to reload the scopes: {}\n",
+		   std::current_exception());
 }
 
 void
@@ -102,4 +223,58 @@ Instance::OnReload(int) noexcept
 {
 	if (lua_accounting)
 		lua_accounting->Reload();
+
+	if (lua_settings)
+		lua_settings->Reload();
+
+	if (lua_workers)
+		lua_workers->Reload();
+
+	/* after the main thread's "reload" function, which may have
+	   assigned new scopes */
+	ReloadScopes();
+}
+
+void
+Instance::OnReady(Event::Duration startup_duration) noexcept
+{
+	stats.startup_duration = startup_duration;
+	stats.initial_directories = shard
+		? shard->GetDirectoryCount()
+		: shards->GetDirectoryCount();
+
+	fmt::print(stderr, "Ready after {:.1f}ms ({} directories)\n",
+		   std::chrono::duration<double, std::milli>(startup_duration).count(),
+		   stats.initial_directories);
+
+	LogFdUsage(GetWatchCount());
+}
+
+std::size_t
+Instance::GetWatchCount() const noexcept
+{
+	return shard
+		? shard->GetWatchCount()
+		: shards->GetWatchCount();
+}
+
+void
+Instance::OnDumpStats(int) noexcept
+{
+	LuaAccountingStats lua;
+	lua.Add(lua_stats);
+	if (lua_workers)
+		lua_workers->AddStats(lua);
+
+	if (shards) {
+		ReaperStats total = stats;
+		shards->AddStats(total);
+		LogStats(total, lua);
+		shards->LogStats();
+	} else
+		LogStats(stats, lua);
+
+	LogFdUsage(GetWatchCount());
+
+	LogReleaseLatency(metrics.GetLatency());
 }
@@ -4,35 +4,98 @@
 
 #pragma once
 
+#include "Config.hxx"
+#include "Stats.hxx"
+#include "Metrics.hxx"
+#include "MetricsServer.hxx"
+#include "Shard.hxx"
 #include "event/Loop.hxx"
 #include "event/ShutdownListener.hxx"
 #include "event/SignalEvent.hxx"
-#include "event/FineTimerEvent.hxx"
 #include "io/UniqueFileDescriptor.hxx"
 
 #include <memory>
-#include <set>
-#include <string>
 
-class UnifiedCgroupWatch;
 class LuaAccounting;
+class LuaSettings;
+class LuaWorkerPool;
+class ShardPool;
+class JournalSink;
+class AccountingArchive;
 
-class Instance final {
+class Instance final : ReaperShardHandler {
 	EventLoop event_loop;
 
 	bool should_exit = false;
 
 	ShutdownListener shutdown_listener;
-	SignalEvent sighup_event;
+	SignalEvent sighup_event, sigusr1_event;
 
 	const UniqueFileDescriptor root_cgroup;
 
-	std::unique_ptr<UnifiedCgroupWatch> unified_cgroup_watch;
-
+	/**
+	 * Settings from reaper.lua.
+	 */
+	ReaperConfig config;
+
+	ReaperStats stats;
+
+	/**
+	 * Counters of the Lua handler if it runs in the main
+	 * thread.
+	 */
+	LuaAccountingStats lua_stats;
+
+	ReleaseMetrics metrics;
+
+	/**
+	 * The Lua state in which the main thread has loaded
+	 * reaper.lua (if ReaperConfig::lua_threads is non-zero;
+	 * otherwise, the state of #lua_accounting is used).  It is
+	 * kept for reading the scopes on SIGHUP.  Declared before
+	 * #lua_accounting, whose initializer creates it.
+	 */
+	std::unique_ptr<LuaSettings> lua_settings;
+
+	/**
+	 * Runs the Lua handler in the main thread (if
+	 * ReaperConfig::lua_threads is zero).
+	 */
 	std::unique_ptr<LuaAccounting> lua_accounting;
 
-	std::set<std::string> cgroup_delete_queue;
-	FineTimerEvent defer_cgroup_delete;
+	/**
+	 * Runs the Lua handler in worker threads (if
+	 * ReaperConfig::lua_threads is non-zero).
+	 */
+	std::unique_ptr<LuaWorkerPool> lua_workers;
+
+	/**
+	 * Watches the managed scopes in the main thread (if
+	 * ReaperConfig::shards is zero).
+	 */
+	std::unique_ptr<ReaperShard> shard;
+
+	/**
+	 * Watches the managed scopes in worker threads (if
+	 * ReaperConfig::shards is non-zero).
+	 */
+	std::unique_ptr<ShardPool> shards;
+
+	/**
+	 * Only used if ReaperConfig::release_log is
+	 * ReleaseLog::JOURNAL.
+	 */
+	std::unique_ptr<JournalSink> journal_sink;
+
+	/**
+	 * Only used if ReaperConfig::archive_directory is set.
+	 */
+	std::unique_ptr<AccountingArchive> archive;
+
+	/**
+	 * Only used if ReaperConfig::metrics_socket is set.
+	 */
+	std::unique_ptr<MetricsListener> metrics_listener;
 
 public:
 	Instance();
@@ -46,10 +109,57 @@ public:
 		event_loop.Run();
 	}
 
+	/**
+	 * The daemon has finished its initialization (including the
+	 * initial scan of the cgroup tree) and is about to notify
+	 * systemd.
+	 *
+	 * @param startup_duration the time since the process was
+	 * started
+	 */
+	void OnReady(Event::Duration startup_duration) noexcept;
+
 private:
 	void OnExit() noexcept;
 	void OnReload(int) noexcept;
 
-	void OnCgroupEmpty(const char *path) noexcept;
-	void OnDeferredCgroupDelete() noexcept;
+	/**
+	 * Read the scopes from the "reaper_settings" table in the
+	 * main thread's Lua state (which the Lua function "reload"
+	 * may have modified) and apply them (see ApplyScopes()).
+	 * The script is not run again; all other settings are only
+	 * evaluated at startup.
+	 */
+	void ReloadScopes() noexcept;
+
+	/**
+	 * Replace ReaperConfig::scopes and pass a copy to the
+	 * shard(s) (see ReaperShard::ApplyScopes()).
+	 */
+	void ApplyScopes(ManagedScopes &&new_scopes) noexcept;
+
+	/**
+	 * Returns the number of inotify watches of all shards.
+	 */
+	std::size_t GetWatchCount() const noexcept;
+
+	void OnDumpStats(int) noexcept;
+
+	/**
+	 * Log the resource usage of a deleted cgroup and pass it to
+	 * the Lua handler.
+	 */
+	void ReportRelease(const char *path, PendingRelease &release,
+			   const CgroupResourceUsage &usage,
+			   const CgroupResourceUsage &delta) noexcept;
+
+	/* virtual methods from ReaperShardHandler */
+	void OnCgroupReleased(const char *path, PendingRelease &release,
+			      const CgroupResourceUsage &usage,
+			      const CgroupResourceUsage &delta) noexcept override;
+
+	void OnCgroupSample(const char *path, uint_least64_t id,
+			    std::chrono::system_clock::time_point btime,
+			    const CgroupResourceUsage &usage,
+			    const CgroupResourceUsage &delta) noexcept override;
 };
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "JournalSink.hxx"
+#include "Stats.hxx"
+#include "net/SocketAddress.hxx"
+#include "net/SocketError.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::min()
+#include <cassert>
+
+#include <errno.h>
+#include <string.h> // for strerror()
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static constexpr struct sockaddr_un journal_address{
+	.sun_family = AF_LOCAL,
+	.sun_path = "/run/systemd/journal/socket",
+};
+
+inline bool
+JournalSink::Connect() noexcept
+{
+	return socket.Connect(SocketAddress{reinterpret_cast<const struct sockaddr *>(&journal_address),
+					    sizeof(journal_address)});
+}
+
+JournalSink::JournalSink(EventLoop &event_loop, ReaperStats &_stats)
+	:stats(_stats),
+	 socket_event(event_loop, BIND_THIS_METHOD(OnSocketReady)),
+	 defer_flush(event_loop, BIND_THIS_METHOD(OnDeferredFlush)),
+	 slots(std::make_unique_for_overwrite<Slot[]>(N_SLOTS))
+{
+	/* the socket is blocking; all sendmmsg() calls except the
+	   one in FlushBlocking() pass MSG_DONTWAIT */
+	if (!socket.Create(AF_LOCAL, SOCK_DGRAM, 0))
+		throw MakeSocketError("Failed to create journal socket");
+
+	/* like sd_journal_send(), allow large bursts to be
+	   queued in the kernel */
+	socket.SetIntOption(SOL_SOCKET, SO_SNDBUF, 8 * 1024 * 1024);
+
+	if (!Connect())
+		throw MakeSocketError("Failed to connect to journal socket");
+
+	socket_event.Open(socket);
+}
+
+JournalSink::~JournalSink() noexcept
+{
+	socket_event.Abandon();
+}
+
+std::span<char>
+JournalSink::Write() noexcept
+{
+	if (n_queued >= N_SLOTS) {
+		++stats.n_journal_dropped;
+		return {};
+	}
+
+	auto &slot = slots[(head + n_queued) % N_SLOTS];
+	return slot.data;
+}
+
+void
+JournalSink::Commit(std::size_t size) noexcept
+{
+	assert(n_queued < N_SLOTS);
+	assert(size <= MAX_ENTRY_SIZE);
+
+	slots[(head + n_queued) % N_SLOTS].size = size;
+	++n_queued;
+
+	if (!socket_event.GetScheduledFlags())
+		/* send everything which was queued in this event
+		   loop iteration with one sendmmsg() call */
+		defer_flush.ScheduleIdle();
+}
+
+bool
+JournalSink::Flush(int flags) noexcept
+{
+	while (n_queued > 0) {
+		struct iovec iov[MAX_BATCH];
+		struct mmsghdr msgs[MAX_BATCH]{};
+
+		const std::size_t n = std::min(n_queued, MAX_BATCH);
+		for (std::size_t i = 0; i < n; ++i) {
+			auto &slot = slots[(head + i) % N_SLOTS];
+			iov[i] = {slot.data, slot.size};
+
+			auto &msg = msgs[i].msg_hdr;
+			msg.msg_iov = &iov[i];
+			msg.msg_iovlen = 1;
+		}
+
+		int result = sendmmsg(socket.Get(), msgs, n, flags);
+		if (result < 0) {
+			const int e = errno;
+			if (e == EAGAIN || e == EINTR)
+				return false;
+
+			if (e == ECONNREFUSED && Connect())
+				/* journald has been restarted and has
+				   created a new socket */
+				continue;
+
+			/* journald is not running or it rejected
+			   the datagram; drop it, but don't stall
+			   the remaining ones */
+			if (stats.n_journal_dropped == 0)
+				fmt::print(stderr, "Failed to send to journal: {}\n",
+					   strerror(e));
+
+			result = 1;
+			++stats.n_journal_dropped;
+		} else
+			stats.n_journal_sent += result;
+
+		head = (head + result) % N_SLOTS;
+		n_queued -= result;
+	}
+
+	return true;
+}
+
+void
+JournalSink::FlushBlocking() noexcept
+{
+	defer_flush.Cancel();
+	socket_event.Cancel();
+
+	Flush(0);
+}
+
+void
+JournalSink::OnDeferredFlush() noexcept
+{
+	if (!Flush(MSG_DONTWAIT))
+		/* the socket buffer is full; continue as soon as
+		   journald has caught up */
+		socket_event.ScheduleWrite();
+}
+
+void
+JournalSink::OnSocketReady(unsigned) noexcept
+{
+	if (Flush(MSG_DONTWAIT))
+		socket_event.CancelWrite();
+}
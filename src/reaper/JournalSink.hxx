@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/DeferEvent.hxx"
+#include "event/SocketEvent.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::copy()
+#include <concepts> // for std::same_as
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+
+struct ReaperStats;
+
+/**
+ * Sends structured log entries to systemd-journald using its
+ * native protocol (one datagram per entry on
+ * /run/systemd/journal/socket), without ever blocking the event
+ * loop.
+ *
+ * Entries are queued in a bounded ring buffer and sent in batches
+ * with sendmmsg() at the end of the event loop iteration.  If
+ * journald does not keep up, the socket buffer fills up and the
+ * ring buffer is drained as soon as the socket becomes writable
+ * again; entries which do not fit into the ring buffer are dropped
+ * (and counted in ReaperStats::n_journal_dropped).
+ */
+class JournalSink final {
+	/**
+	 * The maximum size of one datagram.  This is enough for two
+	 * paths of PATH_MAX ("MESSAGE" and "CGROUP") plus all
+	 * statistics; the slots are allocated lazily by the kernel,
+	 * so usually only the first page of each one is backed by
+	 * memory.
+	 */
+	static constexpr std::size_t MAX_ENTRY_SIZE = 16384;
+
+	/**
+	 * The number of entries in the ring buffer.
+	 */
+	static constexpr std::size_t N_SLOTS = 256;
+
+	/**
+	 * The maximum number of datagrams per sendmmsg() call.
+	 */
+	static constexpr std::size_t MAX_BATCH = 64;
+
+	ReaperStats &stats;
+
+	/**
+	 * A datagram socket connected to journald.  It needs to be
+	 * connected, because only then does EPOLLOUT wait for room
+	 * in journald's receive queue.
+	 */
+	UniqueSocketDescriptor socket;
+
+	SocketEvent socket_event;
+
+	DeferEvent defer_flush;
+
+	struct Slot {
+		std::size_t size;
+		char data[MAX_ENTRY_SIZE];
+	};
+
+	const std::unique_ptr<Slot[]> slots;
+
+	/**
+	 * The index of the oldest queued entry and the number of
+	 * queued entries.
+	 */
+	std::size_t head = 0, n_queued = 0;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	JournalSink(EventLoop &event_loop, ReaperStats &_stats);
+	~JournalSink() noexcept;
+
+	JournalSink(const JournalSink &) = delete;
+	JournalSink &operator=(const JournalSink &) = delete;
+
+	/**
+	 * Obtain the buffer for the next entry.  After filling it,
+	 * call Commit().
+	 *
+	 * @return an empty span if the ring buffer is full (the
+	 * entry is counted as dropped)
+	 */
+	std::span<char> Write() noexcept;
+
+	/**
+	 * Queue the entry written into the buffer returned by
+	 * Write().
+	 *
+	 * @param size the number of bytes which were written
+	 */
+	void Commit(std::size_t size) noexcept;
+
+	/**
+	 * Send all queued entries, blocking if necessary.  This is
+	 * called before the process exits.
+	 */
+	void FlushBlocking() noexcept;
+
+private:
+	bool Connect() noexcept;
+
+	/**
+	 * Send as many queued entries as possible.
+	 *
+	 * @param flags flags for sendmmsg(), e.g. MSG_DONTWAIT
+	 * @return false if the socket would block
+	 */
+	bool Flush(int flags) noexcept;
+
+	void OnDeferredFlush() noexcept;
+	void OnSocketReady(unsigned events) noexcept;
+};
+
+/**
+ * Formats the fields of one journal entry into the buffer returned
+ * by JournalSink::Write().  A field which does not fit is omitted.
+ */
+class JournalEntryWriter {
+	std::span<char> buffer;
+	std::size_t fill = 0;
+
+public:
+	explicit constexpr JournalEntryWriter(std::span<char> _buffer) noexcept
+		:buffer(_buffer) {}
+
+	constexpr std::size_t size() const noexcept {
+		return fill;
+	}
+
+	/**
+	 * Add a field in the text form ("NAME=value\n").  The value
+	 * must not contain newlines.
+	 */
+	void Add(std::string_view name, const auto &value) noexcept {
+		const auto result = fmt::format_to_n(buffer.data() + fill,
+						     buffer.size() - fill,
+						     "{}={}\n", name, value);
+		if (result.size <= buffer.size() - fill)
+			fill += result.size;
+	}
+
+	/**
+	 * Add a field in the binary form ("NAME\n", the length as
+	 * 64 bit little-endian integer, the value, "\n"), which
+	 * allows arbitrary values.  The value is the concatenation
+	 * of all parts.
+	 */
+	void AddBinary(std::string_view name,
+		       std::same_as<std::string_view> auto... parts) noexcept {
+		const std::size_t length = (parts.size() + ...);
+		if (name.size() + 1 + 8 + length + 1 > buffer.size() - fill)
+			return;
+
+		char *p = std::copy(name.begin(), name.end(),
+				    buffer.data() + fill);
+		*p++ = '\n';
+
+		for (unsigned i = 0; i < 8; ++i)
+			*p++ = static_cast<char>(static_cast<uint_least64_t>(length) >> (8 * i));
+
+		((p = std::copy(parts.begin(), parts.end(), p)), ...);
+		*p++ = '\n';
+
+		fill = p - buffer.data();
+	}
+};
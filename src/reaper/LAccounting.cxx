@@ -3,17 +3,27 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "LAccounting.hxx"
-#include "CgroupAccounting.hxx"
-#include "lua/Assert.hxx"
+#include "LReleasedCgroup.hxx"
+#include "Config.hxx"
+#include "Stats.hxx"
 #include "lua/AutoCloseList.hxx"
-#include "lua/Chrono.hxx"
 #include "lua/CoRunner.hxx"
 #include "lua/Resume.hxx"
-#include "lua/io/CgroupInfo.hxx"
-#include "io/FileAt.hxx"
+#include "lua/Value.hxx"
+#include "lib/fmt/RuntimeError.hxx"
 #include "io/UniqueFileDescriptor.hxx"
 #include "util/DeleteDisposer.hxx"
 #include "util/PrintException.hxx"
+#include "util/ScopeExit.hxx"
+
+#include <fmt/format.h>
+
+#include <cassert>
+#include <utility> // for std::exchange()
+
+extern "C" {
+#include <lua.h>
+}
 
 using namespace Lua;
 
@@ -21,17 +31,44 @@ class LuaAccounting::Thread final
 	: public AutoUnlinkIntrusiveListHook,
 		    Lua::ResumeListener
 {
+	LuaAccounting &parent;
+
 	Lua::AutoCloseList auto_close;
 
+	/**
+	 * The "cgroup" objects passed to the handler; their file
+	 * descriptors are closed when this thread is destroyed.
+	 */
+	LuaReleasedCgroupList released;
+
 	/**
 	 * The Lua thread which runs the handler coroutine.
 	 */
 	Lua::CoRunner runner;
 
+	/**
+	 * The coroutine created by BeginBatch() whose list is being
+	 * filled by Append().
+	 */
+	lua_State *batch_thread = nullptr;
+
+	/**
+	 * The number of cgroups in the list of #batch_thread.
+	 */
+	std::size_t batch_length = 0;
+
+	/**
+	 * Cancels the coroutine after LuaAccounting::timeout.
+	 */
+	CoarseTimerEvent timeout_timer;
+
 public:
-	explicit Thread(lua_State *L) noexcept
-		:auto_close(L),
-		 runner(L) {}
+	explicit Thread(LuaAccounting &_parent) noexcept
+		:parent(_parent),
+		 auto_close(parent.GetState()),
+		 runner(parent.GetState()),
+		 timeout_timer(parent.GetEventLoop(),
+			       BIND_THIS_METHOD(OnTimeout)) {}
 
 	~Thread() noexcept {
 		runner.Cancel();
@@ -39,94 +76,130 @@ public:
 
 	void Start(const Lua::Value &handler,
 		   UniqueFileDescriptor &&cgroup_fd,
-		   const char *relative_path,
+		   const char *relative_path, uint_least64_t id,
 		   std::chrono::system_clock::time_point btime,
-		   const CgroupResourceUsage &usage) noexcept;
+		   const CgroupResourceUsage &usage,
+		   const CgroupResourceUsage &delta) noexcept;
 
-	/* virtual methods from class ResumeListener */
-	void OnLuaFinished(lua_State *L) noexcept override;
-	void OnLuaError(lua_State *L,
-			std::exception_ptr &&error) noexcept override;
-};
+	/**
+	 * Create the coroutine for a batch handler and push an empty
+	 * list for Append().
+	 */
+	void BeginBatch(const Lua::Value &handler,
+			std::size_t capacity) noexcept;
 
-static void
-Push(lua_State *L, Lua::AutoCloseList &auto_close,
-     UniqueFileDescriptor &&cgroup_fd,
-     const char *relative_path,
-     const std::chrono::system_clock::time_point btime,
-     const CgroupResourceUsage &usage)
-{
-	const ScopeCheckStack check_stack{L, 1};
+	/**
+	 * Add a cgroup to the list created by BeginBatch().
+	 */
+	void Append(UniqueFileDescriptor &&cgroup_fd,
+		    const char *relative_path, uint_least64_t id,
+		    std::chrono::system_clock::time_point btime,
+		    const CgroupResourceUsage &usage,
+		    const CgroupResourceUsage &delta) noexcept;
 
-	Lua::NewCgroupInfo(L, auto_close, relative_path, std::move(cgroup_fd));
+	std::size_t GetBatchLength() const noexcept {
+		return batch_length;
+	}
 
-	// inject more attributes into CgroupInfo's FenvCache
-	lua_getfenv(L, -1);
+	/**
+	 * Invoke the batch handler with the list.
+	 */
+	void FinishBatch() noexcept;
 
-	if (btime != std::chrono::system_clock::time_point{}) {
-		SetField(L, RelativeStackIndex{-1}, "btime", btime);
-		SetField(L, RelativeStackIndex{-1}, "age", std::chrono::system_clock::now() - btime);
-	}
+private:
+	/**
+	 * Resume the coroutine for the first time.
+	 */
+	void Run(lua_State *L) noexcept;
 
-	if (usage.cpu.total.count() >= 0)
-		SetField(L, RelativeStackIndex{-1}, "cpu_total", usage.cpu.total);
+	void OnTimeout() noexcept;
 
-	if (usage.cpu.user.count() >= 0)
-		SetField(L, RelativeStackIndex{-1}, "cpu_user", usage.cpu.user);
+public:
+	/* virtual methods from class ResumeListener */
+	void OnLuaFinished(lua_State *L) noexcept override;
+	void OnLuaError(lua_State *L,
+			std::exception_ptr &&error) noexcept override;
+};
 
-	if (usage.cpu.system.count() >= 0)
-		SetField(L, RelativeStackIndex{-1}, "cpu_system", usage.cpu.system);
+inline void
+LuaAccounting::Thread::Start(const Lua::Value &_handler,
+			     UniqueFileDescriptor &&cgroup_fd,
+			     const char *relative_path, uint_least64_t id,
+			     const std::chrono::system_clock::time_point btime,
+			     const CgroupResourceUsage &usage,
+			     const CgroupResourceUsage &delta) noexcept
+{
+	/* create a new thread for the handler coroutine */
+	const auto L = runner.CreateThread(*this);
 
-	if (usage.have_memory_peak)
-		SetField(L, RelativeStackIndex{-1}, "memory_peak",
-			 (lua_Integer)usage.memory_peak);
+	_handler.Push(L);
+	NewLuaReleasedCgroup(L, auto_close, released, relative_path,
+			     std::move(cgroup_fd), id, btime, usage, delta);
+	Run(L);
+}
 
-	if (usage.have_memory_events_high)
-		SetField(L, RelativeStackIndex{-1}, "memory_events_high",
-			 static_cast<lua_Integer>(usage.memory_events_high));
+inline void
+LuaAccounting::Thread::BeginBatch(const Lua::Value &_handler,
+				  std::size_t capacity) noexcept
+{
+	assert(batch_thread == nullptr);
 
-	if (usage.have_memory_events_max)
-		SetField(L, RelativeStackIndex{-1}, "memory_events_max",
-			 static_cast<lua_Integer>(usage.memory_events_max));
+	batch_thread = runner.CreateThread(*this);
 
-	if (usage.have_memory_events_oom)
-		SetField(L, RelativeStackIndex{-1}, "memory_events_oom",
-			 static_cast<lua_Integer>(usage.memory_events_oom));
+	_handler.Push(batch_thread);
+	lua_createtable(batch_thread, capacity, 0);
+}
 
-	if (usage.have_pids_peak)
-		SetField(L, RelativeStackIndex{-1}, "pids_peak",
-			 (lua_Integer)usage.pids_peak);
+inline void
+LuaAccounting::Thread::Append(UniqueFileDescriptor &&cgroup_fd,
+			      const char *relative_path, uint_least64_t id,
+			      const std::chrono::system_clock::time_point btime,
+			      const CgroupResourceUsage &usage,
+			      const CgroupResourceUsage &delta) noexcept
+{
+	assert(batch_thread != nullptr);
 
-	if (usage.have_pids_forks)
-		SetField(L, RelativeStackIndex{-1}, "pids_forks",
-			 (lua_Integer)usage.pids_forks);
+	const auto L = batch_thread;
+	NewLuaReleasedCgroup(L, auto_close, released, relative_path,
+			     std::move(cgroup_fd), id, btime, usage, delta);
+	lua_rawseti(L, -2, ++batch_length);
+}
 
-	if (usage.have_pids_events_max)
-		SetField(L, RelativeStackIndex{-1}, "pids_events_max",
-			 (lua_Integer)usage.pids_events_max);
+inline void
+LuaAccounting::Thread::FinishBatch() noexcept
+{
+	assert(batch_thread != nullptr);
 
-	lua_pop(L, 1);
+	Run(std::exchange(batch_thread, nullptr));
 }
 
 inline void
-LuaAccounting::Thread::Start(const Lua::Value &_handler,
-			     UniqueFileDescriptor &&cgroup_fd,
-			     const char *relative_path,
-			     const std::chrono::system_clock::time_point btime,
-			     const CgroupResourceUsage &usage) noexcept
+LuaAccounting::Thread::Run(lua_State *L) noexcept
 {
-	/* create a new thread for the handler coroutine */
-	const auto L = runner.CreateThread(*this);
+	/* the timer must be scheduled before resuming, because the
+	   coroutine may finish (and destroy this object) right
+	   away */
+	if (parent.timeout > Event::Duration{})
+		timeout_timer.Schedule(parent.timeout);
 
-	_handler.Push(L);
-	Push(L, auto_close, std::move(cgroup_fd), relative_path, btime, usage);
 	Resume(L, 1);
 }
 
+void
+LuaAccounting::Thread::OnTimeout() noexcept
+{
+	++parent.stats.n_timeouts;
+
+	fmt::print(stderr, "Lua handler timed out, cancelling it\n");
+
+	/* the destructor cancels the coroutine */
+	parent.OnThreadDone(*this);
+}
+
 void
 LuaAccounting::Thread::OnLuaFinished(lua_State *) noexcept
 {
-	delete this;
+	parent.OnThreadDone(*this);
 }
 
 void
@@ -135,27 +208,214 @@ LuaAccounting::Thread::OnLuaError(lua_State *,
 {
 	// TODO log more metadata?
 	PrintException(std::move(error));
-	delete this;
+	parent.OnThreadDone(*this);
 }
 
-LuaAccounting::LuaAccounting(Lua::State _state,
-			     Lua::ValuePtr _handler) noexcept
+LuaAccounting::LuaAccounting(EventLoop &event_loop,
+			     Lua::State _state, Lua::ValuePtr _handler,
+			     bool batch_handler,
+			     Lua::ValuePtr _sample_handler,
+			     const ReaperConfig &config,
+			     LuaAccountingStats &_stats) noexcept
 	:state(std::move(_state)),
-	 handler(std::move(_handler)) {}
+	 handler(std::move(_handler)),
+	 sample_handler(std::move(_sample_handler)),
+	 stats(_stats),
+	 max_concurrent(config.lua_max_concurrent),
+	 max_queued(config.lua_queue_size),
+	 timeout(config.lua_timeout),
+	 max_batch_size(batch_handler ? config.release_batch_size : 0),
+	 batch_window(config.release_batch_window),
+	 batch_timer(event_loop, BIND_THIS_METHOD(OnBatchTimer)),
+	 defer_dequeue(event_loop, BIND_THIS_METHOD(OnDeferredDequeue)) {}
 
 LuaAccounting::~LuaAccounting() noexcept
 {
 	threads.clear_and_dispose(DeleteDisposer{});
 }
 
+inline LuaAccounting::Thread &
+LuaAccounting::NewThread() noexcept
+{
+	auto *thread = new Thread(*this);
+	threads.push_back(*thread);
+	++n_threads;
+	stats.running = n_threads;
+	return *thread;
+}
+
+void
+LuaAccounting::OnThreadDone(Thread &thread) noexcept
+{
+	assert(&thread != batch);
+	assert(n_threads > 0);
+
+	delete &thread;
+	--n_threads;
+	stats.running = n_threads;
+
+	/* not calling Dispatch() here, because we may be inside
+	   Resume() called by Dispatch() */
+	if (!queue.empty())
+		defer_dequeue.Schedule();
+}
+
 void
 LuaAccounting::InvokeCgroupReleased(UniqueFileDescriptor cgroup_fd,
-				    const char *relative_path,
+				    const char *relative_path, uint_least64_t id,
 				    const std::chrono::system_clock::time_point btime,
-				    const CgroupResourceUsage &usage)
+				    const CgroupResourceUsage &usage,
+				    const CgroupResourceUsage &delta)
 {
-	auto *thread = new Thread(GetState());
-	threads.push_back(*thread);
-	thread->Start(*handler, std::move(cgroup_fd), relative_path,
-		      btime, usage);
+	/* if there is a queue, this release goes to its end, so the
+	   handler sees them in order */
+	if (!CanDispatch() || !queue.empty()) {
+		/* the file descriptor is closed now; the handler
+		   will only see the usage record */
+		Enqueue(relative_path, id, btime, usage, delta);
+		return;
+	}
+
+	Dispatch(std::move(cgroup_fd), relative_path, id, btime, usage, delta);
+}
+
+void
+LuaAccounting::InvokeCgroupSampled(const char *relative_path, uint_least64_t id,
+				   const std::chrono::system_clock::time_point btime,
+				   const CgroupResourceUsage &usage,
+				   const CgroupResourceUsage &delta) noexcept
+{
+	if (!sample_handler)
+		return;
+
+	if (n_threads >= max_concurrent) {
+		/* there will be another sample in the next
+		   interval */
+		++stats.n_dropped;
+		return;
+	}
+
+	/* no file descriptor: the handler cannot read extended
+	   attributes of a sampled cgroup */
+	NewThread().Start(*sample_handler, {}, relative_path, id, btime,
+			  usage, delta);
+}
+
+void
+LuaAccounting::Enqueue(const char *relative_path, uint_least64_t id,
+		       const std::chrono::system_clock::time_point btime,
+		       const CgroupResourceUsage &usage,
+		       const CgroupResourceUsage &delta) noexcept
+{
+	if (queue.size() >= max_queued) {
+		++stats.n_dropped;
+		return;
+	}
+
+	queue.push_back({relative_path, id, btime, usage, delta});
+	++stats.n_queued;
+	stats.queue_size = queue.size();
+}
+
+void
+LuaAccounting::OnDeferredDequeue() noexcept
+{
+	while (!queue.empty() && CanDispatch()) {
+		const auto &p = queue.front();
+		Dispatch({}, p.relative_path.c_str(), p.id, p.btime,
+			 p.usage, p.delta);
+		queue.pop_front();
+	}
+
+	stats.queue_size = queue.size();
+}
+
+void
+LuaAccounting::Dispatch(UniqueFileDescriptor &&cgroup_fd,
+			const char *relative_path, uint_least64_t id,
+			const std::chrono::system_clock::time_point btime,
+			const CgroupResourceUsage &usage,
+			const CgroupResourceUsage &delta) noexcept
+{
+	if (max_batch_size == 0) {
+		NewThread().Start(*handler, std::move(cgroup_fd),
+				  relative_path, id, btime, usage, delta);
+		return;
+	}
+
+	if (batch == nullptr) {
+		batch = &NewThread();
+		batch->BeginBatch(*handler, max_batch_size);
+		batch_timer.Schedule(batch_window);
+	}
+
+	batch->Append(std::move(cgroup_fd), relative_path, id,
+		      btime, usage, delta);
+
+	if (batch->GetBatchLength() >= max_batch_size)
+		FlushBatch();
+}
+
+void
+LuaAccounting::FlushBatch() noexcept
+{
+	if (batch == nullptr)
+		return;
+
+	batch_timer.Cancel();
+
+	/* one coroutine for the whole list */
+	std::exchange(batch, nullptr)->FinishBatch();
+}
+
+static Lua::ValuePtr
+GetGlobalFunction(lua_State *L, const char *name)
+{
+	lua_getglobal(L, name);
+	AtScopeExit(L) { lua_pop(L, 1); };
+
+	if (lua_isnil(L, -1))
+		throw FmtRuntimeError("Function '{}' not found", name);
+
+	if (!lua_isfunction(L, -1))
+		throw FmtRuntimeError("'{}' is not a function", name);
+
+	return std::make_shared<Lua::Value>(L, Lua::RelativeStackIndex{-1});
+}
+
+/**
+ * Like GetGlobalFunction(), but return nullptr if the global is not
+ * defined.
+ */
+static Lua::ValuePtr
+GetOptionalGlobalFunction(lua_State *L, const char *name)
+{
+	lua_getglobal(L, name);
+	const bool defined = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+
+	if (!defined)
+		return {};
+
+	return GetGlobalFunction(L, name);
+}
+
+std::unique_ptr<LuaAccounting>
+CreateLuaAccounting(EventLoop &event_loop, Lua::State state,
+		    const ReaperConfig &config, LuaAccountingStats &stats)
+{
+	bool batch = true;
+	auto handler = GetOptionalGlobalFunction(state.get(), "cgroup_released_batch");
+	if (!handler) {
+		batch = false;
+		handler = GetGlobalFunction(state.get(), "cgroup_released");
+	}
+
+	auto sample_handler = GetOptionalGlobalFunction(state.get(), "cgroup_sampled");
+
+	return std::make_unique<LuaAccounting>(event_loop,
+					       std::move(state),
+					       std::move(handler),
+					       batch, std::move(sample_handler),
+					       config, stats);
 }
@@ -7,12 +7,21 @@
 #include "lua/ReloadRunner.hxx"
 #include "lua/State.hxx"
 #include "lua/ValuePtr.hxx"
+#include "CgroupAccounting.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/DeferEvent.hxx"
 #include "util/IntrusiveList.hxx"
 
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
 
 class UniqueFileDescriptor;
-struct CgroupResourceUsage;
+struct ReaperConfig;
+struct LuaAccountingStats;
 
 class LuaAccounting final {
 	Lua::State state;
@@ -21,26 +30,184 @@ class LuaAccounting final {
 
 	const Lua::ValuePtr handler;
 
+	/**
+	 * The optional function "cgroup_sampled" (or nullptr).
+	 */
+	const Lua::ValuePtr sample_handler;
+
 	class Thread;
 
+	/**
+	 * All handler coroutines, including #batch.
+	 */
 	IntrusiveList<Thread> threads;
 
+	/**
+	 * The number of items in #threads (cheaper than
+	 * IntrusiveList::size()).
+	 */
+	std::size_t n_threads = 0;
+
+	/**
+	 * A release which is waiting for a free coroutine slot.  It
+	 * holds no file descriptor, only what is needed to create
+	 * the "cgroup" object later.
+	 */
+	struct Pending {
+		std::string relative_path;
+		uint_least64_t id;
+		std::chrono::system_clock::time_point btime;
+		CgroupResourceUsage usage, delta;
+	};
+
+	/**
+	 * Releases which arrived while #max_concurrent coroutines
+	 * were running, oldest first.
+	 */
+	std::deque<Pending> queue;
+
+	LuaAccountingStats &stats;
+
+	/**
+	 * The maximum number of handler coroutines which may exist
+	 * at the same time.
+	 */
+	const std::size_t max_concurrent;
+
+	/**
+	 * The maximum size of #queue; further releases are dropped.
+	 */
+	const std::size_t max_queued;
+
+	/**
+	 * After this duration, a running handler coroutine is
+	 * cancelled.  Zero means no limit.
+	 */
+	const Event::Duration timeout;
+
+	/**
+	 * The maximum number of cgroups passed to the batch handler
+	 * in one call.  Zero means the handler is invoked for each
+	 * cgroup ("cgroup_released" instead of
+	 * "cgroup_released_batch").
+	 */
+	const std::size_t max_batch_size;
+
+	/**
+	 * How long to wait for more cgroups after the first one was
+	 * added to #batch.
+	 */
+	const Event::Duration batch_window;
+
+	/**
+	 * The thread which collects cgroups for the next batch
+	 * handler call; it has not yet been resumed.
+	 */
+	Thread *batch = nullptr;
+
+	CoarseTimerEvent batch_timer;
+
+	/**
+	 * Moves releases from #queue to new coroutines.
+	 */
+	DeferEvent defer_dequeue;
+
 public:
-	LuaAccounting(Lua::State _state, Lua::ValuePtr _handler) noexcept;
+	/**
+	 * @param batch_handler if true, then #_handler is a batch handler
+	 * ("cgroup_released_batch") which gets a list of up to
+	 * ReaperConfig::release_batch_size cgroups
+	 * @param _sample_handler the handler for live samples (see
+	 * #CgroupSampler); may be nullptr
+	 */
+	LuaAccounting(EventLoop &event_loop,
+		      Lua::State _state, Lua::ValuePtr _handler,
+		      bool batch_handler,
+		      Lua::ValuePtr _sample_handler,
+		      const ReaperConfig &config,
+		      LuaAccountingStats &_stats) noexcept;
 
 	~LuaAccounting() noexcept;
 
+	lua_State *GetState() const noexcept {
+		return handler->GetState();
+	}
+
 	void Reload() noexcept {
 		reload.Start();
 	}
 
+	/**
+	 * Invoke the batch handler now for all cgroups which have
+	 * been collected.
+	 */
+	void FlushBatch() noexcept;
+
 	void InvokeCgroupReleased(UniqueFileDescriptor cgroup_fd,
-				  const char *relative_path,
+				  const char *relative_path, uint_least64_t id,
 				  std::chrono::system_clock::time_point btime,
-				  const CgroupResourceUsage &usage);
+				  const CgroupResourceUsage &usage,
+				  const CgroupResourceUsage &delta);
+
+	/**
+	 * Invoke "cgroup_sampled" (if defined) for a live sample of a
+	 * running cgroup.  Samples are never queued; if
+	 * #max_concurrent coroutines are running, the sample is
+	 * dropped.
+	 */
+	void InvokeCgroupSampled(const char *relative_path, uint_least64_t id,
+				 std::chrono::system_clock::time_point btime,
+				 const CgroupResourceUsage &usage,
+				 const CgroupResourceUsage &delta) noexcept;
 
 private:
-	lua_State *GetState() const noexcept {
-		return handler->GetState();
+	EventLoop &GetEventLoop() const noexcept {
+		return batch_timer.GetEventLoop();
+	}
+
+	/**
+	 * Can the release be passed to a coroutine now (or must it
+	 * be queued)?
+	 */
+	[[gnu::pure]]
+	bool CanDispatch() const noexcept {
+		return batch != nullptr || n_threads < max_concurrent;
 	}
+
+	Thread &NewThread() noexcept;
+
+	void Dispatch(UniqueFileDescriptor &&cgroup_fd,
+		      const char *relative_path, uint_least64_t id,
+		      std::chrono::system_clock::time_point btime,
+		      const CgroupResourceUsage &usage,
+		      const CgroupResourceUsage &delta) noexcept;
+
+	void Enqueue(const char *relative_path, uint_least64_t id,
+		     std::chrono::system_clock::time_point btime,
+		     const CgroupResourceUsage &usage,
+		     const CgroupResourceUsage &delta) noexcept;
+
+	/**
+	 * Called by the #Thread when the handler has finished, has
+	 * failed or has timed out.  Destroys the #Thread.
+	 */
+	void OnThreadDone(Thread &thread) noexcept;
+
+	void OnBatchTimer() noexcept {
+		FlushBatch();
+	}
+
+	void OnDeferredDequeue() noexcept;
 };
+
+/**
+ * Create a #LuaAccounting for the handler function defined by the
+ * script which was loaded into the given state
+ * ("cgroup_released_batch" or "cgroup_released", and optionally
+ * "cgroup_sampled").
+ *
+ * Throws on error.
+ */
+std::unique_ptr<LuaAccounting>
+CreateLuaAccounting(EventLoop &event_loop, Lua::State state,
+		    const ReaperConfig &config, LuaAccountingStats &stats);
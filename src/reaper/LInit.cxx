@@ -4,6 +4,7 @@
 
 #include "LInit.hxx"
 #include "LResolver.hxx"
+#include "LReleasedCgroup.hxx"
 #include "config.h"
 #include "lua/Resume.hxx"
 #include "lua/io/XattrTable.hxx"
@@ -45,6 +46,7 @@ LuaInit([[maybe_unused]] EventLoop &event_loop)
 
 	Lua::InitXattrTable(state.get());
 	Lua::RegisterCgroupInfo(state.get());
+	RegisterLuaReleasedCgroup(state.get());
 
 #ifdef HAVE_PG
 	Lua::InitPg(state.get(), event_loop);
@@ -0,0 +1,443 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "LReleasedCgroup.hxx"
+#include "BlockDevices.hxx"
+#include "lua/Chrono.hxx"
+#include "lua/Util.hxx"
+#include "lua/io/CgroupInfo.hxx"
+
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+}
+
+#include <algorithm> // for std::copy()
+#include <array>
+#include <new> // for placement new
+
+static constexpr char lua_released_cgroup_class[] = "cm4all.spawn.reaper.cgroup";
+
+/**
+ * The attributes implemented by #LuaReleasedCgroup; the values
+ * start at 1, because lua_tointeger() returns 0 for unknown keys.
+ */
+enum class Attribute : lua_Integer {
+	PATH = 1,
+	ID,
+	BTIME,
+	AGE,
+	CPU_TOTAL,
+	CPU_USER,
+	CPU_SYSTEM,
+	MEMORY_PEAK,
+	MEMORY_EVENTS_HIGH,
+	MEMORY_EVENTS_MAX,
+	MEMORY_EVENTS_OOM,
+	PIDS_PEAK,
+	PIDS_FORKS,
+	PIDS_EVENTS_MAX,
+	IO_RBYTES,
+	IO_WBYTES,
+	IO_RIOS,
+	IO_WIOS,
+	IO_DBYTES,
+	IO_DEVICES,
+	CPU_THROTTLED,
+	CPU_NR_THROTTLED,
+	CPU_PRESSURE_SOME,
+	CPU_PRESSURE_FULL,
+	MEMORY_PRESSURE_SOME,
+	MEMORY_PRESSURE_FULL,
+	IO_PRESSURE_SOME,
+	IO_PRESSURE_FULL,
+	MEMORY_ANON,
+	MEMORY_FILE,
+	MEMORY_KERNEL,
+	MEMORY_SOCK,
+	MEMORY_PGMAJFAULT,
+	DELTA_CPU_TOTAL,
+	DELTA_CPU_USER,
+	DELTA_CPU_SYSTEM,
+	DELTA_MEMORY_PEAK,
+	DELTA_IO_RBYTES,
+	DELTA_IO_WBYTES,
+};
+
+/**
+ * The attribute names in the order of #Attribute.  They are
+ * interned once in the table which is the upvalue of the "__index"
+ * metamethod, so looking up a name is a single hash lookup.
+ */
+static constexpr std::array attribute_names{
+	"path",
+	"id",
+	"btime",
+	"age",
+	"cpu_total",
+	"cpu_user",
+	"cpu_system",
+	"memory_peak",
+	"memory_events_high",
+	"memory_events_max",
+	"memory_events_oom",
+	"pids_peak",
+	"pids_forks",
+	"pids_events_max",
+	"io_rbytes",
+	"io_wbytes",
+	"io_rios",
+	"io_wios",
+	"io_dbytes",
+	"io_devices",
+	"cpu_throttled",
+	"cpu_nr_throttled",
+	"cpu_pressure_some",
+	"cpu_pressure_full",
+	"memory_pressure_some",
+	"memory_pressure_full",
+	"io_pressure_some",
+	"io_pressure_full",
+	"memory_anon",
+	"memory_file",
+	"memory_kernel",
+	"memory_sock",
+	"memory_pgmajfault",
+	"delta_cpu_total",
+	"delta_cpu_user",
+	"delta_cpu_system",
+	"delta_memory_peak",
+	"delta_io_rbytes",
+	"delta_io_wbytes",
+};
+
+static_assert(attribute_names.size() == static_cast<std::size_t>(Attribute::DELTA_IO_WBYTES));
+
+static void
+PushCpu(lua_State *L, CgroupCpuStat::Duration value) noexcept
+{
+	if (value.count() >= 0)
+		Lua::Push(L, value);
+	else
+		lua_pushnil(L);
+}
+
+static void
+PushOptional(lua_State *L, bool have, uint_least64_t value) noexcept
+{
+	if (have)
+		Lua::Push(L, static_cast<lua_Integer>(value));
+	else
+		lua_pushnil(L);
+}
+
+static void
+PushMemoryStat(lua_State *L, const CgroupMemoryStat &m,
+	       CgroupMemoryStat::Key key) noexcept
+{
+	PushOptional(L, m.Has(key), m.Get(key));
+}
+
+static void
+SetField(lua_State *L, const char *name, uint_least64_t value) noexcept
+{
+	Lua::Push(L, static_cast<lua_Integer>(value));
+	lua_setfield(L, -2, name);
+}
+
+/**
+ * Push a table which maps block device names to tables with the
+ * I/O counters of that device.
+ */
+static void
+PushIoDevices(lua_State *L, const CgroupIoStat &io) noexcept
+{
+	lua_createtable(L, 0, io.n_devices);
+
+	for (std::size_t i = 0; i < io.n_devices; ++i) {
+		const auto &d = io.devices[i];
+
+		lua_createtable(L, 0, 5);
+		SetField(L, "rbytes", d.counters.rbytes);
+		SetField(L, "wbytes", d.counters.wbytes);
+		SetField(L, "rios", d.counters.rios);
+		SetField(L, "wios", d.counters.wios);
+		SetField(L, "dbytes", d.counters.dbytes);
+		lua_setfield(L, -2, FormatBlockDevice(d.dev).c_str());
+	}
+}
+
+/**
+ * Push the attribute of the CgroupInfo object (which is created
+ * now if it does not exist yet).
+ */
+static int
+IndexCgroupInfo(lua_State *L, LuaReleasedCgroup &c)
+{
+	if (c.have_info) {
+		lua_getfenv(L, 1);
+		lua_rawgeti(L, -1, 1);
+	} else {
+		if (c.auto_close == nullptr)
+			/* the handler has finished, and the file
+			   descriptor has been closed already */
+			return 0;
+
+		/* the fenv table holds the CgroupInfo */
+		lua_createtable(L, 1, 0);
+		Lua::NewCgroupInfo(L, *c.auto_close, c.GetPath().data(),
+				   std::move(c.cgroup_fd));
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, 1);
+
+		lua_pushvalue(L, -2);
+		lua_setfenv(L, 1);
+		c.have_info = true;
+	}
+
+	/* invoke the CgroupInfo's "__index" */
+	lua_pushvalue(L, 2);
+	lua_gettable(L, -2);
+	return 1;
+}
+
+static int
+LuaReleasedCgroupIndex(lua_State *L)
+{
+	auto &c = *static_cast<LuaReleasedCgroup *>(lua_touserdata(L, 1));
+
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	const auto attribute = static_cast<Attribute>(lua_tointeger(L, -1));
+	lua_pop(L, 1);
+
+	const auto &u = c.usage;
+	const auto &d = c.delta;
+
+	switch (attribute) {
+	case Attribute::PATH:
+		Lua::Push(L, c.GetPath());
+		return 1;
+
+	case Attribute::ID:
+		PushOptional(L, c.id != 0, c.id);
+		return 1;
+
+	case Attribute::BTIME:
+		if (c.btime != std::chrono::system_clock::time_point{})
+			Lua::Push(L, c.btime);
+		else
+			lua_pushnil(L);
+		return 1;
+
+	case Attribute::AGE:
+		if (c.btime != std::chrono::system_clock::time_point{})
+			Lua::Push(L, c.age);
+		else
+			lua_pushnil(L);
+		return 1;
+
+	case Attribute::CPU_TOTAL:
+		PushCpu(L, u.cpu.total);
+		return 1;
+
+	case Attribute::CPU_USER:
+		PushCpu(L, u.cpu.user);
+		return 1;
+
+	case Attribute::CPU_SYSTEM:
+		PushCpu(L, u.cpu.system);
+		return 1;
+
+	case Attribute::MEMORY_PEAK:
+		PushOptional(L, u.have_memory_peak, u.memory_peak);
+		return 1;
+
+	case Attribute::MEMORY_EVENTS_HIGH:
+		PushOptional(L, u.have_memory_events_high, u.memory_events_high);
+		return 1;
+
+	case Attribute::MEMORY_EVENTS_MAX:
+		PushOptional(L, u.have_memory_events_max, u.memory_events_max);
+		return 1;
+
+	case Attribute::MEMORY_EVENTS_OOM:
+		PushOptional(L, u.have_memory_events_oom, u.memory_events_oom);
+		return 1;
+
+	case Attribute::PIDS_PEAK:
+		PushOptional(L, u.have_pids_peak, u.pids_peak);
+		return 1;
+
+	case Attribute::PIDS_FORKS:
+		PushOptional(L, u.have_pids_forks, u.pids_forks);
+		return 1;
+
+	case Attribute::PIDS_EVENTS_MAX:
+		PushOptional(L, u.have_pids_events_max, u.pids_events_max);
+		return 1;
+
+	case Attribute::IO_RBYTES:
+		PushOptional(L, u.have_io, u.io.total.rbytes);
+		return 1;
+
+	case Attribute::IO_WBYTES:
+		PushOptional(L, u.have_io, u.io.total.wbytes);
+		return 1;
+
+	case Attribute::IO_RIOS:
+		PushOptional(L, u.have_io, u.io.total.rios);
+		return 1;
+
+	case Attribute::IO_WIOS:
+		PushOptional(L, u.have_io, u.io.total.wios);
+		return 1;
+
+	case Attribute::IO_DBYTES:
+		PushOptional(L, u.have_io, u.io.total.dbytes);
+		return 1;
+
+	case Attribute::IO_DEVICES:
+		if (u.have_io)
+			PushIoDevices(L, u.io);
+		else
+			lua_pushnil(L);
+		return 1;
+
+	case Attribute::CPU_THROTTLED:
+		PushCpu(L, u.cpu.throttled);
+		return 1;
+
+	case Attribute::CPU_NR_THROTTLED:
+		PushOptional(L, u.cpu.throttled.count() >= 0, u.cpu.nr_throttled);
+		return 1;
+
+	case Attribute::CPU_PRESSURE_SOME:
+		PushCpu(L, u.cpu_pressure.some);
+		return 1;
+
+	case Attribute::CPU_PRESSURE_FULL:
+		PushCpu(L, u.cpu_pressure.full);
+		return 1;
+
+	case Attribute::MEMORY_PRESSURE_SOME:
+		PushCpu(L, u.memory_pressure.some);
+		return 1;
+
+	case Attribute::MEMORY_PRESSURE_FULL:
+		PushCpu(L, u.memory_pressure.full);
+		return 1;
+
+	case Attribute::IO_PRESSURE_SOME:
+		PushCpu(L, u.io_pressure.some);
+		return 1;
+
+	case Attribute::IO_PRESSURE_FULL:
+		PushCpu(L, u.io_pressure.full);
+		return 1;
+
+	case Attribute::MEMORY_ANON:
+		PushMemoryStat(L, u.memory_stat, CgroupMemoryStat::ANON);
+		return 1;
+
+	case Attribute::MEMORY_FILE:
+		PushMemoryStat(L, u.memory_stat, CgroupMemoryStat::FILE);
+		return 1;
+
+	case Attribute::MEMORY_KERNEL:
+		PushMemoryStat(L, u.memory_stat, CgroupMemoryStat::KERNEL);
+		return 1;
+
+	case Attribute::MEMORY_SOCK:
+		PushMemoryStat(L, u.memory_stat, CgroupMemoryStat::SOCK);
+		return 1;
+
+	case Attribute::MEMORY_PGMAJFAULT:
+		PushMemoryStat(L, u.memory_stat, CgroupMemoryStat::PGMAJFAULT);
+		return 1;
+
+	/* what was charged between the cgroup running empty and its
+	   deletion */
+
+	case Attribute::DELTA_CPU_TOTAL:
+		PushCpu(L, d.cpu.total);
+		return 1;
+
+	case Attribute::DELTA_CPU_USER:
+		PushCpu(L, d.cpu.user);
+		return 1;
+
+	case Attribute::DELTA_CPU_SYSTEM:
+		PushCpu(L, d.cpu.system);
+		return 1;
+
+	case Attribute::DELTA_MEMORY_PEAK:
+		PushOptional(L, d.have_memory_peak, d.memory_peak);
+		return 1;
+
+	case Attribute::DELTA_IO_RBYTES:
+		PushOptional(L, d.have_io, d.io.total.rbytes);
+		return 1;
+
+	case Attribute::DELTA_IO_WBYTES:
+		PushOptional(L, d.have_io, d.io.total.wbytes);
+		return 1;
+	}
+
+	return IndexCgroupInfo(L, c);
+}
+
+static int
+LuaReleasedCgroupGc(lua_State *L)
+{
+	auto *c = static_cast<LuaReleasedCgroup *>(lua_touserdata(L, 1));
+	c->~LuaReleasedCgroup();
+	return 0;
+}
+
+void
+RegisterLuaReleasedCgroup(lua_State *L)
+{
+	luaL_newmetatable(L, lua_released_cgroup_class);
+
+	lua_createtable(L, 0, attribute_names.size());
+	for (std::size_t i = 0; i < attribute_names.size(); ++i) {
+		lua_pushstring(L, attribute_names[i]);
+		lua_pushinteger(L, i + 1);
+		lua_rawset(L, -3);
+	}
+
+	lua_pushcclosure(L, LuaReleasedCgroupIndex, 1);
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, LuaReleasedCgroupGc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_pop(L, 1);
+}
+
+void
+NewLuaReleasedCgroup(lua_State *L, Lua::AutoCloseList &auto_close,
+		     LuaReleasedCgroupList &list,
+		     std::string_view relative_path,
+		     UniqueFileDescriptor &&cgroup_fd, uint_least64_t id,
+		     const std::chrono::system_clock::time_point btime,
+		     const CgroupResourceUsage &usage,
+		     const CgroupResourceUsage &delta) noexcept
+{
+	/* one allocation for the object and the (null-terminated)
+	   path */
+	void *p = lua_newuserdata(L, sizeof(LuaReleasedCgroup) + relative_path.size() + 1);
+	auto *c = new(p) LuaReleasedCgroup(auto_close, std::move(cgroup_fd),
+					   id, btime, usage, delta,
+					   relative_path.size());
+
+	*std::copy(relative_path.begin(), relative_path.end(),
+		   reinterpret_cast<char *>(c + 1)) = '\0';
+
+	luaL_getmetatable(L, lua_released_cgroup_class);
+	lua_setmetatable(L, -2);
+
+	list.Add(*c);
+}
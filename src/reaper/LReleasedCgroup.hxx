@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+struct lua_State;
+namespace Lua { class AutoCloseList; }
+
+/**
+ * The C++ part of the "cgroup" object passed to the Lua handler.  It
+ * lives inside the Lua userdata (followed by the null-terminated
+ * path string), and its attributes are converted to Lua values only
+ * when the handler reads them (through the "__index" metamethod).
+ *
+ * Attributes which are not known here ("xattr", "parent") are
+ * looked up in a CgroupInfo object which is created on demand.
+ */
+struct LuaReleasedCgroup final : AutoUnlinkIntrusiveListHook {
+	/**
+	 * For creating the CgroupInfo object; nullptr after the
+	 * handler coroutine has finished.
+	 */
+	Lua::AutoCloseList *auto_close;
+
+	/**
+	 * Moved to the CgroupInfo object when it is created.
+	 */
+	UniqueFileDescriptor cgroup_fd;
+
+	uint_least64_t id;
+
+	std::chrono::system_clock::time_point btime;
+
+	/**
+	 * The age at the time this object was created.
+	 */
+	std::chrono::system_clock::duration age;
+
+	CgroupResourceUsage usage, delta;
+
+	std::size_t path_length;
+
+	/**
+	 * Has the CgroupInfo object been created?  It is stored in
+	 * the fenv table of the userdata.
+	 */
+	bool have_info = false;
+
+	LuaReleasedCgroup(Lua::AutoCloseList &_auto_close,
+			  UniqueFileDescriptor &&_cgroup_fd,
+			  uint_least64_t _id,
+			  std::chrono::system_clock::time_point _btime,
+			  const CgroupResourceUsage &_usage,
+			  const CgroupResourceUsage &_delta,
+			  std::size_t _path_length) noexcept
+		:auto_close(&_auto_close),
+		 cgroup_fd(std::move(_cgroup_fd)),
+		 id(_id), btime(_btime),
+		 age(btime != std::chrono::system_clock::time_point{}
+		     ? std::chrono::system_clock::now() - btime
+		     : std::chrono::system_clock::duration{}),
+		 usage(_usage), delta(_delta),
+		 path_length(_path_length) {}
+
+	std::string_view GetPath() const noexcept {
+		return {reinterpret_cast<const char *>(this + 1), path_length};
+	}
+
+	/**
+	 * Close the file descriptor and detach from the coroutine
+	 * (which is about to be destroyed).
+	 */
+	void Close() noexcept {
+		auto_close = nullptr;
+		cgroup_fd.Close();
+	}
+};
+
+/**
+ * Keeps track of the #LuaReleasedCgroup objects passed to one
+ * handler coroutine; like Lua::AutoCloseList, its destructor closes
+ * their file descriptors instead of waiting for the garbage
+ * collector.
+ */
+class LuaReleasedCgroupList {
+	IntrusiveList<LuaReleasedCgroup> list;
+
+public:
+	LuaReleasedCgroupList() noexcept = default;
+
+	~LuaReleasedCgroupList() noexcept {
+		list.clear_and_dispose([](LuaReleasedCgroup *c){
+			c->Close();
+		});
+	}
+
+	LuaReleasedCgroupList(const LuaReleasedCgroupList &) = delete;
+	LuaReleasedCgroupList &operator=(const LuaReleasedCgroupList &) = delete;
+
+	void Add(LuaReleasedCgroup &c) noexcept {
+		list.push_back(c);
+	}
+};
+
+void
+RegisterLuaReleasedCgroup(lua_State *L);
+
+/**
+ * Push a new "cgroup" object for the handler.
+ *
+ * @param relative_path the cgroup path with a leading slash
+ */
+void
+NewLuaReleasedCgroup(lua_State *L, Lua::AutoCloseList &auto_close,
+		     LuaReleasedCgroupList &list,
+		     std::string_view relative_path,
+		     UniqueFileDescriptor &&cgroup_fd, uint_least64_t id,
+		     std::chrono::system_clock::time_point btime,
+		     const CgroupResourceUsage &usage,
+		     const CgroupResourceUsage &delta) noexcept;
@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "LWorker.hxx"
+#include "LAccounting.hxx"
+#include "LInit.hxx"
+#include "Config.hxx"
+#include "lua/RunFile.hxx"
+#include "event/Loop.hxx"
+#include "event/PipeEvent.hxx"
+#include "system/Error.hxx"
+#include "util/SpanCast.hxx"
+
+#include <functional> // for std::hash
+#include <string_view>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+/**
+ * The objects owned by the worker thread.
+ */
+class LuaWorker::Context final {
+	LuaWorker &worker;
+
+	EventLoop event_loop;
+
+	PipeEvent wakeup_event;
+
+	std::unique_ptr<LuaAccounting> accounting;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	explicit Context(LuaWorker &_worker)
+		:worker(_worker),
+		 wakeup_event(event_loop, BIND_THIS_METHOD(OnWakeup),
+			      worker.wakeup_fd)
+	{
+		auto state = LuaInit(event_loop);
+		Lua::RunFile(state.get(), worker.path);
+
+		accounting = CreateLuaAccounting(event_loop, std::move(state),
+						 worker.config, worker.stats);
+	}
+
+	void Run() noexcept {
+		wakeup_event.ScheduleRead();
+		event_loop.Run();
+	}
+
+private:
+	void Invoke(LuaRelease &&release) noexcept;
+
+	/**
+	 * Take all releases from #LuaWorker::overflow (and the ones
+	 * which were pushed to the queue before them) and invoke the
+	 * handler for them.
+	 */
+	void DrainOverflow() noexcept;
+
+	void OnWakeup(unsigned events) noexcept;
+};
+
+inline void
+LuaWorker::Context::Invoke(LuaRelease &&release) noexcept
+{
+	if (release.sample)
+		accounting->InvokeCgroupSampled(release.relative_path.c_str(),
+						release.id, release.btime,
+						release.usage, release.delta);
+	else
+		accounting->InvokeCgroupReleased(std::move(release.cgroup_fd),
+						 release.relative_path.c_str(),
+						 release.id, release.btime,
+						 release.usage, release.delta);
+}
+
+inline void
+LuaWorker::Context::DrainOverflow() noexcept
+{
+	std::list<LuaRelease> releases;
+
+	{
+		const std::scoped_lock lock{worker.overflow_mutex};
+
+		/* Push() may have added to the queue after we have
+		   drained it, but before the overflow; those are
+		   older */
+		while (auto release = worker.queue.Pop())
+			releases.emplace_back(std::move(*release));
+
+		releases.splice(releases.end(), worker.overflow);
+
+		/* from now on, Push() uses the queue again; those
+		   releases are handled by the next wakeup */
+		worker.overflow_pending = false;
+	}
+
+	for (auto &release : releases)
+		Invoke(std::move(release));
+}
+
+void
+LuaWorker::Context::OnWakeup(unsigned) noexcept
+{
+	uint64_t value;
+	(void)worker.wakeup_fd.Read(ReferenceAsWritableBytes(value));
+
+	/* clear the flag before looking at the queue, so a release
+	   pushed from now on signals the eventfd again */
+	worker.wakeup_pending = false;
+
+	if (worker.reload_requested.exchange(false))
+		accounting->Reload();
+
+	while (auto release = worker.queue.Pop())
+		Invoke(std::move(*release));
+
+	if (worker.overflow_pending)
+		DrainOverflow();
+
+	if (worker.exit_requested) {
+		accounting->FlushBatch();
+
+		wakeup_event.Cancel();
+		event_loop.Break();
+	}
+}
+
+LuaWorker::LuaWorker(const char *_path, const ReaperConfig &_config)
+	:path(_path), config(_config),
+	 wakeup_fd(AdoptTag{}, eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))
+{
+	if (!wakeup_fd.IsDefined())
+		throw MakeErrno("eventfd() failed");
+
+	std::promise<void> ready;
+	auto ready_future = ready.get_future();
+
+	thread = std::jthread{[this, &ready]{ Run(ready); }};
+
+	/* rethrows the exception if loading reaper.lua has
+	   failed */
+	ready_future.get();
+}
+
+LuaWorker::~LuaWorker() noexcept
+{
+	exit_requested = true;
+	Wake();
+
+	thread.join();
+}
+
+void
+LuaWorker::Wake() noexcept
+{
+	if (!wakeup_pending.exchange(true)) {
+		static constexpr uint64_t one = 1;
+		(void)wakeup_fd.Write(ReferenceAsBytes(one));
+	}
+}
+
+void
+LuaWorker::Push(LuaRelease &&release) noexcept
+{
+	/* preserve the order of the releases: nothing may overtake
+	   the ones waiting in #overflow */
+	if (!overflow_pending && queue.Push(std::move(release))) {
+		Wake();
+		return;
+	}
+
+	if (release.sample) {
+		/* there will be another sample in the next
+		   interval */
+		++stats.n_dropped;
+		return;
+	}
+
+	{
+		const std::scoped_lock lock{overflow_mutex};
+		overflow.emplace_back(std::move(release));
+		overflow_pending = true;
+	}
+
+	Wake();
+}
+
+void
+LuaWorker::Run(std::promise<void> &ready) noexcept
+{
+	/* all signals are handled by the main thread */
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	std::unique_ptr<Context> context;
+
+	try {
+		context = std::make_unique<Context>(*this);
+	} catch (...) {
+		ready.set_exception(std::current_exception());
+		return;
+	}
+
+	ready.set_value();
+
+	context->Run();
+}
+
+LuaWorkerPool::LuaWorkerPool(const char *path, const ReaperConfig &config)
+{
+	workers.reserve(config.lua_threads);
+	for (std::size_t i = 0; i < config.lua_threads; ++i)
+		workers.emplace_back(std::make_unique<LuaWorker>(path, config));
+}
+
+LuaWorkerPool::~LuaWorkerPool() noexcept = default;
+
+/**
+ * Return the path of the parent cgroup.  All of its children are
+ * handled by the same worker.
+ */
+[[gnu::pure]]
+static std::string_view
+GetShardKey(std::string_view relative_path) noexcept
+{
+	const auto slash = relative_path.rfind('/');
+	if (slash != relative_path.npos)
+		relative_path = relative_path.substr(0, slash);
+	return relative_path;
+}
+
+inline LuaWorker &
+LuaWorkerPool::GetWorker(const char *relative_path) const noexcept
+{
+	const std::size_t hash = std::hash<std::string_view>{}(GetShardKey(relative_path));
+	return *workers[hash % workers.size()];
+}
+
+void
+LuaWorkerPool::InvokeCgroupReleased(UniqueFileDescriptor cgroup_fd,
+				    const char *relative_path, uint_least64_t id,
+				    const std::chrono::system_clock::time_point btime,
+				    const CgroupResourceUsage &usage,
+				    const CgroupResourceUsage &delta) noexcept
+{
+	GetWorker(relative_path).Push({
+		std::move(cgroup_fd),
+		relative_path,
+		id, btime, usage, delta,
+	});
+}
+
+void
+LuaWorkerPool::InvokeCgroupSampled(const char *relative_path, uint_least64_t id,
+				   const std::chrono::system_clock::time_point btime,
+				   const CgroupResourceUsage &usage,
+				   const CgroupResourceUsage &delta) noexcept
+{
+	GetWorker(relative_path).Push({
+		{},
+		relative_path,
+		id, btime, usage, delta,
+		true,
+	});
+}
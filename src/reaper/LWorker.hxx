@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+#include "SpscQueue.hxx"
+#include "Stats.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ReaperConfig;
+
+/**
+ * A released cgroup handed over from the main thread to a
+ * #LuaWorker.
+ */
+struct LuaRelease {
+	UniqueFileDescriptor cgroup_fd;
+	std::string relative_path;
+	uint_least64_t id;
+	std::chrono::system_clock::time_point btime;
+	CgroupResourceUsage usage, delta;
+
+	/**
+	 * Is this a live sample of a running cgroup (see
+	 * #CgroupSampler) instead of a release?
+	 */
+	bool sample = false;
+};
+
+/**
+ * A thread with its own #EventLoop and its own Lua state (with
+ * reaper.lua loaded) which invokes the Lua handler for the cgroups
+ * passed to InvokeCgroupReleased().
+ */
+class LuaWorker final {
+	/**
+	 * The capacity of #queue.
+	 */
+	static constexpr std::size_t QUEUE_SIZE = 4096;
+
+	const char *const path;
+
+	const ReaperConfig &config;
+
+	LuaAccountingStats stats;
+
+	SpscQueue<LuaRelease> queue{QUEUE_SIZE};
+
+	/**
+	 * Releases which did not fit into #queue.  The worker thread
+	 * takes them after draining #queue.  Protected by
+	 * #overflow_mutex.
+	 */
+	std::list<LuaRelease> overflow;
+	std::mutex overflow_mutex;
+
+	/**
+	 * Is #overflow non-empty?  While it is, Push() appends to
+	 * #overflow instead of #queue, so no release overtakes the
+	 * ones waiting there.
+	 */
+	std::atomic_bool overflow_pending{false};
+
+	/**
+	 * An eventfd which wakes up the worker thread.
+	 */
+	UniqueFileDescriptor wakeup_fd;
+
+	/**
+	 * Has #wakeup_fd been signalled and the worker thread not
+	 * yet woken up?  This avoids one write() per release.
+	 */
+	std::atomic_bool wakeup_pending{false};
+
+	std::atomic_bool reload_requested{false}, exit_requested{false};
+
+	class Context;
+
+	std::jthread thread;
+
+public:
+	/**
+	 * Start the thread and wait until it has loaded reaper.lua.
+	 *
+	 * Throws on error.
+	 */
+	LuaWorker(const char *_path, const ReaperConfig &_config);
+
+	/**
+	 * Pass all queued cgroups to the handler and stop the thread.
+	 */
+	~LuaWorker() noexcept;
+
+	LuaWorker(const LuaWorker &) = delete;
+	LuaWorker &operator=(const LuaWorker &) = delete;
+
+	const LuaAccountingStats &GetStats() const noexcept {
+		return stats;
+	}
+
+	/**
+	 * Reload the Lua script (asynchronously).
+	 */
+	void Reload() noexcept {
+		reload_requested = true;
+		Wake();
+	}
+
+	/**
+	 * Hand over a released cgroup to the worker thread.  This
+	 * never blocks; if the queue is full, the release is appended
+	 * to #overflow (and samples are dropped and counted).
+	 */
+	void Push(LuaRelease &&release) noexcept;
+
+private:
+	void Wake() noexcept;
+
+	void Run(std::promise<void> &ready) noexcept;
+};
+
+/**
+ * Runs the Lua handler in multiple threads (see
+ * ReaperConfig::lua_threads).  Releases are distributed by a hash
+ * of the parent cgroup path, so the handler calls for cgroups of
+ * the same parent (e.g. the scopes of one user slice) happen in one
+ * thread and in the order they were released.
+ */
+class LuaWorkerPool final {
+	std::vector<std::unique_ptr<LuaWorker>> workers;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	LuaWorkerPool(const char *path, const ReaperConfig &config);
+
+	~LuaWorkerPool() noexcept;
+
+	void Reload() noexcept {
+		for (auto &i : workers)
+			i->Reload();
+	}
+
+	void AddStats(LuaAccountingStats &dest) const noexcept {
+		for (const auto &i : workers)
+			dest.Add(i->GetStats());
+	}
+
+	void InvokeCgroupReleased(UniqueFileDescriptor cgroup_fd,
+				  const char *relative_path, uint_least64_t id,
+				  std::chrono::system_clock::time_point btime,
+				  const CgroupResourceUsage &usage,
+				  const CgroupResourceUsage &delta) noexcept;
+
+	void InvokeCgroupSampled(const char *relative_path, uint_least64_t id,
+				 std::chrono::system_clock::time_point btime,
+				 const CgroupResourceUsage &usage,
+				 const CgroupResourceUsage &delta) noexcept;
+
+private:
+	[[gnu::pure]]
+	LuaWorker &GetWorker(const char *relative_path) const noexcept;
+};
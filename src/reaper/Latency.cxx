@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Latency.hxx"
+
+#include <fmt/format.h>
+
+static uint_least64_t
+ToMicroseconds(Event::Duration d) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void
+ReleaseLatency::Add(const ReleaseTimeline &timeline) noexcept
+{
+	for (std::size_t i = 0; i < N_RELEASE_STAGES; ++i)
+		if (timeline.stages & (1U << i))
+			stages[i].Add(ToMicroseconds(timeline.durations[i]));
+
+	if (timeline.deleted != Event::TimePoint{})
+		total.Add(ToMicroseconds(timeline.deleted - timeline.wakeup));
+}
+
+static void
+LogHistogram(std::string_view name,
+	     const ReleaseLatency::Histogram &h) noexcept
+{
+	if (h.GetCount() == 0)
+		return;
+
+	fmt::print(stderr, " {}=", name);
+
+	const char *separator = "";
+	for (const double q : {0.5, 0.9, 0.99}) {
+		const auto value = h.Quantile(q);
+		if (value == UINT_LEAST64_MAX)
+			fmt::print(stderr, "{}inf", separator);
+		else
+			fmt::print(stderr, "{}{}", separator, value);
+		separator = "/";
+	}
+
+	fmt::print(stderr, "us");
+}
+
+void
+LogReleaseLatency(const ReleaseLatency &latency) noexcept
+{
+	fmt::print(stderr, "latency (p50/p90/p99):");
+
+	for (std::size_t i = 0; i < N_RELEASE_STAGES; ++i)
+		LogHistogram(release_stage_names[i], latency.GetStage(i));
+
+	LogHistogram("total", latency.GetTotal());
+
+	fmt::print(stderr, "\n");
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Histogram.hxx"
+#include "event/Chrono.hxx"
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+/**
+ * The stages of releasing a cgroup, in the order they are run.
+ */
+enum class ReleaseStage : unsigned {
+	/**
+	 * From the event loop wakeup until the event was dispatched
+	 * to the cgroup (includes reading the inotify queue and
+	 * handling the events before it).
+	 */
+	WAKEUP,
+
+	/**
+	 * Reading "cgroup.events" (IsPopulated()).
+	 */
+	POPULATED,
+
+	/**
+	 * statx() for the creation time.
+	 */
+	BIRTH_TIME,
+
+	/**
+	 * Reading the first resource usage snapshot (synchronously
+	 * or the whole io_uring batch).
+	 */
+	COLLECT,
+
+	/**
+	 * Waiting in the #CgroupDeleteScheduler.
+	 */
+	DELETE_QUEUE,
+
+	/**
+	 * Reading the final resource usage snapshot.
+	 */
+	FINAL_USAGE,
+
+	/**
+	 * rmdir() (synchronously or with io_uring).
+	 */
+	DELETE,
+
+	/**
+	 * Logging the resource usage to stderr or to the journal.
+	 */
+	LOG,
+
+	/**
+	 * Appending to the #AccountingArchive.
+	 */
+	ARCHIVE,
+
+	/**
+	 * Passing the cgroup to the Lua handler (or to its worker
+	 * thread).
+	 */
+	LUA,
+
+	N
+};
+
+static constexpr std::size_t N_RELEASE_STAGES =
+	static_cast<std::size_t>(ReleaseStage::N);
+
+/**
+ * The names of all #ReleaseStage values for logging and metrics.
+ */
+static constexpr std::array<std::string_view, N_RELEASE_STAGES> release_stage_names{
+	"wakeup",
+	"populated",
+	"birth_time",
+	"collect",
+	"delete_queue",
+	"final_usage",
+	"delete",
+	"log",
+	"archive",
+	"lua",
+};
+
+/**
+ * Measures how long each stage of one cgroup release took.  It is
+ * started when the event revealing that the cgroup is empty is
+ * dispatched and travels with the #PendingRelease.
+ */
+struct ReleaseTimeline {
+	/**
+	 * When did the event loop wake up for the event which
+	 * revealed that the cgroup is empty?
+	 */
+	Event::TimePoint wakeup;
+
+	/**
+	 * When did the rmdir() finish?  Not set if it has failed.
+	 */
+	Event::TimePoint deleted;
+
+	std::array<Event::Duration, N_RELEASE_STAGES> durations{};
+
+	/**
+	 * A bit mask of the stages which were run.
+	 */
+	unsigned stages = 0;
+
+	void Add(ReleaseStage stage, Event::Duration duration) noexcept {
+		const auto i = static_cast<unsigned>(stage);
+		durations[i] += duration;
+		stages |= 1U << i;
+	}
+
+	/**
+	 * Add the time since the given start to the stage.
+	 *
+	 * @return the current time, to be used as the start of the
+	 * next stage
+	 */
+	Event::TimePoint Finish(ReleaseStage stage,
+				Event::TimePoint start) noexcept {
+		const auto now = Event::Clock::now();
+		Add(stage, now - start);
+		return now;
+	}
+};
+
+/**
+ * Histograms of the duration of each #ReleaseStage and of the
+ * whole release (from the wakeup until the cgroup was deleted).
+ */
+class ReleaseLatency {
+public:
+	/**
+	 * Microseconds; the largest finite bucket ends at 71
+	 * minutes.
+	 */
+	using Histogram = LogLinearHistogram<2, 32>;
+
+private:
+	std::array<Histogram, N_RELEASE_STAGES> stages;
+
+	Histogram total;
+
+public:
+	void Add(const ReleaseTimeline &timeline) noexcept;
+
+	const Histogram &GetStage(std::size_t i) const noexcept {
+		return stages[i];
+	}
+
+	const Histogram &GetTotal() const noexcept {
+		return total;
+	}
+};
+
+/**
+ * Print the median, the 90th and the 99th percentile of all stages
+ * to stderr.
+ */
+void
+LogReleaseLatency(const ReleaseLatency &latency) noexcept;
@@ -15,16 +15,22 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#include <chrono>
+
 #include <stdio.h>
 #include <stdlib.h>
 
 static void
 Run()
 {
+	const auto start_time = std::chrono::steady_clock::now();
+
 	SetupProcess();
 
 	Instance instance;
 
+	instance.OnReady(std::chrono::steady_clock::now() - start_time);
+
 #ifdef HAVE_LIBSYSTEMD
 	/* tell systemd we're ready */
 	sd_notify(0, "READY=1");
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Metrics.hxx"
+#include "CgroupAccounting.hxx"
+
+#include <fmt/format.h>
+
+#include <iterator> // for std::back_inserter()
+
+using std::string_view_literals::operator""sv;
+
+std::size_t
+ReleaseMetrics::AddScope(std::string_view name) noexcept
+{
+	for (std::size_t i = 0; i < scopes.size(); ++i)
+		if (scopes[i].name == name)
+			return i;
+
+	scopes.emplace_back(name);
+	return scopes.size() - 1;
+}
+
+static uint_least64_t
+ToMilliseconds(std::chrono::duration<double> d) noexcept
+{
+	return static_cast<uint_least64_t>(d.count() * 1e3);
+}
+
+void
+ReleaseMetrics::Add(std::size_t scope_index,
+		    std::chrono::system_clock::duration age,
+		    const CgroupResourceUsage &usage) noexcept
+{
+	auto &scope = scopes[scope_index];
+
+	++scope.n_released;
+
+	if (age.count() >= 0)
+		scope.lifetime.Add(std::chrono::duration_cast<std::chrono::milliseconds>(age).count());
+
+	if (usage.cpu.total.count() >= 0)
+		scope.cpu.Add(ToMilliseconds(usage.cpu.total));
+
+	if (usage.have_memory_peak)
+		scope.memory_peak.Add(usage.memory_peak / 1024);
+
+	if (usage.have_pids_forks)
+		scope.forks.Add(usage.pids_forks);
+}
+
+/**
+ * How to convert the integers stored in a histogram to the base
+ * unit of the exported metric.
+ */
+struct MetricUnit {
+	uint_least64_t multiplier, divisor;
+
+	/**
+	 * Subtracted from the exclusive bucket bound; 1 for plain
+	 * counts, which makes the bound inclusive (as required for
+	 * "le"), 0 for truncated values like milliseconds.
+	 */
+	uint_least64_t offset;
+
+	constexpr double operator()(uint_least64_t value) const noexcept {
+		return static_cast<double>(value * multiplier) / divisor;
+	}
+};
+
+static constexpr MetricUnit MICROSECONDS{1, 1000000, 0};
+static constexpr MetricUnit MILLISECONDS{1, 1000, 0};
+static constexpr MetricUnit KILOBYTES{1024, 1, 0};
+static constexpr MetricUnit COUNT{1, 1, 1};
+
+using Output = std::back_insert_iterator<std::string>;
+
+static void
+FormatFamily(Output out, std::string_view name, std::string_view type,
+	     std::string_view unit, std::string_view help)
+{
+	fmt::format_to(out, "# TYPE {} {}\n"sv, name, type);
+	if (!unit.empty())
+		fmt::format_to(out, "# UNIT {} {}\n"sv, name, unit);
+	fmt::format_to(out, "# HELP {} {}\n"sv, name, help);
+}
+
+/**
+ * @param labels the labels of all samples (without braces,
+ * e.g. `scope="foo"`); may be empty
+ */
+template<typename H>
+static void
+FormatHistogram(Output out, std::string_view name, std::string_view labels,
+		const H &h, MetricUnit unit)
+{
+	const std::string_view separator = labels.empty() ? ""sv : ","sv;
+
+	/* OpenMetrics buckets are cumulative */
+	uint_least64_t n = 0;
+	for (std::size_t i = 0; i < H::N_FINITE; ++i) {
+		n += h.GetBucket(i);
+		fmt::format_to(out, "{}_bucket{{{}{}le=\"{}\"}} {}\n"sv,
+			       name, labels, separator,
+			       unit(H::UpperBound(i) - unit.offset), n);
+	}
+
+	fmt::format_to(out, "{}_bucket{{{}{}le=\"+Inf\"}} {}\n"sv,
+		       name, labels, separator, h.GetCount());
+	fmt::format_to(out, "{}_sum{{{}}} {}\n"sv,
+		       name, labels, unit(h.GetSum()));
+	fmt::format_to(out, "{}_count{{{}}} {}\n"sv,
+		       name, labels, h.GetCount());
+}
+
+/**
+ * Format a histogram with the label "scope".
+ */
+template<typename H>
+static void
+FormatScopeHistogram(Output out, std::string_view name, std::string_view scope,
+		     const H &h, MetricUnit unit)
+{
+	FormatHistogram(out, name, fmt::format("scope=\"{}\""sv, scope),
+			h, unit);
+}
+
+std::string
+ReleaseMetrics::Format() const
+{
+	std::string result;
+	result.reserve(256 * 1024);
+	const Output out{result};
+
+	FormatFamily(out, "cm4all_spawn_reaper_released"sv, "counter"sv, {},
+		     "The number of released cgroups"sv);
+	for (const auto &scope : scopes)
+		fmt::format_to(out, "cm4all_spawn_reaper_released_total{{scope=\"{}\"}} {}\n"sv,
+			       scope.name, scope.n_released);
+
+	static constexpr struct {
+		std::string_view name, unit, help;
+		DurationHistogram Scope::*histogram;
+	} durations[] = {
+		{
+			"cm4all_spawn_reaper_cgroup_lifetime_seconds"sv,
+			"seconds"sv,
+			"The time from the creation of a cgroup until it was released"sv,
+			&Scope::lifetime,
+		},
+		{
+			"cm4all_spawn_reaper_cgroup_cpu_seconds"sv,
+			"seconds"sv,
+			"The CPU time used by a released cgroup"sv,
+			&Scope::cpu,
+		},
+	};
+
+	for (const auto &i : durations) {
+		FormatFamily(out, i.name, "histogram"sv, i.unit, i.help);
+		for (const auto &scope : scopes)
+			FormatScopeHistogram(out, i.name, scope.name,
+					     scope.*i.histogram, MILLISECONDS);
+	}
+
+	static constexpr auto memory_peak_name =
+		"cm4all_spawn_reaper_cgroup_memory_peak_bytes"sv;
+	FormatFamily(out, memory_peak_name, "histogram"sv, "bytes"sv,
+		     "The peak memory usage of a released cgroup"sv);
+	for (const auto &scope : scopes)
+		FormatScopeHistogram(out, memory_peak_name, scope.name,
+				     scope.memory_peak, KILOBYTES);
+
+	static constexpr auto forks_name = "cm4all_spawn_reaper_cgroup_forks"sv;
+	FormatFamily(out, forks_name, "histogram"sv, {},
+		     "The number of processes created in a released cgroup"sv);
+	for (const auto &scope : scopes)
+		FormatScopeHistogram(out, forks_name, scope.name,
+				     scope.forks, COUNT);
+
+	static constexpr auto stage_name =
+		"cm4all_spawn_reaper_release_stage_seconds"sv;
+	FormatFamily(out, stage_name, "histogram"sv, "seconds"sv,
+		     "The duration of each stage of releasing a cgroup"sv);
+	for (std::size_t i = 0; i < N_RELEASE_STAGES; ++i)
+		FormatHistogram(out, stage_name,
+				fmt::format("stage=\"{}\""sv, release_stage_names[i]),
+				latency.GetStage(i), MICROSECONDS);
+
+	static constexpr auto latency_name =
+		"cm4all_spawn_reaper_release_latency_seconds"sv;
+	FormatFamily(out, latency_name, "histogram"sv, "seconds"sv,
+		     "The time from the event revealing that a cgroup is empty until it was deleted"sv);
+	FormatHistogram(out, latency_name, {}, latency.GetTotal(), MICROSECONDS);
+
+	result.append("# EOF\n"sv);
+	return result;
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "Histogram.hxx"
+#include "Latency.hxx"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct CgroupResourceUsage;
+
+/**
+ * Counters and histograms of the resource usage of released
+ * cgroups, one set per managed scope (see #ManagedScope).  They
+ * are exported in the OpenMetrics text format (see MetricsListener).
+ */
+class ReleaseMetrics {
+	/**
+	 * Milliseconds; the largest finite bucket ends at 49 days.
+	 */
+	using DurationHistogram = LogLinearHistogram<1, 32>;
+
+	/**
+	 * Kilobytes; the largest finite bucket ends at 4 TB.
+	 */
+	using MemoryHistogram = LogLinearHistogram<1, 32>;
+
+	using CountHistogram = LogLinearHistogram<1, 24>;
+
+	struct Scope {
+		/**
+		 * The name of the systemd scope
+		 * (e.g. "bp-spawn.scope"), used as label value.
+		 */
+		std::string name;
+
+		uint_least64_t n_released = 0;
+
+		DurationHistogram lifetime, cpu;
+
+		MemoryHistogram memory_peak;
+
+		CountHistogram forks;
+
+		explicit Scope(std::string_view _name) noexcept
+			:name(_name) {}
+	};
+
+	std::vector<Scope> scopes;
+
+	ReleaseLatency latency;
+
+public:
+	/**
+	 * Register a scope (unless one with the same name already
+	 * exists).  Scopes are never removed, so the counters of a
+	 * scope which was removed from the configuration are still
+	 * exported, and they continue if it is added again.
+	 *
+	 * @return the index to be passed to Add()
+	 */
+	std::size_t AddScope(std::string_view name) noexcept;
+
+	/**
+	 * Account a released cgroup.  This does not allocate memory.
+	 *
+	 * @param scope the index returned by AddScope()
+	 * @param age the time from the creation of the cgroup until
+	 * its release or a negative value if that is unknown
+	 */
+	void Add(std::size_t scope, std::chrono::system_clock::duration age,
+		 const CgroupResourceUsage &usage) noexcept;
+
+	void AddLatency(const ReleaseTimeline &timeline) noexcept {
+		latency.Add(timeline);
+	}
+
+	const ReleaseLatency &GetLatency() const noexcept {
+		return latency;
+	}
+
+	/**
+	 * Format all metrics in the OpenMetrics text format
+	 * (including the terminating "# EOF" line).  The size of the
+	 * output does not depend on the number of released cgroups.
+	 */
+	std::string Format() const;
+};
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "MetricsServer.hxx"
+#include "Metrics.hxx"
+#include "net/LocalSocketAddress.hxx"
+#include "net/SocketError.hxx"
+#include "util/SpanCast.hxx"
+
+#include <sys/socket.h>
+#include <unistd.h> // for unlink()
+
+using std::chrono_literals::operator""s;
+
+/**
+ * How long a client may take to receive the response.
+ */
+static constexpr Event::Duration TIMEOUT = 10s;
+
+MetricsConnection::MetricsConnection(EventLoop &event_loop,
+				     const ReleaseMetrics &metrics,
+				     UniqueSocketDescriptor &&_fd, SocketAddress)
+	:fd(std::move(_fd)),
+	 event(event_loop, BIND_THIS_METHOD(OnSocketReady), fd),
+	 timeout_event(event_loop, BIND_THIS_METHOD(OnTimeout)),
+	 response(metrics.Format())
+{
+	event.ScheduleWrite();
+	timeout_event.Schedule(TIMEOUT);
+}
+
+void
+MetricsConnection::OnSocketReady(unsigned) noexcept
+{
+	const auto src = std::string_view{response}.substr(position);
+
+	const auto nbytes = fd.Send(AsBytes(src), MSG_DONTWAIT|MSG_NOSIGNAL);
+	if (nbytes < 0) {
+		if (errno == EAGAIN)
+			return;
+
+		delete this;
+		return;
+	}
+
+	position += static_cast<std::size_t>(nbytes);
+	if (position == response.size())
+		delete this;
+}
+
+void
+MetricsConnection::OnTimeout() noexcept
+{
+	delete this;
+}
+
+UniqueSocketDescriptor
+CreateMetricsSocket(const char *path)
+{
+	if (*path != '@')
+		/* delete the socket left behind by the previous
+		   process */
+		unlink(path);
+
+	UniqueSocketDescriptor s;
+	if (!s.CreateNonBlock(AF_LOCAL, SOCK_STREAM, 0))
+		throw MakeSocketError("Failed to create socket");
+
+	if (!s.Bind(LocalSocketAddress{path}))
+		throw MakeSocketError("Failed to bind");
+
+	if (!s.Listen(16))
+		throw MakeSocketError("Failed to listen");
+
+	return s;
+}
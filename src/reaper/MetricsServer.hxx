@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/CoarseTimerEvent.hxx"
+#include "event/SocketEvent.hxx"
+#include "event/net/TemplateServerSocket.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <string>
+
+class ReleaseMetrics;
+class SocketAddress;
+
+/**
+ * A client connected to the metrics socket.  It gets a snapshot of
+ * all metrics in the OpenMetrics text format, and then the
+ * connection is closed.  Clients which don't receive it within 10
+ * seconds are disconnected.
+ */
+class MetricsConnection final : public AutoUnlinkIntrusiveListHook {
+	const UniqueSocketDescriptor fd;
+
+	SocketEvent event;
+
+	/**
+	 * Closes the connection if the client does not receive the
+	 * response in time.
+	 */
+	CoarseTimerEvent timeout_event;
+
+	const std::string response;
+
+	/**
+	 * The number of bytes of #response which have been sent
+	 * already.
+	 */
+	std::size_t position = 0;
+
+public:
+	MetricsConnection(EventLoop &event_loop, const ReleaseMetrics &metrics,
+			  UniqueSocketDescriptor &&_fd, SocketAddress address);
+
+private:
+	void OnSocketReady(unsigned events) noexcept;
+	void OnTimeout() noexcept;
+};
+
+typedef TemplateServerSocket<MetricsConnection,
+			     EventLoop &, const ReleaseMetrics &> MetricsListener;
+
+/**
+ * Create a listening local stream socket for #MetricsListener.  A
+ * path beginning with '@' specifies an abstract socket; a stale
+ * socket file is deleted.
+ *
+ * Throws on error.
+ */
+UniqueSocketDescriptor
+CreateMetricsSocket(const char *path);
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+/**
+ * A lock-free bounded queue with any number of producer threads and
+ * exactly one consumer thread.
+ *
+ * Each slot has a sequence number which tells whether it is free
+ * for the producer which has claimed a position (by incrementing
+ * #head) or whether it has been filled for the consumer.
+ */
+template<typename T>
+class MpscQueue {
+	struct Slot {
+		/**
+		 * Equals the position if the slot is free, or the
+		 * position plus one if it contains a value.
+		 */
+		std::atomic_size_t sequence;
+
+		std::optional<T> value;
+	};
+
+	const std::unique_ptr<Slot[]> slots;
+
+	const std::size_t mask;
+
+	/**
+	 * The number of positions claimed by producers so far.
+	 */
+	alignas(64) std::atomic_size_t head{0};
+
+	/**
+	 * The number of items popped so far; only accessed by the
+	 * consumer.
+	 */
+	alignas(64) std::size_t tail = 0;
+
+public:
+	/**
+	 * @param capacity the maximum number of items; must be a
+	 * power of two
+	 */
+	explicit MpscQueue(std::size_t capacity)
+		:slots(new Slot[capacity]),
+		 mask(capacity - 1)
+	{
+		assert(std::has_single_bit(capacity));
+
+		for (std::size_t i = 0; i < capacity; ++i)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MpscQueue(const MpscQueue &) = delete;
+	MpscQueue &operator=(const MpscQueue &) = delete;
+
+	/**
+	 * Add an item at the end.  May be called by any thread.
+	 *
+	 * @return false if the queue is full (and #value was not
+	 * moved)
+	 */
+	bool Push(T &&value) noexcept {
+		std::size_t h = head.load(std::memory_order_relaxed);
+
+		while (true) {
+			Slot &slot = slots[h & mask];
+			const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+			if (sequence == h) {
+				/* the slot is free; try to claim it */
+				if (head.compare_exchange_weak(h, h + 1,
+							       std::memory_order_relaxed)) {
+					slot.value.emplace(std::move(value));
+					slot.sequence.store(h + 1, std::memory_order_release);
+					return true;
+				}
+
+				/* another producer was faster;
+				   compare_exchange_weak() has loaded
+				   the new #head */
+			} else if (sequence < h) {
+				/* the consumer has not yet popped the
+				   item from the previous round */
+				return false;
+			} else
+				h = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Remove the first item.  May only be called by the
+	 * consumer.
+	 *
+	 * If a producer has claimed the first position but has not
+	 * yet finished writing the value, this returns std::nullopt
+	 * even if later items are ready.
+	 */
+	std::optional<T> Pop() noexcept {
+		Slot &slot = slots[tail & mask];
+		if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+			return std::nullopt;
+
+		std::optional<T> value{std::move(slot.value)};
+		slot.value.reset();
+
+		/* free the slot for the next round */
+		slot.sequence.store(tail + mask + 1, std::memory_order_release);
+		++tail;
+		return value;
+	}
+};
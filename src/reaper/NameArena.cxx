@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "NameArena.hxx"
+
+#include <algorithm> // for std::copy(), std::min()
+#include <cassert>
+#include <new>
+
+NameArena::NameArena() noexcept = default;
+NameArena::~NameArena() noexcept = default;
+
+std::byte *
+NameArena::Allocate(std::size_t size_class) noexcept
+{
+	assert(size_class < N_CLASSES);
+
+	if (FreeSlot *slot = free_lists[size_class]; slot != nullptr) {
+		free_lists[size_class] = slot->next;
+		return reinterpret_cast<std::byte *>(slot);
+	}
+
+	const std::size_t size = (size_class + 1) * ALIGN;
+
+	if (chunk_remaining < size) {
+		/* move the rest of the current chunk to the free
+		   lists so it doesn't get lost */
+		while (chunk_remaining >= ALIGN) {
+			const std::size_t rest_class =
+				std::min(chunk_remaining / ALIGN, N_CLASSES) - 1;
+			Free(chunk_position, rest_class);
+			chunk_position += (rest_class + 1) * ALIGN;
+			chunk_remaining -= (rest_class + 1) * ALIGN;
+		}
+
+		chunks.emplace_back(new std::byte[CHUNK_SIZE]);
+		chunk_position = chunks.back().get();
+		chunk_remaining = CHUNK_SIZE;
+	}
+
+	std::byte *p = chunk_position;
+	chunk_position += size;
+	chunk_remaining -= size;
+	return p;
+}
+
+inline void
+NameArena::Free(std::byte *p, std::size_t size_class) noexcept
+{
+	assert(size_class < N_CLASSES);
+
+	auto *slot = ::new(p) FreeSlot{free_lists[size_class]};
+	free_lists[size_class] = slot;
+}
+
+std::string_view
+NameArena::Intern(std::string_view name, std::size_t hash) noexcept
+{
+	assert(!name.empty());
+	assert(hash == decltype(index)::Hash(name));
+
+	if (Entry *entry = index.Find(name, hash)) {
+		++entry->ref;
+		return entry->GetName();
+	}
+
+	std::byte *p = Allocate(GetSizeClass(name.size()));
+	auto *entry = ::new(p) Entry{1, static_cast<uint_least32_t>(name.size())};
+	auto *dest = reinterpret_cast<char *>(entry + 1);
+	*std::copy(name.begin(), name.end(), dest) = '\0';
+
+	index.Insert(*entry, hash);
+	return entry->GetName();
+}
+
+void
+NameArena::Release(std::string_view name) noexcept
+{
+	assert(!name.empty());
+
+	auto *entry = reinterpret_cast<Entry *>(const_cast<char *>(name.data())) - 1;
+	assert(entry->ref > 0);
+	assert(entry->GetName().data() == name.data());
+
+	if (--entry->ref > 0)
+		return;
+
+	index.Erase(*entry);
+	Free(reinterpret_cast<std::byte *>(entry), GetSizeClass(entry->length));
+}
+
+std::size_t
+NameArena::GetMemoryUsage() const noexcept
+{
+	return chunks.size() * CHUNK_SIZE + index.GetMemoryUsage();
+}
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "ChildIndex.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/**
+ * Storage for directory names.  Equal names are stored only once
+ * (with a reference counter), and the storage is carved from large
+ * chunks with one free list per size class, so there is no heap
+ * allocation per name.  All names are null-terminated, so the
+ * string_view's data() can be passed to system calls.
+ */
+class NameArena {
+	struct Entry {
+		uint_least32_t ref;
+		uint_least32_t length;
+
+		std::string_view GetName() const noexcept {
+			return {reinterpret_cast<const char *>(this + 1), length};
+		}
+	};
+
+	struct GetEntryName {
+		std::string_view operator()(const Entry &entry) const noexcept {
+			return entry.GetName();
+		}
+	};
+
+	/**
+	 * The granularity of allocations.
+	 */
+	static constexpr std::size_t ALIGN = 16;
+
+	/**
+	 * Enough size classes for NAME_MAX plus the null terminator
+	 * plus the #Entry header.
+	 */
+	static constexpr std::size_t N_CLASSES = (sizeof(Entry) + 256 + ALIGN - 1) / ALIGN;
+
+	static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+	ChildIndex<Entry, GetEntryName> index;
+
+	std::vector<std::unique_ptr<std::byte[]>> chunks;
+
+	/**
+	 * The unused rest of the most recent chunk.
+	 */
+	std::byte *chunk_position = nullptr;
+	std::size_t chunk_remaining = 0;
+
+	struct FreeSlot {
+		FreeSlot *next;
+	};
+
+	FreeSlot *free_lists[N_CLASSES]{};
+
+public:
+	NameArena() noexcept;
+	~NameArena() noexcept;
+
+	NameArena(const NameArena &) = delete;
+	NameArena &operator=(const NameArena &) = delete;
+
+	/**
+	 * Obtain a reference to a copy of the specified name.  It
+	 * remains valid until Release() is called.
+	 *
+	 * @param hash the return value of ChildIndex::Hash() for the
+	 * name
+	 */
+	std::string_view Intern(std::string_view name, std::size_t hash) noexcept;
+
+	/**
+	 * Release a reference obtained by Intern().
+	 */
+	void Release(std::string_view name) noexcept;
+
+	/**
+	 * How much heap memory does this arena occupy?
+	 */
+	[[gnu::pure]]
+	std::size_t GetMemoryUsage() const noexcept;
+
+private:
+	static constexpr std::size_t GetSizeClass(std::size_t length) noexcept {
+		return (sizeof(Entry) + length + 1 + ALIGN - 1) / ALIGN - 1;
+	}
+
+	std::byte *Allocate(std::size_t size_class) noexcept;
+	void Free(std::byte *p, std::size_t size_class) noexcept;
+};
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Allocates objects of one type from large chunks and recycles
+ * freed objects through a free list.  Memory is returned to the
+ * system only when the pool is destroyed, i.e. the pool stays at its
+ * high-water mark.
+ */
+template<typename T, std::size_t CHUNK_LENGTH=256>
+class NodePool {
+	union Slot {
+		Slot *next_free;
+		alignas(T) std::byte storage[sizeof(T)];
+	};
+
+	std::vector<std::unique_ptr<Slot[]>> chunks;
+
+	/**
+	 * The number of slots in the most recent chunk which have
+	 * never been used.
+	 */
+	std::size_t chunk_remaining = 0;
+
+	Slot *free_list = nullptr;
+
+	std::size_t n_allocated = 0;
+
+public:
+	NodePool() noexcept = default;
+
+	~NodePool() noexcept {
+		/* all objects must have been deleted already */
+		assert(n_allocated == 0);
+	}
+
+	NodePool(const NodePool &) = delete;
+	NodePool &operator=(const NodePool &) = delete;
+
+	template<typename... Args>
+	T &New(Args&&... args) {
+		Slot *slot = Allocate();
+
+		try {
+			T *t = ::new(slot->storage) T(std::forward<Args>(args)...);
+			++n_allocated;
+			return *t;
+		} catch (...) {
+			Free(slot);
+			throw;
+		}
+	}
+
+	void Delete(T &t) noexcept {
+		assert(n_allocated > 0);
+
+		t.~T();
+		Free(reinterpret_cast<Slot *>(&t));
+		--n_allocated;
+	}
+
+	std::size_t size() const noexcept {
+		return n_allocated;
+	}
+
+	/**
+	 * How much heap memory does this pool occupy?
+	 */
+	std::size_t GetMemoryUsage() const noexcept {
+		return chunks.size() * CHUNK_LENGTH * sizeof(Slot);
+	}
+
+private:
+	Slot *Allocate() {
+		if (free_list != nullptr) {
+			Slot *slot = free_list;
+			free_list = slot->next_free;
+			return slot;
+		}
+
+		if (chunk_remaining == 0) {
+			chunks.emplace_back(std::make_unique_for_overwrite<Slot[]>(CHUNK_LENGTH));
+			chunk_remaining = CHUNK_LENGTH;
+		}
+
+		return &chunks.back()[CHUNK_LENGTH - chunk_remaining--];
+	}
+
+	void Free(Slot *slot) noexcept {
+		slot->next_free = free_list;
+		free_list = slot;
+	}
+};
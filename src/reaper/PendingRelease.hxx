@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+#include "Latency.hxx"
+#include "event/Chrono.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+/**
+ * A cgroup which has run empty and is waiting to be deleted.  Its
+ * resource usage is reported right before that, and this object
+ * carries what is needed for the final snapshot.
+ */
+struct PendingRelease {
+	/**
+	 * A (readable) file descriptor of the cgroup directory; it
+	 * will be passed to the Lua handler.
+	 */
+	UniqueFileDescriptor cgroup_fd;
+
+	CgroupStatFiles stat_files;
+
+	/**
+	 * The kernel's cgroup ID (or 0 if unknown).
+	 */
+	uint_least64_t id;
+
+	std::chrono::system_clock::time_point btime;
+
+	/**
+	 * The snapshot taken when the cgroup ran empty.
+	 */
+	CgroupResourceUsage usage;
+
+	ReleaseTimeline timeline;
+
+	/**
+	 * Keep the empty cgroup at least this long before deleting
+	 * it (see ManagedScope::delete_delay).
+	 */
+	Event::Duration delete_delay{};
+
+	/**
+	 * Report the resource usage of this cgroup?  If false, it is
+	 * only deleted (see ManagedScope::accounting).
+	 */
+	bool accounting = true;
+
+	PendingRelease(CgroupStatFiles &&_stat_files,
+		       uint_least64_t _id,
+		       std::chrono::system_clock::time_point _btime,
+		       const ReleaseTimeline &_timeline) noexcept
+		:stat_files(std::move(_stat_files)),
+		 id(_id), btime(_btime), timeline(_timeline) {}
+};
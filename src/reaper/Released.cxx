@@ -3,38 +3,23 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Instance.hxx"
-#include "Scopes.hxx"
-#include "UnifiedWatch.hxx"
 #include "CgroupAccounting.hxx"
+#include "BlockDevices.hxx"
+#include "JournalSink.hxx"
+#include "Archive.hxx"
 #include "LAccounting.hxx"
-#include "io/FileAt.hxx"
+#include "LWorker.hxx"
+#include "io/UniqueFileDescriptor.hxx"
 #include "time/ISO8601.hxx"
-#include "time/StatxCast.hxx"
+#include "util/PrintException.hxx"
 #include "util/StringBuffer.hxx"
-#include "util/StringCompare.hxx"
 
 #include <fmt/format.h>
 
-#include <fcntl.h> // for AT_REMOVEDIR
 #include <stdio.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/stat.h>
 
 using std::string_view_literals::operator""sv;
 
-static const char *
-GetManagedSuffix(const char *path)
-{
-	for (auto i = managed_scopes; *i != nullptr; ++i) {
-		const char *suffix = StringAfterPrefix(path, *i);
-		if (suffix != nullptr)
-			return suffix;
-	}
-
-	return nullptr;
-}
-
 static char *
 MaybeLogPercent(char *p,
 		std::chrono::duration<double> usage,
@@ -67,17 +52,133 @@ MaybeLogRate(char *p, uint_least32_t n,
 	return p;
 }
 
-static void
-CollectCgroupStats(const char *suffix,
-		   const std::chrono::system_clock::time_point btime,
-		   const CgroupResourceUsage &u)
+static char *
+LogDelta(char *p, const CgroupResourceUsage &delta) noexcept
+{
+	if (delta.cpu.total.count() > 0)
+		p = fmt::format_to(p, " delta_cpu={:.3f}s", delta.cpu.total.count());
+
+	if (delta.have_memory_peak && delta.memory_peak > 0)
+		p = fmt::format_to(p, " delta_memory={}K",
+				   (delta.memory_peak + 1023) / 1024);
+
+	return p;
+}
+
+static constexpr uint_least64_t
+ToKilobytes(uint_least64_t bytes) noexcept
 {
-	char buffer[4096], *p = buffer;
+	return (bytes + 1023) / 1024;
+}
+
+static char *
+LogIo(char *p, const CgroupIoStat &io, bool with_devices) noexcept
+{
+	const auto &t = io.total;
+	if (t.rios == 0 && t.wios == 0 && t.dbytes == 0)
+		return p;
+
+	p = fmt::format_to(p, " io={}K/{}K io_ops={}/{}",
+			   ToKilobytes(t.rbytes), ToKilobytes(t.wbytes),
+			   t.rios, t.wios);
+
+	if (t.dbytes > 0)
+		p = fmt::format_to(p, " io_discard={}K", ToKilobytes(t.dbytes));
+
+	if (with_devices)
+		for (std::size_t i = 0; i < io.n_devices; ++i) {
+			const auto &d = io.devices[i];
+			p = fmt::format_to(p, " io[{}]={}K/{}K",
+					   FormatBlockDevice(d.dev).c_str(),
+					   ToKilobytes(d.counters.rbytes),
+					   ToKilobytes(d.counters.wbytes));
+		}
+
+	return p;
+}
+
+/**
+ * Format the extended statistics (see EnableExtendedCgroupStats());
+ * values which were not collected are omitted.
+ */
+static char *
+LogExtended(char *p, const CgroupResourceUsage &u) noexcept
+{
+	if (u.cpu.throttled.count() > 0)
+		p = fmt::format_to(p, " throttled={:.1f}s/{}",
+				   u.cpu.throttled.count(), u.cpu.nr_throttled);
+
+	static constexpr struct {
+		const char *name;
+		CgroupPressureStat CgroupResourceUsage::*pressure;
+	} pressures[] = {
+		{"cpu", &CgroupResourceUsage::cpu_pressure},
+		{"memory", &CgroupResourceUsage::memory_pressure},
+		{"io", &CgroupResourceUsage::io_pressure},
+	};
+
+	for (const auto &i : pressures) {
+		const auto &pressure = u.*i.pressure;
+		if (pressure.some.count() <= 0)
+			continue;
+
+		p = fmt::format_to(p, " {}_stall={:.3f}s",
+				   i.name, pressure.some.count());
+		if (pressure.full.count() >= 0)
+			p = fmt::format_to(p, "/{:.3f}s", pressure.full.count());
+	}
+
+	static constexpr struct {
+		const char *name;
+		CgroupMemoryStat::Key key;
+		bool bytes;
+	} memory_stat_keys[] = {
+		{"anon", CgroupMemoryStat::ANON, true},
+		{"file", CgroupMemoryStat::FILE, true},
+		{"kernel", CgroupMemoryStat::KERNEL, true},
+		{"sock", CgroupMemoryStat::SOCK, true},
+		{"major_faults", CgroupMemoryStat::PGMAJFAULT, false},
+	};
+
+	for (const auto &i : memory_stat_keys) {
+		if (!u.memory_stat.Has(i.key))
+			continue;
+
+		const auto value = u.memory_stat.Get(i.key);
+		if (value == 0)
+			continue;
+
+		if (i.bytes)
+			p = fmt::format_to(p, " {}={}K", i.name, ToKilobytes(value));
+		else
+			p = fmt::format_to(p, " {}={}", i.name, value);
+	}
+
+	return p;
+}
+
+/**
+ * Format the resource usage of a released cgroup as one line of
+ * text.
+ *
+ * @param with_since include the birth time (as ISO8601 string)?
+ * @param with_io_devices include the per-device I/O breakdown?
+ */
+static char *
+FormatCgroupStats(char *p, uint_least64_t id,
+		  const std::chrono::system_clock::time_point btime,
+		  const CgroupResourceUsage &u,
+		  const CgroupResourceUsage &delta,
+		  bool with_since, bool with_io_devices) noexcept
+{
+	if (id != 0)
+		p = fmt::format_to(p, " id={}"sv, id);
 
 	using Age = std::chrono::duration<double>;
 	Age age{};
 	if (btime != std::chrono::system_clock::time_point{}) {
-		p = fmt::format_to(p, " since={}"sv, FormatISO8601(btime).c_str());
+		if (with_since)
+			p = fmt::format_to(p, " since={}"sv, FormatISO8601(btime).c_str());
 
 		age = std::chrono::duration_cast<Age>(std::chrono::system_clock::now() - btime);
 	}
@@ -130,85 +231,256 @@ CollectCgroupStats(const char *suffix,
 	if (u.have_pids_events_max && u.pids_events_max > 0)
 		p = fmt::format_to(p, " procs_rejected={}", u.pids_events_max);
 
+	if (u.have_io)
+		p = LogIo(p, u.io, with_io_devices);
+
+	p = LogExtended(p, u);
+
+	return LogDelta(p, delta);
+}
+
+/**
+ * @param sample is this a live sample of a running cgroup (see
+ * #CgroupSampler) instead of a release?
+ */
+static void
+CollectCgroupStats(const char *suffix, uint_least64_t id,
+		   const std::chrono::system_clock::time_point btime,
+		   const CgroupResourceUsage &u,
+		   const CgroupResourceUsage &delta,
+		   bool with_io_devices, bool sample)
+{
+	char buffer[4096];
+	const char *p = FormatCgroupStats(buffer, id, btime, u, delta, !sample,
+					  with_io_devices);
+
 	if (p > buffer)
-		fmt::print(stderr, "{}:{}\n", suffix,
+		fmt::print(stderr, "{}:{}{}\n", suffix,
+			   sample ? " sample"sv : ""sv,
 			   std::string_view{buffer, p});
 }
 
-static bool
-DestroyCgroup(const FileDescriptor root_cgroup, const char *relative_path) noexcept
+static uint_least64_t
+ToMicroseconds(std::chrono::duration<double> d) noexcept
+{
+	return static_cast<uint_least64_t>(d.count() * 1e6);
+}
+
+/**
+ * Send the resource usage of a released cgroup to the journal as
+ * structured fields.  The "MESSAGE" field contains the same text
+ * as CollectCgroupStats() (except for the birth time, which is
+ * sent as a number).  Samples have the field "CGROUP_SAMPLE=1".
+ */
+static void
+SendCgroupStats(JournalSink &journal,
+		const char *path, const char *suffix, uint_least64_t id,
+		const std::chrono::system_clock::time_point btime,
+		const CgroupResourceUsage &u,
+		const CgroupResourceUsage &delta,
+		bool with_io_devices, bool sample) noexcept
 {
-	assert(*relative_path == '/');
-	assert(relative_path[1] != 0);
-
-	if (unlinkat(root_cgroup.Get(), relative_path + 1,
-		     AT_REMOVEDIR) < 0) {
-		const int e = errno;
-		if (e == EBUSY)
-			/* meanwhile, a new process has been
-			   spawned/moved into the cgroup; re-add so we
-			   can receive events when it's empty again */
-			return false;
-
-		if (e != ENOENT)
-			fmt::print(stderr, "Failed to delete '{}': {}\n",
-				   relative_path, strerror(e));
+	/* only the (bounded) numeric fields are formatted into this
+	   buffer; the path suffix is copied into the entry
+	   separately */
+	char buffer[4096];
+	const char *p = FormatCgroupStats(buffer, id, btime, u, delta, false,
+					  with_io_devices);
+	if (p == buffer)
+		return;
+
+	const auto dest = journal.Write();
+	if (dest.empty())
+		return;
+
+	/* the paths may contain newlines, so they are sent in the
+	   binary form */
+	JournalEntryWriter w{dest};
+	w.AddBinary("MESSAGE"sv, std::string_view{suffix}, ":"sv,
+		    sample ? " sample"sv : ""sv,
+		    std::string_view{buffer, p});
+	w.Add("PRIORITY"sv, 6); // LOG_INFO
+	w.Add("SYSLOG_IDENTIFIER"sv, "cm4all-spawn-reaper"sv);
+	w.AddBinary("CGROUP"sv, std::string_view{path});
+
+	if (id != 0)
+		w.Add("CGROUP_ID"sv, id);
+
+	if (sample)
+		w.Add("CGROUP_SAMPLE"sv, 1);
+
+	if (btime != std::chrono::system_clock::time_point{})
+		w.Add("CGROUP_BIRTH_USEC"sv,
+		      std::chrono::duration_cast<std::chrono::microseconds>(btime.time_since_epoch()).count());
+
+	if (u.cpu.total.count() >= 0)
+		w.Add("CPU_USEC"sv, ToMicroseconds(u.cpu.total));
+	if (u.cpu.user.count() >= 0)
+		w.Add("CPU_USER_USEC"sv, ToMicroseconds(u.cpu.user));
+	if (u.cpu.system.count() >= 0)
+		w.Add("CPU_SYSTEM_USEC"sv, ToMicroseconds(u.cpu.system));
+	if (u.cpu.throttled.count() >= 0) {
+		w.Add("CPU_THROTTLED_USEC"sv, ToMicroseconds(u.cpu.throttled));
+		w.Add("CPU_NR_THROTTLED"sv, u.cpu.nr_throttled);
+	}
+
+	static constexpr struct {
+		std::string_view some, full;
+		CgroupPressureStat CgroupResourceUsage::*pressure;
+	} pressures[] = {
+		{"CPU_PRESSURE_SOME_USEC"sv, "CPU_PRESSURE_FULL_USEC"sv, &CgroupResourceUsage::cpu_pressure},
+		{"MEMORY_PRESSURE_SOME_USEC"sv, "MEMORY_PRESSURE_FULL_USEC"sv, &CgroupResourceUsage::memory_pressure},
+		{"IO_PRESSURE_SOME_USEC"sv, "IO_PRESSURE_FULL_USEC"sv, &CgroupResourceUsage::io_pressure},
+	};
+
+	for (const auto &i : pressures) {
+		const auto &pressure = u.*i.pressure;
+		if (pressure.some.count() >= 0)
+			w.Add(i.some, ToMicroseconds(pressure.some));
+		if (pressure.full.count() >= 0)
+			w.Add(i.full, ToMicroseconds(pressure.full));
 	}
 
-	return true;
+	if (u.have_memory_peak)
+		w.Add("MEMORY_PEAK"sv, u.memory_peak);
+	if (u.have_memory_events_high)
+		w.Add("MEMORY_EVENTS_HIGH"sv, u.memory_events_high);
+	if (u.have_memory_events_max)
+		w.Add("MEMORY_EVENTS_MAX"sv, u.memory_events_max);
+	if (u.have_memory_events_oom)
+		w.Add("MEMORY_EVENTS_OOM"sv, u.memory_events_oom);
+
+	static constexpr struct {
+		std::string_view field;
+		CgroupMemoryStat::Key key;
+	} memory_stat_fields[] = {
+		{"MEMORY_ANON"sv, CgroupMemoryStat::ANON},
+		{"MEMORY_FILE"sv, CgroupMemoryStat::FILE},
+		{"MEMORY_KERNEL"sv, CgroupMemoryStat::KERNEL},
+		{"MEMORY_SOCK"sv, CgroupMemoryStat::SOCK},
+		{"MEMORY_PGMAJFAULT"sv, CgroupMemoryStat::PGMAJFAULT},
+	};
+
+	for (const auto &i : memory_stat_fields)
+		if (u.memory_stat.Has(i.key))
+			w.Add(i.field, u.memory_stat.Get(i.key));
+
+	if (u.have_pids_peak)
+		w.Add("PIDS_PEAK"sv, u.pids_peak);
+	if (u.have_pids_forks)
+		w.Add("PIDS_FORKS"sv, u.pids_forks);
+	if (u.have_pids_events_max)
+		w.Add("PIDS_EVENTS_MAX"sv, u.pids_events_max);
+
+	if (u.have_io) {
+		w.Add("IO_READ_BYTES"sv, u.io.total.rbytes);
+		w.Add("IO_WRITE_BYTES"sv, u.io.total.wbytes);
+		w.Add("IO_READ_OPS"sv, u.io.total.rios);
+		w.Add("IO_WRITE_OPS"sv, u.io.total.wios);
+		w.Add("IO_DISCARD_BYTES"sv, u.io.total.dbytes);
+	}
+
+	if (delta.cpu.total.count() > 0)
+		w.Add("DELTA_CPU_USEC"sv, ToMicroseconds(delta.cpu.total));
+	if (delta.have_memory_peak)
+		w.Add("DELTA_MEMORY_PEAK"sv, delta.memory_peak);
+
+	journal.Commit(w.size());
 }
 
 void
-Instance::OnCgroupEmpty(const char *path) noexcept
+Instance::ReportRelease(const char *path, PendingRelease &release,
+			const CgroupResourceUsage &usage,
+			const CgroupResourceUsage &delta) noexcept
 {
-	const char *suffix = GetManagedSuffix(path);
-	if (suffix == nullptr)
+	const auto *scope = config.scopes.Find(path);
+	if (scope == nullptr)
+		/* the scope was removed (SIGHUP) after this cgroup
+		   had run empty */
 		return;
 
-	UniqueFileDescriptor cgroup_fd;
-	(void)cgroup_fd.Open({root_cgroup, path + 1}, O_DIRECTORY|O_RDONLY);
+	const char *suffix = scope->GetSuffix(path);
+
+	const auto now = event_loop.SystemNow();
 
-	std::chrono::system_clock::time_point btime;
+	metrics.Add(scope->metrics_index,
+		    release.btime != std::chrono::system_clock::time_point{}
+		    ? now - release.btime
+		    : std::chrono::system_clock::duration{-1},
+		    usage);
 
-	if (cgroup_fd.IsDefined()) {
-		struct statx stx;
-		if (statx(cgroup_fd.Get(), "", AT_EMPTY_PATH|AT_STATX_FORCE_SYNC,
-			  STATX_BTIME, &stx) == 0) {
-			if (stx.stx_mask & STATX_BTIME)
-				btime = ToSystemTimePoint(stx.stx_btime);
+	auto &timeline = release.timeline;
+	auto t = Event::Clock::now();
+
+	if (journal_sink)
+		SendCgroupStats(*journal_sink, path, suffix,
+				release.id, release.btime, usage, delta,
+				config.io_devices, false);
+	else
+		CollectCgroupStats(suffix, release.id, release.btime, usage, delta,
+				   config.io_devices, false);
+
+	t = timeline.Finish(ReleaseStage::LOG, t);
+
+	if (archive) {
+		try {
+			archive->Append(path, release.id, release.btime, now, usage);
+			++stats.n_archived;
+		} catch (...) {
+			PrintException(std::current_exception());
 		}
+
+		t = timeline.Finish(ReleaseStage::ARCHIVE, t);
 	}
 
-	// TODO read resource usage right before the cgroup actually gets deleted
-	const auto u = cgroup_fd.IsDefined()
-		? ReadCgroupResourceUsage(cgroup_fd)
-		: CgroupResourceUsage{};
+	if (lua_accounting) {
+		lua_accounting->InvokeCgroupReleased(std::move(release.cgroup_fd), path,
+						     release.id, release.btime,
+						     usage, delta);
+		timeline.Finish(ReleaseStage::LUA, t);
+	} else if (lua_workers) {
+		lua_workers->InvokeCgroupReleased(std::move(release.cgroup_fd), path,
+						  release.id, release.btime,
+						  usage, delta);
+		timeline.Finish(ReleaseStage::LUA, t);
+	}
 
-	CollectCgroupStats(suffix, btime, u);
+	metrics.AddLatency(timeline);
+}
 
-	if (lua_accounting)
-		lua_accounting->InvokeCgroupReleased(std::move(cgroup_fd), path,
-						     btime, u);
+void
+Instance::OnCgroupSample(const char *path, uint_least64_t id,
+			 const std::chrono::system_clock::time_point btime,
+			 const CgroupResourceUsage &usage,
+			 const CgroupResourceUsage &delta) noexcept
+{
+	const auto *scope = config.scopes.Find(path);
+	if (scope == nullptr || !scope->accounting)
+		/* not a managed cgroup (e.g. the scope itself) */
+		return;
 
-	/* defer the deletion, because unpopulated children of this
-	   cgroup may still exist; this deferral attempts to get the
-	   ordering right */
-	cgroup_delete_queue.emplace(path);
+	const char *suffix = scope->GetSuffix(path);
 
-	/* delay deletion somewhat more so the daemon gets the chance
-	   to read statistics */
-	defer_cgroup_delete.Schedule(std::chrono::milliseconds{50});
+	if (journal_sink)
+		SendCgroupStats(*journal_sink, path, suffix,
+				id, btime, usage, delta,
+				config.io_devices, true);
+	else
+		CollectCgroupStats(suffix, id, btime, usage, delta,
+				   config.io_devices, true);
+
+	if (lua_accounting)
+		lua_accounting->InvokeCgroupSampled(path, id, btime,
+						    usage, delta);
+	else if (lua_workers)
+		lua_workers->InvokeCgroupSampled(path, id, btime,
+						 usage, delta);
 }
 
 void
-Instance::OnDeferredCgroupDelete() noexcept
+Instance::OnCgroupReleased(const char *path, PendingRelease &release,
+			   const CgroupResourceUsage &usage,
+			   const CgroupResourceUsage &delta) noexcept
 {
-	/* delete the sorted set in reverse order */
-	for (auto i = cgroup_delete_queue.rbegin();
-	     i != cgroup_delete_queue.rend(); ++i)
-		if (!DestroyCgroup(root_cgroup, i->c_str()))
-			/* the substr(1) strips the leading slash */
-			unified_cgroup_watch->ReAddCgroup(std::string_view{*i}.substr(1));
-
-	cgroup_delete_queue.clear();
+	ReportRelease(path, release, usage, delta);
 }
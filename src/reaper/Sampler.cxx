@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Sampler.hxx"
+#include "UnifiedWatch.hxx"
+#include "Stats.hxx"
+#include "io/FileAt.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::min()
+
+#include <fcntl.h> // for O_RDWR
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * The maximum duration between two timer ticks.  Shorter ticks
+ * spread the reads more evenly at the cost of more wakeups.
+ */
+static constexpr Event::Duration MAX_TICK = std::chrono::seconds{1};
+
+CgroupSampler::CgroupSampler(EventLoop &event_loop,
+			     UnifiedCgroupWatch &_watch,
+			     CgroupSampleHandler &_handler,
+			     ReaperStats &_stats,
+			     Event::Duration _interval,
+			     bool _reset_memory_peak) noexcept
+	:watch(_watch), handler(_handler), stats(_stats),
+	 interval(_interval),
+	 tick(std::min(interval, MAX_TICK)),
+	 timer(event_loop, BIND_THIS_METHOD(OnTimer)),
+	 reset_memory_peak(_reset_memory_peak)
+{
+	timer.Schedule(tick);
+}
+
+CgroupSampler::~CgroupSampler() noexcept = default;
+
+inline void
+CgroupSampler::ReadAndResetMemoryPeak(CgroupSample &sample,
+				      FileDescriptor cgroup_fd,
+				      CgroupResourceUsage &usage) noexcept
+{
+	auto &fd = sample.memory_peak_fd;
+	if (!fd.IsDefined() && !fd.Open({cgroup_fd, "memory.peak"}, O_RDWR))
+		return;
+
+	/* until the first write, this file descriptor sees the
+	   lifetime peak, so the first window begins when the cgroup
+	   was created */
+	std::byte buffer[64];
+	if (const auto nbytes = fd.ReadAt(0, buffer); nbytes > 0)
+		ParseCgroupStatFile(usage, CgroupStatFile::MEMORY_PEAK,
+				    ToStringView(std::span{buffer}.first(nbytes)));
+
+	if (fd.Write(AsBytes("reset\n"sv)) < 0) {
+		/* this kernel (older than 6.12) cannot reset
+		   "memory.peak"; don't try again */
+		fmt::print(stderr, "Failed to reset memory.peak, disabling sample_reset_memory_peak\n");
+		reset_memory_peak = false;
+		fd.Close();
+	}
+}
+
+void
+CgroupSampler::OnTimer() noexcept
+{
+	/* visit as many groups as needed to sample each one once per
+	   interval */
+	const std::size_t n_groups = watch.GetDirectoryCount();
+	const std::size_t n = (n_groups * tick.count() + interval.count() - 1) / interval.count();
+
+	watch.VisitOldestGroups(n, [this](UnifiedCgroupWatch::Group &group){
+		/* in fd budget mode, the directory is reopened
+		   here */
+		UniqueFileDescriptor cgroup_fd_buffer;
+		const FileDescriptor cgroup_fd = group.GetDirectoryFd(cgroup_fd_buffer);
+		auto &stat_files = group.GetStatFiles();
+
+		auto usage = ReadCgroupResourceUsage(cgroup_fd, stat_files);
+
+		const bool first = !group.sample;
+		if (first)
+			group.sample = std::make_unique<CgroupSample>();
+
+		auto &sample = *group.sample;
+
+		if (reset_memory_peak)
+			ReadAndResetMemoryPeak(sample, cgroup_fd, usage);
+
+		const auto delta = first
+			? usage
+			: CalcCgroupResourceDelta(sample.usage, usage);
+
+		++stats.n_samples;
+		handler.OnCgroupSample(group.GetPath().c_str(), group.GetId(),
+				       stat_files.GetBirthTime(cgroup_fd),
+				       usage, delta);
+
+		sample.usage = usage;
+	});
+
+	timer.Schedule(tick);
+}
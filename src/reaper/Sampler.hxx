@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+#include "event/Chrono.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstdint>
+
+class UnifiedCgroupWatch;
+struct ReaperStats;
+
+/**
+ * The state of the live sampling of one cgroup, attached to its
+ * UnifiedCgroupWatch::Group.
+ */
+struct CgroupSample {
+	/**
+	 * The resource usage at the previous sample.
+	 */
+	CgroupResourceUsage usage;
+
+	/**
+	 * A read-write file descriptor of "memory.peak" which gets
+	 * reset after each sample (only if
+	 * ReaperConfig::sample_reset_memory_peak is enabled).  The
+	 * kernel tracks the peak separately for each file
+	 * descriptor which has been written to, so this does not
+	 * affect the lifetime peak reported on release.
+	 */
+	UniqueFileDescriptor memory_peak_fd;
+};
+
+class CgroupSampleHandler {
+public:
+	/**
+	 * A running cgroup has been sampled.
+	 *
+	 * @param path the cgroup path with a leading slash
+	 * @param usage the resource usage now
+	 * @param delta how much was charged since the previous
+	 * sample (or since the cgroup was created if this is the
+	 * first sample)
+	 */
+	virtual void OnCgroupSample(const char *path, uint_least64_t id,
+				    std::chrono::system_clock::time_point btime,
+				    const CgroupResourceUsage &usage,
+				    const CgroupResourceUsage &delta) noexcept = 0;
+};
+
+/**
+ * Periodically reads the resource usage of all cgroups known to
+ * #UnifiedCgroupWatch while they are still running, so the usage of
+ * long-running cgroups becomes visible before they are released.
+ *
+ * The reads are spread over the interval: on each timer tick, the
+ * cgroups which were sampled least recently are read, as many as
+ * needed to visit each cgroup once per interval.  New cgroups are
+ * visited last, therefore cgroups which live shorter than the
+ * interval are usually not sampled at all.
+ */
+class CgroupSampler final {
+	UnifiedCgroupWatch &watch;
+
+	CgroupSampleHandler &handler;
+
+	ReaperStats &stats;
+
+	const Event::Duration interval;
+
+	/**
+	 * The duration between two timer ticks.
+	 */
+	const Event::Duration tick;
+
+	CoarseTimerEvent timer;
+
+	/**
+	 * Reset "memory.peak" after each sample?  This gets cleared
+	 * if the kernel does not support it.
+	 */
+	bool reset_memory_peak;
+
+public:
+	/**
+	 * @param _interval the time between two samples of the same
+	 * cgroup
+	 */
+	CgroupSampler(EventLoop &event_loop, UnifiedCgroupWatch &_watch,
+		      CgroupSampleHandler &_handler, ReaperStats &_stats,
+		      Event::Duration _interval,
+		      bool _reset_memory_peak) noexcept;
+
+	~CgroupSampler() noexcept;
+
+	CgroupSampler(const CgroupSampler &) = delete;
+	CgroupSampler &operator=(const CgroupSampler &) = delete;
+
+private:
+	/**
+	 * Read "memory.peak" through CgroupSample::memory_peak_fd
+	 * (opening it if necessary) and reset it.
+	 */
+	void ReadAndResetMemoryPeak(CgroupSample &sample,
+				    FileDescriptor cgroup_fd,
+				    CgroupResourceUsage &usage) noexcept;
+
+	void OnTimer() noexcept;
+};
@@ -3,15 +3,136 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "Scopes.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "util/IterableSplitString.hxx"
 
-/**
- * These systemd scopes are allocated by our software which uses the
- * process spawner.  Their cgroups are managed by this daemon.
- */
-const char *const managed_scopes[] = {
-	"/system.slice/system-cm4all.slice/bp-spawn.scope/",
-	"/system.slice/system-cm4all.slice/lukko-spawn.scope/",
-	"/system.slice/system-cm4all.slice/workshop-spawn.scope/",
-
-	nullptr,
-};
+#include <cassert>
+
+using std::string_view_literals::operator""sv;
+
+std::string_view
+ManagedScope::GetName() const noexcept
+{
+	std::string_view name{path};
+	if (const auto slash = name.rfind('/'); slash != name.npos)
+		name = name.substr(slash + 1);
+
+	return name;
+}
+
+ManagedScopes
+ManagedScopes::Default()
+{
+	/**
+	 * These systemd scopes are allocated by our software which
+	 * uses the process spawner.
+	 */
+	static constexpr std::string_view default_scopes[] = {
+		"/system.slice/system-cm4all.slice/bp-spawn.scope"sv,
+		"/system.slice/system-cm4all.slice/lukko-spawn.scope"sv,
+		"/system.slice/system-cm4all.slice/workshop-spawn.scope"sv,
+	};
+
+	ManagedScopes scopes;
+	for (const auto path : default_scopes)
+		scopes.Add(ManagedScope{path});
+	return scopes;
+}
+
+ManagedScopes::ManagedScopes(const ManagedScopes &src)
+{
+	for (const auto &scope : src)
+		Add(ManagedScope{scope});
+}
+
+void
+ManagedScopes::Add(ManagedScope &&_scope)
+{
+	if (!_scope.path.starts_with('/') || _scope.path.ends_with('/'))
+		throw FmtRuntimeError("Malformed scope path '{}'", _scope.path);
+
+	/* first pass: validate without modifying the tree */
+
+	const Node *existing = &root;
+
+	for (const auto name : IterableSplitString(_scope.GetRelativePath(), '/')) {
+		if (name.empty() || name == "."sv || name == ".."sv)
+			throw FmtRuntimeError("Malformed scope path '{}'",
+					      _scope.path);
+
+		if (existing == nullptr)
+			continue;
+
+		if (existing->scope != nullptr)
+			throw FmtRuntimeError("Scope '{}' is inside scope '{}'",
+					      _scope.path, existing->scope->path);
+
+		existing = existing->children.Find(name);
+	}
+
+	if (existing != nullptr) {
+		if (existing->scope != nullptr)
+			throw FmtRuntimeError("Duplicate scope '{}'", _scope.path);
+
+		throw FmtRuntimeError("Scope '{}' contains another scope",
+				      _scope.path);
+	}
+
+	/* second pass: insert the nodes; their names point into
+	   the ManagedScope::path of the list item */
+
+	auto &scope = scopes.emplace_back(std::move(_scope));
+
+	Node *node = &root;
+
+	for (const auto name : IterableSplitString(scope.GetRelativePath(), '/')) {
+		const auto hash = decltype(node->children)::Hash(name);
+		Node *child = node->children.Find(name, hash);
+		if (child == nullptr) {
+			child = &nodes.emplace_front(name);
+			node->children.Insert(*child, hash);
+		}
+
+		node = child;
+	}
+
+	assert(node->scope == nullptr);
+	node->scope = &scope;
+}
+
+const ManagedScope *
+ManagedScopes::Get(std::string_view path) const noexcept
+{
+	if (!path.starts_with('/'))
+		return nullptr;
+
+	const Node *node = &root;
+
+	for (const auto name : IterableSplitString(path.substr(1), '/')) {
+		node = node->children.Find(name);
+		if (node == nullptr)
+			return nullptr;
+	}
+
+	return node->scope;
+}
+
+const ManagedScope *
+ManagedScopes::Find(const char *path) const noexcept
+{
+	assert(*path == '/');
+
+	const Node *node = &root;
+
+	for (const auto name : IterableSplitString(path + 1, '/')) {
+		if (node->scope != nullptr)
+			/* this cgroup is below the scope */
+			return node->scope;
+
+		node = node->children.Find(name);
+		if (node == nullptr)
+			return nullptr;
+	}
+
+	return nullptr;
+}
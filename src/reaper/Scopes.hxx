@@ -4,8 +4,186 @@
 
 #pragma once
 
+#include "ChildIndex.hxx"
+#include "event/Chrono.hxx"
+
+#include <cstddef>
+#include <forward_list>
+#include <list>
+#include <string>
+#include <string_view>
+
 /**
- * These systemd scopes are allocated by our software which uses the
- * process spawner.  Their cgroups are managed by this daemon.
+ * A systemd scope allocated by our software which uses the process
+ * spawner.  Its cgroups are managed by this daemon.
  */
-extern const char *const managed_scopes[];
+struct ManagedScope {
+	/**
+	 * The cgroup path with a leading slash and without a
+	 * trailing slash.
+	 */
+	std::string path;
+
+	/**
+	 * Keep empty cgroups at least this long before deleting
+	 * them.
+	 */
+	Event::Duration delete_delay{};
+
+	/**
+	 * Report the resource usage of released cgroups (log,
+	 * archive, metrics, Lua)?  If false, they are only deleted.
+	 */
+	bool accounting = true;
+
+	/**
+	 * The index of this scope in #ReleaseMetrics (see
+	 * ReleaseMetrics::AddScope()).
+	 */
+	std::size_t metrics_index = 0;
+
+	explicit ManagedScope(std::string_view _path) noexcept
+		:path(_path) {}
+
+	/**
+	 * The path relative to the cgroup2 mount (without the
+	 * leading slash).
+	 */
+	std::string_view GetRelativePath() const noexcept {
+		return std::string_view{path}.substr(1);
+	}
+
+	/**
+	 * The name of the systemd scope (e.g. "bp-spawn.scope").
+	 */
+	[[gnu::pure]]
+	std::string_view GetName() const noexcept;
+
+	/**
+	 * Returns the part of the specified cgroup path after the
+	 * scope path and the slash following it.
+	 *
+	 * @param child_path a cgroup path for which Find() has
+	 * returned this scope
+	 */
+	const char *GetSuffix(const char *child_path) const noexcept {
+		return child_path + path.size() + 1;
+	}
+};
+
+/**
+ * The set of all #ManagedScope instances.  They are indexed in a
+ * tree of path segments, which makes the lookup O(path length),
+ * independent of the number of scopes.
+ */
+class ManagedScopes {
+	struct Node;
+
+	struct GetNodeName {
+		std::string_view operator()(const Node &node) const noexcept;
+	};
+
+	struct Node {
+		/**
+		 * The path segment; it points into
+		 * ManagedScope::path.
+		 */
+		std::string_view name;
+
+		ChildIndex<Node, GetNodeName> children;
+
+		/**
+		 * The scope whose path ends at this node (or nullptr
+		 * if this is only an ancestor of scopes).
+		 */
+		const ManagedScope *scope = nullptr;
+
+		Node() noexcept = default;
+
+		explicit Node(std::string_view _name) noexcept
+			:name(_name) {}
+	};
+
+	/**
+	 * The scopes in the order they were added.  This is a linked
+	 * list because the nodes point into it.
+	 */
+	std::list<ManagedScope> scopes;
+
+	/**
+	 * Allocator for all #Node objects (except for #root).
+	 */
+	std::forward_list<Node> nodes;
+
+	Node root;
+
+public:
+	ManagedScopes() noexcept = default;
+
+	/**
+	 * Copy all scopes (for another thread); the index is rebuilt.
+	 */
+	ManagedScopes(const ManagedScopes &src);
+
+	ManagedScopes(ManagedScopes &&) noexcept = default;
+	ManagedScopes &operator=(ManagedScopes &&) noexcept = default;
+
+	/**
+	 * The scopes used if "reaper_settings" does not specify
+	 * any.
+	 */
+	static ManagedScopes Default();
+
+	bool empty() const noexcept {
+		return scopes.empty();
+	}
+
+	auto begin() noexcept {
+		return scopes.begin();
+	}
+
+	auto end() noexcept {
+		return scopes.end();
+	}
+
+	auto begin() const noexcept {
+		return scopes.begin();
+	}
+
+	auto end() const noexcept {
+		return scopes.end();
+	}
+
+	/**
+	 * Add a scope.
+	 *
+	 * Throws if the path is malformed or if it is equal to,
+	 * inside or above an existing scope.
+	 */
+	void Add(ManagedScope &&scope);
+
+	/**
+	 * Look up a scope by its exact path.
+	 *
+	 * @param path the scope path (with a leading slash and
+	 * without a trailing slash)
+	 */
+	[[gnu::pure]]
+	const ManagedScope *Get(std::string_view path) const noexcept;
+
+	/**
+	 * Find the managed scope which contains the specified cgroup.
+	 *
+	 * @param path the cgroup path (with a leading slash)
+	 * @return the scope or nullptr if the cgroup is not managed
+	 * by this daemon (this includes the scope cgroup itself)
+	 */
+	[[gnu::pure]]
+	const ManagedScope *Find(const char *path) const noexcept;
+};
+
+inline std::string_view
+ManagedScopes::GetNodeName::operator()(const Node &node) const noexcept
+{
+	return node.name;
+}
@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Shard.hxx"
+#include "Config.hxx"
+#include "Stats.hxx"
+#include "WatchTrace.hxx"
+#include "event/Loop.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/PrintException.hxx"
+
+#ifdef HAVE_URING
+#include "StatBatch.hxx"
+#endif
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::min()
+#include <vector>
+
+#include <fcntl.h> // for O_DIRECTORY
+
+ReaperShard::ReaperShard(EventLoop &event_loop, FileDescriptor _root_cgroup,
+			 const ReaperConfig &_config, ManagedScopes &&_scopes,
+			 std::size_t shard_index, std::size_t n_shards,
+			 ReaperStats &_stats, ReaperShardHandler &_handler)
+	:root_cgroup(_root_cgroup), config(_config),
+	 stats(_stats), handler(_handler),
+	 scopes(std::move(_scopes)),
+	 defer_collect(event_loop, BIND_THIS_METHOD(OnCollect)),
+	 delete_scheduler(event_loop, root_cgroup, *this, stats)
+{
+	assert(root_cgroup.IsDefined());
+
+	const bool use_inotify =
+		config.empty_detection == ReaperConfig::EmptyDetection::INOTIFY;
+
+	if (!config.watch_trace.empty()) {
+		const auto path = n_shards > 1
+			? fmt::format("{}.{}", config.watch_trace, shard_index)
+			: config.watch_trace;
+		trace = std::make_unique<WatchTraceWriter>(event_loop, path.c_str());
+	}
+
+	/* created after all other fields, because the initial scan
+	   may invoke OnCgroupEmpty() */
+	unified_cgroup_watch = std::make_unique<UnifiedCgroupWatch>(event_loop,
+								    root_cgroup,
+								    use_inotify,
+								    BIND_THIS_METHOD(OnCgroupEmpty));
+	unified_cgroup_watch->SetShard(shard_index, n_shards);
+	unified_cgroup_watch->SetTrace(trace.get());
+
+	if (config.fd_budget)
+		unified_cgroup_watch->EnableFdBudget();
+
+	std::vector<std::string_view> relative_paths;
+	for (const auto &scope : scopes)
+		relative_paths.emplace_back(scope.GetRelativePath());
+
+	unified_cgroup_watch->AddCgroups(relative_paths);
+
+	if (config.sample_interval > Event::Duration{})
+		sampler = std::make_unique<CgroupSampler>(event_loop,
+							  *unified_cgroup_watch,
+							  handler, stats,
+							  config.sample_interval,
+							  config.sample_reset_memory_peak);
+}
+
+ReaperShard::~ReaperShard() noexcept = default;
+
+void
+ReaperShard::ApplyScopes(ManagedScopes &&new_scopes) noexcept
+{
+	/* stop watching the removed scopes first, while their
+	   #ManagedScope objects still exist */
+	for (const auto &scope : scopes) {
+		if (new_scopes.Get(scope.path) == nullptr) {
+			fmt::print(stderr, "Removing scope {}\n", scope.path);
+			unified_cgroup_watch->RemoveCgroup(scope.GetRelativePath());
+		}
+	}
+
+	std::vector<std::string_view> added;
+	for (const auto &scope : new_scopes) {
+		if (scopes.Get(scope.path) == nullptr) {
+			fmt::print(stderr, "Adding scope {}\n", scope.path);
+			added.emplace_back(scope.GetRelativePath());
+		}
+	}
+
+	/* the options of the scopes which were not added or removed
+	   are applied just by replacing the table; moving it does
+	   not move the strings referenced by #added */
+	scopes = std::move(new_scopes);
+
+	if (!added.empty()) {
+		try {
+			unified_cgroup_watch->AddCgroups(added);
+		} catch (...) {
+			PrintException(std::current_exception());
+		}
+	}
+}
+
+void
+ReaperShard::Flush() noexcept
+{
+	sampler.reset();
+
+	defer_collect.Cancel();
+
+#ifdef HAVE_URING
+	if (collect_batch) {
+		/* the kernel may still write into the buffers of
+		   this batch, so it must not be freed; this process
+		   is about to exit, so just leak it and collect its
+		   cgroups synchronously */
+		(void)collect_batch.release();
+
+		collect_queue.splice(collect_queue.begin(), collecting);
+	}
+#endif
+
+	CollectSync();
+
+	/* delete (and report) the cgroups which are still waiting
+	   in the queue; they would not be accounted otherwise */
+	delete_scheduler.FlushAll();
+}
+
+void
+ReaperShard::OnCgroupEmpty(UnifiedCgroupWatch::Group &group,
+			   ReleaseTimeline &timeline) noexcept
+{
+	/* this is the only place where the path string is built */
+	auto path = group.GetPath();
+	const auto *scope = scopes.Find(path.c_str());
+	if (scope == nullptr)
+		return;
+
+	const FileDescriptor cgroup_fd = group.GetDirectoryFd();
+	auto &stat_files = group.GetStatFiles();
+
+	++stats.n_released;
+	stats.release_syscalls_saved += stat_files.GetSavedSyscalls();
+
+	const auto birth_time_start = Event::Clock::now();
+	const auto btime = stat_files.GetBirthTime(cgroup_fd);
+	timeline.Finish(ReleaseStage::BIRTH_TIME, birth_time_start);
+
+	/* the first snapshot (it is used for all values which cannot
+	   be read again right before the cgroup gets deleted) is
+	   read by OnCollect() at the end of this event loop
+	   iteration, together with all other cgroups which have run
+	   empty in this iteration */
+	PendingRelease release{std::move(stat_files), group.GetId(), btime, timeline};
+	release.delete_delay = scope->delete_delay;
+	release.accounting = scope->accounting;
+
+	if (!release.accounting) {
+		/* no first snapshot needed */
+		delete_scheduler.Add(std::move(path), std::move(release));
+		return;
+	}
+
+	/* we need our own readable directory file descriptor (the
+	   one from TreeWatch is O_PATH); reopen it now, while the
+	   TreeWatch file descriptor is known to be valid, so this
+	   needs no path lookup (in fd budget mode, there is none,
+	   and the directory is opened by its path later) */
+	if (cgroup_fd.IsDefined())
+		(void)release.cgroup_fd.Open({cgroup_fd, "."},
+					     O_DIRECTORY|O_RDONLY);
+
+	collect_queue.emplace_back(std::move(path), std::move(release));
+	defer_collect.ScheduleIdle();
+}
+
+void
+ReaperShard::CollectSync() noexcept
+{
+	for (auto &[path, release] : collect_queue) {
+		const auto start = Event::Clock::now();
+
+		if (!release.cgroup_fd.IsDefined())
+			/* fd budget mode (or the reopen in
+			   OnCgroupEmpty() has failed) */
+			(void)release.cgroup_fd.Open({root_cgroup, path.c_str() + 1},
+						     O_DIRECTORY|O_RDONLY);
+
+		release.usage = ReadCgroupResourceUsage(release.cgroup_fd,
+							release.stat_files);
+
+		release.timeline.Finish(ReleaseStage::COLLECT, start);
+	}
+
+	FinishCollect(collect_queue);
+}
+
+#ifdef HAVE_URING
+
+/**
+ * The maximum number of cgroups in one #CgroupStatBatch.  This
+ * limits the memory used for buffers; larger bursts are split into
+ * several batches.
+ */
+static constexpr std::size_t MAX_COLLECT_BATCH = 1024;
+
+inline bool
+ReaperShard::CollectUring(Uring::Queue &queue) noexcept
+{
+	assert(!collect_batch);
+	assert(collecting.empty());
+
+	const std::size_t n = std::min(collect_queue.size(), MAX_COLLECT_BATCH);
+
+	collect_start = Event::Clock::now();
+
+	try {
+		collect_batch = std::make_unique<CgroupStatBatch>(queue, root_cgroup, n,
+								  BIND_THIS_METHOD(OnCollectBatchDone));
+	} catch (...) {
+		PrintException(std::current_exception());
+		return false;
+	}
+
+	collecting.splice(collecting.end(), collect_queue,
+			  collect_queue.begin(),
+			  std::next(collect_queue.begin(), n));
+
+	for (auto &[path, release] : collecting)
+		/* the c_str()+1 strips the leading slash */
+		collect_batch->Add(path.c_str() + 1, release);
+
+	if (!collect_batch->Submit())
+		/* everything was done synchronously */
+		OnCollectBatchDone();
+
+	return true;
+}
+
+void
+ReaperShard::OnCollectBatchDone() noexcept
+{
+	assert(collect_batch);
+
+	collect_batch.reset();
+
+	const auto duration = Event::Clock::now() - collect_start;
+	for (auto &[path, release] : collecting)
+		release.timeline.Add(ReleaseStage::COLLECT, duration);
+
+	FinishCollect(collecting);
+
+	if (!collect_queue.empty())
+		/* more cgroups have run empty meanwhile */
+		defer_collect.ScheduleIdle();
+}
+
+#endif // HAVE_URING
+
+void
+ReaperShard::OnCollect() noexcept
+{
+#ifdef HAVE_URING
+	if (collect_batch)
+		/* wait for the batch to finish; OnCollectBatchDone()
+		   will reschedule */
+		return;
+
+	if (auto *queue = GetEventLoop().GetUring()) {
+		if (CollectUring(*queue))
+			return;
+	}
+#endif
+
+	CollectSync();
+}
+
+void
+ReaperShard::FinishCollect(PendingReleaseList &list) noexcept
+{
+	for (auto &[path, release] : list)
+		/* defer the deletion, because unpopulated children
+		   of this cgroup may still exist; the scheduler
+		   deletes them first */
+		delete_scheduler.Add(std::move(path), std::move(release));
+
+	list.clear();
+}
+
+void
+ReaperShard::OnCgroupDeleted(const char *path, PendingRelease &release,
+			     const CgroupResourceUsage &usage) noexcept
+{
+	if (!release.accounting)
+		return;
+
+	handler.OnCgroupReleased(path, release, usage,
+				 CalcCgroupResourceDelta(release.usage, usage));
+}
+
+void
+ReaperShard::OnCgroupBusy(std::string_view path) noexcept
+{
+	/* re-add so we can receive events when it's empty again;
+	   the substr(1) strips the leading slash */
+	unified_cgroup_watch->ReAddCgroup(path.substr(1));
+}
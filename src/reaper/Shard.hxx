@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "DeleteScheduler.hxx"
+#include "PendingRelease.hxx"
+#include "Sampler.hxx"
+#include "Scopes.hxx"
+#include "UnifiedWatch.hxx"
+#include "event/DeferEvent.hxx"
+#include "io/FileDescriptor.hxx"
+#include "config.h"
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+struct ReaperConfig;
+struct ReaperStats;
+class CgroupStatBatch;
+class WatchTraceWriter;
+namespace Uring { class Queue; }
+
+class ReaperShardHandler : public CgroupSampleHandler {
+public:
+	/**
+	 * A cgroup has been deleted; its resource usage shall be
+	 * reported.
+	 *
+	 * @param path the cgroup path with a leading slash
+	 * @param usage the final snapshot of the resource usage
+	 * @param delta the difference between the first and the
+	 * final snapshot
+	 */
+	virtual void OnCgroupReleased(const char *path, PendingRelease &release,
+				      const CgroupResourceUsage &usage,
+				      const CgroupResourceUsage &delta) noexcept = 0;
+};
+
+/**
+ * Watches the managed scopes (or a part of them, see
+ * ReaperConfig::shards), collects the resource usage of cgroups
+ * which have run empty and deletes them.  Everything happens in the
+ * thread of the given #EventLoop; the releases are passed to the
+ * #ReaperShardHandler.
+ */
+class ReaperShard final : CgroupDeleteHandler {
+	const FileDescriptor root_cgroup;
+
+	const ReaperConfig &config;
+
+	ReaperStats &stats;
+
+	ReaperShardHandler &handler;
+
+	/**
+	 * This shard's copy of the managed scopes.
+	 */
+	ManagedScopes scopes;
+
+	/**
+	 * Only used if ReaperConfig::watch_trace is set.  It is
+	 * declared before #unified_cgroup_watch, which uses it.
+	 */
+	std::unique_ptr<WatchTraceWriter> trace;
+
+	std::unique_ptr<UnifiedCgroupWatch> unified_cgroup_watch;
+
+	/**
+	 * Only used if ReaperConfig::sample_interval is set.
+	 */
+	std::unique_ptr<CgroupSampler> sampler;
+
+	using PendingReleaseList = std::list<std::pair<std::string, PendingRelease>>;
+
+	/**
+	 * Cgroups which have run empty during the current event loop
+	 * iteration.  Their first snapshot is read by OnCollect() in
+	 * one batch.  The first element of each pair is the cgroup
+	 * path with a leading slash.
+	 */
+	PendingReleaseList collect_queue;
+	DeferEvent defer_collect;
+
+#ifdef HAVE_URING
+	/**
+	 * The cgroups being collected by #collect_batch.  This list
+	 * must not be modified until the batch has finished.
+	 */
+	PendingReleaseList collecting;
+
+	std::unique_ptr<CgroupStatBatch> collect_batch;
+
+	/**
+	 * When was #collect_batch started?
+	 */
+	Event::TimePoint collect_start;
+#endif
+
+	/**
+	 * Cgroups which have been collected and are waiting to be
+	 * deleted.
+	 */
+	CgroupDeleteScheduler delete_scheduler;
+
+public:
+	/**
+	 * Start watching the scopes (this performs the initial
+	 * scan).
+	 *
+	 * @param shard_index the index of this shard (see
+	 * UnifiedCgroupWatch::SetShard())
+	 * @param n_shards the total number of shards (1 if there is
+	 * only this one)
+	 *
+	 * Throws on error.
+	 */
+	ReaperShard(EventLoop &event_loop, FileDescriptor _root_cgroup,
+		    const ReaperConfig &_config, ManagedScopes &&_scopes,
+		    std::size_t shard_index, std::size_t n_shards,
+		    ReaperStats &_stats, ReaperShardHandler &_handler);
+
+	~ReaperShard() noexcept;
+
+	ReaperShard(const ReaperShard &) = delete;
+	ReaperShard &operator=(const ReaperShard &) = delete;
+
+	EventLoop &GetEventLoop() const noexcept {
+		return defer_collect.GetEventLoop();
+	}
+
+	std::size_t GetDirectoryCount() const noexcept {
+		return unified_cgroup_watch->GetDirectoryCount();
+	}
+
+	std::size_t GetWatchCount() const noexcept {
+		return unified_cgroup_watch->GetWatchCount();
+	}
+
+	/**
+	 * Replace the managed scopes.  Only the scopes which were
+	 * added or removed are applied to the #UnifiedCgroupWatch;
+	 * the subtrees of all other scopes are not touched.
+	 */
+	void ApplyScopes(ManagedScopes &&new_scopes) noexcept;
+
+	/**
+	 * Collect and delete all cgroups which have run empty,
+	 * synchronously, and stop sampling.  This is called before
+	 * the process exits.
+	 */
+	void Flush() noexcept;
+
+private:
+	void OnCgroupEmpty(UnifiedCgroupWatch::Group &group,
+			   ReleaseTimeline &timeline) noexcept;
+
+	/**
+	 * Read the first snapshot of all cgroups in #collect_queue,
+	 * either synchronously or with one io_uring submission.
+	 */
+	void OnCollect() noexcept;
+
+	/**
+	 * Read the first snapshot of all cgroups in #collect_queue
+	 * synchronously (fallback if io_uring is not available).
+	 */
+	void CollectSync() noexcept;
+
+	/**
+	 * Move the collected cgroups into #delete_scheduler.
+	 */
+	void FinishCollect(PendingReleaseList &list) noexcept;
+
+#ifdef HAVE_URING
+	/**
+	 * Start a #CgroupStatBatch for (the first part of)
+	 * #collect_queue.
+	 *
+	 * @return false if io_uring could not be used
+	 */
+	bool CollectUring(Uring::Queue &queue) noexcept;
+
+	void OnCollectBatchDone() noexcept;
+#endif
+
+	/* virtual methods from CgroupDeleteHandler */
+	void OnCgroupDeleted(const char *path, PendingRelease &release,
+			     const CgroupResourceUsage &usage) noexcept override;
+	void OnCgroupBusy(std::string_view path) noexcept override;
+};
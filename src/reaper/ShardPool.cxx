@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "ShardPool.hxx"
+#include "Shard.hxx"
+#include "Config.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "system/Error.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "util/SpanCast.hxx"
+#include "config.h"
+
+#ifdef HAVE_URING
+#include <liburing.h> // for IORING_SETUP_*
+#endif
+
+#include <fmt/core.h>
+
+#include <list>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+using std::chrono_literals::operator""s;
+using std::chrono_literals::operator""ms;
+
+/**
+ * The objects owned by the worker thread.
+ */
+class ShardWorker::Context final : ReaperShardHandler {
+	/**
+	 * How often are the counters copied to the #ShardWorker?
+	 */
+	static constexpr Event::Duration PUBLISH_INTERVAL = 1s;
+
+	ShardWorker &worker;
+
+	EventLoop event_loop;
+
+	PipeEvent wakeup_event;
+
+	CoarseTimerEvent publish_timer;
+
+	ReaperStats stats;
+
+	ReaperShard shard;
+
+	/**
+	 * Releases which did not fit into the #ShardPool queue.  They
+	 * are never dropped (the cgroups have already been deleted);
+	 * FlushOverflow() retries them when the main thread has made
+	 * room.
+	 */
+	std::list<ShardReport> overflow;
+
+public:
+	/**
+	 * Throws on error.
+	 */
+	Context(ShardWorker &_worker, ManagedScopes &&scopes)
+		:worker(_worker),
+		 wakeup_event(event_loop, BIND_THIS_METHOD(OnWakeup),
+			      worker.wakeup_fd),
+		 publish_timer(event_loop, BIND_THIS_METHOD(OnPublishTimer)),
+		 shard(event_loop, worker.root_cgroup, worker.config,
+		       std::move(scopes),
+		       worker.index, worker.config.shards,
+		       stats, *this)
+	{
+#ifdef HAVE_URING
+		try {
+			event_loop.EnableUring(4096, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+		} catch (...) {
+			fmt::print(stderr, "Failed to initialize io_uring: {}\n",
+				   std::current_exception());
+		}
+#endif
+
+		PublishStats();
+	}
+
+	void Run() noexcept {
+		wakeup_event.ScheduleRead();
+		publish_timer.Schedule(PUBLISH_INTERVAL);
+		event_loop.Run();
+	}
+
+private:
+	/**
+	 * Copy the counters to the #ShardWorker, where the main
+	 * thread can read them.
+	 */
+	void PublishStats() noexcept {
+		const std::scoped_lock lock{worker.mutex};
+		worker.stats = stats;
+		worker.n_directories = shard.GetDirectoryCount();
+		worker.n_watches = shard.GetWatchCount();
+	}
+
+	void OnPublishTimer() noexcept {
+		/* just in case a wakeup from the main thread was
+		   missed */
+		FlushOverflow();
+
+		PublishStats();
+		publish_timer.Schedule(PUBLISH_INTERVAL);
+	}
+
+	/**
+	 * Pass a report to the #ShardPool.  Releases which do not
+	 * fit into its queue are moved to #overflow; samples are
+	 * dropped instead.
+	 */
+	void Report(ShardReport &&report) noexcept;
+
+	/**
+	 * Push as many reports from #overflow as possible.
+	 *
+	 * @return true if #overflow is empty now
+	 */
+	bool FlushOverflow() noexcept;
+
+	void OnWakeup(unsigned events) noexcept;
+
+	/* virtual methods from ReaperShardHandler */
+	void OnCgroupReleased(const char *path, PendingRelease &release,
+			      const CgroupResourceUsage &usage,
+			      const CgroupResourceUsage &delta) noexcept override {
+		const auto id = release.id;
+		const auto btime = release.btime;
+		Report({
+			.path = path,
+			.release = std::move(release),
+			.id = id,
+			.btime = btime,
+			.usage = usage,
+			.delta = delta,
+		});
+	}
+
+	void OnCgroupSample(const char *path, uint_least64_t id,
+			    std::chrono::system_clock::time_point btime,
+			    const CgroupResourceUsage &usage,
+			    const CgroupResourceUsage &delta) noexcept override {
+		Report({
+			.path = path,
+			.release = std::nullopt,
+			.id = id,
+			.btime = btime,
+			.usage = usage,
+			.delta = delta,
+		});
+	}
+};
+
+void
+ShardWorker::Context::Report(ShardReport &&report) noexcept
+{
+	/* preserve the order of the releases: nothing may overtake
+	   the ones waiting in #overflow */
+	if (overflow.empty() && worker.Push(std::move(report)))
+		return;
+
+	if (!report.release) {
+		/* the next sample supersedes this one */
+		++worker.n_dropped;
+		return;
+	}
+
+	overflow.emplace_back(std::move(report));
+	worker.n_overflow = overflow.size();
+
+	if (!worker.overflow_pending.exchange(true))
+		/* the main thread may have drained the queue
+		   before the flag was set, so try again right
+		   away */
+		FlushOverflow();
+}
+
+bool
+ShardWorker::Context::FlushOverflow() noexcept
+{
+	while (!overflow.empty()) {
+		if (!worker.Push(std::move(overflow.front()))) {
+			worker.n_overflow = overflow.size();
+			return false;
+		}
+
+		overflow.pop_front();
+	}
+
+	worker.n_overflow = 0;
+	worker.overflow_pending = false;
+	return true;
+}
+
+void
+ShardWorker::Context::OnWakeup(unsigned) noexcept
+{
+	uint64_t value;
+	(void)worker.wakeup_fd.Read(ReferenceAsWritableBytes(value));
+
+	/* clear the flag before looking at the commands, so a
+	   command submitted from now on signals the eventfd again */
+	worker.wakeup_pending = false;
+
+	std::optional<ManagedScopes> scopes;
+
+	{
+		const std::scoped_lock lock{worker.mutex};
+		scopes.swap(worker.new_scopes);
+	}
+
+	if (scopes)
+		shard.ApplyScopes(std::move(*scopes));
+
+	FlushOverflow();
+
+	if (worker.exit_requested) {
+		shard.Flush();
+
+		/* while the worker threads exit, the main thread
+		   drains the queue (see ~ShardPool()) */
+		while (!FlushOverflow())
+			std::this_thread::yield();
+
+		PublishStats();
+
+		wakeup_event.Cancel();
+		publish_timer.Cancel();
+		event_loop.Break();
+	}
+}
+
+ShardWorker::ShardWorker(ShardPool &_pool, FileDescriptor _root_cgroup,
+			 const ReaperConfig &_config,
+			 std::size_t _index, ManagedScopes &&scopes)
+	:pool(_pool), root_cgroup(_root_cgroup), config(_config),
+	 index(_index),
+	 wakeup_fd(AdoptTag{}, eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))
+{
+	if (!wakeup_fd.IsDefined())
+		throw MakeErrno("eventfd() failed");
+
+	thread = std::jthread{[this, scopes = std::move(scopes)]() mutable {
+		Run(std::move(scopes));
+	}};
+}
+
+ShardWorker::~ShardWorker() noexcept
+{
+	RequestExit();
+
+	thread.join();
+}
+
+void
+ShardWorker::Wake() noexcept
+{
+	if (!wakeup_pending.exchange(true)) {
+		static constexpr uint64_t one = 1;
+		(void)wakeup_fd.Write(ReferenceAsBytes(one));
+	}
+}
+
+void
+ShardWorker::ApplyScopes(ManagedScopes &&scopes) noexcept
+{
+	{
+		const std::scoped_lock lock{mutex};
+		new_scopes = std::move(scopes);
+	}
+
+	Wake();
+}
+
+bool
+ShardWorker::Push(ShardReport &&report) noexcept
+{
+	if (!pool.Push(std::move(report)))
+		return false;
+
+	++n_reports;
+	return true;
+}
+
+void
+ShardWorker::LogStats() const noexcept
+{
+	const std::scoped_lock lock{mutex};
+
+	fmt::print(stderr, "shard {}: directories={} released={} deleted={} delete_queue={}/{} reports={} overflow={} dropped={}\n",
+		   index, n_directories,
+		   stats.n_released, stats.n_deleted,
+		   stats.delete_queue_size, stats.delete_queue_max,
+		   n_reports.load(), n_overflow.load(), n_dropped.load());
+}
+
+void
+ShardWorker::Run(ManagedScopes &&scopes) noexcept
+{
+	/* all signals are handled by the main thread */
+	sigset_t mask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	std::unique_ptr<Context> context;
+
+	try {
+		context = std::make_unique<Context>(*this, std::move(scopes));
+	} catch (...) {
+		done = true;
+		ready.set_exception(std::current_exception());
+		return;
+	}
+
+	ready.set_value();
+
+	context->Run();
+	context.reset();
+
+	done = true;
+}
+
+ShardPool::ShardPool(EventLoop &event_loop, FileDescriptor root_cgroup,
+		     const ReaperConfig &config,
+		     ReaperShardHandler &_handler)
+	:handler(_handler),
+	 wakeup_fd(AdoptTag{}, eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)),
+	 wakeup_event(event_loop, BIND_THIS_METHOD(OnWakeup), wakeup_fd)
+{
+	if (!wakeup_fd.IsDefined())
+		throw MakeErrno("eventfd() failed");
+
+	/* the initial scans run in parallel */
+	workers.reserve(config.shards);
+	for (std::size_t i = 0; i < config.shards; ++i)
+		workers.emplace_back(std::make_unique<ShardWorker>(*this, root_cgroup,
+								   config, i,
+								   ManagedScopes{config.scopes}));
+
+	for (auto &i : workers)
+		i->WaitReady();
+
+	wakeup_event.ScheduleRead();
+}
+
+ShardPool::~ShardPool() noexcept
+{
+	for (auto &i : workers)
+		i->RequestExit();
+
+	/* the workers report all cgroups they flush, which may be
+	   more than the queue can hold, so drain it while waiting */
+	for (const auto &i : workers) {
+		while (!i->IsDone()) {
+			Drain();
+			std::this_thread::sleep_for(1ms);
+		}
+	}
+
+	workers.clear();
+
+	Drain();
+
+	wakeup_event.Cancel();
+}
+
+void
+ShardPool::ApplyScopes(const ManagedScopes &scopes) noexcept
+{
+	for (auto &i : workers)
+		i->ApplyScopes(ManagedScopes{scopes});
+}
+
+std::size_t
+ShardPool::GetDirectoryCount() const noexcept
+{
+	std::size_t n = 0;
+	for (const auto &i : workers)
+		n += i->GetDirectoryCount();
+	return n;
+}
+
+std::size_t
+ShardPool::GetWatchCount() const noexcept
+{
+	std::size_t n = 0;
+	for (const auto &i : workers)
+		n += i->GetWatchCount();
+	return n;
+}
+
+void
+ShardPool::LogStats() const noexcept
+{
+	for (const auto &i : workers)
+		i->LogStats();
+}
+
+bool
+ShardPool::Push(ShardReport &&report) noexcept
+{
+	if (!queue.Push(std::move(report)))
+		return false;
+
+	if (!wakeup_pending.exchange(true)) {
+		static constexpr uint64_t one = 1;
+		(void)wakeup_fd.Write(ReferenceAsBytes(one));
+	}
+
+	return true;
+}
+
+void
+ShardPool::OnWakeup(unsigned) noexcept
+{
+	uint64_t value;
+	(void)wakeup_fd.Read(ReferenceAsWritableBytes(value));
+
+	/* clear the flag before looking at the queue, so a report
+	   pushed from now on signals the eventfd again */
+	wakeup_pending = false;
+
+	Drain();
+}
+
+void
+ShardPool::Drain() noexcept
+{
+	while (auto report = queue.Pop()) {
+		if (report->release)
+			handler.OnCgroupReleased(report->path.c_str(),
+						 *report->release,
+						 report->usage, report->delta);
+		else
+			handler.OnCgroupSample(report->path.c_str(),
+					       report->id, report->btime,
+					       report->usage, report->delta);
+	}
+
+	for (auto &i : workers)
+		i->OnQueueDrained();
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "MpscQueue.hxx"
+#include "PendingRelease.hxx"
+#include "Scopes.hxx"
+#include "Stats.hxx"
+#include "event/PipeEvent.hxx"
+#include "io/FileDescriptor.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ReaperConfig;
+class ShardPool;
+class ReaperShardHandler;
+
+/**
+ * A released cgroup (or a live sample) handed over from a
+ * #ShardWorker to the main thread.
+ */
+struct ShardReport {
+	/**
+	 * The cgroup path with a leading slash.
+	 */
+	std::string path;
+
+	/**
+	 * Only set for releases, not for samples.
+	 */
+	std::optional<PendingRelease> release;
+
+	uint_least64_t id;
+	std::chrono::system_clock::time_point btime;
+	CgroupResourceUsage usage, delta;
+};
+
+/**
+ * A thread with its own #EventLoop and #ReaperShard.  The shard's
+ * releases are passed to the #ShardPool.
+ */
+class ShardWorker final {
+	ShardPool &pool;
+
+	const FileDescriptor root_cgroup;
+
+	const ReaperConfig &config;
+
+	/**
+	 * The index of this shard (see UnifiedCgroupWatch::SetShard()).
+	 */
+	const std::size_t index;
+
+	/**
+	 * An eventfd which wakes up the worker thread.
+	 */
+	UniqueFileDescriptor wakeup_fd;
+
+	/**
+	 * Has #wakeup_fd been signalled and the worker thread not
+	 * yet woken up?  This avoids one write() per command.
+	 */
+	std::atomic_bool wakeup_pending{false};
+
+	std::atomic_bool exit_requested{false};
+
+	/**
+	 * Has the worker thread finished (after flushing its shard)?
+	 */
+	std::atomic_bool done{false};
+
+	/**
+	 * Protects #new_scopes, #stats, #n_directories and
+	 * #n_watches.
+	 */
+	mutable std::mutex mutex;
+
+	/**
+	 * Scopes to be applied by the worker thread (see
+	 * ReaperShard::ApplyScopes()).
+	 */
+	std::optional<ManagedScopes> new_scopes;
+
+	/**
+	 * A copy of the shard's counters; it is updated by the worker
+	 * thread periodically.
+	 */
+	ReaperStats stats;
+
+	/**
+	 * The number of directories watched by the shard; it is
+	 * updated together with #stats.
+	 */
+	std::size_t n_directories = 0;
+
+	/**
+	 * The number of inotify watches registered by the shard; it
+	 * is updated together with #stats.
+	 */
+	std::size_t n_watches = 0;
+
+	/**
+	 * The number of reports passed to the #ShardPool and the
+	 * number of samples which were dropped because its queue was
+	 * full.
+	 */
+	std::atomic<uint_least64_t> n_reports{0}, n_dropped{0};
+
+	/**
+	 * The number of releases which did not fit into the
+	 * #ShardPool queue and are waiting in the worker thread.
+	 */
+	std::atomic_size_t n_overflow{0};
+
+	/**
+	 * Set by the worker thread while it has releases which did
+	 * not fit into the #ShardPool queue; the main thread wakes it
+	 * up after draining the queue (see OnQueueDrained()).
+	 */
+	std::atomic_bool overflow_pending{false};
+
+	class Context;
+
+	std::promise<void> ready;
+	std::future<void> ready_future = ready.get_future();
+
+	std::jthread thread;
+
+public:
+	/**
+	 * Start the thread; it performs the initial scan of the
+	 * scopes.
+	 *
+	 * Throws on error.
+	 */
+	ShardWorker(ShardPool &_pool, FileDescriptor _root_cgroup,
+		    const ReaperConfig &_config,
+		    std::size_t _index, ManagedScopes &&scopes);
+
+	/**
+	 * Stop the thread (see RequestExit()) and wait for it.
+	 */
+	~ShardWorker() noexcept;
+
+	ShardWorker(const ShardWorker &) = delete;
+	ShardWorker &operator=(const ShardWorker &) = delete;
+
+	/**
+	 * Wait until the initial scan has finished.
+	 *
+	 * Throws if the thread has failed to start.
+	 */
+	void WaitReady() {
+		ready_future.get();
+	}
+
+	/**
+	 * Ask the worker thread to collect and delete all empty
+	 * cgroups and to exit (asynchronously).  Before it exits, the
+	 * worker thread waits for the main thread to make room for
+	 * all remaining releases in the #ShardPool queue.
+	 */
+	void RequestExit() noexcept {
+		exit_requested = true;
+		Wake();
+	}
+
+	bool IsDone() const noexcept {
+		return done;
+	}
+
+	/**
+	 * Pass new scopes to the worker thread (asynchronously).
+	 */
+	void ApplyScopes(ManagedScopes &&scopes) noexcept;
+
+	/**
+	 * The main thread has drained the #ShardPool queue.  Wake up
+	 * the worker thread if it has releases waiting for room.
+	 */
+	void OnQueueDrained() noexcept {
+		if (overflow_pending)
+			Wake();
+	}
+
+	std::size_t GetDirectoryCount() const noexcept {
+		const std::scoped_lock lock{mutex};
+		return n_directories;
+	}
+
+	std::size_t GetWatchCount() const noexcept {
+		const std::scoped_lock lock{mutex};
+		return n_watches;
+	}
+
+	void AddStats(ReaperStats &dest) const noexcept {
+		const std::scoped_lock lock{mutex};
+		dest.AddShard(stats);
+	}
+
+	/**
+	 * Log the counters of this shard to stderr.
+	 */
+	void LogStats() const noexcept;
+
+private:
+	void Wake() noexcept;
+
+	/**
+	 * Called by the worker thread.
+	 *
+	 * @return false if the #ShardPool queue is full
+	 */
+	bool Push(ShardReport &&report) noexcept;
+
+	void Run(ManagedScopes &&scopes) noexcept;
+};
+
+/**
+ * Distributes the children of all managed scopes among multiple
+ * #ShardWorker threads (see ReaperConfig::shards) by a hash of their
+ * names.  The workers detect empty cgroups, collect their resource
+ * usage and delete them; the reports are passed to the
+ * #ReaperShardHandler in the main thread through one lock-free
+ * queue.
+ */
+class ShardPool final {
+	friend class ShardWorker;
+
+	/**
+	 * The capacity of #queue.
+	 */
+	static constexpr std::size_t QUEUE_SIZE = 4096;
+
+	ReaperShardHandler &handler;
+
+	MpscQueue<ShardReport> queue{QUEUE_SIZE};
+
+	/**
+	 * An eventfd which wakes up the main thread.
+	 */
+	UniqueFileDescriptor wakeup_fd;
+
+	/**
+	 * Has #wakeup_fd been signalled and the main thread not yet
+	 * woken up?  This avoids one write() per report.
+	 */
+	std::atomic_bool wakeup_pending{false};
+
+	PipeEvent wakeup_event;
+
+	std::vector<std::unique_ptr<ShardWorker>> workers;
+
+public:
+	/**
+	 * Start all threads and wait until they have finished their
+	 * initial scan.
+	 *
+	 * Throws on error.
+	 */
+	ShardPool(EventLoop &event_loop, FileDescriptor root_cgroup,
+		  const ReaperConfig &config,
+		  ReaperShardHandler &_handler);
+
+	/**
+	 * Stop all threads and pass their remaining reports to the
+	 * handler.
+	 */
+	~ShardPool() noexcept;
+
+	ShardPool(const ShardPool &) = delete;
+	ShardPool &operator=(const ShardPool &) = delete;
+
+	/**
+	 * Pass a copy of the new scopes to each shard.
+	 */
+	void ApplyScopes(const ManagedScopes &scopes) noexcept;
+
+	std::size_t GetDirectoryCount() const noexcept;
+
+	/**
+	 * Returns the number of inotify watches of all shards (as of
+	 * their last update).
+	 */
+	std::size_t GetWatchCount() const noexcept;
+
+	void AddStats(ReaperStats &dest) const noexcept {
+		for (const auto &i : workers)
+			i->AddStats(dest);
+	}
+
+	/**
+	 * Log the counters of each shard to stderr.
+	 */
+	void LogStats() const noexcept;
+
+private:
+	/**
+	 * Add a report to the queue.  May be called by any thread.
+	 *
+	 * @return false if the queue is full
+	 */
+	bool Push(ShardReport &&report) noexcept;
+
+	void OnWakeup(unsigned events) noexcept;
+
+	/**
+	 * Pass all queued reports to the handler.
+	 */
+	void Drain() noexcept;
+};
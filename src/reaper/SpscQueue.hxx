@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+/**
+ * A lock-free bounded queue with exactly one producer thread and
+ * exactly one consumer thread.
+ */
+template<typename T>
+class SpscQueue {
+	const std::unique_ptr<std::optional<T>[]> slots;
+
+	const std::size_t mask;
+
+	/**
+	 * The number of items pushed so far; only modified by the
+	 * producer.
+	 */
+	alignas(64) std::atomic_size_t head{0};
+
+	/**
+	 * The number of items popped so far; only modified by the
+	 * consumer.
+	 */
+	alignas(64) std::atomic_size_t tail{0};
+
+public:
+	/**
+	 * @param capacity the maximum number of items; must be a
+	 * power of two
+	 */
+	explicit SpscQueue(std::size_t capacity)
+		:slots(new std::optional<T>[capacity]),
+		 mask(capacity - 1)
+	{
+		assert(std::has_single_bit(capacity));
+	}
+
+	SpscQueue(const SpscQueue &) = delete;
+	SpscQueue &operator=(const SpscQueue &) = delete;
+
+	/**
+	 * Add an item at the end.  May only be called by the
+	 * producer.
+	 *
+	 * @return false if the queue is full (and #value was not
+	 * moved)
+	 */
+	bool Push(T &&value) noexcept {
+		const std::size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask)
+			return false;
+
+		slots[h & mask].emplace(std::move(value));
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Remove the first item.  May only be called by the
+	 * consumer.
+	 */
+	std::optional<T> Pop() noexcept {
+		const std::size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return std::nullopt;
+
+		auto &slot = slots[t & mask];
+		std::optional<T> value{std::move(slot)};
+		slot.reset();
+
+		tail.store(t + 1, std::memory_order_release);
+		return value;
+	}
+};
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "StatBatch.hxx"
+#include "PendingRelease.hxx"
+#include "io/uring/Queue.hxx"
+#include "util/PrintException.hxx"
+#include "util/SpanCast.hxx"
+
+#include <liburing.h>
+
+#include <cassert>
+
+#include <fcntl.h> // for O_DIRECTORY
+
+inline std::byte *
+CgroupStatBatch::Item::GetBuffer(CgroupStatFile file) noexcept
+{
+	std::byte *p = buffer;
+	for (std::size_t i = 0; i < static_cast<std::size_t>(file); ++i)
+		p += buffer_sizes[i];
+	return p;
+}
+
+void
+CgroupStatBatch::OpenOperation::OnUringCompletion(int res) noexcept
+{
+	if (res >= 0)
+		item->release->cgroup_fd = UniqueFileDescriptor{AdoptTag{}, res};
+
+	item->OnOperationDone();
+}
+
+void
+CgroupStatBatch::ReadOperation::OnUringCompletion(int res) noexcept
+{
+	const std::size_t size = buffer_sizes[static_cast<std::size_t>(file)];
+
+	if (res > 0) {
+		if (static_cast<std::size_t>(res) >= size)
+			/* might be truncated; read the file again
+			   with a larger buffer in Item::Finish() */
+			truncated = true;
+		else
+			ParseCgroupStatFile(item->release->usage, file,
+					    ToStringView(std::span{item->GetBuffer(file), static_cast<std::size_t>(res)}));
+	}
+
+	item->OnOperationDone();
+}
+
+inline void
+CgroupStatBatch::Item::OnOperationDone() noexcept
+{
+	assert(n_pending > 0);
+
+	if (--n_pending > 0)
+		return;
+
+	Finish();
+	batch->OnItemFinished();
+}
+
+void
+CgroupStatBatch::Item::Finish() noexcept
+{
+	if (!open.IsSubmitted() && !release->cgroup_fd.IsDefined())
+		(void)release->cgroup_fd.Open({batch->root_cgroup, relative_path},
+					      O_DIRECTORY|O_RDONLY);
+
+	for (const auto &read : reads)
+		if (read.NeedsSyncRead())
+			ReadCgroupStatFile(release->usage, release->cgroup_fd,
+					   release->stat_files,
+					   static_cast<CgroupStatFile>(&read - reads.data()));
+}
+
+CgroupStatBatch::CgroupStatBatch(Uring::Queue &_queue,
+				 FileDescriptor _root_cgroup,
+				 std::size_t _capacity, Callback _callback)
+	:queue(_queue), root_cgroup(_root_cgroup), callback(_callback),
+	 items(std::make_unique_for_overwrite<Item[]>(_capacity)),
+	 capacity(_capacity)
+{
+}
+
+CgroupStatBatch::~CgroupStatBatch() noexcept
+{
+	/* the kernel would write into the buffers of pending
+	   operations */
+	assert(!IsBusy() || n_items == 0);
+}
+
+void
+CgroupStatBatch::Add(const char *relative_path,
+		     PendingRelease &release) noexcept
+{
+	assert(n_items < capacity);
+	assert(n_pending > 0);
+
+	auto &item = items[n_items++];
+	item.batch = this;
+	item.relative_path = relative_path;
+	item.release = &release;
+	item.n_pending = 0;
+	item.open.Init(item);
+
+	for (std::size_t i = 0; i < item.reads.size(); ++i)
+		item.reads[i].Init(item, static_cast<CgroupStatFile>(i));
+
+	try {
+		if (!release.cgroup_fd.IsDefined()) {
+			/* the cgroup directory was not reopened
+			   by ReaperShard::OnCgroupEmpty() (fd
+			   budget mode): open it by its path; this
+			   uses the root cgroup and not the
+			   TreeWatch file descriptor, because the
+			   latter may be closed before the kernel
+			   gets to this operation */
+			auto &open_sqe = queue.RequireSubmitEntry();
+			io_uring_prep_openat(&open_sqe, root_cgroup.Get(), relative_path,
+					     O_DIRECTORY|O_RDONLY|O_CLOEXEC, 0);
+			queue.Push(open_sqe, item.open);
+			item.open.SetSubmitted();
+			++item.n_pending;
+		}
+
+		for (std::size_t i = 0; i < item.reads.size(); ++i) {
+			const auto file = static_cast<CgroupStatFile>(i);
+			const FileDescriptor fd = release.stat_files.Get(file);
+			if (!fd.IsDefined())
+				/* not pre-opened: will be read by
+				   Item::Finish() */
+				continue;
+
+			auto &read = item.reads[i];
+			auto &sqe = queue.RequireSubmitEntry();
+			io_uring_prep_read(&sqe, fd.Get(), item.GetBuffer(file),
+					   buffer_sizes[i], 0);
+			queue.Push(sqe, read);
+			read.SetSubmitted();
+			++item.n_pending;
+		}
+	} catch (...) {
+		/* the submission queue is broken; do the rest
+		   synchronously in Item::Finish() */
+		PrintException(std::current_exception());
+	}
+
+	if (item.n_pending > 0)
+		++n_pending;
+	else
+		item.Finish();
+}
+
+bool
+CgroupStatBatch::Submit() noexcept
+{
+	assert(n_pending > 0);
+
+	try {
+		queue.Submit();
+	} catch (...) {
+		/* the prepared entries remain in the submission
+		   queue and will be submitted by the next
+		   io_uring_submit() call */
+		PrintException(std::current_exception());
+	}
+
+	/* release the reference held by the constructor */
+	--n_pending;
+	return IsBusy();
+}
+
+inline void
+CgroupStatBatch::OnItemFinished() noexcept
+{
+	assert(n_pending > 0);
+
+	if (--n_pending == 0)
+		callback();
+}
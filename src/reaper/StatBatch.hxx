@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "CgroupAccounting.hxx"
+#include "io/FileDescriptor.hxx"
+#include "io/uring/Operation.hxx"
+#include "util/BindMethod.hxx"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+
+namespace Uring { class Queue; }
+struct PendingRelease;
+
+/**
+ * Read the first snapshot of many released cgroups with one
+ * io_uring submission: for each cgroup, one IORING_OP_READ per
+ * pre-opened statistics file, and one IORING_OP_OPENAT (which
+ * opens the cgroup directory for the Lua handler) only if
+ * PendingRelease::cgroup_fd has not been opened already.  The
+ * results are parsed into PendingRelease::usage as they complete.
+ *
+ * Statistics files which were not pre-opened (and files which did
+ * not fit into the buffer) are read synchronously after all
+ * operations have completed.
+ */
+class CgroupStatBatch final {
+	/**
+	 * The buffer sizes for each #CgroupStatFile.  The files are
+	 * tiny, except for "cpu.stat" and "io.stat" which have a few
+	 * lines and "memory.stat" which has dozens.
+	 */
+	static constexpr std::array<std::size_t, std::size_t(CgroupStatFile::N)> buffer_sizes{
+		1024, // cpu.stat
+		64, // memory.peak
+		256, // memory.events
+		64, // pids.peak
+		64, // pids.forks
+		64, // pids.events
+		1024, // io.stat (with a few devices)
+		256, // cpu.pressure
+		256, // memory.pressure
+		256, // io.pressure
+		4096, // memory.stat
+	};
+
+	static constexpr std::size_t ITEM_BUFFER_SIZE = []{
+		std::size_t size = 0;
+		for (const std::size_t i : buffer_sizes)
+			size += i;
+		return size;
+	}();
+
+	struct Item;
+
+	class OpenOperation final : public Uring::Operation {
+		Item *item;
+
+		bool submitted;
+
+	public:
+		void Init(Item &_item) noexcept {
+			item = &_item;
+			submitted = false;
+		}
+
+		void SetSubmitted() noexcept {
+			submitted = true;
+		}
+
+		bool IsSubmitted() const noexcept {
+			return submitted;
+		}
+
+	private:
+		void OnUringCompletion(int res) noexcept override;
+	};
+
+	class ReadOperation final : public Uring::Operation {
+		Item *item;
+		CgroupStatFile file;
+
+		bool submitted;
+
+		/**
+		 * Was the file truncated because it did not fit into
+		 * the buffer?  It will be read again synchronously.
+		 */
+		bool truncated;
+
+	public:
+		void Init(Item &_item, CgroupStatFile _file) noexcept {
+			item = &_item;
+			file = _file;
+			submitted = truncated = false;
+		}
+
+		void SetSubmitted() noexcept {
+			submitted = true;
+		}
+
+		/**
+		 * Must this file be read synchronously by
+		 * Item::Finish()?
+		 */
+		bool NeedsSyncRead() const noexcept {
+			return !submitted || truncated;
+		}
+
+	private:
+		void OnUringCompletion(int res) noexcept override;
+	};
+
+	struct Item {
+		CgroupStatBatch *batch;
+
+		const char *relative_path;
+
+		PendingRelease *release;
+
+		/**
+		 * The number of operations which have not yet
+		 * completed.
+		 */
+		unsigned n_pending;
+
+		OpenOperation open;
+		std::array<ReadOperation, std::size_t(CgroupStatFile::N)> reads;
+
+		std::byte buffer[ITEM_BUFFER_SIZE];
+
+		std::byte *GetBuffer(CgroupStatFile file) noexcept;
+
+		void OnOperationDone() noexcept;
+
+		/**
+		 * Do everything synchronously which could not be
+		 * done with io_uring.
+		 */
+		void Finish() noexcept;
+	};
+
+	Uring::Queue &queue;
+
+	const FileDescriptor root_cgroup;
+
+	using Callback = BoundMethod<void() noexcept>;
+	const Callback callback;
+
+	const std::unique_ptr<Item[]> items;
+	const std::size_t capacity;
+	std::size_t n_items = 0;
+
+	/**
+	 * The number of #Item instances which have not yet finished
+	 * plus one until Submit() has been called.
+	 */
+	std::size_t n_pending = 1;
+
+public:
+	/**
+	 * @param _capacity the maximum number of Add() calls
+	 * @param _callback invoked after all operations have
+	 * completed; it may destroy this object
+	 */
+	CgroupStatBatch(Uring::Queue &_queue, FileDescriptor _root_cgroup,
+			std::size_t _capacity, Callback _callback);
+
+	~CgroupStatBatch() noexcept;
+
+	CgroupStatBatch(const CgroupStatBatch &) = delete;
+	CgroupStatBatch &operator=(const CgroupStatBatch &) = delete;
+
+	bool IsBusy() const noexcept {
+		return n_pending > 0;
+	}
+
+	/**
+	 * Prepare the operations for one cgroup.  The
+	 * #PendingRelease must not be moved or destroyed until the
+	 * callback has been invoked.  If the submission queue fails,
+	 * the remaining work for this cgroup is done synchronously
+	 * later.
+	 *
+	 * @param relative_path the cgroup path relative to the
+	 * #root_cgroup (without a leading slash); it must remain
+	 * valid until the callback has been invoked
+	 */
+	void Add(const char *relative_path, PendingRelease &release) noexcept;
+
+	/**
+	 * Submit all operations prepared by Add().  The callback is
+	 * never invoked by this method.
+	 *
+	 * @return true if operations are pending (the callback will
+	 * be invoked later), false if all cgroups have been
+	 * collected already
+	 */
+	bool Submit() noexcept;
+
+private:
+	void OnItemFinished() noexcept;
+};
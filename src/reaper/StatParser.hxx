@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "util/NumberParser.hxx"
+
+#include <algorithm> // for std::min()
+#include <array>
+#include <bit> // for std::bit_ceil(), std::countr_zero()
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Finds the separator bytes (up to three different ones) in a
+ * buffer.  With SSE2, 16 bytes are compared at a time and the
+ * result is kept as a bit mask, so each byte is looked at only once,
+ * no matter how many separators it contains.
+ */
+class StatSeparatorScanner {
+	const char *const end;
+
+	/**
+	 * The first byte which has not yet been scanned.
+	 */
+	const char *next;
+
+	/**
+	 * The beginning of the block described by #mask.
+	 */
+	const char *block;
+
+	/**
+	 * One bit for each separator in #block which has not yet been
+	 * returned by Next().
+	 */
+	uint_least32_t mask = 0;
+
+	const char a, b, c;
+
+public:
+	StatSeparatorScanner(std::string_view s,
+			     char _a, char _b, char _c) noexcept
+		:end(s.data() + s.size()), next(s.data()), block(next),
+		 a(_a), b(_b), c(_c) {}
+
+	StatSeparatorScanner(std::string_view s, char _a, char _b) noexcept
+		:StatSeparatorScanner(s, _a, _b, _b) {}
+
+	const char *GetEnd() const noexcept {
+		return end;
+	}
+
+	/**
+	 * @return a pointer to the next separator or GetEnd()
+	 */
+	const char *Next() noexcept {
+		while (mask == 0) {
+			if (next == end)
+				return end;
+
+			Load();
+		}
+
+		const unsigned i = std::countr_zero(mask);
+		mask &= mask - 1;
+		return block + i;
+	}
+
+	/**
+	 * Skip everything up to and including the next occurrence of
+	 * the specified separator.
+	 *
+	 * @return a pointer to the separator or GetEnd()
+	 */
+	const char *SkipTo(char separator) noexcept {
+		const char *p;
+		do {
+			p = Next();
+		} while (p != end && *p != separator);
+		return p;
+	}
+
+private:
+	constexpr bool IsSeparator(char ch) const noexcept {
+		return ch == a || ch == b || ch == c;
+	}
+
+	void Load() noexcept {
+		block = next;
+
+#ifdef __SSE2__
+		if (end - next >= 16) {
+			const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(next));
+			const __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)),
+								     _mm_cmpeq_epi8(v, _mm_set1_epi8(b))),
+						       _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+			mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+			next += 16;
+			return;
+		}
+#endif
+
+		/* the tail (or no SIMD): one byte at a time */
+		const std::size_t n = std::min<std::size_t>(end - next, 32);
+		mask = 0;
+		for (std::size_t i = 0; i < n; ++i)
+			if (IsSeparator(next[i]))
+				mask |= uint_least32_t{1} << i;
+		next += n;
+	}
+};
+
+/**
+ * A set of (up to 32) statistics keys with a perfect hash function
+ * which is generated at compile time: each key has a slot of its
+ * own, so a lookup hashes the name once and compares it with at most
+ * one key.
+ *
+ * The index of each key is its position in the list passed to the
+ * constructor.
+ */
+template<std::size_t N>
+class StatKeys {
+	static_assert(N > 0 && N <= 32);
+
+	static constexpr std::size_t CAPACITY = std::bit_ceil(N * 2);
+
+	/**
+	 * Unused slots have an empty name (which never matches
+	 * because empty keys are not allowed) and the index #N.
+	 */
+	std::array<std::string_view, CAPACITY> names{};
+	std::array<uint_least8_t, CAPACITY> indices;
+
+	/**
+	 * The (odd) multiplier of the hash function.
+	 */
+	uint_least32_t seed = 0x9e3779b1;
+
+public:
+	/**
+	 * A bit mask containing all keys.
+	 */
+	static constexpr unsigned ALL = N < 32 ? (1U << N) - 1 : ~0U;
+
+	/**
+	 * Fails to compile if the keys contain duplicates or empty
+	 * strings.
+	 */
+	consteval explicit StatKeys(const std::array<std::string_view, N> &keys) {
+		for (const auto key : keys)
+			if (key.empty())
+				throw std::invalid_argument{"Empty key"};
+
+		for (unsigned i = 0; !TryBuild(keys); ++i) {
+			if (i >= 1000000)
+				throw std::invalid_argument{"No perfect hash"};
+
+			seed += 2;
+		}
+	}
+
+	/**
+	 * @return the index of the key or #N if it is not in this
+	 * set
+	 */
+	[[gnu::pure]]
+	constexpr std::size_t Find(std::string_view name) const noexcept {
+		const std::size_t slot = GetSlot(name, seed);
+		return names[slot] == name ? indices[slot] : N;
+	}
+
+private:
+	static constexpr unsigned SHIFT = 32 - std::countr_zero(CAPACITY);
+
+	/**
+	 * Multiplicative hashing of the length and three characters;
+	 * this is much cheaper than hashing all characters, and the
+	 * constructor verifies that it is unique for all keys.
+	 */
+	static constexpr std::size_t GetSlot(std::string_view s,
+					     uint_least32_t seed) noexcept {
+		if (s.empty())
+			return 0;
+
+		const uint_least32_t x = static_cast<uint_least32_t>(s.size()) |
+			(static_cast<uint_least32_t>(static_cast<unsigned char>(s.front())) << 8) |
+			(static_cast<uint_least32_t>(static_cast<unsigned char>(s[s.size() / 2])) << 16) |
+			(static_cast<uint_least32_t>(static_cast<unsigned char>(s.back())) << 24);
+		return static_cast<uint_least32_t>(x * seed) >> SHIFT;
+	}
+
+	constexpr bool TryBuild(const std::array<std::string_view, N> &keys) noexcept {
+		names = {};
+		indices.fill(N);
+
+		for (std::size_t i = 0; i < N; ++i) {
+			const std::size_t slot = GetSlot(keys[i], seed);
+			if (!names[slot].empty())
+				/* collision (or duplicate key) */
+				return false;
+
+			names[slot] = keys[i];
+			indices[slot] = i;
+		}
+
+		return true;
+	}
+};
+
+/**
+ * Parse a "flat keyed" statistics file (lines consisting of "KEY
+ * VALUE", e.g. "cpu.stat" or "memory.stat") in one pass.  Lines
+ * with unknown keys or malformed values are ignored.
+ *
+ * @param values the array the value of each key is stored in (at
+ * the key's index)
+ * @param wanted stop parsing as soon as all of these keys have been
+ * found
+ * @return a bit mask of the indices which were found
+ */
+template<std::size_t N>
+unsigned
+ParseFlatKeyed(std::string_view contents, const StatKeys<N> &keys,
+	       std::span<uint_least64_t> values,
+	       unsigned wanted=StatKeys<N>::ALL) noexcept
+{
+	assert(values.size() >= N);
+
+	StatSeparatorScanner scanner{contents, ' ', '\n'};
+	const char *const end = scanner.GetEnd();
+	const char *line = contents.data();
+	unsigned found = 0;
+
+	while (line != end) {
+		const char *p = scanner.Next();
+		if (p == end)
+			break;
+
+		if (*p == '\n') {
+			/* no value */
+			line = p + 1;
+			continue;
+		}
+
+		const std::string_view name{line, p};
+		const char *const value = p + 1;
+
+		p = scanner.Next();
+		const std::string_view value_s{value, p};
+
+		if (p != end && *p != '\n')
+			/* ignore additional fields */
+			p = scanner.SkipTo('\n');
+
+		if (const std::size_t i = keys.Find(name); i < N) {
+			if (auto v = ParseInteger<uint_least64_t>(value_s)) {
+				values[i] = *v;
+				found |= 1U << i;
+
+				if ((found & wanted) == wanted)
+					break;
+			}
+		}
+
+		if (p == end)
+			break;
+
+		line = p + 1;
+	}
+
+	return found;
+}
+
+/**
+ * Parse a "nested keyed" statistics file (lines consisting of "KEY
+ * SUBKEY=VALUE SUBKEY=VALUE ...", e.g. "io.stat" or
+ * "memory.pressure") in one pass.  Unknown subkeys are ignored;
+ * lines with a malformed field or value are skipped.
+ *
+ * @param f a function which is invoked for each line with the key
+ * (std::string_view), the values (std::span<const uint_least64_t,
+ * N>) and a bit mask of the subkey indices which were found
+ */
+template<std::size_t N, typename F>
+void
+ParseNestedKeyed(std::string_view contents, const StatKeys<N> &keys,
+		 F &&f) noexcept
+{
+	StatSeparatorScanner scanner{contents, ' ', '=', '\n'};
+	const char *const end = scanner.GetEnd();
+	const char *line = contents.data();
+
+	while (line != end) {
+		const char *p = scanner.Next();
+		if (p == end)
+			break;
+
+		if (*p != ' ') {
+			/* no fields */
+			if (*p != '\n')
+				p = scanner.SkipTo('\n');
+			if (p == end)
+				break;
+			line = p + 1;
+			continue;
+		}
+
+		const std::string_view key{line, p};
+
+		std::array<uint_least64_t, N> values;
+		unsigned found = 0;
+		bool valid = true;
+
+		while (p != end && *p == ' ') {
+			const char *const name = p + 1;
+			p = scanner.Next();
+			if (p == end || *p != '=') {
+				valid = false;
+				break;
+			}
+
+			const std::string_view name_s{name, p};
+			const char *const value = p + 1;
+			p = scanner.Next();
+
+			if (const std::size_t i = keys.Find(name_s); i < N) {
+				if (auto v = ParseInteger<uint_least64_t>(std::string_view{value, p})) {
+					values[i] = *v;
+					found |= 1U << i;
+				} else {
+					valid = false;
+					break;
+				}
+			}
+		}
+
+		if (valid && (p == end || *p == '\n'))
+			f(key, std::span<const uint_least64_t, N>{values}, found);
+		else if (p != end && *p != '\n')
+			p = scanner.SkipTo('\n');
+
+		if (p == end)
+			break;
+
+		line = p + 1;
+	}
+}
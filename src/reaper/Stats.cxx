@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "Stats.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::max()
+
+void
+ReaperStats::AddShard(const ReaperStats &other) noexcept
+{
+	n_released += other.n_released;
+	release_syscalls_saved += other.release_syscalls_saved;
+	n_deleted += other.n_deleted;
+	n_delete_busy += other.n_delete_busy;
+	n_delete_backoff += other.n_delete_backoff;
+	delete_queue_size += other.delete_queue_size;
+	delete_queue_max = std::max(delete_queue_max, other.delete_queue_max);
+	delete_latency_total += other.delete_latency_total;
+	delete_latency_max = std::max(delete_latency_max, other.delete_latency_max);
+	n_samples += other.n_samples;
+}
+
+void
+LogStats(const ReaperStats &stats, const LuaAccountingStats &lua) noexcept
+{
+	fmt::print(stderr, "released={} release_syscalls_saved={}",
+		   stats.n_released, stats.release_syscalls_saved);
+
+	if (stats.n_released > 0)
+		fmt::print(stderr, "[{:.1f}/release]",
+			   static_cast<double>(stats.release_syscalls_saved) / stats.n_released);
+
+	fmt::print(stderr, " deleted={} delete_busy={} delete_backoff={} delete_queue={}/{}",
+		   stats.n_deleted, stats.n_delete_busy, stats.n_delete_backoff,
+		   stats.delete_queue_size, stats.delete_queue_max);
+
+	if (stats.n_deleted > 0) {
+		using Ms = std::chrono::duration<double, std::milli>;
+		fmt::print(stderr, " delete_latency={:.1f}ms/{:.1f}ms",
+			   Ms(stats.delete_latency_total).count() / stats.n_deleted,
+			   Ms(stats.delete_latency_max).count());
+	}
+
+	if (stats.n_journal_sent > 0 || stats.n_journal_dropped > 0)
+		fmt::print(stderr, " journal_sent={} journal_dropped={}",
+			   stats.n_journal_sent, stats.n_journal_dropped);
+
+	if (stats.n_archived > 0)
+		fmt::print(stderr, " archived={}", stats.n_archived);
+
+	if (stats.n_samples > 0)
+		fmt::print(stderr, " samples={}", stats.n_samples);
+
+	fmt::print(stderr, " lua_running={} lua_queue={} lua_queued={} lua_dropped={} lua_timeouts={}",
+		   lua.running.load(), lua.queue_size.load(),
+		   lua.n_queued.load(), lua.n_dropped.load(), lua.n_timeouts.load());
+
+	fmt::print(stderr, " startup={:.1f}ms initial_directories={}\n",
+		   std::chrono::duration<double, std::milli>(stats.startup_duration).count(),
+		   stats.initial_directories);
+}
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Counters of one LuaAccounting instance.  They are atomic because
+ * the instance may run in a worker thread (see LuaWorker) while the
+ * main thread logs them.
+ */
+struct LuaAccountingStats {
+	/**
+	 * The number of Lua handler coroutines running now.
+	 */
+	std::atomic_size_t running{0};
+
+	/**
+	 * The number of releases waiting for a Lua handler
+	 * coroutine now.
+	 */
+	std::atomic_size_t queue_size{0};
+
+	/**
+	 * The number of releases which had to wait for a Lua handler
+	 * coroutine, the number of releases which were not passed
+	 * to the handler because a queue was full and the number of
+	 * handler coroutines which were cancelled because they took
+	 * too long.
+	 */
+	std::atomic<uint_least64_t> n_queued{0}, n_dropped{0}, n_timeouts{0};
+
+	/**
+	 * Add the counters of another instance (which may be
+	 * modified by another thread meanwhile).
+	 */
+	void Add(const LuaAccountingStats &other) noexcept {
+		running += other.running;
+		queue_size += other.queue_size;
+		n_queued += other.n_queued;
+		n_dropped += other.n_dropped;
+		n_timeouts += other.n_timeouts;
+	}
+};
+
+/**
+ * Counters describing what the reaper has been doing.  They can be
+ * dumped with SIGUSR1.
+ */
+struct ReaperStats {
+	/**
+	 * The number of cgroups which have been released.
+	 */
+	uint_least64_t n_released = 0;
+
+	/**
+	 * The number of system calls (openat(), statx()) which the
+	 * release path did not have to do because they were done
+	 * when the cgroup was discovered.
+	 */
+	uint_least64_t release_syscalls_saved = 0;
+
+	/**
+	 * The number of cgroups which have been deleted (after their
+	 * resource usage was reported).
+	 */
+	uint_least64_t n_deleted = 0;
+
+	/**
+	 * The number of deletions which failed with EBUSY because
+	 * the cgroup was populated again.
+	 */
+	uint_least64_t n_delete_busy = 0;
+
+	/**
+	 * The number of deletions which were postponed because the
+	 * cgroup had failed with EBUSY recently.
+	 */
+	uint_least64_t n_delete_backoff = 0;
+
+	/**
+	 * The number of cgroups waiting to be deleted (now and the
+	 * maximum ever seen).
+	 */
+	std::size_t delete_queue_size = 0, delete_queue_max = 0;
+
+	/**
+	 * The time from enqueuing a cgroup until its deletion
+	 * (the sum for all deleted cgroups and the maximum).
+	 */
+	std::chrono::steady_clock::duration delete_latency_total{};
+	std::chrono::steady_clock::duration delete_latency_max{};
+
+	/**
+	 * The number of entries sent to the journal and the number
+	 * of entries which were dropped because journald did not
+	 * keep up.
+	 */
+	uint_least64_t n_journal_sent = 0, n_journal_dropped = 0;
+
+	/**
+	 * The number of releases appended to the accounting
+	 * archive.
+	 */
+	uint_least64_t n_archived = 0;
+
+	/**
+	 * The number of live samples of running cgroups (see
+	 * #CgroupSampler).
+	 */
+	uint_least64_t n_samples = 0;
+
+	/**
+	 * How long it took from the process start until systemd was
+	 * notified (READY=1).
+	 */
+	std::chrono::steady_clock::duration startup_duration{};
+
+	/**
+	 * The number of directories found by the initial scan.
+	 */
+	std::size_t initial_directories = 0;
+
+	/**
+	 * Add the counters of a #ReaperShard which runs in a worker
+	 * thread (see ShardPool).
+	 */
+	void AddShard(const ReaperStats &other) noexcept;
+};
+
+/**
+ * Print all counters to stderr.
+ *
+ * @param lua the sum of the Lua handler counters of all threads
+ */
+void
+LogStats(const ReaperStats &stats, const LuaAccountingStats &lua) noexcept;
@@ -3,18 +3,235 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "TreeWatch.hxx"
+#include "DirentReader.hxx"
+#include "WatchTrace.hxx"
+#include "WatchTraceFormat.hxx"
 #include "lib/fmt/ExceptionFormatter.hxx"
 #include "system/Error.hxx"
-#include "io/DirectoryReader.hxx"
 #include "io/FileAt.hxx"
 #include "io/FileName.hxx"
 #include "io/Open.hxx"
 #include "io/linux/ProcPath.hxx"
+#include "util/BindMethod.hxx"
 #include "util/IterableSplitString.hxx"
 #include "util/PrintException.hxx"
 
+#include <algorithm> // for std::copy_backward()
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
 #include <assert.h>
+#include <fcntl.h> // for O_PATH
+#include <limits.h> // for PATH_MAX
+#include <stdint.h> // for SIZE_MAX
 #include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h> // for readlink()
+
+/**
+ * The result of scanning a subtree in a worker thread (see
+ * TreeWatch::Add()).  It contains only the file descriptors and
+ * names of all subdirectories; the #Directory objects are created
+ * by TreeWatch::MergeScanResult() in the main thread.
+ */
+struct TreeWatch::ScanResult {
+	static constexpr std::size_t NO_PARENT = SIZE_MAX;
+
+	struct Entry {
+		/**
+		 * The index of the parent entry or #NO_PARENT if
+		 * this is a child of the directory being scanned.
+		 * Parents are always stored before their children.
+		 */
+		std::size_t parent;
+
+		/**
+		 * The location of the name in #names.
+		 */
+		std::size_t name_position, name_length;
+
+		/**
+		 * An O_PATH file descriptor.
+		 */
+		UniqueFileDescriptor fd;
+
+		/**
+		 * The range of #entries which are the subdirectories
+		 * of this one.  After the inotify watch has been
+		 * added, their names are compared with the directory
+		 * contents (see IsCurrent()), to find out whether the
+		 * directory was modified in between.
+		 */
+		std::size_t children_begin = 0, children_end = 0;
+
+		/**
+		 * Were all subdirectories recorded?  This is false if
+		 * the directory could not be read or if the type of
+		 * an entry was unknown.
+		 */
+		bool complete = false;
+	};
+
+	std::vector<Entry> entries;
+
+	/**
+	 * All names, concatenated (without null terminators).
+	 */
+	std::string names;
+
+	/**
+	 * The error which occurred while scanning the top-level
+	 * directory.
+	 */
+	std::exception_ptr error;
+
+	std::string_view GetName(const Entry &entry) const noexcept {
+		return std::string_view{names}.substr(entry.name_position,
+						      entry.name_length);
+	}
+
+	/**
+	 * The worker thread's main function.
+	 *
+	 * @param _tree_watch the #TreeWatch which decides which
+	 * children of the top-level directory are skipped (see
+	 * TreeWatch::ShouldSkipChild())
+	 */
+	void Run(const TreeWatch &_tree_watch,
+		 FileDescriptor directory_fd) noexcept;
+
+	/**
+	 * Does the directory of the specified entry still contain
+	 * exactly the subdirectories seen by the worker thread?  This
+	 * must be called after the inotify watch has been added.
+	 */
+	[[gnu::pure]]
+	bool IsCurrent(std::size_t i, FileDescriptor directory_fd,
+		       std::span<std::byte> buffer) const noexcept;
+
+private:
+	const TreeWatch *tree_watch;
+
+	void Scan(FileDescriptor directory_fd, std::size_t parent,
+		  std::span<std::byte> buffer);
+};
+
+void
+TreeWatch::ScanResult::Run(const TreeWatch &_tree_watch,
+			   FileDescriptor directory_fd) noexcept
+try {
+	tree_watch = &_tree_watch;
+
+	const auto buffer = std::make_unique_for_overwrite<std::byte[]>(SCAN_BUFFER_SIZE);
+	Scan(directory_fd, NO_PARENT, {buffer.get(), SCAN_BUFFER_SIZE});
+} catch (...) {
+	error = std::current_exception();
+}
+
+void
+TreeWatch::ScanResult::Scan(FileDescriptor directory_fd, std::size_t parent,
+			    std::span<std::byte> buffer)
+{
+	const std::size_t begin = entries.size();
+	bool complete = true;
+
+	{
+		const auto fd = OpenDirectory({directory_fd, "."});
+		DirentReader reader{fd, buffer};
+		while (const auto *dirent = reader.Read()) {
+			if (dirent->d_type == DT_UNKNOWN) {
+				/* the main thread will have to scan
+				   this directory again */
+				complete = false;
+				continue;
+			}
+
+			if (dirent->d_type != DT_DIR || IsSpecialFilename(dirent->d_name))
+				continue;
+
+			if (parent == NO_PARENT &&
+			    tree_watch->ShouldSkipChild(dirent->d_name))
+				continue;
+
+			UniqueFileDescriptor child_fd;
+			try {
+				child_fd = OpenDirectoryPath({directory_fd, dirent->d_name});
+			} catch (...) {
+				/* ignore; this name is missing from the
+				   entries, so IsCurrent() fails and the
+				   main thread will scan this directory
+				   again */
+				continue;
+			}
+
+			const std::string_view name{dirent->d_name};
+			entries.push_back({
+				.parent = parent,
+				.name_position = names.size(),
+				.name_length = name.size(),
+				.fd = std::move(child_fd),
+			});
+			names.append(name);
+		}
+	}
+
+	const std::size_t end = entries.size();
+
+	if (parent != NO_PARENT) {
+		auto &p = entries[parent];
+		p.children_begin = begin;
+		p.children_end = end;
+		p.complete = complete;
+	}
+
+	for (std::size_t i = begin; i < end; ++i) {
+		try {
+			Scan(entries[i].fd, i, buffer);
+		} catch (...) {
+			/* the main thread will try again */
+			entries[i].complete = false;
+		}
+	}
+}
+
+bool
+TreeWatch::ScanResult::IsCurrent(std::size_t i, FileDescriptor directory_fd,
+				 std::span<std::byte> buffer) const noexcept
+try {
+	const auto &entry = entries[i];
+	if (!entry.complete)
+		return false;
+
+	/* comparing just the number of subdirectories (e.g. with
+	   the link count) is not enough: one may have been deleted
+	   and another one created in the meantime */
+	std::unordered_set<std::string_view> expected;
+	expected.reserve(entry.children_end - entry.children_begin);
+	for (std::size_t j = entry.children_begin; j < entry.children_end; ++j)
+		expected.emplace(GetName(entries[j]));
+
+	std::size_t n_found = 0;
+
+	const auto fd = OpenDirectory({directory_fd, "."});
+	DirentReader reader{fd, buffer};
+	while (const auto *dirent = reader.Read()) {
+		if (dirent->d_type == DT_UNKNOWN)
+			return false;
+
+		if (dirent->d_type != DT_DIR || IsSpecialFilename(dirent->d_name))
+			continue;
+
+		if (!expected.contains(dirent->d_name))
+			return false;
+
+		++n_found;
+	}
+
+	return n_found == expected.size();
+} catch (...) {
+	return false;
+}
 
 inline
 TreeWatch::Directory::Directory(Root, TreeWatch &_tree_watch, FileDescriptor directory_fd,
@@ -35,17 +252,49 @@ TreeWatch::Directory::Directory(Directory &_parent, std::string_view _name,
 {
 }
 
+TreeWatch::Directory::~Directory() noexcept
+{
+	assert(children.empty());
+	assert(data == nullptr);
+
+	if (parent != nullptr)
+		tree_watch.names.Release(name);
+}
+
 std::string
-TreeWatch::Directory::GetRelativePath() const noexcept
+TreeWatch::Directory::GetRelativePath(std::string_view prefix) const noexcept
 {
-	if (parent == nullptr)
-		return {};
+	/* determine the length first, so the string needs to be
+	   allocated only once, and then fill it from the end */
+
+	std::size_t length = prefix.size();
+	for (const Directory *i = this; i->parent != nullptr; i = i->parent)
+		length += i->name.size() + 1;
 
-	auto p = parent->GetRelativePath();
-	if (!p.empty())
-		p.push_back('/');
+	if (length > prefix.size())
+		/* no slash before the first segment */
+		--length;
 
-	return std::move(p) + name;
+	std::string p(length, '\0');
+	char *end = p.data() + length;
+
+	for (const Directory *i = this; i->parent != nullptr; i = i->parent) {
+		end = std::copy_backward(i->name.begin(), i->name.end(), end);
+		if (i->parent->parent != nullptr)
+			*--end = '/';
+	}
+
+	assert(end == p.data() + prefix.size());
+	std::copy(prefix.begin(), prefix.end(), p.data());
+	return p;
+}
+
+std::string
+TreeWatch::Directory::GetAbsolutePath() const noexcept
+{
+	assert(!tree_watch.root_path.empty());
+
+	return GetRelativePath(tree_watch.root_path);
 }
 
 void
@@ -55,7 +304,30 @@ TreeWatch::Directory::Open(FileDescriptor parent_fd)
 	assert(!fd.IsDefined());
 	assert(!IsWatching());
 
-	fd = OpenDirectoryPath({parent_fd, name.c_str()});
+	/* NameArena guarantees null-termination */
+	fd = OpenDirectoryPath({parent_fd, name.data()});
+}
+
+FileDescriptor
+TreeWatch::Directory::GetFd(UniqueFileDescriptor &buffer) const noexcept
+{
+	if (fd.IsDefined())
+		return fd;
+
+	(void)buffer.Open({tree_watch.root.fd, GetRelativePath().c_str()},
+			  O_PATH|O_DIRECTORY);
+	return buffer;
+}
+
+bool
+TreeWatch::Directory::OpenFile(UniqueFileDescriptor &file, const char *filename,
+			       int flags) const noexcept
+{
+	if (fd.IsDefined())
+		return file.Open({fd, filename}, flags);
+
+	const auto path = GetRelativePath() + '/' + filename;
+	return file.Open({tree_watch.root.fd, path.c_str()}, flags);
 }
 
 inline void
@@ -63,9 +335,15 @@ TreeWatch::Directory::AddWatch()
 {
 	assert(!IsWatching());
 
-	InotifyWatch::AddWatch(ProcFdPath(fd),
-			       IN_EXCL_UNLINK|IN_ONLYDIR|
-			       IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO);
+	static constexpr uint32_t mask = IN_EXCL_UNLINK|IN_ONLYDIR|
+		IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO;
+
+	if (fd.IsDefined())
+		InotifyWatch::AddWatch(ProcFdPath(fd), mask);
+	else
+		/* fd budget mode; IN_ONLYDIR makes this fail if
+		   the path is not a directory */
+		InotifyWatch::AddWatch(GetAbsolutePath().c_str(), mask);
 }
 
 void
@@ -77,13 +355,45 @@ TreeWatch::Directory::OnInotify(unsigned mask, const char *_name) noexcept
 TreeWatch::TreeWatch(EventLoop &event_loop, FileDescriptor directory_fd,
 		     const char *base_path)
 	:inotify_manager(event_loop),
-	 root(Directory::Root(), *this, directory_fd, base_path)
+	 root(Directory::Root(), *this, directory_fd, base_path),
+	 scan_buffer(std::make_unique_for_overwrite<std::byte[]>(SCAN_BUFFER_SIZE))
 {
+	inotify_manager.SetOverflowHandler(BIND_THIS_METHOD(OnInotifyOverflow));
 	root.AddWatch();
 }
 
+TreeWatch::~TreeWatch() noexcept
+{
+	DeleteChildren(root);
+}
+
 void
-TreeWatch::Add(std::string_view relative_path)
+TreeWatch::EnableFdBudget()
+{
+	assert(root.children.empty());
+
+	char buffer[PATH_MAX];
+	const ssize_t length = readlink(ProcFdPath(root.fd), buffer,
+					sizeof(buffer) - 1);
+	if (length <= 0)
+		throw MakeErrno("Failed to determine the path of the root directory");
+
+	root_path.assign(buffer, length);
+	if (root_path.back() != '/')
+		root_path.push_back('/');
+
+	fd_budget = true;
+}
+
+std::size_t
+TreeWatch::GetMemoryUsage() const noexcept
+{
+	return directory_pool.GetMemoryUsage() + names.GetMemoryUsage()
+		+ root.children.GetMemoryUsage() + SCAN_BUFFER_SIZE;
+}
+
+TreeWatch::Directory *
+TreeWatch::AddPath(std::string_view relative_path)
 {
 	assert(root.IsOpen());
 
@@ -97,7 +407,8 @@ TreeWatch::Add(std::string_view relative_path)
 
 		if (!child.IsOpen() && directory->IsOpen()) {
 			try {
-				child.Open(directory->fd);
+				if (!fd_budget)
+					child.Open(directory->fd);
 				child.AddWatch();
 			} catch (...) {
 				PrintException(std::current_exception());
@@ -107,14 +418,80 @@ TreeWatch::Add(std::string_view relative_path)
 		directory = &child;
 	}
 
-	if (directory != &root) {
-		directory->all = true;
+	if (directory == &root)
+		return nullptr;
+
+	directory->all = true;
+
+	if (!directory->IsOpen() || !directory->children.empty())
+		return nullptr;
 
-		if (directory->IsOpen() && directory->children.empty()) {
-			OnDirectoryCreated(directory->GetRelativePath(),
-					   directory->fd);
+	OnDirectoryCreated(*directory);
+	return directory;
+}
+
+void
+TreeWatch::Add(std::string_view relative_path)
+{
+	if (auto *directory = AddPath(relative_path))
+		ScanDirectory(*directory);
+}
+
+void
+TreeWatch::Add(std::span<const std::string_view> relative_paths)
+{
+	std::vector<Directory *> scan;
+	for (const auto relative_path : relative_paths)
+		if (auto *directory = AddPath(relative_path))
+			scan.push_back(directory);
+
+	if (scan.size() < 2 || fd_budget ||
+	    std::thread::hardware_concurrency() < 2) {
+		/* not worth the overhead (or not possible without
+		   a file descriptor for each directory) */
+		for (auto *directory : scan)
 			ScanDirectory(*directory);
-		}
+		return;
+	}
+
+	std::vector<ScanResult> results(scan.size());
+
+	{
+		std::vector<std::jthread> threads;
+		threads.reserve(scan.size());
+
+		for (std::size_t i = 0; i < scan.size(); ++i)
+			threads.emplace_back([this, &result = results[i],
+					      fd = FileDescriptor{scan[i]->fd}]{
+				result.Run(*this, fd);
+			});
+
+		/* the std::jthread destructors wait for all
+		   threads */
+	}
+
+	for (std::size_t i = 0; i < scan.size(); ++i)
+		MergeScanResult(*scan[i], results[i]);
+}
+
+void
+TreeWatch::Remove(std::string_view relative_path) noexcept
+{
+	Directory *directory = FindDirectory(relative_path);
+	if (directory == nullptr || directory == &root)
+		return;
+
+	Directory *parent = directory->parent;
+	DiscardDirectory(*directory);
+	DeleteChild(*parent, *directory);
+
+	/* free the parents which were only created by AddPath() to
+	   reach the removed directory */
+	while (parent != &root && !parent->all && parent->children.empty()) {
+		directory = parent;
+		parent = directory->parent;
+		DiscardDirectory(*directory);
+		DeleteChild(*parent, *directory);
 	}
 }
 
@@ -129,11 +506,9 @@ TreeWatch::FindDirectory(std::string_view relative_path) const noexcept
 		if (name.empty())
 			continue;
 
-		const auto i = directory->children.find(name);
-		if (i == directory->children.end())
+		directory = directory->children.Find(name);
+		if (directory == nullptr)
 			return nullptr;
-
-		directory = &i->second;
 	}
 
 	return directory;
@@ -143,13 +518,51 @@ TreeWatch::Directory &
 TreeWatch::MakeChild(Directory &parent, std::string_view name,
 		     bool persist, bool all) noexcept
 {
-	return parent.children.emplace(std::piecewise_construct,
-				       std::forward_as_tuple(name),
-				       std::forward_as_tuple(parent,
-							     name,
-							     persist,
-							     all))
-		.first->second;
+	const auto hash = DirectoryIndex::Hash(name);
+	if (auto *child = parent.children.Find(name, hash))
+		return *child;
+
+	auto &child = directory_pool.New(parent, names.Intern(name, hash),
+					 persist, all);
+	parent.children.Insert(child, hash);
+	return child;
+}
+
+void
+TreeWatch::DeleteChild(Directory &parent, Directory &child) noexcept
+{
+	assert(child.parent == &parent);
+
+	parent.children.Erase(child);
+	directory_pool.Delete(child);
+}
+
+void
+TreeWatch::DeleteChildren(Directory &directory) noexcept
+{
+	directory.children.RemoveIf([this](Directory &child){
+		DeleteChildren(child);
+		directory_pool.Delete(child);
+		return true;
+	});
+}
+
+void
+TreeWatch::DiscardDirectory(Directory &directory) noexcept
+{
+	if (directory.all || directory.data != nullptr)
+		OnDirectoryDeleted(directory);
+
+	assert(directory.data == nullptr);
+
+	directory.fd.Close();
+	directory.RemoveWatch();
+
+	directory.children.RemoveIf([this](Directory &child){
+		DiscardDirectory(child);
+		directory_pool.Delete(child);
+		return true;
+	});
 }
 
 void
@@ -159,30 +572,123 @@ TreeWatch::ScanDirectory(Directory &directory)
 	assert(directory.IsWatching());
 	assert(directory.children.empty());
 
-	DirectoryReader reader(OpenDirectory({directory.fd, "."}));
-	while (const char *name = reader.Read()) {
-		if (IsSpecialFilename(name))
-			continue;
+	/* first pass: add all children while reading the directory;
+	   the recursion is postponed, because it reuses
+	   #scan_buffer */
+	std::vector<Directory *> new_children;
+
+	{
+		/* in fd budget mode, the directory is opened by its
+		   path */
+		const auto fd = directory.fd.IsDefined()
+			? OpenDirectory({directory.fd, "."})
+			: OpenDirectory({root.fd, directory.GetRelativePath().c_str()});
+		DirentReader reader{fd, {scan_buffer.get(), SCAN_BUFFER_SIZE}};
+		while (const auto *dirent = reader.Read()) {
+			if (!MaybeDirectory(*dirent))
+				/* the kernel told us that this is not
+				   a directory; don't bother to open()
+				   it */
+				continue;
 
-		const std::string_view name_sv{name};
-		if (ShouldSkipName(name_sv))
-			continue;
+			const char *name = dirent->d_name;
+			if (IsSpecialFilename(name))
+				continue;
 
-		try {
-			auto fd = OpenDirectoryPath({directory.fd, name});
+			const std::string_view name_sv{name};
+			if (dirent->d_type == DT_UNKNOWN && ShouldSkipName(name_sv))
+				continue;
 
-			auto &child = MakeChild(directory, name_sv, false, true);
-			if (child.IsOpen())
+			if (IsAdded(directory) && ShouldSkipChild(name_sv))
 				continue;
 
-			assert(child.children.empty());
+			try {
+				/* in fd budget mode, the child is not
+				   opened; its inotify watch is added by
+				   path */
+				UniqueFileDescriptor child_fd;
+				if (!fd_budget)
+					child_fd = OpenDirectoryPath({directory.fd, name});
 
-			child.fd = std::move(fd);
-			child.AddWatch();
+				auto &child = MakeChild(directory, name_sv, false, true);
+				if (child.IsOpen())
+					continue;
+
+				assert(child.children.empty());
 
-			OnDirectoryCreated(child.GetRelativePath(), child.fd);
+				child.fd = std::move(child_fd);
+				child.AddWatch();
+
+				OnDirectoryCreated(child);
 
-			ScanDirectory(child);
+				new_children.push_back(&child);
+			} catch (const std::system_error &e) {
+				if (IsPathNotFound(e))
+					continue;
+
+				PrintException(std::current_exception());
+			} catch (...) {
+				PrintException(std::current_exception());
+			}
+		}
+	}
+
+	/* second pass: recurse */
+	for (auto *child : new_children) {
+		try {
+			ScanDirectory(*child);
+		} catch (...) {
+			PrintException(std::current_exception());
+		}
+	}
+}
+
+void
+TreeWatch::RescanDirectory(Directory &directory)
+{
+	assert(directory.IsOpen());
+
+	/* collect the names first, because HandleNewDirectory()
+	   reuses #scan_buffer */
+	std::unordered_set<std::string> found;
+
+	{
+		const auto fd = directory.fd.IsDefined()
+			? OpenDirectory({directory.fd, "."})
+			: OpenDirectory({root.fd, directory.GetRelativePath().c_str()});
+		DirentReader reader{fd, {scan_buffer.get(), SCAN_BUFFER_SIZE}};
+		while (const auto *dirent = reader.Read())
+			if (MaybeDirectory(*dirent) &&
+			    !IsSpecialFilename(dirent->d_name))
+				found.emplace(dirent->d_name);
+	}
+
+	/* compare with the children we know; the names are copied,
+	   because the callbacks may free #Directory objects */
+	std::vector<std::string> deleted, existing;
+	directory.children.ForEach([&found, &deleted, &existing](const Directory &child){
+		if (!child.IsOpen())
+			/* a parent of an added path which did not
+			   exist; HandleNewDirectory() will open it if
+			   it exists now */
+			return;
+
+		if (auto i = found.find(std::string{child.name}); i != found.end()) {
+			found.erase(i);
+			existing.emplace_back(child.name);
+		} else
+			deleted.emplace_back(child.name);
+	});
+
+	for (const auto &name : deleted) {
+		Trace(WatchTraceType::DELETE, directory, name);
+		HandleDeletedDirectory(directory, name);
+	}
+
+	for (const auto &name : found) {
+		try {
+			Trace(WatchTraceType::CREATE, directory, name);
+			HandleNewDirectory(directory, name);
 		} catch (const std::system_error &e) {
 			if (IsPathNotFound(e))
 				continue;
@@ -192,30 +698,116 @@ TreeWatch::ScanDirectory(Directory &directory)
 			PrintException(std::current_exception());
 		}
 	}
+
+	/* the new children have been scanned completely by
+	   HandleNewDirectory(); recurse into the others */
+	for (const auto &name : existing) {
+		auto *child = directory.children.Find(name);
+		if (child == nullptr || !child->IsOpen())
+			continue;
+
+		try {
+			RescanDirectory(*child);
+		} catch (const std::system_error &e) {
+			/* if it has been deleted meanwhile, the
+			   IN_DELETE event is still in the queue */
+			if (!IsPathNotFound(e))
+				PrintException(std::current_exception());
+		} catch (...) {
+			PrintException(std::current_exception());
+		}
+	}
+}
+
+void
+TreeWatch::OnInotifyOverflow() noexcept
+{
+	fmt::print(stderr, "inotify event queue overflow, rescanning\n");
+
+	OnEventsLost();
+
+	try {
+		RescanDirectory(root);
+	} catch (...) {
+		PrintException(std::current_exception());
+	}
+}
+
+void
+TreeWatch::MergeScanResult(Directory &directory, ScanResult &result)
+{
+	if (result.error) {
+		/* the worker thread was unable to read the
+		   top-level directory; try again in this thread */
+		ScanDirectory(directory);
+		return;
+	}
+
+	/* maps ScanResult::entries indices to #Directory objects;
+	   nullptr means the subtree is skipped */
+	std::vector<Directory *> directories(result.entries.size(), nullptr);
+
+	for (std::size_t i = 0; i < result.entries.size(); ++i) {
+		auto &entry = result.entries[i];
+
+		Directory *parent = entry.parent == ScanResult::NO_PARENT
+			? &directory
+			: directories[entry.parent];
+		if (parent == nullptr)
+			continue;
+
+		try {
+			auto &child = MakeChild(*parent, result.GetName(entry),
+						false, true);
+			if (child.IsOpen())
+				continue;
+
+			assert(child.children.empty());
+
+			child.fd = std::move(entry.fd);
+			child.AddWatch();
+
+			OnDirectoryCreated(child);
+
+			if (result.IsCurrent(i, child.fd,
+					     {scan_buffer.get(), SCAN_BUFFER_SIZE}))
+				directories[i] = &child;
+			else
+				/* the directory was modified after the
+				   worker thread had read it, but before
+				   the inotify watch was added (or it could
+				   not be read at all); discard the
+				   worker's result and scan it again */
+				ScanDirectory(child);
+		} catch (...) {
+			PrintException(std::current_exception());
+		}
+	}
 }
 
 void
 TreeWatch::HandleDeletedDirectory(Directory &directory) noexcept
 {
-	if (directory.all)
-		OnDirectoryDeleted(directory.GetRelativePath());
+	if (directory.all || directory.data != nullptr)
+		OnDirectoryDeleted(directory);
+
+	assert(directory.data == nullptr);
 
 	directory.fd.Close();
 	directory.RemoveWatch();
 
-	for (auto i = directory.children.begin(), end = directory.children.end(); i != end;) {
-		auto &child = i->second;
-
+	directory.children.RemoveIf([this, &directory](Directory &child){
 		HandleDeletedDirectory(child);
 
 		assert(child.children.empty() || child.persist);
 		assert(!child.persist || directory.persist);
 
 		if (child.persist)
-			++i;
-		else
-			i = directory.children.erase(i);
-	}
+			return false;
+
+		directory_pool.Delete(child);
+		return true;
+	});
 }
 
 void
@@ -226,23 +818,25 @@ TreeWatch::HandleNewDirectory(Directory &parent, std::string_view name)
 	if (ShouldSkipName(name))
 		return;
 
+	if (IsAdded(parent) && ShouldSkipChild(name))
+		return;
+
 	Directory *child;
 
 	if (parent.all) {
 		child = &MakeChild(parent, name, false, true);
 	} else {
-		auto i = parent.children.find(name);
-		if (i == parent.children.end())
+		child = parent.children.Find(name);
+		if (child == nullptr)
 			return;
-
-		child = &i->second;
 	}
 
 	if (!child->IsOpen()) {
-		child->Open(parent.fd);
+		if (!fd_budget)
+			child->Open(parent.fd);
 		child->AddWatch();
 
-		OnDirectoryCreated(child->GetRelativePath(), child->fd);
+		OnDirectoryCreated(*child);
 
 		if (child->all)
 			ScanDirectory(*child);
@@ -253,31 +847,47 @@ void
 TreeWatch::HandleDeletedDirectory(Directory &parent,
 				  std::string_view name) noexcept
 {
-	auto i = parent.children.find(name);
-	if (i == parent.children.end())
+	auto *child = parent.children.Find(name);
+	if (child == nullptr)
 		return;
 
-	auto &child = i->second;
+	HandleDeletedDirectory(*child);
 
-	HandleDeletedDirectory(child);
-
-	if (!child.persist) {
-		parent.children.erase(i);
+	if (!child->persist) {
+		DeleteChild(parent, *child);
 
 		if (parent.children.empty())
-			OnDirectoryEmpty(parent.GetRelativePath());
+			OnDirectoryEmpty(parent);
 	}
 }
 
+inline void
+TreeWatch::Trace(WatchTraceType type, const Directory &parent,
+		 std::string_view name) noexcept
+{
+	if (trace == nullptr)
+		return;
+
+	auto path = parent.GetRelativePath();
+	if (!path.empty())
+		path.push_back('/');
+	path.append(name);
+
+	trace->Append(type, path);
+}
+
 inline void
 TreeWatch::HandleInotifyEvent(Directory &directory, uint32_t mask,
 			      std::string_view name) noexcept
 {
 	try {
-		if (mask & (IN_CREATE|IN_MOVED_TO))
+		if (mask & (IN_CREATE|IN_MOVED_TO)) {
+			Trace(WatchTraceType::CREATE, directory, name);
 			HandleNewDirectory(directory, name);
-		else if (mask & (IN_DELETE|IN_MOVED_FROM))
+		} else if (mask & (IN_DELETE|IN_MOVED_FROM)) {
+			Trace(WatchTraceType::DELETE, directory, name);
 			HandleDeletedDirectory(directory, name);
+		}
 	} catch (...) {
 		fmt::print(stderr, "Failed to handle inotify event {:#x} on '{}/{}': {}\n",
 			   mask, directory.GetRelativePath(), name,
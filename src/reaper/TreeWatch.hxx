@@ -4,26 +4,74 @@
 
 #pragma once
 
+#include "ChildIndex.hxx"
+#include "NameArena.hxx"
+#include "NodePool.hxx"
 #include "io/UniqueFileDescriptor.hxx"
 #include "event/InotifyManager.hxx"
 
-#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
 #include <string_view>
+#include <utility> // for std::as_const()
+
+class WatchTraceWriter;
+enum class WatchTraceType : uint8_t;
 
 class TreeWatch {
 	InotifyManager inotify_manager;
 
+protected:
+	struct Directory;
+
+	/**
+	 * Base class for objects which a subclass attaches to a
+	 * #Directory (see Directory::data).
+	 */
+	struct DirectoryData {};
+
+private:
+	struct GetDirectoryName {
+		std::string_view operator()(const Directory &directory) const noexcept;
+	};
+
+	using DirectoryIndex = ChildIndex<Directory, GetDirectoryName>;
+
+protected:
 	struct Directory final : InotifyWatch {
 		TreeWatch &tree_watch;
 
 		Directory *const parent;
 
-		const std::string name;
-
+		/**
+		 * The directory name; it is owned by
+		 * TreeWatch::names.
+		 */
+		const std::string_view name;
+
+		/**
+		 * An O_PATH file descriptor.  In fd budget mode (see
+		 * TreeWatch::EnableFdBudget()), it is never opened
+		 * (except for the root); use GetFd() to open it
+		 * temporarily.
+		 */
 		UniqueFileDescriptor fd;
 
-		std::map<std::string, Directory, std::less<>> children;
+		/**
+		 * The child directories; they are owned by
+		 * TreeWatch::directory_pool.
+		 */
+		DirectoryIndex children;
+
+		/**
+		 * Data attached by the subclass in
+		 * OnDirectoryCreated(); it is owned by the subclass
+		 * and must be freed in OnDirectoryDeleted().
+		 */
+		DirectoryData *data = nullptr;
 
 		const bool persist;
 		bool all;
@@ -36,14 +84,65 @@ class TreeWatch {
 		Directory(Directory &_parent, std::string_view _name,
 			  bool _persist, bool _all) noexcept;
 
-		std::string GetRelativePath() const noexcept;
+		~Directory() noexcept;
+
+		/**
+		 * Build the path relative to the #TreeWatch root
+		 * (without a leading slash).
+		 *
+		 * @param prefix a string to be inserted at the
+		 * beginning (e.g. a slash)
+		 */
+		std::string GetRelativePath(std::string_view prefix={}) const noexcept;
+
+		/**
+		 * Build the absolute path of this directory.  Only
+		 * available in fd budget mode.
+		 */
+		std::string GetAbsolutePath() const noexcept;
+
+		bool HasChildren() const noexcept {
+			return !children.empty();
+		}
 
+		/**
+		 * Has this directory been opened (and is it being
+		 * watched)?  In fd budget mode, the inotify watch is
+		 * the only trace of that.
+		 */
 		bool IsOpen() const noexcept {
-			return fd.IsDefined();
+			return fd.IsDefined() || IsWatching();
 		}
 
 		void Open(FileDescriptor parent_fd);
 
+		/**
+		 * Returns the file descriptor of this directory.  In fd
+		 * budget mode, it is opened (O_PATH) by its path into
+		 * the given buffer, which must be kept by the caller
+		 * as long as the returned #FileDescriptor is used.
+		 *
+		 * Returns an undefined #FileDescriptor on error.
+		 */
+		FileDescriptor GetFd(UniqueFileDescriptor &buffer) const noexcept;
+
+		/**
+		 * Open a file inside this directory.  In fd budget
+		 * mode, the file is opened by its path relative to the
+		 * root; this needs only one system call.
+		 *
+		 * @return false on error (with errno set)
+		 */
+		bool OpenFile(UniqueFileDescriptor &file, const char *filename,
+			      int flags) const noexcept;
+
+		/**
+		 * Add the inotify watch, either through the
+		 * /proc/self/fd link of #fd or (in fd budget mode,
+		 * where #fd is not opened) by the absolute path.
+		 *
+		 * Throws on error.
+		 */
 		void AddWatch();
 
 	protected:
@@ -51,22 +150,118 @@ class TreeWatch {
 		void OnInotify(unsigned mask, const char *name) noexcept override;
 	};
 
+private:
+	/**
+	 * The size of the getdents64() buffer used for scanning
+	 * directories.
+	 */
+	static constexpr std::size_t SCAN_BUFFER_SIZE = 64 * 1024;
+
+	struct ScanResult;
+
+	/**
+	 * The names of all #Directory objects (except for the root).
+	 */
+	NameArena names;
+
+	/**
+	 * Allocator for all #Directory objects (except for the
+	 * root).
+	 */
+	NodePool<Directory> directory_pool;
+
 	Directory root;
 
+	/**
+	 * The getdents64() buffer for ScanDirectory().
+	 */
+	const std::unique_ptr<std::byte[]> scan_buffer;
+
+	/**
+	 * Don't open the directories (except for the root)?  See
+	 * EnableFdBudget().
+	 */
+	bool fd_budget = false;
+
+	/**
+	 * The absolute path of the root directory with a trailing
+	 * slash.  Only set in fd budget mode, where the inotify
+	 * watches are added by path.
+	 */
+	std::string root_path;
+
+protected:
+	/**
+	 * If set, then all events are recorded in this trace (see
+	 * SetTrace()).
+	 */
+	WatchTraceWriter *trace = nullptr;
+
 public:
 	TreeWatch(EventLoop &event_loop,
 		  FileDescriptor directory_fd, const char *base_path);
 
+	~TreeWatch() noexcept;
+
+	TreeWatch(const TreeWatch &) = delete;
+	TreeWatch &operator=(const TreeWatch &) = delete;
+
 	auto &GetEventLoop() const noexcept {
 		return inotify_manager.GetEventLoop();
 	}
 
+	InotifyManager &GetInotifyManager() noexcept {
+		return inotify_manager;
+	}
+
+	/**
+	 * Record all inotify events (and the events seen by the
+	 * subclass) in the given trace.  Pass nullptr to stop
+	 * recording.
+	 */
+	void SetTrace(WatchTraceWriter *_trace) noexcept {
+		trace = _trace;
+	}
+
+	/**
+	 * Enable "fd budget mode": don't keep a file descriptor for
+	 * each directory; the inotify watches are added by the
+	 * absolute path, and the directory is opened by its path
+	 * only when it is needed.  This costs a few system calls,
+	 * but the number of file descriptors does not grow with the
+	 * tree.  The initial scan is not parallelized in this mode,
+	 * because the worker threads would need a file descriptor
+	 * for each directory.  Must be called before Add().
+	 *
+	 * Throws on error.
+	 */
+	void EnableFdBudget();
+
 	void Add(std::string_view relative_path);
 
+	/**
+	 * Add multiple paths.  Unlike calling Add() for each of them,
+	 * this scans the subtrees in parallel (one worker thread per
+	 * path) if there is more than one CPU; the results are merged
+	 * into the tree (and the virtual methods get invoked) in this
+	 * thread.
+	 */
+	void Add(std::span<const std::string_view> relative_paths);
+
+	/**
+	 * Stop watching a path which was added with Add(), including
+	 * its subtree.  OnDirectoryDeleted() is invoked for all
+	 * directories in the subtree, but the other subtrees are
+	 * left alone.  Parent directories which were only watched to
+	 * reach this path are freed as well.
+	 */
+	void Remove(std::string_view relative_path) noexcept;
+
 	/**
 	 * Look up a directory that is being watched.  Returns the
 	 * directory's #FileDescriptor if found, or else an undefined
-	 * #FileDescriptor.
+	 * #FileDescriptor.  In fd budget mode, the file descriptor
+	 * is undefined (except for the root).
 	 */
 	[[gnu::pure]]
 	FileDescriptor Find(std::string_view relative_path) const noexcept {
@@ -76,15 +271,22 @@ public:
 			: FileDescriptor::Undefined();
 	}
 
-	[[gnu::pure]]
-	bool IsDirectoryEmpty(std::string_view relative_path) const noexcept {
-		const auto *directory = FindDirectory(relative_path);
-		return directory != nullptr
-			? directory->children.empty()
-			: true;
+	/**
+	 * Returns the number of directories being watched (excluding
+	 * the root).
+	 */
+	std::size_t GetDirectoryCount() const noexcept {
+		return directory_pool.size();
 	}
 
-private:
+	/**
+	 * Returns how much heap memory the tree occupies (without the
+	 * kernel's inotify watches and file descriptors).
+	 */
+	[[gnu::pure]]
+	std::size_t GetMemoryUsage() const noexcept;
+
+protected:
 	/**
 	 * Look up a #Directory object.  Returns nullptr if the
 	 * specified path is not being watched.
@@ -92,17 +294,83 @@ private:
 	[[gnu::pure]]
 	const Directory *FindDirectory(std::string_view relative_path) const noexcept;
 
+	[[gnu::pure]]
+	Directory *FindDirectory(std::string_view relative_path) noexcept {
+		return const_cast<Directory *>(std::as_const(*this).FindDirectory(relative_path));
+	}
+
+private:
+	/**
+	 * Was this directory passed to Add()?
+	 */
+	static bool IsAdded(const Directory &directory) noexcept {
+		return directory.persist && directory.all;
+	}
+
 	Directory &MakeChild(Directory &parent, std::string_view name,
 			     bool persist, bool all) noexcept;
 
+	/**
+	 * Remove the specified child from its parent and free it.
+	 */
+	void DeleteChild(Directory &parent, Directory &child) noexcept;
+
+	/**
+	 * Free all children (recursively), without invoking any
+	 * callbacks.
+	 */
+	void DeleteChildren(Directory &directory) noexcept;
+
+	/**
+	 * Stop watching the directory and free all children
+	 * (recursively), invoking OnDirectoryDeleted() like
+	 * HandleDeletedDirectory() does.
+	 */
+	void DiscardDirectory(Directory &directory) noexcept;
+
+	/**
+	 * Create (and open) the #Directory objects for the given
+	 * path.
+	 *
+	 * @return the directory which needs to be scanned with
+	 * ScanDirectory() or nullptr if none
+	 */
+	Directory *AddPath(std::string_view relative_path);
+
 	void ScanDirectory(Directory &directory);
 
+	/**
+	 * Re-read the (already scanned) directory and its subtree
+	 * and apply all differences to the tree, as if the inotify
+	 * events had been received.
+	 */
+	void RescanDirectory(Directory &directory);
+
+	/**
+	 * The kernel's inotify event queue has overflowed (see
+	 * InotifyManager::SetOverflowHandler()).  Events have been
+	 * lost, so the whole tree is rescanned.
+	 */
+	void OnInotifyOverflow() noexcept;
+
+	/**
+	 * Merge the result of a worker thread into the tree.
+	 */
+	void MergeScanResult(Directory &directory, ScanResult &result);
+
 	void HandleNewDirectory(Directory &parent, std::string_view name);
 
 	void HandleDeletedDirectory(Directory &directory) noexcept;
 	void HandleDeletedDirectory(Directory &parent,
 				    std::string_view name) noexcept;
 
+	/**
+	 * Record an event concerning a child of the given directory
+	 * in the #trace (if there is one).
+	 */
+	void Trace(WatchTraceType type, const Directory &parent,
+		   std::string_view name) noexcept;
+
 	void HandleInotifyEvent(Directory &directory, uint32_t mask,
 				std::string_view name) noexcept;
 	void HandleInotifyEvent(Directory &directory, uint32_t mask,
@@ -111,13 +379,51 @@ private:
 protected:
 	/**
 	 * Check whether the file name should be ignored while
-	 * scanning for subdirectories.
+	 * scanning for subdirectories.  While scanning, this is only
+	 * consulted if the filesystem does not report the file type
+	 * in getdents64().
 	 */
 	[[gnu::pure]]
 	virtual bool ShouldSkipName(std::string_view name) const noexcept = 0;
 
-	virtual void OnDirectoryCreated(std::string_view relative_path,
-					FileDescriptor directory_fd) noexcept = 0;
-	virtual void OnDirectoryEmpty(std::string_view relative_path) noexcept = 0;
-	virtual void OnDirectoryDeleted(std::string_view relative_path) noexcept = 0;
+	/**
+	 * Check whether the specified child of a directory which was
+	 * passed to Add() should be ignored (including its subtree).
+	 * This allows multiple #TreeWatch instances to split a
+	 * directory among themselves.  This may be called from the
+	 * scanner threads (see Add()).
+	 */
+	[[gnu::pure]]
+	virtual bool ShouldSkipChild([[maybe_unused]] std::string_view name) const noexcept {
+		return false;
+	}
+
+	virtual void OnDirectoryCreated(Directory &directory) noexcept = 0;
+
+	/**
+	 * The last child of this directory has been deleted.
+	 */
+	virtual void OnDirectoryEmpty(Directory &directory) noexcept = 0;
+
+	/**
+	 * The directory has been deleted.  This is called for all
+	 * directories which have Directory::data or which were
+	 * discovered while scanning.  The #Directory object may be
+	 * freed after this method returns.
+	 */
+	virtual void OnDirectoryDeleted(Directory &directory) noexcept = 0;
+
+	/**
+	 * Inotify events have been lost because the kernel's event
+	 * queue has overflowed.  This is called before the tree gets
+	 * rescanned; the rescan invokes the other virtual methods
+	 * for all changes which were missed.
+	 */
+	virtual void OnEventsLost() noexcept {}
 };
+
+inline std::string_view
+TreeWatch::GetDirectoryName::operator()(const Directory &directory) const noexcept
+{
+	return directory.name;
+}
@@ -3,148 +3,357 @@
 // author: Max Kellermann <max.kellermann@ionos.com>
 
 #include "UnifiedWatch.hxx"
-#include "event/PipeEvent.hxx"
+#include "CgroupId.hxx"
+#include "Sampler.hxx"
+#include "WatchTrace.hxx"
+#include "WatchTraceFormat.hxx"
+#include "event/Loop.hxx"
 #include "io/FileAt.hxx"
 #include "io/Open.hxx"
 #include "io/UniqueFileDescriptor.hxx"
-#include "util/BindMethod.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "lib/fmt/ToBuffer.hxx"
+#include "util/IterableSplitString.hxx"
 #include "util/PrintException.hxx"
 #include "util/ScopeExit.hxx"
 #include "util/SpanCast.hxx"
+#include "util/StringSplit.hxx"
 
 #include <algorithm> // for std::binary_search()
+#include <functional> // for std::hash
+#include <optional>
+
+#include <fcntl.h> // for O_RDONLY
+#include <sys/inotify.h> // for IN_MODIFY
 
 using std::string_view_literals::operator""sv;
 
+/**
+ * Parse the "populated" field of a "cgroup.events" file.  Returns
+ * std::nullopt if the field is missing or malformed.
+ */
+[[gnu::pure]]
+static std::optional<bool>
+ParsePopulated(std::string_view contents) noexcept
+{
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [name, value] = Split(line, ' ');
+		if (name != "populated"sv)
+			continue;
+
+		if (value == "0"sv)
+			return false;
+		else if (value == "1"sv)
+			return true;
+		else
+			return std::nullopt;
+	}
+
+	return std::nullopt;
+}
+
 static bool
-IsPopulated(FileDescriptor fd) noexcept
+IsPopulated(std::span<const std::byte> buffer, ssize_t nbytes) noexcept
 {
-	std::byte buffer[4096];
-	ssize_t nbytes = fd.ReadAt(0, buffer);
 	if (nbytes <= 0)
 		return false;
 
-	const std::string_view contents = ToStringView(std::span{buffer}.first(nbytes));
-	return !contents.contains("populated 0"sv);
-}
+	const auto contents = ToStringView(buffer.first(nbytes));
 
-class UnifiedCgroupWatch::Group {
-	UnifiedCgroupWatch &parent;
+	/* if the file cannot be parsed, assume it is populated, to
+	   be on the safe side */
+	return ParsePopulated(contents).value_or(true);
+}
 
-	const std::string relative_path;
+static bool
+IsPopulated(FileDescriptor fd) noexcept
+{
+	std::byte buffer[256];
+	return IsPopulated(buffer, fd.ReadAt(0, buffer));
+}
 
-	/**
-	 * Polls for events on the "cgroup.events" file.
-	 */
-	PipeEvent event;
+inline
+UnifiedCgroupWatch::Group::Group(UnifiedCgroupWatch &_parent,
+				 Directory &_directory,
+				 FileDescriptor directory_fd,
+				 UniqueFileDescriptor &&_fd) noexcept
+	:InotifyWatch(_parent.GetInotifyManager()),
+	 parent(_parent), directory(_directory),
+	 id(ReadCgroupId(directory_fd)),
+	 event(parent.GetEventLoop(), BIND_THIS_METHOD(EventCallback),
+	       _fd.Release())
+{
+	assert(directory.data == nullptr);
+	directory.data = this;
+
+	if (parent.fd_budget)
+		/* don't keep the statistics files open; only read
+		   the birth time now, because the directory file
+		   descriptor is not available when the cgroup gets
+		   released */
+		(void)stat_files.GetBirthTime(directory_fd);
+	else
+		stat_files.Open(directory_fd);
+
+	if (event.IsDefined())
+		event.Schedule(event.EXCEPTIONAL);
+}
 
-public:
-	Group(UnifiedCgroupWatch &_parent,
-	      std::string_view _relative_path,
-	      UniqueFileDescriptor &&_fd) noexcept;
+inline
+UnifiedCgroupWatch::Group::~Group() noexcept
+{
+	assert(directory.data == this);
+	directory.data = nullptr;
 
-	~Group() noexcept {
+	if (event.IsDefined())
 		event.Close();
-	}
-
-	const std::string &GetRelativePath() noexcept {
-		return relative_path;
-	}
+}
 
-	[[gnu::pure]]
-	bool IsPopulated() const noexcept {
+bool
+UnifiedCgroupWatch::Group::IsPopulated() const noexcept
+{
+	if (event.IsDefined())
 		return ::IsPopulated(event.GetFileDescriptor());
-	}
 
-private:
-	void EventCallback(unsigned events) noexcept;
-};
+	/* inotify mode: there is no file descriptor for
+	   "cgroup.events" */
+	UniqueFileDescriptor fd;
+	if (!directory.OpenFile(fd, "cgroup.events", O_RDONLY))
+		return false;
 
-inline
-UnifiedCgroupWatch::Group::Group(UnifiedCgroupWatch &_parent,
-				 std::string_view _relative_path,
-				 UniqueFileDescriptor &&_fd) noexcept
-	:parent(_parent),
-	 relative_path(_relative_path),
-	 event(parent.GetEventLoop(), BIND_THIS_METHOD(EventCallback),
-	       _fd.Release())
+	return ::IsPopulated(fd);
+}
+
+bool
+UnifiedCgroupWatch::Group::IsPopulated(ReleaseTimeline &timeline,
+				       Event::TimePoint wakeup) const noexcept
 {
-	event.Schedule(event.EXCEPTIONAL);
+	timeline.wakeup = wakeup;
+
+	const auto start = timeline.Finish(ReleaseStage::WAKEUP, wakeup);
+	const bool populated = IsPopulated();
+	timeline.Finish(ReleaseStage::POPULATED, start);
+
+	parent.Trace(populated ? WatchTraceType::POPULATED : WatchTraceType::EMPTY,
+		     directory);
+
+	return populated;
+}
+
+void
+UnifiedCgroupWatch::Group::AddEventsWatch(FileDescriptor directory_fd)
+{
+	/* the watch is on the file and not on the directory (which
+	   is already watched by class TreeWatch): kernfs generates
+	   inotify events only for files whose inode is in the inode
+	   cache, and the watch pins it */
+	if (parent.fd_budget)
+		InotifyWatch::AddWatch((directory.GetAbsolutePath() + "/cgroup.events").c_str(),
+				       IN_MODIFY);
+	else
+		InotifyWatch::AddWatch(FmtBuffer<64>("/proc/self/fd/{}/cgroup.events",
+						     directory_fd.Get()),
+				       IN_MODIFY);
 }
 
 void
 UnifiedCgroupWatch::Group::EventCallback(unsigned) noexcept
 {
-	if (!IsPopulated())
-		parent.OnGroupEmpty(*this);
+	ReleaseTimeline timeline;
+	if (!IsPopulated(timeline, parent.GetEventLoop().SteadyNow()))
+		parent.OnGroupEmpty(*this, timeline);
+}
+
+void
+UnifiedCgroupWatch::Group::OnInotify(unsigned mask, const char *) noexcept
+{
+	if ((mask & IN_MODIFY) == 0 || check_pending)
+		return;
+
+	ReleaseTimeline timeline;
+	if (!IsPopulated(timeline, parent.GetEventLoop().SteadyNow()))
+		parent.OnGroupEmpty(*this, timeline);
 }
 
 UnifiedCgroupWatch::UnifiedCgroupWatch(EventLoop &event_loop,
 				       FileDescriptor cgroup2_mount,
+				       bool _use_inotify,
 				       Callback _callback)
 	:TreeWatch(event_loop, cgroup2_mount, "."),
-	 callback(_callback)
+	 callback(_callback),
+	 use_inotify(_use_inotify)
 {
 }
 
-UnifiedCgroupWatch::~UnifiedCgroupWatch() noexcept = default;
+UnifiedCgroupWatch::~UnifiedCgroupWatch() noexcept
+{
+	/* detach all groups before ~TreeWatch() frees the
+	   directories */
+	groups.clear_and_dispose([this](Group *group){
+		DeleteGroup(*group);
+	});
+}
 
 void
-UnifiedCgroupWatch::AddCgroup(std::string_view relative_path)
+UnifiedCgroupWatch::AddCgroups(std::span<const std::string_view> relative_paths)
 {
 	assert(!in_add);
 	in_add = true;
 	AtScopeExit(this) { in_add = false; };
 
-	TreeWatch::Add(relative_path);
+	if (trace != nullptr)
+		for (const auto i : relative_paths)
+			trace->Append(WatchTraceType::ADD, i);
+
+	TreeWatch::Add(relative_paths);
+
+	if (trace != nullptr)
+		trace->Append(WatchTraceType::SCANNED);
+
+	if (use_inotify)
+		/* in epoll mode, the initial epoll event does this;
+		   in inotify mode, it is postponed until the scan is
+		   complete, because OnGroupEmpty() needs to know
+		   whether there are child cgroups */
+		CheckNewGroups();
+}
+
+void
+UnifiedCgroupWatch::RemoveCgroup(std::string_view relative_path) noexcept
+{
+	if (trace != nullptr)
+		trace->Append(WatchTraceType::REMOVE, relative_path);
+
+	TreeWatch::Remove(relative_path);
+}
+
+void
+UnifiedCgroupWatch::CheckNewGroups() noexcept
+{
+	for (auto i = groups.begin(); i != groups.end();) {
+		/* advance the iterator first because OnGroupEmpty()
+		   may delete the group */
+		auto &group = *i;
+		++i;
+
+		if (group.check_pending) {
+			group.check_pending = false;
+
+			/* the event loop's cached time is stale
+			   during the initial scan */
+			ReleaseTimeline timeline;
+			if (!group.IsPopulated(timeline, Event::Clock::now()))
+				OnGroupEmpty(group, timeline);
+		}
+	}
 }
 
 void
 UnifiedCgroupWatch::ReAddCgroup(std::string_view relative_path) noexcept
 {
-	if (const auto fd = TreeWatch::Find(relative_path); fd.IsDefined()) {
+	auto *directory = FindDirectory(relative_path);
+	if (directory == nullptr || !directory->IsOpen() ||
+	    directory->data != nullptr)
+		return;
+
+	try {
+		auto &group = InsertGroup(*directory, false);
+
+		/* in inotify mode, there is no initial event, so
+		   check now whether the new process has already
+		   exited */
+		ReleaseTimeline timeline;
+		if (use_inotify &&
+		    !group.IsPopulated(timeline, GetEventLoop().SteadyNow()))
+			OnGroupEmpty(group, timeline);
+	} catch (...) {
+		PrintException(std::current_exception());
+	}
+}
+
+UnifiedCgroupWatch::Group &
+UnifiedCgroupWatch::InsertGroup(Directory &directory, bool discard)
+{
+	assert(directory.IsOpen());
+	assert(directory.data == nullptr);
+
+	/* in fd budget mode, this may reopen the directory
+	   temporarily */
+	UniqueFileDescriptor directory_fd_buffer;
+	const FileDescriptor directory_fd = directory.GetFd(directory_fd_buffer);
+	if (!directory_fd.IsDefined())
+		throw FmtErrno("Failed to open {}", directory.GetRelativePath());
+
+	UniqueFileDescriptor fd;
+	if (!use_inotify) {
+		fd = OpenReadOnly({directory_fd, "cgroup.events"});
+		if (discard)
+			/* discard the initial event by reading from
+			   the "cgroup.events" file */
+			IsPopulated(fd);
+	}
+
+	auto &group = group_pool.New(*this, directory, directory_fd,
+				     std::move(fd));
+	groups.push_back(group);
+
+	if (use_inotify) {
 		try {
-			InsertGroup(relative_path, fd, false);
+			group.AddEventsWatch(directory_fd);
 		} catch (...) {
-			PrintException(std::current_exception());
+			DeleteGroup(group);
+			throw;
 		}
+
+		if (in_add)
+			/* checked by CheckNewGroups() after
+			   TreeWatch::Add() returns */
+			group.check_pending = true;
 	}
+
+	return group;
+}
+
+inline void
+UnifiedCgroupWatch::Trace(WatchTraceType type,
+			  const Directory &directory) noexcept
+{
+	if (trace != nullptr)
+		trace->Append(type, directory.GetRelativePath());
+}
+
+inline void
+UnifiedCgroupWatch::DeleteGroup(Group &group) noexcept
+{
+	/* the Group destructor detaches it from the directory and
+	   AutoUnlinkIntrusiveListHook removes it from #groups */
+	group_pool.Delete(group);
+}
+
+inline void
+UnifiedCgroupWatch::ReleaseGroup(Group &group,
+				 ReleaseTimeline &timeline) noexcept
+{
+	if (trace != nullptr)
+		trace->Append(WatchTraceType::RELEASE,
+			      std::string_view{group.GetPath()}.substr(1));
+
+	callback(group, timeline);
+	DeleteGroup(group);
 }
 
 void
-UnifiedCgroupWatch::OnGroupEmpty(Group &group) noexcept
+UnifiedCgroupWatch::OnGroupEmpty(Group &group,
+				 ReleaseTimeline &timeline) noexcept
 {
-	if (!IsDirectoryEmpty(group.GetRelativePath()))
+	if (group.HasChildren())
 		/* there are still child cgroups, but they are
 		   unpopulated; they may be populated soon, so don't
 		   reap this cgroup yet; later, OnDirectoryEmpty() may
 		   do that */
 		return;
 
-	callback(("/" + group.GetRelativePath()).c_str());
-
-	auto i = groups.find(group.GetRelativePath());
-	assert(i != groups.end());
-	assert(&i->second == &group);
-	groups.erase(i);
-}
-
-void
-UnifiedCgroupWatch::InsertGroup(const std::string_view relative_path,
-				FileDescriptor directory_fd,
-				bool discard)
-{
-	auto fd = OpenReadOnly({directory_fd, "cgroup.events"});
-	if (discard)
-		/* discard the initial event by reading from the
-		   "cgroup.events" file */
-		IsPopulated(fd);
-
-	groups.emplace(std::piecewise_construct,
-		       std::forward_as_tuple(relative_path),
-		       std::forward_as_tuple(*this,
-					     relative_path,
-					     std::move(fd)));
+	ReleaseGroup(group, timeline);
 }
 
 bool
@@ -212,9 +421,15 @@ UnifiedCgroupWatch::ShouldSkipName(std::string_view name) const noexcept
 	return std::binary_search(std::begin(skip_names), std::end(skip_names), name);
 }
 
+bool
+UnifiedCgroupWatch::ShouldSkipChild(std::string_view name) const noexcept
+{
+	return n_shards > 1 &&
+		std::hash<std::string_view>{}(name) % n_shards != shard_index;
+}
+
 void
-UnifiedCgroupWatch::OnDirectoryCreated(const std::string_view relative_path,
-				       FileDescriptor directory_fd) noexcept
+UnifiedCgroupWatch::OnDirectoryCreated(Directory &directory) noexcept
 {
 	try {
 		/* if this new cgroup was just created, call
@@ -222,38 +437,53 @@ UnifiedCgroupWatch::OnDirectoryCreated(const std::string_view relative_path,
 		   don't want to auto-delete if it it's empty, because
 		   we already know it's empty; delete empty cgroups
 		   immediately only during the initial scan, i.e. from
-		   inside AddCgroup() */
+		   inside AddCgroups() */
 		const bool discard = !in_add;
 
-		InsertGroup(relative_path, directory_fd, discard);
+		if (in_add)
+			Trace(WatchTraceType::SCAN, directory);
+
+		InsertGroup(directory, discard);
 	} catch (...) {
 		PrintException(std::current_exception());
 	}
 }
 
 void
-UnifiedCgroupWatch::OnDirectoryEmpty(std::string_view relative_path) noexcept
+UnifiedCgroupWatch::OnDirectoryEmpty(Directory &directory) noexcept
 {
-	auto i = groups.find(relative_path);
-	if (i == groups.end())
+	auto *group = static_cast<Group *>(directory.data);
+	if (group == nullptr)
 		return;
 
-	auto &group = i->second;
-	if (group.IsPopulated())
+	ReleaseTimeline timeline;
+	if (group->IsPopulated(timeline, GetEventLoop().SteadyNow()))
 		/* the last child cgroup was deleted, but this one is
 		   still populated, so don't reap it */
 		return;
 
-	callback(("/" + group.GetRelativePath()).c_str());
-	groups.erase(i);
+	ReleaseGroup(*group, timeline);
+}
+
+void
+UnifiedCgroupWatch::OnDirectoryDeleted(Directory &directory) noexcept
+{
+	if (auto *group = static_cast<Group *>(directory.data))
+		DeleteGroup(*group);
 }
 
 void
-UnifiedCgroupWatch::OnDirectoryDeleted(const std::string_view relative_path) noexcept
+UnifiedCgroupWatch::OnEventsLost() noexcept
 {
-	auto i = groups.find(relative_path);
-	if (i == groups.end())
+	if (!use_inotify)
+		/* the "cgroup.events" notifications come from epoll,
+		   which does not lose them */
 		return;
 
-	groups.erase(i);
+	/* some of the IN_MODIFY events on "cgroup.events" may have
+	   been lost; check all groups again */
+	for (auto &group : groups)
+		group.check_pending = true;
+
+	CheckNewGroups();
 }
@@ -5,29 +5,284 @@
 #pragma once
 
 #include "TreeWatch.hxx"
+#include "CgroupAccounting.hxx"
+#include "Latency.hxx"
+#include "NodePool.hxx"
+#include "event/PipeEvent.hxx"
+#include "util/BindMethod.hxx"
+#include "util/IntrusiveList.hxx"
 
-#include <map>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
 
+struct CgroupSample;
+
 /**
  * Watch events in the "unified" (v2) cgroup hierarchy.
  */
 class UnifiedCgroupWatch final : TreeWatch {
-	typedef BoundMethod<void(const char *relative_path) noexcept> Callback;
+public:
+	/**
+	 * The state of one watched cgroup.  It is attached to the
+	 * #TreeWatch directory (see Directory::data), so there is no
+	 * separate lookup table.
+	 */
+	class Group final
+		: public DirectoryData, public AutoUnlinkIntrusiveListHook,
+		  InotifyWatch
+	{
+		UnifiedCgroupWatch &parent;
+
+		Directory &directory;
+
+		/**
+		 * The kernel's cgroup ID (or 0 if unknown).
+		 */
+		const uint_least64_t id;
+
+		/**
+		 * Polls for events on the "cgroup.events" file.  In
+		 * inotify mode, this is not used; instead, an inotify
+		 * watch on that file is registered with the
+		 * #TreeWatch's #InotifyManager (see AddEventsWatch()).
+		 */
+		PipeEvent event;
+
+		/**
+		 * The statistics files, opened in advance so releasing the
+		 * cgroup doesn't need to look them up.
+		 */
+		CgroupStatFiles stat_files;
+
+	public:
+		/**
+		 * Inotify mode only: the cgroup was found by the
+		 * initial scan, and CheckNewGroups() has not yet
+		 * checked whether it is empty.
+		 */
+		bool check_pending = false;
+
+		/**
+		 * The previous live sample (see #CgroupSampler);
+		 * nullptr if this cgroup has not been sampled yet.
+		 */
+		std::unique_ptr<CgroupSample> sample;
+
+		/**
+		 * @param directory_fd the cgroup directory (which may
+		 * have been reopened in fd budget mode)
+		 * @param _fd the "cgroup.events" file (undefined in
+		 * inotify mode)
+		 */
+		Group(UnifiedCgroupWatch &_parent, Directory &_directory,
+		      FileDescriptor directory_fd,
+		      UniqueFileDescriptor &&_fd) noexcept;
+		~Group() noexcept;
+
+		Group(const Group &) = delete;
+		Group &operator=(const Group &) = delete;
+
+		uint_least64_t GetId() const noexcept {
+			return id;
+		}
+
+		/**
+		 * Build the cgroup path with a leading slash.
+		 */
+		std::string GetPath() const noexcept {
+			return directory.GetRelativePath("/");
+		}
+
+		/**
+		 * Returns the (O_PATH) file descriptor of the cgroup
+		 * directory.  It is undefined in fd budget mode; use
+		 * the other overload if one is really needed.
+		 */
+		FileDescriptor GetDirectoryFd() const noexcept {
+			return directory.fd;
+		}
+
+		/**
+		 * Like GetDirectoryFd(), but reopen the directory in
+		 * fd budget mode (see TreeWatch::Directory::GetFd()).
+		 */
+		FileDescriptor GetDirectoryFd(UniqueFileDescriptor &buffer) const noexcept {
+			return directory.GetFd(buffer);
+		}
+
+		CgroupStatFiles &GetStatFiles() noexcept {
+			return stat_files;
+		}
+
+		bool HasChildren() const noexcept {
+			return directory.HasChildren();
+		}
+
+		[[gnu::pure]]
+		bool IsPopulated() const noexcept;
+
+		/**
+		 * Like IsPopulated(), but start a #ReleaseTimeline
+		 * (with the stages WAKEUP and POPULATED).
+		 *
+		 * @param wakeup the time the event loop woke up for
+		 * the event being handled
+		 */
+		bool IsPopulated(ReleaseTimeline &timeline,
+				 Event::TimePoint wakeup) const noexcept;
+
+		/**
+		 * Inotify mode only: watch IN_MODIFY on the
+		 * "cgroup.events" file.
+		 *
+		 * @param directory_fd the cgroup directory (not used
+		 * in fd budget mode, where the watch is added by the
+		 * absolute path)
+		 *
+		 * Throws on error.
+		 */
+		void AddEventsWatch(FileDescriptor directory_fd);
+
+	private:
+		void EventCallback(unsigned events) noexcept;
+
+		// virtual methods from InotifyWatch
+		void OnInotify(unsigned mask, const char *name) noexcept override;
+	};
+
+private:
+	typedef BoundMethod<void(Group &group,
+				 ReleaseTimeline &timeline) noexcept> Callback;
 	const Callback callback;
 
-	class Group;
+	/**
+	 * Allocator for all #Group objects.
+	 */
+	NodePool<Group> group_pool;
 
-	std::map<std::string, Group, std::less<>> groups;
+	/**
+	 * All #Group instances; this list is used to free them in the
+	 * destructor and by CheckNewGroups().
+	 */
+	IntrusiveList<Group> groups;
+
+	/**
+	 * Detect empty cgroups with an inotify watch on each
+	 * "cgroup.events" file instead of registering it in epoll?
+	 */
+	const bool use_inotify;
+
+	/**
+	 * Don't keep file descriptors for each cgroup (see
+	 * EnableFdBudget())?
+	 */
+	bool fd_budget = false;
 
 	bool in_add = false;
 
+	/**
+	 * This object handles only the children of added cgroups
+	 * whose name hash modulo #n_shards equals #shard_index (see
+	 * SetShard()).
+	 */
+	std::size_t shard_index = 0, n_shards = 1;
+
 public:
+	/**
+	 * @param _use_inotify detect empty cgroups with inotify
+	 * instead of epoll
+	 */
 	UnifiedCgroupWatch(EventLoop &event_loop, FileDescriptor cgroup2_mount,
+			   bool _use_inotify,
 			   Callback _callback);
 	~UnifiedCgroupWatch() noexcept;
 
-	void AddCgroup(std::string_view relative_path);
+	using TreeWatch::GetDirectoryCount;
+	using TreeWatch::SetTrace;
+
+	/**
+	 * Enable fd budget mode (see TreeWatch::EnableFdBudget()):
+	 * keep no file descriptor for each cgroup; the directories
+	 * and the "cgroup.events" files are reopened by their paths
+	 * when needed, and the statistics files are not opened in
+	 * advance.  This requires inotify mode.  Must be called
+	 * before AddCgroups().
+	 *
+	 * Throws on error.
+	 */
+	void EnableFdBudget() {
+		assert(use_inotify);
+
+		TreeWatch::EnableFdBudget();
+		fd_budget = true;
+	}
+
+	/**
+	 * Returns the number of inotify watches registered by this
+	 * object: one per directory and (in inotify mode) one per
+	 * "cgroup.events" file.
+	 */
+	[[gnu::pure]]
+	std::size_t GetWatchCount() const noexcept {
+		return GetDirectoryCount() + 1 +
+			(use_inotify ? group_pool.size() : 0);
+	}
+
+	/**
+	 * Handle only a part of the children of each added cgroup
+	 * (and their subtrees); the other parts are handled by other
+	 * #UnifiedCgroupWatch instances (with different indexes),
+	 * usually in other threads.  Must be called before
+	 * AddCgroups().
+	 */
+	void SetShard(std::size_t _index, std::size_t _n) noexcept {
+		shard_index = _index;
+		n_shards = _n;
+	}
+
+	/**
+	 * Invoke a function for up to @n groups, beginning with the
+	 * one which was visited least recently, and move them to the
+	 * end of the list.  Each group is visited at most once per
+	 * call.  The function must not delete groups.
+	 */
+	void VisitOldestGroups(std::size_t n, auto &&f) {
+		const Group *first = nullptr;
+
+		for (; n > 0 && !groups.empty(); --n) {
+			auto &group = groups.front();
+			if (&group == first)
+				/* all groups have been visited */
+				break;
+
+			if (first == nullptr)
+				first = &group;
+
+			groups.pop_front();
+			groups.push_back(group);
+			f(group);
+		}
+	}
+
+	void AddCgroup(std::string_view relative_path) {
+		AddCgroups({&relative_path, 1});
+	}
+
+	/**
+	 * Add multiple cgroups; their subtrees are scanned in
+	 * parallel (see TreeWatch::Add()).
+	 */
+	void AddCgroups(std::span<const std::string_view> relative_paths);
+
+	/**
+	 * Stop watching a cgroup which was added with AddCgroup() and
+	 * its subtree.  Its groups are freed without invoking the
+	 * callback, i.e. they will not be released by this object.
+	 */
+	void RemoveCgroup(std::string_view relative_path) noexcept;
 
 	/**
 	 * Re-add a cgroup that is still registered in #TreeWatch.
@@ -39,23 +294,44 @@ public:
 
 private:
 	/**
-	 * Insert a new #Group instance into the #groups map.
+	 * Create a new #Group instance and attach it to the
+	 * directory.
 	 *
 	 * Throws on error.
 	 *
-	 * @param directory_fd the cgorup directory #FileDescriptor
 	 * @param discard true to discard the initial event
 	 */
-	void InsertGroup(const std::string_view relative_path,
-			 FileDescriptor directory_fd,
-			 bool discard);
+	Group &InsertGroup(Directory &directory, bool discard);
+
+	/**
+	 * Inotify mode only: check all groups with
+	 * Group::check_pending.
+	 */
+	void CheckNewGroups() noexcept;
+
+	/**
+	 * Record an event concerning the given directory in the
+	 * trace (if there is one).
+	 */
+	void Trace(WatchTraceType type, const Directory &directory) noexcept;
+
+	/**
+	 * Free the #Group (which detaches it from its directory).
+	 */
+	void DeleteGroup(Group &group) noexcept;
+
+	/**
+	 * Invoke the callback and free the #Group.
+	 */
+	void ReleaseGroup(Group &group, ReleaseTimeline &timeline) noexcept;
 
-	void OnGroupEmpty(Group &group) noexcept;
+	void OnGroupEmpty(Group &group, ReleaseTimeline &timeline) noexcept;
 
 protected:
 	bool ShouldSkipName(std::string_view name) const noexcept override;
-	void OnDirectoryCreated(std::string_view relative_path,
-				FileDescriptor directory_fd) noexcept override;
-	void OnDirectoryEmpty(std::string_view relative_path) noexcept override;
-	void OnDirectoryDeleted(std::string_view relative_path) noexcept override;
+	bool ShouldSkipChild(std::string_view name) const noexcept override;
+	void OnDirectoryCreated(Directory &directory) noexcept override;
+	void OnDirectoryEmpty(Directory &directory) noexcept override;
+	void OnDirectoryDeleted(Directory &directory) noexcept override;
+	void OnEventsLost() noexcept override;
 };
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WatchTrace.hxx"
+#include "WatchTraceFormat.hxx"
+#include "ArchiveFormat.hxx" // for WriteVarint()
+#include "lib/fmt/SystemError.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::mismatch()
+#include <cstring> // for std::memcpy()
+
+#include <fcntl.h>
+
+using std::chrono_literals::operator""s;
+
+WatchTraceWriter::WatchTraceWriter(EventLoop &event_loop, const char *path)
+	:flush_timer(event_loop, BIND_THIS_METHOD(Flush)),
+	 buffer(std::make_unique_for_overwrite<std::byte[]>(BUFFER_SIZE)),
+	 last_time(std::chrono::steady_clock::now())
+{
+	if (!fd.Open(path, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC, 0600))
+		throw FmtErrno("Failed to create {}", path);
+
+	const WatchTraceHeader header{
+		.magic = WATCH_TRACE_MAGIC,
+		.start = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()),
+	};
+
+	if (fd.Write(ReferenceAsBytes(header)) != sizeof(header))
+		throw FmtErrno("Failed to write {}", path);
+}
+
+WatchTraceWriter::~WatchTraceWriter() noexcept
+{
+	Flush();
+}
+
+void
+WatchTraceWriter::Flush() noexcept
+{
+	flush_timer.Cancel();
+
+	if (fill == 0 || !fd.IsDefined())
+		return;
+
+	const auto nbytes = fd.Write({buffer.get(), fill});
+	if (nbytes < 0 || static_cast<std::size_t>(nbytes) != fill) {
+		fmt::print(stderr, "Failed to write watch trace, stopping\n");
+		fd.Close();
+	}
+
+	fill = 0;
+}
+
+std::byte *
+WatchTraceWriter::BeginRecord(WatchTraceType type, std::size_t n) noexcept
+{
+	n += 1 + MAX_VARINT_SIZE;
+	if (n > BUFFER_SIZE)
+		/* cannot happen with sane paths */
+		return nullptr;
+
+	if (fill + n > BUFFER_SIZE)
+		Flush();
+
+	if (!fd.IsDefined())
+		return nullptr;
+
+	const auto now = std::chrono::steady_clock::now();
+	const auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - last_time);
+	last_time = now;
+
+	std::byte *p = buffer.get() + fill;
+	*p++ = static_cast<std::byte>(type);
+	return WriteVarint(p, delta.count());
+}
+
+inline void
+WatchTraceWriter::CommitRecord(std::byte *end) noexcept
+{
+	const bool was_empty = fill == 0;
+
+	fill = end - buffer.get();
+
+	if (was_empty)
+		flush_timer.Schedule(1s);
+}
+
+void
+WatchTraceWriter::Append(WatchTraceType type, std::string_view path) noexcept
+{
+	std::byte *p = BeginRecord(type, 2 * MAX_VARINT_SIZE + path.size());
+	if (p == nullptr)
+		return;
+
+	const std::size_t common = std::mismatch(path.begin(), path.end(),
+						 last_path.begin(), last_path.end()).first - path.begin();
+	const std::string_view tail = path.substr(common);
+
+	p = WriteVarint(p, common);
+	p = WriteVarint(p, tail.size());
+	std::memcpy(p, tail.data(), tail.size());
+	CommitRecord(p + tail.size());
+
+	last_path.assign(path);
+}
+
+void
+WatchTraceWriter::Append(WatchTraceType type) noexcept
+{
+	if (std::byte *p = BeginRecord(type, 0))
+		CommitRecord(p);
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include "event/CoarseTimerEvent.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+enum class WatchTraceType : uint8_t;
+
+/**
+ * Records the events seen by #TreeWatch and #UnifiedCgroupWatch in
+ * a compact binary trace file (see WatchTraceFormat.hxx), which can
+ * be replayed later for debugging and benchmarking.
+ *
+ * Records are collected in a buffer which is written when it is
+ * full and (at the latest) one second after the first record was
+ * added to it.
+ */
+class WatchTraceWriter final {
+	static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+	UniqueFileDescriptor fd;
+
+	CoarseTimerEvent flush_timer;
+
+	const std::unique_ptr<std::byte[]> buffer;
+
+	/**
+	 * The number of bytes in #buffer.
+	 */
+	std::size_t fill = 0;
+
+	/**
+	 * The path of the previous record; the next one is encoded
+	 * relative to it.
+	 */
+	std::string last_path;
+
+	std::chrono::steady_clock::time_point last_time;
+
+public:
+	/**
+	 * Create (or truncate) the trace file and write the header.
+	 *
+	 * Throws on error.
+	 */
+	WatchTraceWriter(EventLoop &event_loop, const char *path);
+
+	/**
+	 * Flush the buffer.
+	 */
+	~WatchTraceWriter() noexcept;
+
+	WatchTraceWriter(const WatchTraceWriter &) = delete;
+	WatchTraceWriter &operator=(const WatchTraceWriter &) = delete;
+
+	/**
+	 * Append a record with a cgroup path (relative to the
+	 * cgroup2 mount, without a leading slash).
+	 */
+	void Append(WatchTraceType type, std::string_view path) noexcept;
+
+	/**
+	 * Append a record without a path.
+	 */
+	void Append(WatchTraceType type) noexcept;
+
+	/**
+	 * Write the buffer to the file.  After a write error, the
+	 * error is logged and tracing is stopped.
+	 */
+	void Flush() noexcept;
+
+private:
+	/**
+	 * Make sure that the buffer has room for @n more bytes
+	 * (flushing it if necessary), write the record type and the
+	 * time.
+	 *
+	 * @return a pointer to the end of the record or nullptr if
+	 * tracing has been stopped
+	 */
+	std::byte *BeginRecord(WatchTraceType type, std::size_t n) noexcept;
+
+	void CommitRecord(std::byte *end) noexcept;
+};
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * The file format of the traces written by #WatchTraceWriter (see
+ * the "watch_trace" setting) and read by #WatchTraceReader.
+ *
+ * A trace begins with a #WatchTraceHeader which is followed by
+ * records.  Each record starts with one #WatchTraceType byte and the
+ * number of microseconds since the previous record (or, for the
+ * first one, since WatchTraceHeader::start) as an unsigned LEB128
+ * varint (see ArchiveFormat.hxx).  All record types except SCANNED
+ * are followed by a cgroup path (relative to the cgroup2 mount,
+ * without a leading slash): the number of leading bytes it shares
+ * with the path of the previous record, the number of remaining
+ * bytes (both varints) and these bytes.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+static constexpr std::array<char, 8> WATCH_TRACE_MAGIC{
+	'C', 'M', '4', 'W', 'T', 'R', 'C', '1',
+};
+
+struct WatchTraceHeader {
+	std::array<char, 8> magic;
+
+	/**
+	 * The wall-clock time the trace was started in microseconds
+	 * since the epoch.
+	 */
+	uint64_t start;
+};
+
+enum class WatchTraceType : uint8_t {
+	/**
+	 * A cgroup was passed to UnifiedCgroupWatch::AddCgroups().
+	 */
+	ADD = 1,
+
+	/**
+	 * A cgroup was passed to UnifiedCgroupWatch::RemoveCgroup().
+	 */
+	REMOVE = 2,
+
+	/**
+	 * A cgroup was found by the scan of a cgroup being added.
+	 */
+	SCAN = 3,
+
+	/**
+	 * UnifiedCgroupWatch::AddCgroups() has finished scanning.
+	 */
+	SCANNED = 4,
+
+	/**
+	 * A directory was created or moved into a watched directory
+	 * (IN_CREATE, IN_MOVED_TO).
+	 */
+	CREATE = 5,
+
+	/**
+	 * A directory was deleted or moved out of a watched directory
+	 * (IN_DELETE, IN_MOVED_FROM).
+	 */
+	DELETE = 6,
+
+	/**
+	 * The "cgroup.events" file was read after an event and said
+	 * "populated 1".
+	 */
+	POPULATED = 7,
+
+	/**
+	 * The "cgroup.events" file was read after an event and said
+	 * "populated 0".
+	 */
+	EMPTY = 8,
+
+	/**
+	 * The cgroup was passed to the release callback.
+	 */
+	RELEASE = 9,
+};
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "WatchTraceReader.hxx"
+#include "WatchTraceFormat.hxx"
+#include "ArchiveFormat.hxx" // for ReadVarint()
+#include "io/FileDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+[[noreturn]]
+static void
+ThrowMalformed()
+{
+	throw std::runtime_error{"Malformed watch trace"};
+}
+
+static uint_least64_t
+ReadVarintOrThrow(std::span<const std::byte> &src)
+{
+	uint_least64_t value;
+	if (!ReadVarint(src, value))
+		ThrowMalformed();
+	return value;
+}
+
+WatchTraceReader::WatchTraceReader(FileDescriptor fd)
+{
+	struct stat st;
+	if (fstat(fd.Get(), &st) < 0)
+		throw MakeErrno("Failed to stat watch trace");
+
+	if (static_cast<std::size_t>(st.st_size) < sizeof(WatchTraceHeader))
+		throw std::runtime_error{"Truncated watch trace"};
+
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.Get(), 0);
+	if (p == MAP_FAILED)
+		throw MakeErrno("Failed to map watch trace");
+
+	mapping = {static_cast<const std::byte *>(p), static_cast<std::size_t>(st.st_size)};
+
+	const auto &header = *static_cast<const WatchTraceHeader *>(p);
+	if (header.magic != WATCH_TRACE_MAGIC) {
+		munmap(p, mapping.size());
+		throw std::runtime_error{"Not a watch trace"};
+	}
+
+	start = std::chrono::system_clock::time_point{std::chrono::microseconds{header.start}};
+	remaining = mapping.subspan(sizeof(header));
+}
+
+WatchTraceReader::~WatchTraceReader() noexcept
+{
+	munmap(const_cast<std::byte *>(mapping.data()), mapping.size());
+}
+
+bool
+WatchTraceReader::Read(WatchTraceRecord &record)
+{
+	if (remaining.empty())
+		return false;
+
+	const auto type = static_cast<WatchTraceType>(remaining.front());
+	if (type < WatchTraceType::ADD || type > WatchTraceType::RELEASE)
+		ThrowMalformed();
+
+	remaining = remaining.subspan(1);
+
+	last_time += std::chrono::microseconds{ReadVarintOrThrow(remaining)};
+
+	record.type = type;
+	record.time = last_time;
+
+	if (type == WatchTraceType::SCANNED) {
+		record.path.clear();
+		return true;
+	}
+
+	const auto common = ReadVarintOrThrow(remaining);
+	const auto length = ReadVarintOrThrow(remaining);
+	if (common > last_path.size() || length > remaining.size())
+		ThrowMalformed();
+
+	last_path.resize(common);
+	last_path.append(reinterpret_cast<const char *>(remaining.data()), length);
+	remaining = remaining.subspan(length);
+
+	record.path = last_path;
+	return true;
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+class FileDescriptor;
+enum class WatchTraceType : uint8_t;
+
+/**
+ * A record decoded from a watch trace.
+ */
+struct WatchTraceRecord {
+	WatchTraceType type;
+
+	/**
+	 * The time of this record relative to the start of the
+	 * trace.
+	 */
+	std::chrono::microseconds time;
+
+	/**
+	 * The cgroup path (relative to the cgroup2 mount, without a
+	 * leading slash); empty for SCANNED records.  This string
+	 * is reused for the next record.
+	 */
+	std::string path;
+};
+
+/**
+ * Reads the records of a watch trace (see WatchTraceFormat.hxx)
+ * from a read-only mapping.
+ */
+class WatchTraceReader {
+	std::span<const std::byte> mapping;
+
+	/**
+	 * The records which have not yet been read.
+	 */
+	std::span<const std::byte> remaining;
+
+	std::chrono::system_clock::time_point start;
+
+	std::chrono::microseconds last_time{};
+
+	/**
+	 * The path of the previous record.
+	 */
+	std::string last_path;
+
+public:
+	/**
+	 * Map the file.
+	 *
+	 * Throws on error.
+	 */
+	explicit WatchTraceReader(FileDescriptor fd);
+
+	~WatchTraceReader() noexcept;
+
+	WatchTraceReader(const WatchTraceReader &) = delete;
+	WatchTraceReader &operator=(const WatchTraceReader &) = delete;
+
+	/**
+	 * The wall-clock time the trace was started.
+	 */
+	std::chrono::system_clock::time_point GetStart() const noexcept {
+		return start;
+	}
+
+	/**
+	 * Decode the next record.
+	 *
+	 * Throws if the trace is malformed.
+	 *
+	 * @return false if there are no more records
+	 */
+	bool Read(WatchTraceRecord &record);
+};
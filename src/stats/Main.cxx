@@ -0,0 +1,550 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * cm4all-spawn-stats: query the accounting archive written by
+ * cm4all-spawn-reaper (see "archive_directory" in reaper.lua).
+ */
+
+#include "reaper/ArchiveReader.hxx"
+#include "io/DirectoryReader.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "time/ISO8601.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath> // for std::floor()
+#include <cstdlib>
+#include <functional> // for std::greater
+#include <map>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::string_view_literals::operator""sv;
+
+struct Usage {};
+
+enum class Command {
+	SUM,
+	TOP,
+	PERCENTILES,
+};
+
+enum class Metric {
+	CPU,
+	CPU_USER,
+	CPU_SYSTEM,
+	MEMORY,
+	OOM,
+	PIDS,
+	FORKS,
+};
+
+struct Options {
+	const char *directory = "/var/lib/cm4all-spawn-reaper";
+
+	std::optional<std::chrono::sys_days> since, until;
+
+	/**
+	 * Only cgroups below this path.
+	 */
+	std::string_view prefix;
+
+	/**
+	 * Group by this number of leading path components.
+	 */
+	std::size_t depth = 0;
+
+	/**
+	 * The number of cgroups printed by "top".
+	 */
+	std::size_t limit = 10;
+
+	Command command;
+
+	Metric metric = Metric::CPU;
+};
+
+static std::optional<Metric>
+ParseMetric(std::string_view s) noexcept
+{
+	if (s == "cpu"sv)
+		return Metric::CPU;
+	else if (s == "cpu_user"sv)
+		return Metric::CPU_USER;
+	else if (s == "cpu_system"sv)
+		return Metric::CPU_SYSTEM;
+	else if (s == "memory"sv)
+		return Metric::MEMORY;
+	else if (s == "oom"sv)
+		return Metric::OOM;
+	else if (s == "pids"sv)
+		return Metric::PIDS;
+	else if (s == "forks"sv)
+		return Metric::FORKS;
+	else
+		return std::nullopt;
+}
+
+static constexpr bool
+IsTimeMetric(Metric metric) noexcept
+{
+	return metric == Metric::CPU || metric == Metric::CPU_USER ||
+		metric == Metric::CPU_SYSTEM;
+}
+
+/**
+ * Returns the value of the metric or std::nullopt if it was not
+ * recorded for this cgroup.
+ */
+static std::optional<double>
+GetMetric(Metric metric, const CgroupResourceUsage &u) noexcept
+{
+	const auto cpu = [](CgroupCpuStat::Duration d) -> std::optional<double> {
+		if (d.count() < 0)
+			return std::nullopt;
+		return d.count();
+	};
+
+	const auto optional = [](bool have, auto value) -> std::optional<double> {
+		if (!have)
+			return std::nullopt;
+		return static_cast<double>(value);
+	};
+
+	switch (metric) {
+	case Metric::CPU:
+		return cpu(u.cpu.total);
+
+	case Metric::CPU_USER:
+		return cpu(u.cpu.user);
+
+	case Metric::CPU_SYSTEM:
+		return cpu(u.cpu.system);
+
+	case Metric::MEMORY:
+		return optional(u.have_memory_peak, u.memory_peak);
+
+	case Metric::OOM:
+		return optional(u.have_memory_events_oom, u.memory_events_oom);
+
+	case Metric::PIDS:
+		return optional(u.have_pids_peak, u.pids_peak);
+
+	case Metric::FORKS:
+		return optional(u.have_pids_forks, u.pids_forks);
+	}
+
+	return std::nullopt;
+}
+
+static std::string
+FormatMetric(Metric metric, double value)
+{
+	return IsTimeMetric(metric)
+		? fmt::format("{:.3f}", value)
+		: fmt::format("{:.0f}", value);
+}
+
+/**
+ * Parse "YYYY-MM-DD", "today" or "yesterday" (UTC).
+ */
+static std::optional<std::chrono::sys_days>
+ParseDate(std::string_view s) noexcept
+{
+	const auto today = std::chrono::floor<std::chrono::days>(std::chrono::system_clock::now());
+	if (s == "today"sv)
+		return today;
+	else if (s == "yesterday"sv)
+		return today - std::chrono::days{1};
+
+	int y;
+	unsigned m, d;
+	const char *p = s.data(), *const end = s.data() + s.size();
+
+	auto r = std::from_chars(p, end, y);
+	if (r.ec != std::errc{} || r.ptr == end || *r.ptr != '-')
+		return std::nullopt;
+
+	r = std::from_chars(r.ptr + 1, end, m);
+	if (r.ec != std::errc{} || r.ptr == end || *r.ptr != '-')
+		return std::nullopt;
+
+	r = std::from_chars(r.ptr + 1, end, d);
+	if (r.ec != std::errc{} || r.ptr != end)
+		return std::nullopt;
+
+	const std::chrono::year_month_day ymd{
+		std::chrono::year{y}, std::chrono::month{m}, std::chrono::day{d},
+	};
+	if (!ymd.ok())
+		return std::nullopt;
+
+	return std::chrono::sys_days{ymd};
+}
+
+static std::size_t
+ParseSize(std::string_view s)
+{
+	std::size_t value;
+	const auto r = std::from_chars(s.data(), s.data() + s.size(), value);
+	if (r.ec != std::errc{} || r.ptr != s.data() + s.size())
+		throw Usage{};
+	return value;
+}
+
+static Options
+ParseCommandLine(int argc, char **argv)
+{
+	Options options;
+	std::vector<std::string_view> args;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string_view arg = argv[i];
+		if (!arg.starts_with("--"sv)) {
+			args.push_back(arg);
+			continue;
+		}
+
+		const auto eq = arg.find('=');
+		if (eq == arg.npos)
+			throw Usage{};
+
+		const auto name = arg.substr(2, eq - 2);
+		const auto value = arg.substr(eq + 1);
+
+		if (name == "directory"sv)
+			options.directory = argv[i] + eq + 1;
+		else if (name == "since"sv) {
+			if (options.since = ParseDate(value); !options.since)
+				throw Usage{};
+		} else if (name == "until"sv) {
+			if (options.until = ParseDate(value); !options.until)
+				throw Usage{};
+		} else if (name == "date"sv) {
+			if (options.since = options.until = ParseDate(value); !options.since)
+				throw Usage{};
+		} else if (name == "prefix"sv)
+			options.prefix = value;
+		else if (name == "depth"sv)
+			options.depth = ParseSize(value);
+		else if (name == "limit"sv)
+			options.limit = ParseSize(value);
+		else
+			throw Usage{};
+	}
+
+	if (args.empty() || args.size() > 2)
+		throw Usage{};
+
+	if (args.front() == "sum"sv)
+		options.command = Command::SUM;
+	else if (args.front() == "top"sv)
+		options.command = Command::TOP;
+	else if (args.front() == "percentiles"sv)
+		options.command = Command::PERCENTILES;
+	else
+		throw Usage{};
+
+	if (args.size() > 1) {
+		const auto metric = ParseMetric(args[1]);
+		if (!metric)
+			throw Usage{};
+		options.metric = *metric;
+	}
+
+	/* strip trailing slashes from the prefix */
+	while (options.prefix.ends_with('/'))
+		options.prefix.remove_suffix(1);
+
+	return options;
+}
+
+/**
+ * Parse a segment file name ("YYYY-MM-DD.acct").
+ */
+static std::optional<std::chrono::sys_days>
+ParseSegmentName(std::string_view name) noexcept
+{
+	if (!name.ends_with(".acct"sv))
+		return std::nullopt;
+
+	name.remove_suffix(5);
+	if (name.size() != 10)
+		return std::nullopt;
+
+	return ParseDate(name);
+}
+
+/**
+ * Find all segment files in the range specified by the options,
+ * sorted by date.
+ */
+static std::vector<std::string>
+FindSegments(const Options &options)
+{
+	std::vector<std::pair<std::chrono::sys_days, std::string>> segments;
+
+	DirectoryReader reader{OpenDirectory(options.directory)};
+	while (const char *name = reader.Read()) {
+		const auto day = ParseSegmentName(name);
+		if (!day ||
+		    (options.since && *day < *options.since) ||
+		    (options.until && *day > *options.until))
+			continue;
+
+		segments.emplace_back(*day, name);
+	}
+
+	std::sort(segments.begin(), segments.end());
+
+	std::vector<std::string> result;
+	result.reserve(segments.size());
+	for (auto &i : segments)
+		result.emplace_back(std::move(i.second));
+	return result;
+}
+
+/**
+ * Does the cgroup (given as parent path and name) match the
+ * prefix?  That is the case if it is the prefix or if it is below
+ * it.
+ */
+[[gnu::pure]]
+static bool
+MatchPrefix(std::string_view parent, std::string_view name,
+	    std::string_view prefix) noexcept
+{
+	if (prefix.empty())
+		return true;
+
+	if (prefix.size() <= parent.size())
+		return parent.starts_with(prefix) &&
+			(parent.size() == prefix.size() ||
+			 parent[prefix.size()] == '/');
+
+	return prefix.starts_with(parent) &&
+		prefix[parent.size()] == '/' &&
+		prefix.substr(parent.size() + 1) == name;
+}
+
+/**
+ * Returns the first #depth components of the path.
+ */
+[[gnu::pure]]
+static std::string_view
+GetGroup(std::string_view path, std::size_t depth) noexcept
+{
+	std::size_t end = 0;
+	for (std::size_t i = 0; i < depth; ++i) {
+		const auto slash = path.find('/', end + 1);
+		if (slash == path.npos)
+			return path;
+		end = slash;
+	}
+
+	return path.substr(0, end);
+}
+
+/**
+ * Invoke a function for each matching record in all selected
+ * segments.
+ */
+static void
+ForEachRecord(const Options &options, auto &&f)
+{
+	const auto directory_fd = OpenDirectory(options.directory);
+
+	std::string path;
+
+	for (const auto &name : FindSegments(options)) {
+		ArchiveReader reader{OpenReadOnly({directory_fd, name.c_str()})};
+		ArchiveRecord record;
+
+		while (reader.Read(record)) {
+			if (!MatchPrefix(record.parent, record.name, options.prefix))
+				continue;
+
+			const auto value = GetMetric(options.metric, record.usage);
+			if (!value)
+				continue;
+
+			path.assign(record.parent);
+			path.push_back('/');
+			path.append(record.name);
+
+			f(record, std::string_view{path}, *value);
+		}
+	}
+}
+
+static std::string_view
+FormatGroup(std::string_view group) noexcept
+{
+	return group.empty() ? "/"sv : group;
+}
+
+static void
+RunSum(const Options &options)
+{
+	struct Sum {
+		std::size_t n = 0;
+		double sum = 0;
+	};
+
+	std::map<std::string, Sum, std::less<>> groups;
+
+	ForEachRecord(options, [&](const ArchiveRecord &, std::string_view path, double value){
+		const auto group = GetGroup(path, options.depth);
+		auto i = groups.find(group);
+		if (i == groups.end())
+			i = groups.emplace(group, Sum{}).first;
+
+		++i->second.n;
+		i->second.sum += value;
+	});
+
+	std::vector<std::pair<std::string_view, Sum>> sorted(groups.begin(), groups.end());
+	std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b){
+		return a.second.sum > b.second.sum;
+	});
+
+	fmt::print("{:>10} {:>16} {:>14} {}\n", "COUNT", "SUM", "AVG", "GROUP");
+	for (const auto &[group, sum] : sorted)
+		fmt::print("{:>10} {:>16} {:>14} {}\n", sum.n,
+			   FormatMetric(options.metric, sum.sum),
+			   FormatMetric(options.metric, sum.sum / sum.n),
+			   FormatGroup(group));
+}
+
+static void
+RunTop(const Options &options)
+{
+	struct Item {
+		double value;
+		std::chrono::system_clock::time_point release_time;
+		std::string path;
+
+		bool operator>(const Item &other) const noexcept {
+			return value > other.value;
+		}
+	};
+
+	if (options.limit == 0)
+		return;
+
+	/* a min-heap of the largest values seen so far */
+	std::priority_queue<Item, std::vector<Item>, std::greater<>> top;
+
+	ForEachRecord(options, [&](const ArchiveRecord &record, std::string_view path, double value){
+		if (top.size() >= options.limit) {
+			if (value <= top.top().value)
+				return;
+			top.pop();
+		}
+
+		top.push({value, record.release_time, std::string{path}});
+	});
+
+	std::vector<Item> sorted;
+	sorted.reserve(top.size());
+	while (!top.empty()) {
+		sorted.push_back(top.top());
+		top.pop();
+	}
+
+	fmt::print("{:>16} {:<25} {}\n", "VALUE", "RELEASED", "CGROUP");
+	for (auto i = sorted.rbegin(); i != sorted.rend(); ++i)
+		fmt::print("{:>16} {:<25} {}\n",
+			   FormatMetric(options.metric, i->value),
+			   FormatISO8601(i->release_time).c_str(),
+			   i->path);
+}
+
+/**
+ * Returns the given percentile of the values (which are reordered).
+ */
+static double
+Percentile(std::vector<double> &values, double p) noexcept
+{
+	const auto n = static_cast<std::size_t>(std::floor(p * static_cast<double>(values.size() - 1)));
+	std::nth_element(values.begin(), values.begin() + n, values.end());
+	return values[n];
+}
+
+static void
+RunPercentiles(const Options &options)
+{
+	std::map<std::string, std::vector<double>, std::less<>> groups;
+
+	ForEachRecord(options, [&](const ArchiveRecord &, std::string_view path, double value){
+		const auto group = GetGroup(path, options.depth);
+		auto i = groups.find(group);
+		if (i == groups.end())
+			i = groups.emplace(group, std::vector<double>{}).first;
+
+		i->second.push_back(value);
+	});
+
+	fmt::print("{:>10} {:>14} {:>14} {:>14} {:>14} {}\n",
+		   "COUNT", "P50", "P90", "P99", "MAX", "GROUP");
+
+	for (auto &[group, values] : groups)
+		fmt::print("{:>10} {:>14} {:>14} {:>14} {:>14} {}\n",
+			   values.size(),
+			   FormatMetric(options.metric, Percentile(values, 0.5)),
+			   FormatMetric(options.metric, Percentile(values, 0.9)),
+			   FormatMetric(options.metric, Percentile(values, 0.99)),
+			   FormatMetric(options.metric, *std::max_element(values.begin(), values.end())),
+			   FormatGroup(group));
+}
+
+int
+main(int argc, char **argv)
+try {
+	const auto options = ParseCommandLine(argc, argv);
+
+	switch (options.command) {
+	case Command::SUM:
+		RunSum(options);
+		break;
+
+	case Command::TOP:
+		RunTop(options);
+		break;
+
+	case Command::PERCENTILES:
+		RunPercentiles(options);
+		break;
+	}
+
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr,
+		   "Usage: {} [OPTIONS] sum|top|percentiles [METRIC]\n"
+		   "\n"
+		   "Metrics: cpu (default), cpu_user, cpu_system, memory, oom, pids, forks\n"
+		   "\n"
+		   "Options:\n"
+		   "  --directory=PATH   the archive directory\n"
+		   "  --date=DATE        only this day (YYYY-MM-DD, today, yesterday)\n"
+		   "  --since=DATE       only this day and later\n"
+		   "  --until=DATE       only this day and earlier\n"
+		   "  --prefix=PATH      only cgroups below this path\n"
+		   "  --depth=N          group by the first N path components\n"
+		   "  --limit=N          the number of cgroups printed by \"top\"\n",
+		   argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,607 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Simulate cgroup churn on an ordinary filesystem (e.g. tmpfs) and
+ * measure how UnifiedCgroupWatch (in inotify mode) keeps up.  This
+ * needs neither root nor real cgroups.
+ *
+ * The given directory gets a subtree called "bench-churn" with a
+ * number of fake scopes.  A generator thread creates fake cgroups
+ * (directories containing a "cgroup.events" file saying "populated
+ * 1") at a fixed rate; after their lifetime, it writes "populated 0"
+ * into that file, or it deletes some of them while they are still
+ * populated.  The main thread runs the watch; each empty cgroup is
+ * deleted in the callback, like the reaper does.
+ *
+ * The result is printed as JSON on stdout: the number of events per
+ * second, the CPU time of the main thread per event, the peak
+ * resident set size and the latency from writing "populated 0" until
+ * the callback was invoked.
+ *
+ * With "--fd-budget", the watch runs in fd budget mode (see
+ * UnifiedCgroupWatch::EnableFdBudget()); the number of file
+ * descriptors and inotify watches after the initial scan shows the
+ * difference.
+ *
+ * In inotify mode, new cgroups are not checked for emptiness, so a
+ * cgroup which is emptied before the watch has caught up with its
+ * creation is never reported; these are counted as "missed" and
+ * indicate that the watch has fallen behind by more than the
+ * lifetime.
+ */
+
+#include "FakeCgroup.hxx"
+#include "reaper/FdUsage.hxx"
+#include "reaper/UnifiedWatch.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "util/PrintException.hxx"
+#include "util/ScopeExit.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h> // for getrusage()
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+using std::chrono_literals::operator""ms;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr const char *base_name = "bench-churn";
+
+/**
+ * The staging directory for fake cgroups (below #base_name, see
+ * FakeCgroup.hxx).
+ */
+static constexpr const char *staging_name = "staging";
+
+struct Usage {};
+
+struct Options {
+	const char *directory = nullptr;
+
+	/**
+	 * New cgroups per second.
+	 */
+	std::size_t rate = 10000;
+
+	/**
+	 * How long does the generator create new cgroups?
+	 */
+	std::chrono::seconds duration{10};
+
+	/**
+	 * How long is each cgroup populated?
+	 */
+	std::chrono::milliseconds lifetime{100};
+
+	/**
+	 * The number of populated cgroups which exist during the
+	 * whole run (they are found by the initial scan).
+	 */
+	std::size_t initial = 10000;
+
+	std::size_t scopes = 4;
+
+	/**
+	 * The percentage of cgroups which are deleted by the
+	 * generator while they are still populated (instead of
+	 * running empty).
+	 */
+	unsigned delete_percent = 0;
+
+	/**
+	 * Enable fd budget mode?
+	 */
+	bool fd_budget = false;
+};
+
+static std::size_t
+ParseSize(std::string_view s)
+{
+	std::size_t value;
+	const auto r = std::from_chars(s.data(), s.data() + s.size(), value);
+	if (r.ec != std::errc{} || r.ptr != s.data() + s.size())
+		throw Usage{};
+	return value;
+}
+
+static Options
+ParseCommandLine(int argc, char **argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string_view arg = argv[i];
+		if (!arg.starts_with("--"sv)) {
+			if (options.directory != nullptr)
+				throw Usage{};
+
+			options.directory = argv[i];
+			continue;
+		}
+
+		if (arg == "--fd-budget"sv) {
+			options.fd_budget = true;
+			continue;
+		}
+
+		const auto eq = arg.find('=');
+		if (eq == arg.npos)
+			throw Usage{};
+
+		const auto name = arg.substr(2, eq - 2);
+		const auto value = arg.substr(eq + 1);
+
+		if (name == "rate"sv)
+			options.rate = ParseSize(value);
+		else if (name == "duration"sv)
+			options.duration = std::chrono::seconds(ParseSize(value));
+		else if (name == "lifetime"sv)
+			options.lifetime = std::chrono::milliseconds(ParseSize(value));
+		else if (name == "initial"sv)
+			options.initial = ParseSize(value);
+		else if (name == "scopes"sv)
+			options.scopes = ParseSize(value);
+		else if (name == "delete"sv)
+			options.delete_percent = ParseSize(value);
+		else
+			throw Usage{};
+	}
+
+	if (options.directory == nullptr || options.rate == 0 ||
+	    options.duration.count() == 0 || options.scopes == 0 ||
+	    options.delete_percent > 100)
+		throw Usage{};
+
+	return options;
+}
+
+static std::string
+MakeScopeName(std::size_t i) noexcept
+{
+	return fmt::format("scope{}", i);
+}
+
+/**
+ * The generator thread: creates cgroups at a fixed rate and empties
+ * (or deletes) them after their lifetime.
+ */
+class ChurnGenerator {
+	const Options &options;
+
+	const FileDescriptor staging;
+
+	const std::span<const UniqueFileDescriptor> scopes;
+
+	/**
+	 * The time each cgroup was emptied (nanoseconds of #Clock),
+	 * indexed by the cgroup's serial number; read by the main
+	 * thread.
+	 */
+	const std::unique_ptr<std::atomic<Clock::rep>[]> empty_times;
+
+	struct Pending {
+		Clock::time_point due;
+		std::size_t serial;
+		bool remove;
+	};
+
+	std::deque<Pending> pending;
+
+	std::atomic_size_t n_created{0}, n_emptied{0}, n_deleted{0};
+
+	std::atomic_bool done{false};
+
+	std::jthread thread;
+
+public:
+	ChurnGenerator(const Options &_options, FileDescriptor _staging,
+		       std::span<const UniqueFileDescriptor> _scopes)
+		:options(_options), staging(_staging), scopes(_scopes),
+		 empty_times(new std::atomic<Clock::rep>[GetTotal()]) {}
+
+	std::size_t GetTotal() const noexcept {
+		return options.rate * options.duration.count();
+	}
+
+	void Start() {
+		thread = std::jthread{[this]{
+			try {
+				Run();
+			} catch (...) {
+				PrintException(std::current_exception());
+			}
+
+			done = true;
+		}};
+	}
+
+	bool IsDone() const noexcept {
+		return done;
+	}
+
+	std::size_t GetCreated() const noexcept {
+		return n_created;
+	}
+
+	std::size_t GetEmptied() const noexcept {
+		return n_emptied;
+	}
+
+	std::size_t GetDeleted() const noexcept {
+		return n_deleted;
+	}
+
+	Clock::time_point GetEmptyTime(std::size_t serial) const noexcept {
+		return Clock::time_point{Clock::duration{empty_times[serial].load(std::memory_order_acquire)}};
+	}
+
+private:
+	void Run();
+
+	void Expire(Clock::time_point now);
+};
+
+void
+ChurnGenerator::Run()
+{
+	std::minstd_rand rng{42};
+	std::uniform_int_distribution<unsigned> percent{0, 99};
+
+	const std::size_t total = GetTotal();
+	const auto start = Clock::now();
+	std::size_t serial = 0;
+
+	while (serial < total) {
+		const auto now = Clock::now();
+
+		/* catch up with the rate (if this thread was too
+		   slow, it creates a burst) */
+		const auto elapsed = std::chrono::duration<double>(now - start);
+		const std::size_t due = std::min<std::size_t>(elapsed.count() * options.rate + 1,
+							     total);
+
+		for (; serial < due; ++serial) {
+			const auto name = fmt::format("c{}", serial);
+			CreateFakeCgroup(staging, scopes[serial % scopes.size()],
+					 name.c_str(), true);
+			++n_created;
+
+			pending.push_back({
+				.due = Clock::now() + options.lifetime,
+				.serial = serial,
+				.remove = percent(rng) < options.delete_percent,
+			});
+		}
+
+		Expire(now);
+
+		std::this_thread::sleep_for(1ms);
+	}
+
+	while (!pending.empty()) {
+		std::this_thread::sleep_until(pending.front().due);
+		Expire(Clock::now());
+	}
+}
+
+void
+ChurnGenerator::Expire(Clock::time_point now)
+{
+	/* all cgroups have the same lifetime, so #pending is
+	   sorted */
+	while (!pending.empty() && pending.front().due <= now) {
+		const auto p = pending.front();
+		pending.pop_front();
+
+		const auto name = fmt::format("c{}", p.serial);
+		const FileDescriptor scope = scopes[p.serial % scopes.size()];
+
+		if (p.remove) {
+			DeleteFakeCgroup(staging, scope, name.c_str());
+			++n_deleted;
+		} else {
+			const auto cgroup = OpenPath({scope, name.c_str()}, O_DIRECTORY);
+			empty_times[p.serial].store(Clock::now().time_since_epoch().count(),
+						    std::memory_order_release);
+			WriteFakeCgroupEvents(cgroup, false);
+			++n_emptied;
+		}
+	}
+}
+
+class ChurnBench {
+	const Options &options;
+
+	const FileDescriptor root;
+
+	const FileDescriptor staging;
+
+	ChurnGenerator &generator;
+
+	EventLoop event_loop;
+
+	FineTimerEvent check_timer;
+
+	UnifiedCgroupWatch watch;
+
+	std::vector<Clock::duration> latencies;
+
+	std::size_t n_released = 0, n_unknown = 0;
+
+	/**
+	 * When did the generator finish?  Used for the timeout for
+	 * releases which never arrive.
+	 */
+	Clock::time_point generator_done{};
+
+public:
+	ChurnBench(const Options &_options, FileDescriptor _root,
+		   FileDescriptor _staging, ChurnGenerator &_generator)
+		:options(_options), root(_root), staging(_staging),
+		 generator(_generator),
+		 check_timer(event_loop, BIND_THIS_METHOD(OnCheckTimer)),
+		 watch(event_loop, root, true,
+		       BIND_THIS_METHOD(OnCgroupEmpty))
+	{
+		latencies.reserve(generator.GetTotal());
+	}
+
+	void Run();
+
+private:
+	void OnCheckTimer() noexcept;
+
+	void OnCgroupEmpty(UnifiedCgroupWatch::Group &group,
+			   ReleaseTimeline &) noexcept;
+};
+
+void
+ChurnBench::OnCgroupEmpty(UnifiedCgroupWatch::Group &group,
+			  ReleaseTimeline &) noexcept
+{
+	const auto now = Clock::now();
+
+	const auto path = group.GetPath();
+	const auto slash = path.rfind('/');
+	const std::string_view name = std::string_view{path}.substr(slash + 1);
+
+	std::size_t serial;
+	if (!name.starts_with('c') ||
+	    std::from_chars(name.data() + 1, name.data() + name.size(), serial).ec != std::errc{} ||
+	    serial >= generator.GetTotal()) {
+		++n_unknown;
+		return;
+	}
+
+	++n_released;
+	latencies.push_back(now - generator.GetEmptyTime(serial));
+
+	/* delete it like the reaper does (without the delay) */
+	const std::string name_s{name};
+	if (renameat(root.Get(), path.c_str() + 1,
+		     staging.Get(), name_s.c_str()) == 0)
+		DeleteStagedFakeCgroup(staging, name_s.c_str());
+}
+
+void
+ChurnBench::OnCheckTimer() noexcept
+{
+	if (generator.IsDone()) {
+		const auto now = Clock::now();
+		if (generator_done == Clock::time_point{})
+			generator_done = now;
+
+		if (n_released >= generator.GetEmptied() ||
+		    now - generator_done > std::chrono::seconds{5}) {
+			event_loop.Break();
+			return;
+		}
+	}
+
+	check_timer.Schedule(100ms);
+}
+
+static double
+ToMicroseconds(Clock::duration d) noexcept
+{
+	return std::chrono::duration<double, std::micro>(d).count();
+}
+
+static double
+ToMicroseconds(const struct timeval &tv) noexcept
+{
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/**
+ * The CPU time (user + system) of the calling thread [us].
+ */
+static double
+GetThreadCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ToMicroseconds(ru.ru_utime) + ToMicroseconds(ru.ru_stime);
+}
+
+void
+ChurnBench::Run()
+{
+	std::vector<std::string> scope_paths;
+	for (std::size_t i = 0; i < options.scopes; ++i)
+		scope_paths.emplace_back(fmt::format("{}/{}", base_name,
+						     MakeScopeName(i)));
+
+	const std::vector<std::string_view> relative_paths{scope_paths.begin(),
+							   scope_paths.end()};
+
+	if (options.fd_budget)
+		watch.EnableFdBudget();
+
+	auto t0 = Clock::now();
+	watch.AddCgroups(relative_paths);
+	const auto scan_duration = Clock::now() - t0;
+	const std::size_t initial_directories = watch.GetDirectoryCount();
+	const std::size_t initial_fds = CountOpenFds();
+	const std::size_t initial_watches = watch.GetWatchCount();
+
+	const double cpu_before = GetThreadCpuTime();
+	t0 = Clock::now();
+
+	generator.Start();
+	check_timer.Schedule(100ms);
+	event_loop.Run();
+
+	const auto run_duration = Clock::now() - t0;
+	const double cpu = GetThreadCpuTime() - cpu_before;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	std::sort(latencies.begin(), latencies.end());
+
+	const auto percentile = [this](double p) -> double {
+		if (latencies.empty())
+			return 0;
+
+		std::size_t i = latencies.size() * p;
+		return ToMicroseconds(latencies[std::min(i, latencies.size() - 1)]);
+	};
+
+	const std::size_t created = generator.GetCreated();
+	const std::size_t emptied = generator.GetEmptied();
+	const std::size_t deleted = generator.GetDeleted();
+
+	/* each cgroup causes two events: its creation and its
+	   release (or deletion) */
+	const std::size_t n_events = created + n_released + deleted;
+	const double seconds = std::chrono::duration<double>(run_duration).count();
+
+	fmt::print("{{\n"
+		   "  \"rate\": {},\n"
+		   "  \"duration_s\": {:.3f},\n"
+		   "  \"lifetime_ms\": {},\n"
+		   "  \"scopes\": {},\n"
+		   "  \"fd_budget\": {},\n"
+		   "  \"initial\": {},\n"
+		   "  \"initial_directories\": {},\n"
+		   "  \"initial_fds\": {},\n"
+		   "  \"initial_watches\": {},\n"
+		   "  \"scan_ms\": {:.1f},\n"
+		   "  \"created\": {},\n"
+		   "  \"emptied\": {},\n"
+		   "  \"deleted\": {},\n"
+		   "  \"released\": {},\n"
+		   "  \"missed\": {},\n"
+		   "  \"unknown\": {},\n"
+		   "  \"events_per_second\": {:.0f},\n"
+		   "  \"cpu_us_per_event\": {:.2f},\n"
+		   "  \"cpu_percent\": {:.1f},\n"
+		   "  \"peak_rss_kb\": {},\n"
+		   "  \"latency_us\": {{\"p50\": {:.0f}, \"p90\": {:.0f}, \"p99\": {:.0f}, \"p999\": {:.0f}, \"max\": {:.0f}}}\n"
+		   "}}\n",
+		   options.rate, seconds, options.lifetime.count(),
+		   options.scopes, options.fd_budget,
+		   options.initial, initial_directories,
+		   initial_fds, initial_watches,
+		   ToMicroseconds(scan_duration) / 1000,
+		   created, emptied, deleted, n_released,
+		   emptied - std::min(n_released, emptied), n_unknown,
+		   n_events / seconds,
+		   n_events > 0 ? cpu / n_events : 0.,
+		   cpu / (seconds * 1e4),
+		   ru.ru_maxrss,
+		   percentile(0.5), percentile(0.9), percentile(0.99),
+		   percentile(0.999),
+		   latencies.empty() ? 0. : ToMicroseconds(latencies.back()));
+}
+
+static void
+Run(const Options &options)
+{
+	const auto directory = OpenPath(options.directory, O_DIRECTORY);
+
+	if (mkdirat(directory.Get(), base_name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", base_name);
+
+	AtScopeExit(&directory) { RemoveTree(directory, base_name); };
+
+	const auto base = OpenPath({directory, base_name}, O_DIRECTORY);
+
+	if (mkdirat(base.Get(), staging_name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", staging_name);
+
+	const auto staging = OpenPath({base, staging_name}, O_DIRECTORY);
+
+	std::vector<UniqueFileDescriptor> scopes;
+	for (std::size_t i = 0; i < options.scopes; ++i) {
+		/* a scope is a (populated) fake cgroup, too */
+		const auto name = MakeScopeName(i);
+		CreateFakeCgroup(staging, base, name.c_str(), true);
+
+		scopes.emplace_back(OpenPath({base, name.c_str()}, O_DIRECTORY));
+	}
+
+	/* these remain populated during the whole run */
+	for (std::size_t i = 0; i < options.initial; ++i)
+		CreateFakeCgroup(staging, scopes[i % scopes.size()],
+				 fmt::format("i{}", i).c_str(), true);
+
+	ChurnGenerator generator{options, staging, scopes};
+
+	/* Run() returns only after the generator thread has
+	   finished */
+	ChurnBench bench{options, directory, staging, generator};
+	bench.Run();
+}
+
+int
+main(int argc, char **argv)
+try {
+	const auto options = ParseCommandLine(argc, argv);
+	Run(options);
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr,
+		   "Usage: {} [OPTIONS] DIRECTORY\n"
+		   "\n"
+		   "DIRECTORY should be on tmpfs.\n"
+		   "\n"
+		   "Options:\n"
+		   "  --rate=N         new cgroups per second (default 10000)\n"
+		   "  --duration=S     how long new cgroups are created (default 10)\n"
+		   "  --lifetime=MS    how long each cgroup is populated (default 100)\n"
+		   "  --initial=N      populated cgroups found by the initial scan (default 10000)\n"
+		   "  --scopes=N       the number of scopes (default 4)\n"
+		   "  --delete=PERCENT cgroups deleted while populated (default 0)\n"
+		   "  --fd-budget      don't keep file descriptors for each cgroup\n",
+		   argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
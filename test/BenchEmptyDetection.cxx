@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Compare the two empty detection modes of class UnifiedCgroupWatch
+ * ("epoll" and "inotify"): number of file descriptors, kernel slab
+ * memory and the latency from killing the last process of a cgroup
+ * until the callback gets invoked.
+ *
+ * The first argument is the cgroup2 mount point; the process needs
+ * write access to it, because it creates a subtree called
+ * "bench-empty" and moves child processes into it.  That subtree
+ * contains COUNT cgroups which have one (empty) child cgroup each;
+ * the children get released right away, but their parents remain
+ * watched.  The latency is measured with new cgroups which are
+ * created after the initial scan, like systemd scopes.
+ */
+
+#include "reaper/UnifiedWatch.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "system/Error.hxx"
+#include "util/PrintException.hxx"
+#include "util/ScopeExit.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr const char *base_name = "bench-empty";
+
+/**
+ * The number of processes which get killed per mode.
+ */
+static constexpr std::size_t N_SAMPLES = 200;
+
+static std::size_t
+CountFileDescriptors()
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir == nullptr)
+		throw MakeErrno("Failed to open /proc/self/fd");
+
+	std::size_t n = 0;
+	while (const auto *e = readdir(dir))
+		if (e->d_name[0] != '.')
+			++n;
+
+	closedir(dir);
+	return n;
+}
+
+/**
+ * Returns the "Slab" value from /proc/meminfo [kB].
+ */
+static long
+ReadSlab() noexcept
+{
+	FILE *file = fopen("/proc/meminfo", "r");
+	if (file == nullptr)
+		return 0;
+
+	char line[256];
+	long value = 0;
+	while (fgets(line, sizeof(line), file) != nullptr)
+		if (sscanf(line, "Slab: %ld", &value) == 1)
+			break;
+
+	fclose(file);
+	return value;
+}
+
+/**
+ * Fork a process which moves itself into the specified cgroup and
+ * waits to be killed.
+ */
+static pid_t
+SpawnInto(FileDescriptor cgroup_fd)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		throw MakeErrno("pipe() failed");
+
+	const pid_t pid = fork();
+	if (pid < 0)
+		throw MakeErrno("fork() failed");
+
+	if (pid == 0) {
+		UniqueFileDescriptor procs;
+		if (!procs.Open({cgroup_fd, "cgroup.procs"}, O_WRONLY) ||
+		    write(procs.Get(), "0", 1) < 0)
+			_exit(EXIT_FAILURE);
+
+		(void)write(fds[1], "x", 1);
+		pause();
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	char ch;
+	const bool ok = read(fds[0], &ch, 1) == 1;
+	close(fds[0]);
+	if (!ok) {
+		waitpid(pid, nullptr, 0);
+		throw std::runtime_error{"Failed to move the child process into the cgroup"};
+	}
+
+	return pid;
+}
+
+class EmptyDetectionBench {
+	EventLoop event_loop;
+
+	FineTimerEvent break_timer;
+
+	UnifiedCgroupWatch watch;
+
+	/**
+	 * The path of the cgroup whose release is being waited for.
+	 */
+	std::string target;
+
+	Clock::time_point kill_time;
+
+	std::vector<Clock::duration> latencies;
+
+	bool released = false;
+
+public:
+	EmptyDetectionBench(FileDescriptor mount, bool use_inotify)
+		:break_timer(event_loop, BIND_THIS_METHOD(OnBreakTimer)),
+		 watch(event_loop, mount, use_inotify,
+		       BIND_THIS_METHOD(OnCgroupEmpty)) {}
+
+	void Run(FileDescriptor mount, const char *label, std::size_t n);
+
+private:
+	/**
+	 * Run the #EventLoop for the specified duration.
+	 */
+	void RunFor(Event::Duration d) noexcept {
+		break_timer.Schedule(d);
+		event_loop.Run();
+	}
+
+	void OnBreakTimer() noexcept {
+		event_loop.Break();
+	}
+
+	void OnCgroupEmpty(UnifiedCgroupWatch::Group &group,
+			   ReleaseTimeline &) noexcept {
+		if (released || group.GetPath() != target)
+			/* one of the initial leaf cgroups */
+			return;
+
+		latencies.push_back(Clock::now() - kill_time);
+		released = true;
+		break_timer.Cancel();
+		event_loop.Break();
+	}
+};
+
+void
+EmptyDetectionBench::Run(FileDescriptor mount, const char *label,
+			 std::size_t n)
+{
+	using std::chrono_literals::operator""ms;
+
+	const std::size_t fds_before = CountFileDescriptors();
+	const long slab_before = ReadSlab();
+	const auto t0 = Clock::now();
+
+	watch.AddCgroup(base_name);
+
+	const auto register_duration = Clock::now() - t0;
+
+	/* handle the initial events (and release the empty leaf
+	   cgroups) */
+	RunFor(100ms);
+
+	const std::size_t fds_after = CountFileDescriptors();
+	const long slab_after = ReadSlab();
+
+	const auto base = OpenPath({mount, base_name}, O_DIRECTORY);
+
+	for (std::size_t i = 0; i < N_SAMPLES; ++i) {
+		const auto name = fmt::format("lat{}", i);
+		if (mkdirat(base.Get(), name.c_str(), 0777) < 0)
+			throw FmtErrno("Failed to create {}", name);
+
+		AtScopeExit(&base, &name) {
+			unlinkat(base.Get(), name.c_str(), AT_REMOVEDIR);
+		};
+
+		/* let TreeWatch see the new cgroup */
+		RunFor(5ms);
+
+		const auto cgroup = OpenPath({base, name.c_str()}, O_DIRECTORY);
+		const pid_t pid = SpawnInto(cgroup);
+
+		/* the kernel rate-limits "cgroup.events"
+		   notifications to one per 10ms; wait for the
+		   "populated 1" notification to pass */
+		usleep(20000);
+
+		target = fmt::format("/{}/{}", base_name, name);
+		released = false;
+		kill_time = Clock::now();
+		kill(pid, SIGKILL);
+
+		while (!released)
+			RunFor(1000ms);
+
+		waitpid(pid, nullptr, 0);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	const auto us = [](Clock::duration d){
+		return std::chrono::duration<double, std::micro>(d).count();
+	};
+
+	fmt::print("{}: n={} fds={} slab_delta={}kB register={:.1f}ms"
+		   " latency p50={:.0f}us p99={:.0f}us max={:.0f}us\n",
+		   label, n, fds_after - fds_before, slab_after - slab_before,
+		   us(register_duration) / 1000,
+		   us(latencies[latencies.size() / 2]),
+		   us(latencies[latencies.size() * 99 / 100]),
+		   us(latencies.back()));
+}
+
+static void
+CreateCgroups(FileDescriptor mount, std::size_t n)
+{
+	if (mkdirat(mount.Get(), base_name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", base_name);
+
+	const auto base = OpenPath({mount, base_name}, O_DIRECTORY);
+	for (std::size_t i = 0; i < n; ++i) {
+		const auto name = fmt::format("c{}", i);
+		if (mkdirat(base.Get(), name.c_str(), 0777) < 0)
+			throw FmtErrno("Failed to create {}", name);
+
+		const auto parent = OpenPath({base, name.c_str()}, O_DIRECTORY);
+		if (mkdirat(parent.Get(), "leaf", 0777) < 0)
+			throw FmtErrno("Failed to create {}/leaf", name);
+	}
+}
+
+static void
+DeleteCgroups(FileDescriptor mount, std::size_t n) noexcept
+{
+	UniqueFileDescriptor base;
+	if (!base.Open({mount, base_name}, O_DIRECTORY|O_PATH))
+		return;
+
+	for (std::size_t i = 0; i < n; ++i) {
+		const auto name = fmt::format("c{}", i);
+		unlinkat(base.Get(), fmt::format("{}/leaf", name).c_str(),
+			 AT_REMOVEDIR);
+		unlinkat(base.Get(), name.c_str(), AT_REMOVEDIR);
+	}
+
+	unlinkat(mount.Get(), base_name, AT_REMOVEDIR);
+}
+
+static void
+RunMode(FileDescriptor mount, std::size_t n, bool use_inotify)
+{
+	CreateCgroups(mount, n);
+	AtScopeExit(mount, n) { DeleteCgroups(mount, n); };
+
+	EmptyDetectionBench bench{mount, use_inotify};
+	bench.Run(mount, use_inotify ? "inotify" : "epoll", n);
+}
+
+struct Usage {};
+
+int
+main(int argc, char **argv)
+try {
+	if (argc < 2 || argc > 3)
+		throw Usage{};
+
+	std::size_t n = 10000;
+	if (argc == 3) {
+		char *endptr;
+		n = strtoul(argv[2], &endptr, 10);
+		if (endptr == argv[2] || *endptr != 0 || n == 0)
+			throw Usage{};
+	}
+
+	const auto mount = OpenPath(argv[1], O_DIRECTORY);
+
+	RunMode(mount, n, false);
+	RunMode(mount, n, true);
+
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr, "Usage: {} CGROUP2_MOUNT [COUNT]\n", argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Compare the Lua allocations and the CPU time per released cgroup
+ * of the old "cgroup" object (a CgroupInfo whose fenv table is
+ * populated with all attributes) and #LuaReleasedCgroup (which
+ * converts attributes only when they are read).
+ */
+
+#include "reaper/LReleasedCgroup.hxx"
+#include "lua/AutoCloseList.hxx"
+#include "lua/Chrono.hxx"
+#include "lua/Util.hxx"
+#include "lua/io/CgroupInfo.hxx"
+#include "util/PrintException.hxx"
+
+extern "C" {
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+}
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <cstdlib>
+
+using Clock = std::chrono::steady_clock;
+
+struct AllocCounter {
+	std::size_t n_allocs = 0, n_bytes = 0;
+};
+
+static void *
+CountingAlloc(void *ud, void *ptr, std::size_t osize, std::size_t nsize) noexcept
+{
+	auto &counter = *static_cast<AllocCounter *>(ud);
+
+	if (nsize == 0) {
+		free(ptr);
+		return nullptr;
+	}
+
+	if (nsize > osize || ptr == nullptr) {
+		++counter.n_allocs;
+		counter.n_bytes += nsize;
+	}
+
+	return realloc(ptr, nsize);
+}
+
+static constexpr const char *script = R"(
+function read_one(c)
+  sink = c.memory_peak
+end
+
+function read_four(c)
+  sink = c.path
+  sink = c.cpu_total
+  sink = c.memory_peak
+  sink = c.pids_peak
+end
+
+function read_all(c)
+  for _, name in ipairs(all_names) do
+    sink = c[name]
+  end
+end
+
+all_names = {
+  'path', 'id', 'btime', 'age', 'cpu_total', 'cpu_user', 'cpu_system',
+  'memory_peak', 'memory_events_high', 'memory_events_max',
+  'memory_events_oom', 'pids_peak', 'pids_forks', 'pids_events_max',
+  'delta_cpu_total', 'delta_cpu_user', 'delta_cpu_system',
+  'delta_memory_peak',
+}
+)";
+
+static CgroupResourceUsage
+MakeUsage(std::size_t i) noexcept
+{
+	CgroupResourceUsage u{};
+	u.cpu.total = CgroupCpuStat::Duration{i * 0.5};
+	u.cpu.user = CgroupCpuStat::Duration{i * 0.3};
+	u.cpu.system = CgroupCpuStat::Duration{i * 0.2};
+	u.memory_peak = i * 4096;
+	u.memory_events_high = u.memory_events_max = u.memory_events_oom = 0;
+	u.pids_peak = 3;
+	u.pids_forks = 42;
+	u.pids_events_max = 0;
+	u.have_memory_peak = true;
+	u.have_memory_events_high = u.have_memory_events_max = true;
+	u.have_memory_events_oom = true;
+	u.have_pids_peak = u.have_pids_forks = u.have_pids_events_max = true;
+	return u;
+}
+
+/**
+ * The old implementation: all attributes are copied into the
+ * CgroupInfo's fenv table.
+ */
+static void
+PushEager(lua_State *L, Lua::AutoCloseList &auto_close, LuaReleasedCgroupList &,
+	  const char *path, std::chrono::system_clock::time_point btime,
+	  const CgroupResourceUsage &usage, const CgroupResourceUsage &delta)
+{
+	using Lua::RelativeStackIndex, Lua::SetField;
+
+	Lua::NewCgroupInfo(L, auto_close, path, UniqueFileDescriptor{});
+
+	lua_getfenv(L, -1);
+
+	SetField(L, RelativeStackIndex{-1}, "id", static_cast<lua_Integer>(42));
+	SetField(L, RelativeStackIndex{-1}, "btime", btime);
+	SetField(L, RelativeStackIndex{-1}, "age", std::chrono::system_clock::now() - btime);
+	SetField(L, RelativeStackIndex{-1}, "cpu_total", usage.cpu.total);
+	SetField(L, RelativeStackIndex{-1}, "cpu_user", usage.cpu.user);
+	SetField(L, RelativeStackIndex{-1}, "cpu_system", usage.cpu.system);
+	SetField(L, RelativeStackIndex{-1}, "memory_peak", (lua_Integer)usage.memory_peak);
+	SetField(L, RelativeStackIndex{-1}, "memory_events_high", (lua_Integer)usage.memory_events_high);
+	SetField(L, RelativeStackIndex{-1}, "memory_events_max", (lua_Integer)usage.memory_events_max);
+	SetField(L, RelativeStackIndex{-1}, "memory_events_oom", (lua_Integer)usage.memory_events_oom);
+	SetField(L, RelativeStackIndex{-1}, "pids_peak", (lua_Integer)usage.pids_peak);
+	SetField(L, RelativeStackIndex{-1}, "pids_forks", (lua_Integer)usage.pids_forks);
+	SetField(L, RelativeStackIndex{-1}, "pids_events_max", (lua_Integer)usage.pids_events_max);
+	SetField(L, RelativeStackIndex{-1}, "delta_cpu_total", delta.cpu.total);
+	SetField(L, RelativeStackIndex{-1}, "delta_cpu_user", delta.cpu.user);
+	SetField(L, RelativeStackIndex{-1}, "delta_cpu_system", delta.cpu.system);
+	SetField(L, RelativeStackIndex{-1}, "delta_memory_peak", (lua_Integer)delta.memory_peak);
+
+	lua_pop(L, 1);
+}
+
+static void
+PushLazy(lua_State *L, Lua::AutoCloseList &auto_close, LuaReleasedCgroupList &list,
+	 const char *path, std::chrono::system_clock::time_point btime,
+	 const CgroupResourceUsage &usage, const CgroupResourceUsage &delta)
+{
+	NewLuaReleasedCgroup(L, auto_close, list, path, UniqueFileDescriptor{},
+			     42, btime, usage, delta);
+}
+
+using PushFunction = void (*)(lua_State *, Lua::AutoCloseList &, LuaReleasedCgroupList &,
+			      const char *, std::chrono::system_clock::time_point,
+			      const CgroupResourceUsage &, const CgroupResourceUsage &);
+
+static void
+InvokeOne(lua_State *L, const char *handler, PushFunction push, std::size_t i)
+{
+	static constexpr const char *path = "/system.slice/app-42.scope";
+
+	const auto usage = MakeUsage(i);
+	const auto btime = std::chrono::system_clock::now() - std::chrono::seconds{i};
+
+	/* like LuaAccounting::Thread: one AutoCloseList per
+	   handler invocation */
+	Lua::AutoCloseList auto_close{L};
+	LuaReleasedCgroupList list;
+
+	lua_getglobal(L, handler);
+	push(L, auto_close, list, path, btime, usage, CgroupResourceUsage{});
+	if (lua_pcall(L, 1, 0, 0) != 0)
+		throw std::runtime_error{lua_tostring(L, -1)};
+}
+
+static void
+Run(lua_State *L, AllocCounter &counter, const char *handler,
+    const char *label, PushFunction push, std::size_t n)
+{
+	/* count allocations with the garbage collector stopped */
+	static constexpr std::size_t N_COUNT = 1000;
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	lua_gc(L, LUA_GCSTOP, 0);
+
+	counter = {};
+	for (std::size_t i = 0; i < N_COUNT; ++i)
+		InvokeOne(L, handler, push, i);
+
+	const double allocs = static_cast<double>(counter.n_allocs) / N_COUNT;
+	const double bytes = static_cast<double>(counter.n_bytes) / N_COUNT;
+
+	lua_gc(L, LUA_GCRESTART, 0);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+
+	/* measure the time with the garbage collector running,
+	   including one final full collection */
+	const auto t0 = Clock::now();
+	for (std::size_t i = 0; i < n; ++i)
+		InvokeOne(L, handler, push, i);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	const auto duration = Clock::now() - t0;
+
+	fmt::print("{:<9} {:<5} allocs/release={:.1f} bytes/release={:.0f} time/release={:.2f}us\n",
+		   handler, label, allocs, bytes,
+		   std::chrono::duration<double, std::micro>(duration).count() / n);
+}
+
+struct Usage {};
+
+int
+main(int argc, char **argv)
+try {
+	if (argc > 2)
+		throw Usage{};
+
+	std::size_t n = 100000;
+	if (argc == 2) {
+		char *endptr;
+		n = strtoul(argv[1], &endptr, 10);
+		if (endptr == argv[1] || *endptr != 0 || n == 0)
+			throw Usage{};
+	}
+
+	AllocCounter counter;
+	lua_State *L = lua_newstate(CountingAlloc, &counter);
+	if (L == nullptr)
+		throw std::runtime_error{"lua_newstate() failed"};
+
+	luaL_openlibs(L);
+	Lua::RegisterCgroupInfo(L);
+	RegisterLuaReleasedCgroup(L);
+
+	if (luaL_loadstring(L, script) != 0 || lua_pcall(L, 0, 0, 0) != 0)
+		throw std::runtime_error{lua_tostring(L, -1)};
+
+	for (const char *handler : {"read_one", "read_four", "read_all"}) {
+		Run(L, counter, handler, "eager", PushEager, n);
+		Run(L, counter, handler, "lazy", PushLazy, n);
+	}
+
+	lua_close(L);
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr, "Usage: {} [COUNT]\n", argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Measure the wall time it takes to read the first snapshot of a
+ * burst of released cgroups, synchronously and (if available) with
+ * io_uring batches.
+ *
+ * The cgroups are created as subdirectories of the given directory.
+ * On cgroupfs, these are real cgroups (the process needs write
+ * access); on any other filesystem (e.g. tmpfs), fake statistics
+ * files are created.
+ */
+
+#include "reaper/PendingRelease.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "util/PrintException.hxx"
+#include "config.h"
+
+#ifdef HAVE_URING
+#include "reaper/StatBatch.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+
+#include <liburing.h> // for IORING_SETUP_*
+#endif
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <list>
+#include <string>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <linux/magic.h> // for CGROUP2_SUPER_MAGIC
+#include <sys/stat.h>
+#include <sys/vfs.h> // for fstatfs()
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr const char *fake_files[][2] = {
+	{"cpu.stat", "usage_usec 123456\nuser_usec 100000\nsystem_usec 23456\nnr_periods 0\nnr_throttled 0\nthrottled_usec 0\n"},
+	{"memory.peak", "16777216\n"},
+	{"memory.events", "low 0\nhigh 0\nmax 0\noom 0\noom_kill 0\noom_group_kill 0\n"},
+	{"pids.peak", "3\n"},
+	{"pids.forks", "42\n"},
+	{"pids.events", "max 0\n"},
+};
+
+static bool
+IsCgroup2(FileDescriptor fd) noexcept
+{
+	struct statfs s;
+	return fstatfs(fd.Get(), &s) == 0 && s.f_type == CGROUP2_SUPER_MAGIC;
+}
+
+struct Burst {
+	const FileDescriptor root;
+	const bool fake;
+
+	std::list<std::string> names;
+	std::list<PendingRelease> releases;
+
+	Burst(FileDescriptor _root, std::size_t n);
+	~Burst() noexcept;
+
+	/**
+	 * Prepare the #PendingRelease objects like UnifiedCgroupWatch
+	 * does when the cgroups are discovered.
+	 */
+	void Discover();
+};
+
+Burst::Burst(FileDescriptor _root, std::size_t n)
+	:root(_root), fake(!IsCgroup2(root))
+{
+	for (std::size_t i = 0; i < n; ++i) {
+		auto &name = names.emplace_back(fmt::format("bench-{}", i));
+		if (mkdirat(root.Get(), name.c_str(), 0777) < 0)
+			throw FmtErrno("Failed to create {}", name);
+
+		if (fake) {
+			const auto dir = OpenPath({root, name.c_str()}, O_DIRECTORY);
+			for (const auto [file, contents] : fake_files) {
+				UniqueFileDescriptor fd;
+				if (!fd.Open({dir, file}, O_CREAT|O_WRONLY, 0666))
+					throw FmtErrno("Failed to create {}", file);
+				fd.FullWrite(std::as_bytes(std::span{std::string_view{contents}}));
+			}
+		}
+	}
+}
+
+Burst::~Burst() noexcept
+{
+	releases.clear();
+
+	for (const auto &name : names) {
+		if (fake) {
+			const auto dir = OpenPath({root, name.c_str()}, O_DIRECTORY);
+			for (const auto [file, contents] : fake_files)
+				unlinkat(dir.Get(), file, 0);
+		}
+
+		unlinkat(root.Get(), name.c_str(), AT_REMOVEDIR);
+	}
+}
+
+void
+Burst::Discover()
+{
+	releases.clear();
+
+	for (const auto &name : names) {
+		const auto dir = OpenPath({root, name.c_str()}, O_DIRECTORY);
+		CgroupStatFiles stat_files;
+		stat_files.Open(dir);
+		const auto btime = stat_files.GetBirthTime(dir);
+		releases.emplace_back(std::move(stat_files), 0, btime,
+				      ReleaseTimeline{});
+	}
+}
+
+static void
+PrintResult(const char *label, std::size_t n, Clock::duration d) noexcept
+{
+	const auto s = std::chrono::duration<double>(d).count();
+	fmt::print("{}: n={} wall={:.1f}ms per_cgroup={:.2f}us\n",
+		   label, n, s * 1000, s * 1e6 / n);
+}
+
+static void
+RunSync(Burst &burst)
+{
+	burst.Discover();
+
+	const auto t0 = Clock::now();
+
+	auto name = burst.names.begin();
+	for (auto &release : burst.releases) {
+		(void)release.cgroup_fd.Open({burst.root, name->c_str()},
+					     O_DIRECTORY|O_RDONLY);
+		release.usage = ReadCgroupResourceUsage(release.cgroup_fd,
+							release.stat_files);
+		++name;
+	}
+
+	PrintResult("sync", burst.releases.size(), Clock::now() - t0);
+}
+
+#ifdef HAVE_URING
+
+class UringRunner {
+	EventLoop &event_loop;
+	Burst &burst;
+
+	std::list<std::string>::iterator next_name;
+	std::list<PendingRelease>::iterator next_release;
+
+	std::unique_ptr<CgroupStatBatch> batch;
+
+public:
+	UringRunner(EventLoop &_event_loop, Burst &_burst) noexcept
+		:event_loop(_event_loop), burst(_burst),
+		 next_name(burst.names.begin()),
+		 next_release(burst.releases.begin()) {}
+
+	void Start() noexcept {
+		/* same as MAX_COLLECT_BATCH in Released.cxx */
+		static constexpr std::size_t MAX_BATCH = 1024;
+
+		auto &queue = *event_loop.GetUring();
+
+		batch = std::make_unique<CgroupStatBatch>(queue, burst.root, MAX_BATCH,
+							  BIND_THIS_METHOD(OnBatchDone));
+
+		for (std::size_t i = 0; i < MAX_BATCH &&
+			     next_release != burst.releases.end();
+		     ++i, ++next_name, ++next_release)
+			batch->Add(next_name->c_str(), *next_release);
+
+		if (!batch->Submit())
+			OnBatchDone();
+	}
+
+private:
+	void OnBatchDone() noexcept {
+		batch.reset();
+
+		if (next_release == burst.releases.end())
+			event_loop.Break();
+		else
+			Start();
+	}
+};
+
+static void
+RunUring(Burst &burst)
+{
+	EventLoop event_loop;
+
+	try {
+		event_loop.EnableUring(4096, IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN);
+	} catch (...) {
+		fmt::print(stderr, "Failed to initialize io_uring: {}\n",
+			   std::current_exception());
+		return;
+	}
+
+	burst.Discover();
+
+	const auto t0 = Clock::now();
+
+	UringRunner runner{event_loop, burst};
+	runner.Start();
+	event_loop.Run();
+
+	PrintResult("io_uring", burst.releases.size(), Clock::now() - t0);
+}
+
+#endif // HAVE_URING
+
+struct Usage {};
+
+int
+main(int argc, char **argv)
+try {
+	if (argc < 2 || argc > 3)
+		throw Usage{};
+
+	std::size_t n = 10000;
+	if (argc == 3) {
+		char *endptr;
+		n = strtoul(argv[2], &endptr, 10);
+		if (endptr == argv[2] || *endptr != 0 || n == 0)
+			throw Usage{};
+	}
+
+	const auto root = OpenPath(argv[1], O_DIRECTORY);
+	Burst burst{root, n};
+
+	RunSync(burst);
+
+#ifdef HAVE_URING
+	RunUring(burst);
+#else
+	fmt::print("io_uring: not available\n");
+#endif
+
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr, "Usage: {} DIRECTORY [COUNT]\n", argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
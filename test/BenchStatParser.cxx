@@ -0,0 +1,558 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Compare the speed of the cgroupfs statistics file parser
+ * (StatParser.hxx) with the line-by-line parser it replaced, and
+ * verify that both produce the same results.
+ *
+ * The input is a set of files captured from a production host;
+ * optionally, the statistics files of a real cgroup directory are
+ * used instead.
+ */
+
+#include "reaper/CgroupAccounting.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "util/IterableSplitString.hxx"
+#include "util/NumberParser.hxx"
+#include "util/PrintException.hxx"
+#include "util/SpanCast.hxx"
+#include "util/StringSplit.hxx"
+#include "config.h"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <chrono>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/sysmacros.h> // for makedev()
+
+using std::string_view_literals::operator""sv;
+
+using Clock = std::chrono::steady_clock;
+
+struct Sample {
+	CgroupStatFile file;
+	std::string contents;
+};
+
+/**
+ * Statistics files captured from a cgroup of a busy web server
+ * (Linux 6.6).
+ */
+static constexpr std::pair<CgroupStatFile, std::string_view> captured[] = {
+	{CgroupStatFile::CPU_STAT,
+	 "usage_usec 48613202\n"
+	 "user_usec 39164077\n"
+	 "system_usec 9449125\n"
+	 "core_sched.force_idle_usec 0\n"
+	 "nr_periods 81270\n"
+	 "nr_throttled 1187\n"
+	 "throttled_usec 20573355\n"
+	 "nr_bursts 0\n"
+	 "burst_usec 0\n"sv},
+
+	{CgroupStatFile::MEMORY_EVENTS,
+	 "low 0\n"
+	 "high 0\n"
+	 "max 2891\n"
+	 "oom 3\n"
+	 "oom_kill 3\n"
+	 "oom_group_kill 0\n"sv},
+
+	{CgroupStatFile::PIDS_EVENTS,
+	 "max 17\n"sv},
+
+	{CgroupStatFile::IO_STAT,
+	 "259:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 dbytes=0 dios=0\n"
+	 "8:16 rbytes=90112 wbytes=0 rios=11 wios=0 dbytes=0 dios=0\n"
+	 "8:0 rbytes=104857600 wbytes=2147483648 rios=25600 wios=524288 dbytes=4096 dios=1\n"
+	 "253:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 dbytes=0 dios=0\n"
+	 "253:1 rbytes=0 wbytes=8192 rios=0 wios=2 dbytes=0 dios=0\n"sv},
+
+	{CgroupStatFile::CPU_PRESSURE,
+	 "some avg10=0.00 avg60=0.12 avg300=0.31 total=2049116\n"
+	 "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"sv},
+
+	{CgroupStatFile::MEMORY_PRESSURE,
+	 "some avg10=1.53 avg60=0.87 avg300=0.20 total=1373526\n"
+	 "full avg10=1.51 avg60=0.85 avg300=0.19 total=1338719\n"sv},
+
+	{CgroupStatFile::IO_PRESSURE,
+	 "some avg10=0.00 avg60=0.00 avg300=0.00 total=112391\n"
+	 "full avg10=0.00 avg60=0.00 avg300=0.00 total=109807\n"sv},
+
+	{CgroupStatFile::MEMORY_STAT,
+	 "anon 112709632\n"
+	 "file 398266368\n"
+	 "kernel 13062144\n"
+	 "kernel_stack 1097728\n"
+	 "pagetables 2789376\n"
+	 "sec_pagetables 0\n"
+	 "percpu 432\n"
+	 "sock 139264\n"
+	 "vmalloc 0\n"
+	 "shmem 58511360\n"
+	 "zswap 0\n"
+	 "zswapped 0\n"
+	 "file_mapped 64102400\n"
+	 "file_dirty 135168\n"
+	 "file_writeback 0\n"
+	 "swapcached 0\n"
+	 "anon_thp 8388608\n"
+	 "file_thp 0\n"
+	 "shmem_thp 0\n"
+	 "inactive_anon 169865216\n"
+	 "active_anon 1355776\n"
+	 "inactive_file 190349312\n"
+	 "active_file 149405696\n"
+	 "unevictable 0\n"
+	 "slab_reclaimable 7512456\n"
+	 "slab_unreclaimable 1451288\n"
+	 "slab 8963744\n"
+	 "workingset_refault_anon 0\n"
+	 "workingset_refault_file 1284\n"
+	 "workingset_activate_anon 0\n"
+	 "workingset_activate_file 655\n"
+	 "workingset_restore_anon 0\n"
+	 "workingset_restore_file 183\n"
+	 "workingset_nodereclaim 0\n"
+	 "pgscan 45213\n"
+	 "pgsteal 44921\n"
+	 "pgscan_kswapd 0\n"
+	 "pgscan_direct 45213\n"
+	 "pgscan_khugepaged 0\n"
+	 "pgsteal_kswapd 0\n"
+	 "pgsteal_direct 44921\n"
+	 "pgsteal_khugepaged 0\n"
+	 "pgfault 10396735\n"
+	 "pgmajfault 1374\n"
+	 "pgrefill 3310\n"
+	 "pgactivate 37093\n"
+	 "pgdeactivate 3191\n"
+	 "pglazyfree 0\n"
+	 "pglazyfreed 0\n"
+	 "zswpin 0\n"
+	 "zswpout 0\n"
+	 "zswpwb 0\n"
+	 "thp_fault_alloc 61\n"
+	 "thp_collapse_alloc 4\n"
+	 "thp_swpout 0\n"
+	 "thp_swpout_fallback 0\n"sv},
+};
+
+/*
+ * The line-by-line parser which was used before StatParser.hxx.
+ */
+
+struct LegacyFlatKey {
+	std::string_view name;
+	unsigned index;
+};
+
+static unsigned
+LegacyParseFlatKeyed(std::string_view contents,
+		     std::span<const LegacyFlatKey> keys,
+		     std::span<uint_least64_t> values) noexcept
+{
+	unsigned found = 0;
+	std::size_t next = 0;
+
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [name, value_s] = Split(line, ' ');
+
+		for (std::size_t i = next; i < keys.size(); ++i) {
+			if (name != keys[i].name)
+				continue;
+
+			if (auto value = ParseInteger<uint_least64_t>(value_s)) {
+				values[keys[i].index] = *value;
+				found |= 1U << keys[i].index;
+			}
+
+			next = i + 1;
+			break;
+		}
+
+		if (next == keys.size())
+			break;
+	}
+
+	return found;
+}
+
+static constexpr LegacyFlatKey legacy_cpu_stat_keys[] = {
+	{"usage_usec"sv, 0},
+	{"user_usec"sv, 1},
+	{"system_usec"sv, 2},
+#ifdef ENABLE_CPU_THROTTLE_STATS
+	{"nr_throttled"sv, 3},
+	{"throttled_usec"sv, 4},
+#endif
+};
+
+static CgroupCpuStat
+LegacyParseCpuStat(std::string_view contents) noexcept
+{
+	std::array<uint_least64_t, 5> values;
+	const unsigned found = LegacyParseFlatKeyed(contents, legacy_cpu_stat_keys,
+						    values);
+
+	CgroupCpuStat result;
+	if (found & 1)
+		result.total = std::chrono::microseconds(values[0]);
+	if (found & 2)
+		result.user = std::chrono::microseconds(values[1]);
+	if (found & 4)
+		result.system = std::chrono::microseconds(values[2]);
+	if ((found & 0x18) == 0x18) {
+		result.throttled = std::chrono::microseconds(values[4]);
+		result.nr_throttled = values[3];
+	}
+
+	return result;
+}
+
+static constexpr LegacyFlatKey legacy_memory_stat_keys[] = {
+	{"anon"sv, CgroupMemoryStat::ANON},
+	{"file"sv, CgroupMemoryStat::FILE},
+	{"kernel"sv, CgroupMemoryStat::KERNEL},
+	{"sock"sv, CgroupMemoryStat::SOCK},
+	{"pgmajfault"sv, CgroupMemoryStat::PGMAJFAULT},
+};
+
+static void
+LegacyParseMemoryEvents(std::string_view contents,
+			CgroupResourceUsage &result) noexcept
+{
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [name, value_s] = Split(line, ' ');
+		const auto value = ParseInteger<uint_least32_t>(value_s);
+		if (!value)
+			continue;
+
+		if (name == "high"sv) {
+			result.memory_events_high = *value;
+			result.have_memory_events_high = true;
+		} else if (name == "max"sv) {
+			result.memory_events_max = *value;
+			result.have_memory_events_max = true;
+		} else if (name == "oom"sv) {
+			result.memory_events_oom = *value;
+			result.have_memory_events_oom = true;
+		}
+	}
+}
+
+static void
+LegacyParsePidsEvents(std::string_view contents,
+		      CgroupResourceUsage &result) noexcept
+{
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [name, value_s] = Split(line, ' ');
+		if (name == "max"sv) {
+			if (auto value = ParseInteger<uint_least32_t>(value_s)) {
+				result.pids_events_max = *value;
+				result.have_pids_events_max = true;
+			}
+		}
+	}
+}
+
+static bool
+LegacyParseIoStatLine(std::string_view line, dev_t &dev_r,
+		      CgroupIoStat::Counters &counters) noexcept
+{
+	const auto [dev_s, rest] = Split(line, ' ');
+	const auto [major_s, minor_s] = Split(dev_s, ':');
+	const auto major = ParseInteger<unsigned>(major_s);
+	const auto minor = ParseInteger<unsigned>(minor_s);
+	if (!major || !minor)
+		return false;
+
+	dev_r = makedev(*major, *minor);
+
+	for (const std::string_view i : IterableSplitString(rest, ' ')) {
+		const auto [name, value_s] = Split(i, '=');
+		const auto value = ParseInteger<uint_least64_t>(value_s);
+		if (!value)
+			return false;
+
+		if (name == "rbytes"sv)
+			counters.rbytes = *value;
+		else if (name == "wbytes"sv)
+			counters.wbytes = *value;
+		else if (name == "rios"sv)
+			counters.rios = *value;
+		else if (name == "wios"sv)
+			counters.wios = *value;
+		else if (name == "dbytes"sv)
+			counters.dbytes = *value;
+	}
+
+	return true;
+}
+
+static void
+LegacyParseIoStat(std::string_view contents, CgroupResourceUsage &result) noexcept
+{
+	if (const auto newline = contents.rfind('\n');
+	    newline != contents.npos)
+		contents = contents.substr(0, newline);
+	else
+		return;
+
+	CgroupIoStat io;
+
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		dev_t dev;
+		CgroupIoStat::Counters counters;
+		if (LegacyParseIoStatLine(line, dev, counters))
+			io.AddDevice(dev, counters);
+	}
+
+	result.io = io;
+	result.have_io = true;
+}
+
+static CgroupPressureStat
+LegacyParsePressure(std::string_view contents) noexcept
+{
+	CgroupPressureStat result;
+
+	for (const std::string_view line : IterableSplitString(contents, '\n')) {
+		const auto [kind, rest] = Split(line, ' ');
+
+		static constexpr auto total_prefix = "total="sv;
+		const auto i = rest.rfind(total_prefix);
+		if (i == rest.npos)
+			continue;
+
+		const auto value = ParseInteger<uint_least64_t>(rest.substr(i + total_prefix.size()));
+		if (!value)
+			continue;
+
+		const CgroupPressureStat::Duration total = std::chrono::microseconds(*value);
+		if (kind == "some"sv)
+			result.some = total;
+		else if (kind == "full"sv)
+			result.full = total;
+	}
+
+	return result;
+}
+
+static void
+LegacyParseCgroupStatFile(CgroupResourceUsage &result, CgroupStatFile file,
+			  std::string_view contents) noexcept
+{
+	switch (file) {
+	case CgroupStatFile::CPU_STAT:
+		result.cpu = LegacyParseCpuStat(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_EVENTS:
+		LegacyParseMemoryEvents(contents, result);
+		break;
+
+	case CgroupStatFile::PIDS_EVENTS:
+		LegacyParsePidsEvents(contents, result);
+		break;
+
+	case CgroupStatFile::IO_STAT:
+		LegacyParseIoStat(contents, result);
+		break;
+
+	case CgroupStatFile::CPU_PRESSURE:
+		result.cpu_pressure = LegacyParsePressure(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_PRESSURE:
+		result.memory_pressure = LegacyParsePressure(contents);
+		break;
+
+	case CgroupStatFile::IO_PRESSURE:
+		result.io_pressure = LegacyParsePressure(contents);
+		break;
+
+	case CgroupStatFile::MEMORY_STAT:
+		result.memory_stat.found =
+			LegacyParseFlatKeyed(contents, legacy_memory_stat_keys,
+					     result.memory_stat.values);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Format the values parsed from the specified file, for comparing
+ * the results of both parsers.
+ */
+static std::string
+Describe(const CgroupResourceUsage &u, CgroupStatFile file) noexcept
+{
+	switch (file) {
+	case CgroupStatFile::CPU_STAT:
+		return fmt::format("total={} user={} system={} throttled={} nr_throttled={}",
+				   u.cpu.total.count(), u.cpu.user.count(),
+				   u.cpu.system.count(), u.cpu.throttled.count(),
+				   u.cpu.throttled.count() >= 0 ? u.cpu.nr_throttled : 0);
+
+	case CgroupStatFile::MEMORY_EVENTS:
+		return fmt::format("high={}/{} max={}/{} oom={}/{}",
+				   u.have_memory_events_high, u.memory_events_high,
+				   u.have_memory_events_max, u.memory_events_max,
+				   u.have_memory_events_oom, u.memory_events_oom);
+
+	case CgroupStatFile::PIDS_EVENTS:
+		return fmt::format("max={}/{}",
+				   u.have_pids_events_max, u.pids_events_max);
+
+	case CgroupStatFile::IO_STAT: {
+		std::string s = fmt::format("total={}/{}/{}/{}/{}",
+					    u.io.total.rbytes, u.io.total.wbytes,
+					    u.io.total.rios, u.io.total.wios,
+					    u.io.total.dbytes);
+		for (std::size_t i = 0; i < u.io.n_devices; ++i) {
+			const auto &d = u.io.devices[i];
+			s += fmt::format(" {}:{}={}", major(d.dev), minor(d.dev),
+					 d.counters.GetBytes());
+		}
+		return s;
+	}
+
+	case CgroupStatFile::CPU_PRESSURE:
+	case CgroupStatFile::MEMORY_PRESSURE:
+	case CgroupStatFile::IO_PRESSURE: {
+		const auto &p = file == CgroupStatFile::CPU_PRESSURE
+			? u.cpu_pressure
+			: file == CgroupStatFile::MEMORY_PRESSURE
+			? u.memory_pressure
+			: u.io_pressure;
+		return fmt::format("some={} full={}",
+				   p.some.count(), p.full.count());
+	}
+
+	case CgroupStatFile::MEMORY_STAT: {
+		std::string s = fmt::format("found={:#x}", u.memory_stat.found);
+		for (unsigned i = 0; i < CgroupMemoryStat::N_KEYS; ++i)
+			if (u.memory_stat.Has(CgroupMemoryStat::Key(i)))
+				s += fmt::format(" {}", u.memory_stat.values[i]);
+		return s;
+	}
+
+	default:
+		return {};
+	}
+}
+
+/**
+ * Read the statistics files of a real cgroup.
+ */
+static std::vector<Sample>
+LoadCgroup(const char *path)
+{
+	const auto directory = OpenDirectory(path);
+
+	std::vector<Sample> samples;
+	for (const auto &[file, contents] : captured) {
+		UniqueFileDescriptor fd;
+		if (!fd.OpenReadOnly({directory, GetCgroupStatFileName(file)}))
+			continue;
+
+		std::array<std::byte, 16384> buffer;
+		const auto nbytes = fd.Read(buffer);
+		if (nbytes > 0)
+			samples.push_back({file, std::string{ToStringView(std::span{buffer}.first(nbytes))}});
+	}
+
+	return samples;
+}
+
+struct Usage {};
+
+int
+main(int argc, char **argv)
+try {
+	std::size_t n = 1000000;
+
+	if (argc > 3)
+		throw Usage{};
+
+	if (argc >= 2) {
+		char *endptr;
+		n = strtoul(argv[1], &endptr, 10);
+		if (endptr == argv[1] || *endptr != 0 || n == 0)
+			throw Usage{};
+	}
+
+	EnableExtendedCgroupStats();
+
+	std::vector<Sample> samples;
+	if (argc == 3)
+		samples = LoadCgroup(argv[2]);
+	else
+		for (const auto &[file, contents] : captured)
+			samples.push_back({file, std::string{contents}});
+
+	bool mismatch = false;
+
+	for (const auto &sample : samples) {
+		const char *const name = GetCgroupStatFileName(sample.file);
+
+		CgroupResourceUsage legacy_result;
+		LegacyParseCgroupStatFile(legacy_result, sample.file, sample.contents);
+		const auto legacy = Describe(legacy_result, sample.file);
+
+		CgroupResourceUsage new_result;
+		ParseCgroupStatFile(new_result, sample.file, sample.contents);
+		const auto result = Describe(new_result, sample.file);
+
+		if (result != legacy) {
+			fmt::print(stderr, "{}: mismatch\n  legacy: {}\n  new:    {}\n",
+				   name, legacy, result);
+			mismatch = true;
+		}
+
+		auto t0 = Clock::now();
+		for (std::size_t i = 0; i < n; ++i) {
+			CgroupResourceUsage u;
+			LegacyParseCgroupStatFile(u, sample.file, sample.contents);
+			asm volatile("" : : "g"(&u) : "memory");
+		}
+		const auto legacy_duration = Clock::now() - t0;
+
+		t0 = Clock::now();
+		for (std::size_t i = 0; i < n; ++i) {
+			CgroupResourceUsage u;
+			ParseCgroupStatFile(u, sample.file, sample.contents);
+			asm volatile("" : : "g"(&u) : "memory");
+		}
+		const auto new_duration = Clock::now() - t0;
+
+		const double legacy_ns = std::chrono::duration<double, std::nano>(legacy_duration).count() / n;
+		const double new_ns = std::chrono::duration<double, std::nano>(new_duration).count() / n;
+
+		fmt::print("{:<16} {:5} bytes: legacy={:7.1f}ns new={:7.1f}ns ({:.2f}x)\n",
+			   name, sample.contents.size(),
+			   legacy_ns, new_ns, legacy_ns / new_ns);
+	}
+
+	return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr, "Usage: {} [COUNT [CGROUP_DIRECTORY]]\n", argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Compare the memory usage and the speed of the TreeWatch directory
+ * layout (NodePool + NameArena + ChildIndex) with the std::map layout
+ * it replaced.  Each layout runs in a forked process, so the
+ * resident set size can be measured without interference.
+ */
+
+#include "reaper/ChildIndex.hxx"
+#include "reaper/NameArena.hxx"
+#include "reaper/NodePool.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * The members which both layouts have in common (file descriptor,
+ * flags); the InotifyWatch base class is omitted in both.
+ */
+struct Payload {
+	int fd = -1;
+	bool persist = false, all = true;
+};
+
+struct MapDirectory {
+	const std::string name;
+	Payload payload;
+	std::map<std::string, MapDirectory, std::less<>> children;
+
+	explicit MapDirectory(std::string_view _name) noexcept
+		:name(_name) {}
+};
+
+class MapTree {
+	MapDirectory root{{}};
+
+public:
+	void Create(std::string_view name) noexcept {
+		root.children.emplace(std::piecewise_construct,
+				      std::forward_as_tuple(name),
+				      std::forward_as_tuple(name));
+	}
+
+	[[gnu::pure]]
+	bool Find(std::string_view name) const noexcept {
+		return root.children.find(name) != root.children.end();
+	}
+
+	void Delete(std::string_view name) noexcept {
+		if (auto i = root.children.find(name); i != root.children.end())
+			root.children.erase(i);
+	}
+};
+
+class CompactTree {
+	struct Directory;
+
+	struct GetName {
+		std::string_view operator()(const Directory &directory) const noexcept;
+	};
+
+	struct Directory {
+		const std::string_view name;
+		Payload payload;
+		ChildIndex<Directory, GetName> children;
+
+		explicit Directory(std::string_view _name) noexcept
+			:name(_name) {}
+	};
+
+	NameArena names;
+	NodePool<Directory> pool;
+	Directory root{{}};
+
+public:
+	~CompactTree() noexcept {
+		root.children.RemoveIf([this](Directory &child){
+			names.Release(child.name);
+			pool.Delete(child);
+			return true;
+		});
+	}
+
+	void Create(std::string_view name) noexcept {
+		const auto hash = ChildIndex<Directory, GetName>::Hash(name);
+		if (root.children.Find(name, hash) != nullptr)
+			return;
+
+		auto &child = pool.New(names.Intern(name, hash));
+		root.children.Insert(child, hash);
+	}
+
+	[[gnu::pure]]
+	bool Find(std::string_view name) const noexcept {
+		return root.children.Find(name) != nullptr;
+	}
+
+	void Delete(std::string_view name) noexcept {
+		if (auto *child = root.children.Find(name)) {
+			root.children.Erase(*child);
+			names.Release(child->name);
+			pool.Delete(*child);
+		}
+	}
+};
+
+inline std::string_view
+CompactTree::GetName::operator()(const Directory &directory) const noexcept
+{
+	return directory.name;
+}
+
+static std::size_t
+GetResidentBytes() noexcept
+{
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == nullptr)
+		return 0;
+
+	unsigned long size, resident;
+	const bool ok = fscanf(file, "%lu %lu", &size, &resident) == 2;
+	fclose(file);
+	if (!ok)
+		return 0;
+
+	return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+static double
+PerSecond(std::size_t n, Clock::duration d) noexcept
+{
+	return n / std::chrono::duration<double>(d).count();
+}
+
+template<typename Tree>
+static void
+Run(const char *label, std::span<const std::string> names,
+    std::span<const std::string> delete_order)
+{
+	const std::size_t rss_before = GetResidentBytes();
+
+	Tree tree;
+
+	auto t0 = Clock::now();
+	for (const auto &name : names)
+		tree.Create(name);
+	const auto create_duration = Clock::now() - t0;
+
+	const std::size_t rss_after = GetResidentBytes();
+
+	t0 = Clock::now();
+	std::size_t found = 0;
+	for (const auto &name : delete_order)
+		found += tree.Find(name);
+	const auto find_duration = Clock::now() - t0;
+
+	t0 = Clock::now();
+	for (const auto &name : delete_order)
+		tree.Delete(name);
+	const auto delete_duration = Clock::now() - t0;
+
+	fmt::print("{}: n={} found={} rss={:.1f}B/cgroup create={:.0f}/s lookup={:.0f}/s delete={:.0f}/s\n",
+		   label, names.size(), found,
+		   static_cast<double>(rss_after - rss_before) / names.size(),
+		   PerSecond(names.size(), create_duration),
+		   PerSecond(delete_order.size(), find_duration),
+		   PerSecond(delete_order.size(), delete_duration));
+}
+
+template<typename Tree>
+static void
+RunForked(const char *label, std::span<const std::string> names,
+	  std::span<const std::string> delete_order)
+{
+	fflush(stdout);
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork() failed");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		Run<Tree>(label, names, delete_order);
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+}
+
+struct Usage {};
+
+int
+main(int argc, char **argv)
+try {
+	std::size_t n = 100000;
+
+	if (argc > 2)
+		throw Usage{};
+
+	if (argc == 2) {
+		char *endptr;
+		n = strtoul(argv[1], &endptr, 10);
+		if (endptr == argv[1] || *endptr != 0 || n == 0)
+			throw Usage{};
+	}
+
+	/* names similar to the ones created by the spawner below
+	   bp-spawn.scope */
+	std::mt19937_64 rng{42};
+	std::vector<std::string> names;
+	names.reserve(n);
+	for (std::size_t i = 0; i < n; ++i)
+		names.emplace_back(fmt::format("cgi-{:016x}", rng()));
+
+	std::vector<std::string> delete_order{names};
+	std::shuffle(delete_order.begin(), delete_order.end(), rng);
+
+	RunForked<MapTree>("map", names, delete_order);
+	RunForked<CompactTree>("compact", names, delete_order);
+
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr, "Usage: {} [COUNT]\n", argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+#include "FakeCgroup.hxx"
+#include "io/DirectoryReader.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "util/PrintException.hxx"
+#include "util/SpanCast.hxx"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+
+/* both have the same length, so overwriting one with the other
+   does not need to truncate the file */
+static constexpr std::string_view populated_1 = "populated 1\nfrozen 0\n"sv;
+static constexpr std::string_view populated_0 = "populated 0\nfrozen 0\n"sv;
+
+static constexpr std::string_view
+GetEventsContents(bool populated) noexcept
+{
+	return populated ? populated_1 : populated_0;
+}
+
+void
+WriteFakeCgroupEvents(FileDescriptor cgroup, bool populated)
+{
+	const auto fd = OpenWriteOnly({cgroup, "cgroup.events"});
+	if (fd.WriteAt(0, AsBytes(GetEventsContents(populated))) < 0)
+		throw FmtErrno("Failed to write cgroup.events");
+}
+
+void
+CreateFakeCgroup(FileDescriptor staging, FileDescriptor parent,
+		 const char *name, bool populated)
+{
+	if (mkdirat(staging.Get(), name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", name);
+
+	{
+		const auto fd = OpenPath({staging, name}, O_DIRECTORY);
+		UniqueFileDescriptor events;
+		if (!events.Open({fd, "cgroup.events"}, O_CREAT|O_WRONLY, 0666) ||
+		    events.Write(AsBytes(GetEventsContents(populated))) < 0)
+			throw FmtErrno("Failed to create {}/cgroup.events", name);
+	}
+
+	if (renameat(staging.Get(), name, parent.Get(), name) < 0)
+		throw FmtErrno("Failed to move {}", name);
+}
+
+void
+DeleteStagedFakeCgroup(FileDescriptor staging, const char *name) noexcept
+{
+	UniqueFileDescriptor fd;
+	if (fd.Open({staging, name}, O_DIRECTORY|O_RDONLY)) {
+		unlinkat(fd.Get(), "cgroup.events", 0);
+		fd.Close();
+	}
+
+	if (unlinkat(staging.Get(), name, AT_REMOVEDIR) < 0 &&
+	    errno == ENOTEMPTY)
+		RemoveTree(staging, name);
+}
+
+void
+DeleteFakeCgroup(FileDescriptor staging, FileDescriptor parent,
+		 const char *name) noexcept
+{
+	if (renameat(parent.Get(), name, staging.Get(), name) == 0)
+		DeleteStagedFakeCgroup(staging, name);
+}
+
+void
+RemoveTree(FileDescriptor parent, const char *name) noexcept
+try {
+	const auto fd = OpenDirectory({parent, name});
+
+	std::vector<std::string> names;
+
+	{
+		DirectoryReader reader{OpenDirectory({fd, "."})};
+		while (const char *i = reader.Read())
+			if (std::string_view{i} != "."sv &&
+			    std::string_view{i} != ".."sv)
+				names.emplace_back(i);
+	}
+
+	for (const auto &i : names)
+		if (unlinkat(fd.Get(), i.c_str(), 0) < 0)
+			RemoveTree(fd, i.c_str());
+
+	unlinkat(parent.Get(), name, AT_REMOVEDIR);
+} catch (...) {
+	PrintException(std::current_exception());
+}
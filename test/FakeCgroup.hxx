@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Fake cgroups on an ordinary filesystem (e.g. tmpfs) for
+ * benchmarking UnifiedCgroupWatch in inotify mode: each one is a
+ * directory containing a "cgroup.events" file.
+ *
+ * Fake cgroups are prepared in a "staging" directory and then moved
+ * into their parent, so the watch never sees a cgroup without a
+ * "cgroup.events" file.  Deleted cgroups are moved to the staging
+ * directory, too, before their files are deleted.
+ */
+
+#pragma once
+
+class FileDescriptor;
+
+/**
+ * Overwrite the "cgroup.events" file of a fake cgroup.
+ *
+ * Throws on error.
+ */
+void
+WriteFakeCgroupEvents(FileDescriptor cgroup, bool populated);
+
+/**
+ * Create a fake cgroup in the staging directory and move it into
+ * the parent.
+ *
+ * Throws on error.
+ */
+void
+CreateFakeCgroup(FileDescriptor staging, FileDescriptor parent,
+		 const char *name, bool populated);
+
+/**
+ * Delete a fake cgroup which has already been moved to the staging
+ * directory (including its children, if there are any).
+ */
+void
+DeleteStagedFakeCgroup(FileDescriptor staging, const char *name) noexcept;
+
+/**
+ * Move a fake cgroup out of its parent and delete it.
+ */
+void
+DeleteFakeCgroup(FileDescriptor staging, FileDescriptor parent,
+		 const char *name) noexcept;
+
+/**
+ * Delete a directory tree (which contains only directories and
+ * regular files).
+ */
+void
+RemoveTree(FileDescriptor parent, const char *name) noexcept;
@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <max.kellermann@ionos.com>
+
+/*
+ * Replay a trace recorded by the reaper (see the "watch_trace"
+ * setting) on an ordinary filesystem (e.g. tmpfs) and run
+ * UnifiedCgroupWatch (in inotify mode) against it.  This needs
+ * neither root nor real cgroups.
+ *
+ * The cgroups of the trace are created as fake cgroups (see
+ * FakeCgroup.hxx) in a subtree called "replay" of the given
+ * directory: the cgroups found by the initial scan are created
+ * (populated) before UnifiedCgroupWatch::AddCgroups() is called;
+ * after that, each record is applied to the filesystem (creating or
+ * deleting a directory or writing "cgroup.events").  The recorded
+ * releases are not applied; instead, the watch is expected to
+ * release the same cgroups.
+ *
+ * By default, the records are applied as fast as possible, but the
+ * watch gets a chance to handle the events caused by each record
+ * before the next one is applied, which makes the results
+ * reproducible.  With "--realtime", the recorded timing is
+ * reproduced.
+ *
+ * The result is printed as JSON on stdout.  The CPU time includes
+ * applying the records.
+ */
+
+#include "FakeCgroup.hxx"
+#include "reaper/UnifiedWatch.hxx"
+#include "reaper/WatchTraceFormat.hxx"
+#include "reaper/WatchTraceReader.hxx"
+#include "event/FineTimerEvent.hxx"
+#include "event/Loop.hxx"
+#include "io/FileAt.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "util/PrintException.hxx"
+#include "util/ScopeExit.hxx"
+#include "util/StringSplit.hxx"
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h> // for getrusage()
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr const char *root_name = "replay";
+
+/**
+ * The staging directory for fake cgroups (see FakeCgroup.hxx).
+ */
+static constexpr const char *staging_name = "replay-staging";
+
+struct Usage {};
+
+struct Options {
+	const char *trace = nullptr;
+	const char *directory = nullptr;
+
+	/**
+	 * Reproduce the recorded timing instead of replaying as fast
+	 * as possible?
+	 */
+	bool realtime = false;
+};
+
+static Options
+ParseCommandLine(int argc, char **argv)
+{
+	Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string_view arg = argv[i];
+		if (!arg.starts_with("--"sv)) {
+			if (options.trace == nullptr)
+				options.trace = argv[i];
+			else if (options.directory == nullptr)
+				options.directory = argv[i];
+			else
+				throw Usage{};
+			continue;
+		}
+
+		if (arg == "--realtime"sv)
+			options.realtime = true;
+		else
+			throw Usage{};
+	}
+
+	if (options.directory == nullptr)
+		throw Usage{};
+
+	return options;
+}
+
+class TraceReplay {
+	const Options &options;
+
+	const FileDescriptor root;
+
+	const FileDescriptor staging;
+
+	WatchTraceReader &reader;
+
+	/**
+	 * The next record to be applied (if #have_record is set).
+	 */
+	WatchTraceRecord record;
+
+	bool have_record = false;
+
+	/**
+	 * Has the end of the trace been reached?
+	 */
+	bool done = false;
+
+	EventLoop event_loop;
+
+	FineTimerEvent replay_timer;
+
+	UnifiedCgroupWatch watch;
+
+	/**
+	 * The paths of ADD records which will be passed to
+	 * UnifiedCgroupWatch::AddCgroups() by the next SCANNED record.
+	 */
+	std::vector<std::string> pending_add;
+
+	Clock::time_point start;
+
+	/**
+	 * Used to generate unique names in the staging directory.
+	 */
+	std::size_t n_staged = 0;
+
+	std::size_t n_records = 0, n_failed = 0;
+
+	std::size_t n_recorded_releases = 0, n_released = 0;
+
+	std::chrono::microseconds last_time{};
+
+public:
+	TraceReplay(const Options &_options, FileDescriptor _root,
+		    FileDescriptor _staging, WatchTraceReader &_reader)
+		:options(_options), root(_root), staging(_staging),
+		 reader(_reader),
+		 replay_timer(event_loop, BIND_THIS_METHOD(OnReplayTimer)),
+		 watch(event_loop, root, true,
+		       BIND_THIS_METHOD(OnCgroupEmpty))
+	{
+	}
+
+	void Run();
+
+private:
+	/**
+	 * Create the fake cgroup with the given path and its parents
+	 * (unless they already exist).
+	 *
+	 * Throws on error.
+	 *
+	 * @param populated the state of the cgroup (its parents are
+	 * always created populated)
+	 */
+	void MakeCgroup(std::string_view path, bool populated);
+
+	/**
+	 * Throws on error.
+	 */
+	void DeleteCgroup(std::string_view path);
+
+	/**
+	 * Throws on error.
+	 */
+	void WriteEvents(std::string_view path, bool populated);
+
+	void AddPending();
+
+	/**
+	 * Apply one record to the filesystem (or to the watch).
+	 *
+	 * Throws on error.
+	 */
+	void Apply(const WatchTraceRecord &r);
+
+	void OnReplayTimer() noexcept;
+
+	void OnCgroupEmpty(UnifiedCgroupWatch::Group &,
+			   ReleaseTimeline &) noexcept {
+		++n_released;
+	}
+};
+
+void
+TraceReplay::MakeCgroup(std::string_view path, bool populated)
+{
+	FileDescriptor parent = root;
+	UniqueFileDescriptor parent_fd;
+
+	while (!path.empty()) {
+		const auto [name_s, rest] = Split(path, '/');
+		path = rest;
+
+		if (name_s.empty())
+			continue;
+
+		const std::string name{name_s};
+
+		UniqueFileDescriptor fd;
+		if (!fd.Open({parent, name.c_str()}, O_PATH|O_DIRECTORY)) {
+			CreateFakeCgroup(staging, parent, name.c_str(),
+					 !path.empty() || populated);
+			fd = OpenPath({parent, name.c_str()}, O_DIRECTORY);
+		}
+
+		parent_fd = std::move(fd);
+		parent = parent_fd;
+	}
+}
+
+void
+TraceReplay::DeleteCgroup(std::string_view path)
+{
+	const auto [parent_path, name_s] = SplitLast(path, '/');
+
+	UniqueFileDescriptor parent_fd;
+	if (name_s.data() != nullptr)
+		parent_fd = OpenPath({root, std::string{parent_path}.c_str()}, O_DIRECTORY);
+
+	const FileDescriptor parent = parent_fd.IsDefined() ? FileDescriptor{parent_fd} : root;
+	const std::string name{name_s.data() != nullptr ? name_s : path};
+
+	const auto staged = fmt::format("d{}", n_staged++);
+	if (renameat(parent.Get(), name.c_str(), staging.Get(), staged.c_str()) < 0)
+		throw FmtErrno("Failed to move {}", path);
+
+	DeleteStagedFakeCgroup(staging, staged.c_str());
+}
+
+void
+TraceReplay::WriteEvents(std::string_view path, bool populated)
+{
+	const auto fd = OpenPath({root, std::string{path}.c_str()}, O_DIRECTORY);
+	WriteFakeCgroupEvents(fd, populated);
+}
+
+void
+TraceReplay::AddPending()
+{
+	const std::vector<std::string_view> relative_paths{pending_add.begin(),
+							   pending_add.end()};
+	watch.AddCgroups(relative_paths);
+	pending_add.clear();
+}
+
+void
+TraceReplay::Apply(const WatchTraceRecord &r)
+{
+	switch (r.type) {
+	case WatchTraceType::ADD:
+		MakeCgroup(r.path, true);
+		pending_add.emplace_back(r.path);
+		break;
+
+	case WatchTraceType::REMOVE:
+		watch.RemoveCgroup(r.path);
+		break;
+
+	case WatchTraceType::SCAN:
+		/* the initial state is unknown; if the cgroup was
+		   empty, an EMPTY record follows */
+		MakeCgroup(r.path, true);
+		break;
+
+	case WatchTraceType::SCANNED:
+		AddPending();
+		break;
+
+	case WatchTraceType::CREATE:
+		/* a new cgroup is empty until a process is moved
+		   into it (which is recorded as POPULATED) */
+		MakeCgroup(r.path, false);
+		break;
+
+	case WatchTraceType::DELETE:
+		DeleteCgroup(r.path);
+		break;
+
+	case WatchTraceType::POPULATED:
+	case WatchTraceType::EMPTY:
+		WriteEvents(r.path, r.type == WatchTraceType::POPULATED);
+		break;
+
+	case WatchTraceType::RELEASE:
+		++n_recorded_releases;
+		break;
+	}
+}
+
+void
+TraceReplay::OnReplayTimer() noexcept
+{
+	if (done) {
+		event_loop.Break();
+		return;
+	}
+
+	const auto now = Clock::now();
+
+	while (true) {
+		if (!have_record) {
+			try {
+				have_record = reader.Read(record);
+			} catch (...) {
+				PrintException(std::current_exception());
+			}
+
+			if (!have_record) {
+				/* give the watch a chance to handle
+				   the events caused by the last
+				   record */
+				done = true;
+				replay_timer.Schedule({});
+				return;
+			}
+		}
+
+		if (options.realtime) {
+			const auto due = start + record.time;
+			if (due > now) {
+				replay_timer.Schedule(due - now);
+				return;
+			}
+		}
+
+		have_record = false;
+		++n_records;
+		last_time = record.time;
+
+		try {
+			Apply(record);
+		} catch (...) {
+			/* the trace may contain events which cannot
+			   be reproduced, e.g. because the recording
+			   started while cgroups were being
+			   deleted */
+			++n_failed;
+		}
+
+		if (!options.realtime) {
+			/* let the watch handle the events caused by
+			   this record before applying the next one */
+			replay_timer.Schedule({});
+			return;
+		}
+	}
+}
+
+static double
+ToMicroseconds(const struct timeval &tv) noexcept
+{
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/**
+ * The CPU time (user + system) of the calling thread [us].
+ */
+static double
+GetThreadCpuTime() noexcept
+{
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ToMicroseconds(ru.ru_utime) + ToMicroseconds(ru.ru_stime);
+}
+
+void
+TraceReplay::Run()
+{
+	const double cpu_before = GetThreadCpuTime();
+	start = Clock::now();
+
+	replay_timer.Schedule({});
+	event_loop.Run();
+
+	const auto run_duration = Clock::now() - start;
+	const double cpu = GetThreadCpuTime() - cpu_before;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	const double seconds = std::chrono::duration<double>(run_duration).count();
+
+	fmt::print("{{\n"
+		   "  \"realtime\": {},\n"
+		   "  \"records\": {},\n"
+		   "  \"failed\": {},\n"
+		   "  \"trace_duration_s\": {:.3f},\n"
+		   "  \"duration_s\": {:.3f},\n"
+		   "  \"records_per_second\": {:.0f},\n"
+		   "  \"cpu_us_per_record\": {:.2f},\n"
+		   "  \"directories\": {},\n"
+		   "  \"recorded_releases\": {},\n"
+		   "  \"released\": {},\n"
+		   "  \"peak_rss_kb\": {}\n"
+		   "}}\n",
+		   options.realtime, n_records, n_failed,
+		   std::chrono::duration<double>(last_time).count(),
+		   seconds,
+		   n_records / seconds,
+		   n_records > 0 ? cpu / n_records : 0.,
+		   watch.GetDirectoryCount(),
+		   n_recorded_releases, n_released,
+		   ru.ru_maxrss);
+}
+
+static void
+Run(const Options &options)
+{
+	WatchTraceReader reader{OpenReadOnly(options.trace)};
+
+	const auto directory = OpenPath(options.directory, O_DIRECTORY);
+
+	if (mkdirat(directory.Get(), root_name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", root_name);
+
+	AtScopeExit(&directory) { RemoveTree(directory, root_name); };
+
+	if (mkdirat(directory.Get(), staging_name, 0777) < 0)
+		throw FmtErrno("Failed to create {}", staging_name);
+
+	AtScopeExit(&directory) { RemoveTree(directory, staging_name); };
+
+	const auto root = OpenPath({directory, root_name}, O_DIRECTORY);
+	const auto staging = OpenPath({directory, staging_name}, O_DIRECTORY);
+
+	TraceReplay replay{options, root, staging, reader};
+	replay.Run();
+}
+
+int
+main(int argc, char **argv)
+try {
+	const auto options = ParseCommandLine(argc, argv);
+	Run(options);
+	return EXIT_SUCCESS;
+} catch (const Usage &) {
+	fmt::print(stderr,
+		   "Usage: {} [--realtime] TRACE DIRECTORY\n"
+		   "\n"
+		   "DIRECTORY should be on tmpfs.\n",
+		   argv[0]);
+	return EXIT_FAILURE;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -8,7 +8,10 @@
 
 #include <fmt/format.h>
 
+#include <chrono>
 #include <span>
+#include <string_view>
+#include <vector>
 
 #include <fcntl.h> // for AT_FDCWD
 #include <stdlib.h>
@@ -23,17 +26,16 @@ protected:
 		return false;
 	}
 
-	void OnDirectoryCreated(std::string_view relative_path,
-				FileDescriptor) noexcept override {
-		fmt::print("+ {}\n", relative_path);
+	void OnDirectoryCreated(Directory &directory) noexcept override {
+		fmt::print("+ {}\n", directory.GetRelativePath());
 	}
 
-	void OnDirectoryEmpty(std::string_view relative_path) noexcept override {
-		fmt::print("e {}\n", relative_path);
+	void OnDirectoryEmpty(Directory &directory) noexcept override {
+		fmt::print("e {}\n", directory.GetRelativePath());
 	}
 
-	void OnDirectoryDeleted(std::string_view relative_path) noexcept override {
-		fmt::print("- {}\n", relative_path);
+	void OnDirectoryDeleted(Directory &directory) noexcept override {
+		fmt::print("- {}\n", directory.GetRelativePath());
 	}
 };
 
@@ -53,8 +55,13 @@ try {
 	EventLoop event_loop;
 	MyTreeWatch tw(event_loop, base_path);
 
-	for (const char *relative_path : args)
-		tw.Add(relative_path);
+	const std::vector<std::string_view> relative_paths{args.begin(), args.end()};
+
+	const auto t0 = std::chrono::steady_clock::now();
+	tw.Add(relative_paths);
+	fmt::print(stderr, "Scanned {} directories in {:.1f}ms\n",
+		   tw.GetDirectoryCount(),
+		   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
 
 	event_loop.Run();
 